@@ -0,0 +1,129 @@
+/*
+ * Connection rate of a listener as clients connect and hang up in a
+ * loop, when every wakeup of the worker takes a single connection,
+ * the way the accept loop used to, and when it drains the backlog
+ * with an acceptor. The listener is polled level-triggered in both,
+ * so that connections left in the backlog wake the worker up again.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "acceptor.h"
+
+#define BENCH_CLIENTS     4
+#define BENCH_CONNECTIONS 20000
+
+struct bench_client {
+    struct sockaddr_in addr;
+    int count;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *client_main(void *arg) {
+    struct bench_client *c = arg;
+    /* A reset instead of a FIN, so that loopback does not run out of ports in TIME_WAIT */
+    struct linger lg = { 1, 0 };
+    for(int i = 0; i < c->count; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd == -1) {
+            perror("socket");
+            exit(EXIT_FAILURE);
+        }
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        if(connect(fd, (struct sockaddr *)&c->addr, sizeof(c->addr)) == -1) {
+            perror("connect");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+static void on_accept(int connfd, void *data) {
+    (void)data;
+    close(connfd);
+}
+
+static int listen_loopback(struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    socklen_t len = sizeof(*addr);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(fd == -1 || bind(fd, (struct sockaddr *)addr, sizeof(*addr)) == -1 ||
+            listen(fd, 1024) == -1 ||
+            getsockname(fd, (struct sockaddr *)addr, &len) == -1) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/* Accepts every connection of the clients, a single one or a batch per wakeup */
+static void run(const char *name, int batched) {
+    struct sockaddr_in addr;
+    int listenfd = listen_loopback(&addr);
+    Acceptor *acceptor = acceptor_init(listenfd, on_accept, NULL);
+    if(acceptor == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t threads[BENCH_CLIENTS];
+    struct bench_client clients[BENCH_CLIENTS];
+    double start = now();
+    for(int i = 0; i < BENCH_CLIENTS; ++i) {
+        clients[i] = (struct bench_client){ addr, BENCH_CONNECTIONS / BENCH_CLIENTS };
+        if(pthread_create(&threads[i], NULL, client_main, &clients[i]) != 0) {
+            fprintf(stderr, "accept_bench: pthread_create failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    long accepted = 0, wakeups = 0;
+    struct pollfd pfd = { listenfd, POLLIN, 0 };
+    while(accepted < BENCH_CONNECTIONS) {
+        if(poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        wakeups++;
+        if(batched) {
+            int n = acceptor_drain(acceptor);
+            accepted += n > 0 ? n : 0;
+        } else {
+            int connfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(connfd != -1) {
+                close(connfd);
+                accepted++;
+            }
+        }
+    }
+    double elapsed = now() - start;
+    for(int i = 0; i < BENCH_CLIENTS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    printf("%-22s %8.0f connections/s, %5.2f connections per wakeup\n", name,
+            accepted / elapsed, (double)accepted / wakeups);
+    acceptor_destroy(acceptor);
+    close(listenfd);
+}
+
+int main(void) {
+    printf("%d clients, %d connections\n", BENCH_CLIENTS, BENCH_CONNECTIONS);
+    run("one accept per wakeup", 0);
+    run("acceptor_drain", 1);
+    return EXIT_SUCCESS;
+}
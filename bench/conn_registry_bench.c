@@ -0,0 +1,97 @@
+/*
+ * Throughput of the connection registry as threads are added, with a
+ * single shard, which is one lock for every thread, and with the
+ * default shards. Each thread keeps connections of its own coming
+ * and going, the way a worker records the clients it accepts, and
+ * looks one up now and then.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "conn_registry.h"
+
+#define BENCH_MAX_THREADS 16
+#define BENCH_LIVE        1024
+#define BENCH_OPS         2000000
+
+struct bench_thread {
+    ConnRegistry *registry;
+    unsigned int id;
+    unsigned int nthreads;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Cheap and deterministic */
+static unsigned int next_rand(unsigned int *state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+static void *bench_main(void *arg) {
+    struct bench_thread *t = arg;
+    unsigned int state = t->id + 1;
+    ConnInfo info = { .worker = t->id, .since_ms = 0 };
+
+    /* The fds of a thread are interleaved with the others, as accept(2) hands them out */
+    for(int i = 0; i < BENCH_LIVE; ++i) {
+        conn_registry_insert(t->registry, i * t->nthreads + t->id, &info);
+    }
+    for(int i = 0; i < BENCH_OPS; ++i) {
+        int fd = (next_rand(&state) % BENCH_LIVE) * t->nthreads + t->id;
+        if(i % 4 == 0) {
+            conn_registry_lookup(t->registry, fd, NULL);
+        } else {
+            conn_registry_remove(t->registry, fd);
+            conn_registry_insert(t->registry, fd, &info);
+        }
+    }
+    return NULL;
+}
+
+/* Returns the millions of operations a second of nthreads threads */
+static double run(unsigned int nshards, unsigned int nthreads) {
+    ConnRegistry *registry = conn_registry_init(nshards);
+    if(registry == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    pthread_t threads[BENCH_MAX_THREADS];
+    struct bench_thread args[BENCH_MAX_THREADS];
+    double start = now();
+    for(unsigned int i = 0; i < nthreads; ++i) {
+        args[i] = (struct bench_thread){ registry, i, nthreads };
+        if(pthread_create(&threads[i], NULL, bench_main, &args[i]) != 0) {
+            fprintf(stderr, "conn_registry_bench: pthread_create failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(unsigned int i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+    conn_registry_destroy(registry);
+    return (double)nthreads * BENCH_OPS / elapsed / 1e6;
+}
+
+int main(void) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int max = ncpus > 4 ? (unsigned int)ncpus : 4;
+    if(max > BENCH_MAX_THREADS) {
+        max = BENCH_MAX_THREADS;
+    }
+    printf("%ld cores\n", ncpus);
+    for(unsigned int n = 1; n <= max; n *= 2) {
+        double one = run(1, n);
+        double sharded = run(0, n);
+        printf("%2u threads: one lock %6.1f Mops/s   %d shards %6.1f Mops/s\n",
+                n, one, CONN_REGISTRY_SHARDS, sharded);
+    }
+    return EXIT_SUCCESS;
+}
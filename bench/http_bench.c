@@ -0,0 +1,75 @@
+/*
+ * Throughput of the HTTP parser on a single core, in requests per
+ * second. The same browser-like request is parsed over and over,
+ * once with the whole head in the buffer and once as it would
+ * arrive from a slow client, a few bytes per read.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http.h"
+
+#define BENCH_ITERATIONS 2000000
+#define BENCH_READ_SZ    16
+
+static const char s_request[] =
+    "GET http://www.example.com/static/js/app.min.js?v=20240101 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:121.0) Gecko/20100101 Firefox/121.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Cookie: session=4f2c8a9e1b7d3c5a6e0f; theme=dark; tz=Europe%2FParis\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Cache-Control: no-cache\r\n"
+    "\r\n";
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the number of requests parsed per second */
+static double run(size_t read_sz) {
+    HttpParser parser;
+    size_t len = sizeof(s_request) - 1;
+    unsigned long headers = 0;
+
+    double start = now();
+    for(int i = 0; i < BENCH_ITERATIONS; ++i) {
+        http_parser_init(&parser, HTTP_REQUEST, 0);
+        int status = HTTP_PARSE_AGAIN;
+        for(size_t n = read_sz; status == HTTP_PARSE_AGAIN; n += read_sz) {
+            status = http_parse_head(&parser, s_request, n < len ? n : len);
+        }
+        if(status != HTTP_PARSE_DONE) {
+            fprintf(stderr, "http_bench: the request failed to parse\n");
+            exit(EXIT_FAILURE);
+        }
+        headers += parser.nheaders;
+    }
+    double elapsed = now() - start;
+
+    /* Keeps the compiler from dropping the loop */
+    if(headers != (unsigned long)BENCH_ITERATIONS * parser.nheaders) {
+        exit(EXIT_FAILURE);
+    }
+    return BENCH_ITERATIONS / elapsed;
+}
+
+int main(void) {
+    size_t len = sizeof(s_request) - 1;
+    double whole = run(len);
+    double partial = run(BENCH_READ_SZ);
+
+    printf("request head: %zu bytes\n", len);
+    printf("whole head:      %12.0f req/s per core (%.1f MB/s)\n",
+            whole, whole * len / 1e6);
+    printf("%2d-byte reads:   %12.0f req/s per core (%.1f MB/s)\n",
+            BENCH_READ_SZ, partial, partial * len / 1e6);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,560 @@
+/*
+ * A load generator for the proxy. Every thread keeps its share of
+ * the connections busy, sending a request as soon as the response
+ * to the previous one is in, for as long as the run lasts, then the
+ * threads add up what they saw and print it as a line of JSON:
+ * requests and bytes a second, and the latency of the requests at
+ * the 50th, 99th and 99.9th percentiles.
+ *
+ * Requests go to the origin through the proxy (-x), as a forward
+ * proxy gets them, or through a CONNECT tunnel opened by the proxy
+ * (-T), or to the origin itself when there is no proxy, to tell
+ * what the proxy costs. Connections are persistent with -k, a
+ * connection the server closes after a response is opened again,
+ * otherwise every request gets a connection of its own. The latency
+ * of a request includes the connect(2), and the CONNECT of a tunnel,
+ * when it is the first of its connection.
+ *
+ * Ten thousand connections and more need more descriptors than
+ * usual, and more source ports than one address has: the soft limit
+ * of descriptors is raised to the hard one, and connections to
+ * loopback are spread over the source addresses 127.0.0.1 to
+ * 127.0.0.LOAD_SOURCES.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "conn.h"
+#include "http.h"
+
+#define LOAD_MAX_THREADS 64
+#define LOAD_HEAD_SZ     8192
+#define LOAD_READ_SZ     (64 * 1024)
+#define LOAD_REQ_SZ      1024
+#define LOAD_SOURCES     64
+
+/* Latencies in microseconds, with 32 linear buckets per power of two, about 3% apart */
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS) * HIST_SUB)
+
+enum load_state {
+    LOAD_CONNECTING,
+    LOAD_TUNNELING,
+    LOAD_SENDING,
+    LOAD_READING
+};
+
+struct load_config {
+    struct sockaddr_in server;  /* The proxy, or the origin without one */
+    char authority[64];         /* Of the origin */
+    const char *path;
+    const char *name;
+    unsigned int nconns;
+    unsigned int nthreads;
+    double duration;
+    int keep_alive;
+    int tunnel;
+    int proxied;
+};
+
+struct load_worker {
+    unsigned int id;
+    pthread_t thread_id;
+    const struct load_config *cfg;
+    ConnectionPool *pool;
+    char request[LOAD_REQ_SZ];
+    size_t request_len;
+    char connect[LOAD_REQ_SZ];
+    size_t connect_len;
+    char scratch[LOAD_READ_SZ];
+    uint64_t deadline_ns;
+    unsigned int live;
+    /* What the worker saw */
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t reconnects;
+    uint64_t bytes;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+struct load_conn {
+    int fd;
+    unsigned int id;
+    struct load_worker *w;
+    enum load_state state;
+    int answered;           /* A response came on this connection already */
+    int head_done;
+    uint64_t start_ns;
+    size_t sent;
+    HttpParser parser;
+    char head[LOAD_HEAD_SZ];
+    size_t head_len;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int hist_index(uint64_t v) {
+    if(v < 2 * HIST_SUB) {
+        return v;
+    }
+    unsigned int e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS) * HIST_SUB + (v >> (e - HIST_SUB_BITS));
+}
+
+/* The highest value that falls into bucket i */
+static uint64_t hist_value(unsigned int i) {
+    if(i < 2 * HIST_SUB) {
+        return i;
+    }
+    unsigned int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t m = i % HIST_SUB + HIST_SUB;
+    return ((m + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total, double p) {
+    if(total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p * total);
+    if(rank >= total) {
+        rank = total - 1;
+    }
+    uint64_t seen = 0;
+    for(unsigned int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += hist[i];
+        if(seen > rank) {
+            return hist_value(i);
+        }
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+static void load_handler(ConnectionPool *pool, int fd, unsigned int events, void *data);
+
+static void close_conn(struct load_conn *c) {
+    conn_remove_fd(c->w->pool, c->fd);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* Opens the connection again, unless the run is over */
+static void open_conn(struct load_conn *c) {
+    struct load_worker *w = c->w;
+    const struct load_config *cfg = w->cfg;
+    c->fd = -1;
+    if(now_ns() >= w->deadline_ns) {
+        w->live--;
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        perror("socket");
+        w->errors++;
+        w->live--;
+        return;
+    }
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    if((ntohl(cfg->server.sin_addr.s_addr) >> 24) == 127) {
+        /* The kernel picks the port once the destination is known */
+        struct sockaddr_in src;
+        memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(0x7f000001 + c->id % LOAD_SOURCES);
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof(yes));
+        bind(fd, (struct sockaddr *)&src, sizeof(src));
+    }
+    c->fd = fd;
+    c->answered = 0;
+    c->start_ns = now_ns();
+    c->state = LOAD_CONNECTING;
+    if(connect(fd, (const struct sockaddr *)&cfg->server, sizeof(cfg->server)) == -1 &&
+            errno != EINPROGRESS) {
+        close(fd);
+        c->fd = -1;
+        w->errors++;
+        w->live--;
+        return;
+    }
+    if(conn_register_fd(w->pool, fd, CONN_EV_WRITE, load_handler, c) == -1) {
+        close(fd);
+        c->fd = -1;
+        w->errors++;
+        w->live--;
+    }
+}
+
+/* The connection failed, or the server closed it */
+static void reopen_conn(struct load_conn *c, int error) {
+    if(error) {
+        c->w->errors++;
+    } else {
+        c->w->reconnects++;
+    }
+    close_conn(c);
+    open_conn(c);
+}
+
+static void start_request(struct load_conn *c, uint64_t start_ns) {
+    c->state = LOAD_SENDING;
+    c->sent = 0;
+    c->head_len = 0;
+    c->head_done = 0;
+    c->start_ns = start_ns;
+    http_parser_init(&c->parser, HTTP_RESPONSE, 0);
+}
+
+static void finish_request(struct load_conn *c) {
+    struct load_worker *w = c->w;
+    uint64_t now = now_ns();
+    if(c->parser.status >= 200 && c->parser.status < 400) {
+        w->requests++;
+        w->hist[hist_index((now - c->start_ns) / 1000)]++;
+    } else {
+        w->errors++;
+    }
+    c->answered = 1;
+    if(!w->cfg->keep_alive || !c->parser.keep_alive) {
+        close_conn(c);
+        open_conn(c);
+        return;
+    }
+    if(now >= w->deadline_ns) {
+        close_conn(c);
+        w->live--;
+        return;
+    }
+    start_request(c, now);
+    conn_modify_fd(w->pool, c->fd, CONN_EV_WRITE);
+}
+
+/*
+ * Returns 1 once the whole of buf is sent, 0 on EAGAIN, -1 on error
+ * and -2 if the server closed a persistent connection
+ */
+static int send_all(struct load_conn *c, const char *buf, size_t len) {
+    while(c->sent < len) {
+        ssize_t n = send(c->fd, buf + c->sent, len - c->sent, MSG_NOSIGNAL);
+        if(n > 0) {
+            c->sent += n;
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if(errno == EPIPE || errno == ECONNRESET) {
+            return c->answered ? -2 : -1;
+        } else if(errno != EINTR) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Reads the response, returns 1 once it is complete, 0 on EAGAIN,
+ * -1 on error and -2 if the server closed a persistent connection
+ * before it answered
+ */
+static int read_response(struct load_conn *c) {
+    struct load_worker *w = c->w;
+    for(;;) {
+        char *buf = c->head_done ? w->scratch : c->head + c->head_len;
+        size_t room = c->head_done ? sizeof(w->scratch) : sizeof(c->head) - c->head_len;
+        if(room == 0) {
+            return -1;
+        }
+        ssize_t n = recv(c->fd, buf, room, 0);
+        if(n == 0 || (n == -1 && (errno == ECONNRESET || errno == EPIPE))) {
+            if(c->head_len == 0 && c->answered) {
+                return -2;
+            }
+            if(c->head_done && c->parser.body == HTTP_BODY_UNTIL_CLOSE) {
+                return 1;
+            }
+            return -1;
+        }
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        w->bytes += n;
+        size_t consumed;
+        int status;
+        if(!c->head_done) {
+            c->head_len += n;
+            status = http_parse_head(&c->parser, c->head, c->head_len);
+            if(status == HTTP_PARSE_AGAIN) {
+                continue;
+            }
+            if(status == HTTP_PARSE_ERROR) {
+                return -1;
+            }
+            c->head_done = 1;
+            if(c->parser.body == HTTP_BODY_NONE) {
+                return 1;
+            }
+            buf = c->head + c->parser.head_len;
+            n = c->head_len - c->parser.head_len;
+        }
+        status = http_parse_body(&c->parser, buf, n, &consumed);
+        if(status == HTTP_PARSE_ERROR) {
+            return -1;
+        }
+        if(status == HTTP_PARSE_DONE) {
+            return 1;
+        }
+    }
+}
+
+static void load_handler(ConnectionPool *pool, int fd, unsigned int events, void *data) {
+    (void)pool;
+    (void)fd;
+    struct load_conn *c = data;
+    struct load_worker *w = c->w;
+
+    if(c->state == LOAD_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if(!(events & (CONN_EV_WRITE | CONN_EV_ERROR))) {
+            return;
+        }
+        if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+            reopen_conn(c, 1);
+            return;
+        }
+        start_request(c, c->start_ns);
+        if(w->cfg->tunnel) {
+            /* A 200 to a CONNECT has no body */
+            c->state = LOAD_TUNNELING;
+            http_parser_init(&c->parser, HTTP_RESPONSE, HTTP_PARSER_NO_BODY);
+        }
+    }
+    for(;;) {
+        int status;
+        switch(c->state) {
+            case LOAD_TUNNELING:
+                if(c->sent < w->connect_len) {
+                    if((status = send_all(c, w->connect, w->connect_len)) == 1) {
+                        conn_modify_fd(w->pool, c->fd, CONN_EV_READ);
+                        continue;
+                    }
+                } else if((status = read_response(c)) == 1) {
+                    if(c->parser.status != 200) {
+                        reopen_conn(c, 1);
+                        return;
+                    }
+                    /* The origin is on the other end from now on */
+                    start_request(c, c->start_ns);
+                    conn_modify_fd(w->pool, c->fd, CONN_EV_WRITE);
+                    continue;
+                }
+                break;
+            case LOAD_SENDING:
+                if((status = send_all(c, w->request, w->request_len)) == 1) {
+                    c->state = LOAD_READING;
+                    conn_modify_fd(w->pool, c->fd, CONN_EV_READ);
+                    continue;
+                }
+                break;
+            case LOAD_READING:
+                if((status = read_response(c)) == 1) {
+                    finish_request(c);
+                    return;
+                }
+                break;
+            default:
+                return;
+        }
+        if(status == -2) {
+            reopen_conn(c, 0);
+        } else if(status == -1) {
+            reopen_conn(c, 1);
+        }
+        return;
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct load_worker *w = arg;
+    const struct load_config *cfg = w->cfg;
+    unsigned int nconns = cfg->nconns / cfg->nthreads +
+        (w->id < cfg->nconns % cfg->nthreads ? 1 : 0);
+    struct load_conn *conns = calloc(nconns, sizeof(*conns));
+    if(conns == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    w->deadline_ns = now_ns() + (uint64_t)(cfg->duration * 1e9);
+    w->live = nconns;
+    for(unsigned int i = 0; i < nconns; ++i) {
+        conns[i].w = w;
+        conns[i].id = i * cfg->nthreads + w->id;
+        open_conn(&conns[i]);
+    }
+    while(w->live > 0) {
+        if(conn_dispatch(w->pool, 100) == -1) {
+            break;
+        }
+        if(now_ns() >= w->deadline_ns + 1000000000ULL) {
+            /* Whatever is still waiting for a response is left out */
+            break;
+        }
+    }
+    for(unsigned int i = 0; i < nconns; ++i) {
+        if(conns[i].fd != -1) {
+            close_conn(&conns[i]);
+        }
+    }
+    free(conns);
+    return NULL;
+}
+
+static int parse_addr(const char *s, struct sockaddr_in *addr) {
+    char host[64];
+    const char *colon = strrchr(s, ':');
+    if(colon == NULL || (size_t)(colon - s) >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, s, colon - s);
+    host[colon - s] = '\0';
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(strtoul(colon + 1, NULL, 10));
+    return inet_pton(AF_INET, host, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -a <origin ip:port> [-x <proxy ip:port>] [-T] [-k] [-p <path>]\n"
+            "       [-c <connections>] [-t <threads>] [-d <seconds>] [-n <name>]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    struct load_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.path = "/";
+    cfg.name = "load";
+    cfg.nconns = 64;
+    cfg.duration = 5;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cfg.nthreads = ncpus > 0 ? (unsigned int)ncpus : 1;
+
+    const char *origin = NULL, *proxy = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "a:x:Tkp:c:t:d:n:")) != -1) {
+        switch(opt) {
+            case 'a': origin = optarg; break;
+            case 'x': proxy = optarg; break;
+            case 'T': cfg.tunnel = 1; break;
+            case 'k': cfg.keep_alive = 1; break;
+            case 'p': cfg.path = optarg; break;
+            case 'c': cfg.nconns = strtoul(optarg, NULL, 10); break;
+            case 't': cfg.nthreads = strtoul(optarg, NULL, 10); break;
+            case 'd': cfg.duration = strtod(optarg, NULL); break;
+            case 'n': cfg.name = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    struct sockaddr_in origin_addr;
+    if(origin == NULL || parse_addr(origin, &origin_addr) == -1 ||
+            (proxy != NULL && parse_addr(proxy, &cfg.server) == -1) ||
+            (cfg.tunnel && proxy == NULL) || cfg.nconns == 0 || cfg.nthreads == 0 ||
+            cfg.nthreads > LOAD_MAX_THREADS || cfg.duration <= 0) {
+        usage(argv[0]);
+    }
+    if(cfg.nthreads > cfg.nconns) {
+        cfg.nthreads = cfg.nconns;
+    }
+    snprintf(cfg.authority, sizeof(cfg.authority), "%s", origin);
+    cfg.proxied = proxy != NULL && !cfg.tunnel;
+    if(proxy == NULL) {
+        cfg.server = origin_addr;
+    }
+
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if(rl.rlim_cur < cfg.nconns + 64) {
+            fprintf(stderr, "loadgen: %lu descriptors for %u connections, some will fail\n",
+                    (unsigned long)rl.rlim_cur, cfg.nconns);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    static struct load_worker workers[LOAD_MAX_THREADS];
+    for(unsigned int i = 0; i < cfg.nthreads; ++i) {
+        struct load_worker *w = &workers[i];
+        w->id = i;
+        w->cfg = &cfg;
+        if((w->pool = conn_pool_init()) == NULL) {
+            return EXIT_FAILURE;
+        }
+        /* A forward proxy is sent the whole URL, the origin and a tunnel only the path */
+        w->request_len = snprintf(w->request, sizeof(w->request),
+                "GET %s%s%s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                cfg.proxied ? "http://" : "", cfg.proxied ? cfg.authority : "", cfg.path,
+                cfg.authority, cfg.keep_alive ? "" : "Connection: close\r\n");
+        w->connect_len = snprintf(w->connect, sizeof(w->connect),
+                "CONNECT %s HTTP/1.1\r\nHost: %s\r\n\r\n", cfg.authority, cfg.authority);
+    }
+
+    uint64_t start = now_ns();
+    for(unsigned int i = 0; i < cfg.nthreads; ++i) {
+        if(pthread_create(&workers[i].thread_id, NULL, worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "loadgen: pthread_create failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    static uint64_t hist[HIST_BUCKETS];
+    uint64_t requests = 0, errors = 0, reconnects = 0, bytes = 0;
+    for(unsigned int i = 0; i < cfg.nthreads; ++i) {
+        struct load_worker *w = &workers[i];
+        pthread_join(w->thread_id, NULL);
+        requests += w->requests;
+        errors += w->errors;
+        reconnects += w->reconnects;
+        bytes += w->bytes;
+        for(unsigned int j = 0; j < HIST_BUCKETS; ++j) {
+            hist[j] += w->hist[j];
+        }
+        conn_destroy(w->pool);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    if(elapsed > cfg.duration) {
+        /* Responses that came in after the deadline are counted over the deadline */
+        elapsed = cfg.duration;
+    }
+
+    printf("{\"scenario\": \"%s\", \"path\": \"%s\", \"proxy\": %s, \"tunnel\": %s, "
+            "\"keep_alive\": %s, \"connections\": %u, \"threads\": %u, \"duration_s\": %.2f, "
+            "\"requests\": %lu, \"errors\": %lu, \"reconnects\": %lu, "
+            "\"requests_per_s\": %.1f, \"mbytes_per_s\": %.2f, "
+            "\"latency_us\": {\"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}}\n",
+            cfg.name, cfg.path, proxy != NULL ? "true" : "false", cfg.tunnel ? "true" : "false",
+            cfg.keep_alive ? "true" : "false", cfg.nconns, cfg.nthreads, elapsed,
+            (unsigned long)requests, (unsigned long)errors, (unsigned long)reconnects,
+            requests / elapsed, bytes / elapsed / 1e6,
+            (unsigned long)hist_percentile(hist, requests, 0.50),
+            (unsigned long)hist_percentile(hist, requests, 0.99),
+            (unsigned long)hist_percentile(hist, requests, 0.999),
+            (unsigned long)hist_percentile(hist, requests, 1.0));
+    return EXIT_SUCCESS;
+}
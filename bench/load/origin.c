@@ -0,0 +1,432 @@
+/*
+ * An origin server for load tests, that answers every request from
+ * memory, as fast as it can, so that what is measured is the proxy
+ * in front of it. What the response looks like is up to the path:
+ *
+ *   /bytes/<n>      a body of n bytes with a Content-Length
+ *   /chunked/<n>    a body of n bytes in chunks
+ *   /<anything>     a body of the default size (-s)
+ *
+ * and a query of delay=<ms> holds the response back for that long,
+ * the way a slow backend would, while chunk=<n> sets the size of the
+ * chunks, so that streams of small chunks can be tried. Connections are persistent unless
+ * the client asks otherwise. Every thread is a reactor of its own,
+ * with a listening socket bound with SO_REUSEPORT, like the workers
+ * of the proxy.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "conn.h"
+#include "acceptor.h"
+#include "http.h"
+#include "timer.h"
+
+#define ORIGIN_HEAD_SZ     8192
+#define ORIGIN_OUT_SZ      (64 * 1024)
+#define ORIGIN_CHUNK_SZ    (16 * 1024)
+#define ORIGIN_BODY_SZ     (256 * 1024)
+#define ORIGIN_TICK_MS     100
+#define ORIGIN_MAX_THREADS 64
+
+enum origin_state {
+    ORIGIN_READING,
+    ORIGIN_DELAYED,
+    ORIGIN_WRITING
+};
+
+struct origin_worker {
+    unsigned int id;
+    pthread_t thread_id;
+    int listenfd;
+    ConnectionPool *pool;
+    Acceptor *acceptor;
+    TimerWheel *timers;
+    unsigned long requests;
+};
+
+struct origin_conn {
+    int fd;
+    struct origin_worker *w;
+    enum origin_state state;
+    HttpParser parser;
+    char in[ORIGIN_HEAD_SZ];
+    size_t in_len;
+    int keep_alive;
+    int chunked;
+    size_t chunk_sz;
+    int body_done;
+    uint64_t body_left;    /* Body bytes not sent (or staged) yet */
+    char out[ORIGIN_OUT_SZ];
+    size_t out_off;
+    size_t out_len;
+    Timer timer;
+};
+
+static volatile sig_atomic_t s_running = 1;
+static uint64_t s_default_size = 1024;
+static char s_body[ORIGIN_BODY_SZ];
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void stop_handler(int signum) {
+    (void)signum;
+    s_running = 0;
+}
+
+static void origin_close(struct origin_conn *c) {
+    timer_cancel(c->w->timers, &c->timer);
+    conn_remove_fd(c->w->pool, c->fd);
+    close(c->fd);
+    free(c);
+}
+
+static void origin_handler(ConnectionPool *pool, int fd, unsigned int events, void *data);
+
+/* Sends what is staged and the body, returns 1 once the response is out, -1 on error */
+static int send_response(struct origin_conn *c) {
+    for(;;) {
+        ssize_t n;
+        if(c->out_off < c->out_len) {
+            n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+            if(n > 0) {
+                c->out_off += n;
+            }
+        } else if(c->body_done) {
+            return 1;
+        } else if(!c->chunked) {
+            /* Straight from the shared body, nothing is copied */
+            size_t len = c->body_left < sizeof(s_body) ? c->body_left : sizeof(s_body);
+            n = send(c->fd, s_body, len, MSG_NOSIGNAL);
+            if(n > 0) {
+                c->body_left -= n;
+                c->body_done = c->body_left == 0;
+            }
+        } else {
+            /* Stages as many chunks as fit, and the last one once the body is out */
+            c->out_off = c->out_len = 0;
+            while(c->body_left > 0 && ORIGIN_OUT_SZ - c->out_len > c->chunk_sz + 32) {
+                size_t len = c->body_left < c->chunk_sz ? c->body_left : c->chunk_sz;
+                c->out_len += sprintf(c->out + c->out_len, "%zx\r\n", len);
+                memcpy(c->out + c->out_len, s_body, len);
+                memcpy(c->out + c->out_len + len, "\r\n", 2);
+                c->out_len += len + 2;
+                c->body_left -= len;
+            }
+            if(c->body_left == 0 && ORIGIN_OUT_SZ - c->out_len >= 5) {
+                memcpy(c->out + c->out_len, "0\r\n\r\n", 5);
+                c->out_len += 5;
+                c->body_done = 1;
+            }
+            continue;
+        }
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+    }
+}
+
+static void start_response(struct origin_conn *c) {
+    c->state = ORIGIN_WRITING;
+    if(conn_modify_fd(c->w->pool, c->fd, CONN_EV_WRITE) == -1) {
+        origin_close(c);
+        return;
+    }
+    origin_handler(c->w->pool, c->fd, CONN_EV_WRITE, c);
+}
+
+static void delay_expired(Timer *timer, void *data) {
+    (void)timer;
+    start_response(data);
+}
+
+/* What the target asks for, the response head is staged */
+static uint64_t prepare_response(struct origin_conn *c) {
+    const char *target = c->in + c->parser.target.off;
+    size_t target_len = c->parser.target.len;
+    char path[256];
+    if(target_len >= sizeof(path)) {
+        target_len = sizeof(path) - 1;
+    }
+    memcpy(path, target, target_len);
+    path[target_len] = '\0';
+
+    uint64_t size = s_default_size;
+    c->chunked = 0;
+    if(strncmp(path, "/bytes/", 7) == 0) {
+        size = strtoull(path + 7, NULL, 10);
+    } else if(strncmp(path, "/chunked/", 9) == 0) {
+        size = strtoull(path + 9, NULL, 10);
+        c->chunked = 1;
+    }
+    uint64_t delay = 0;
+    char *query = strchr(path, '?');
+    char *arg = query != NULL ? strstr(query, "delay=") : NULL;
+    if(arg != NULL) {
+        delay = strtoull(arg + 6, NULL, 10);
+    }
+    arg = query != NULL ? strstr(query, "chunk=") : NULL;
+    c->chunk_sz = arg != NULL ? strtoull(arg + 6, NULL, 10) : 0;
+    if(c->chunk_sz == 0 || c->chunk_sz > ORIGIN_CHUNK_SZ) {
+        c->chunk_sz = ORIGIN_CHUNK_SZ;
+    }
+
+    c->keep_alive = c->parser.keep_alive;
+    c->body_left = size;
+    c->body_done = size == 0 && !c->chunked;
+    c->out_off = 0;
+    if(c->chunked) {
+        c->out_len = sprintf(c->out, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n"
+                "Cache-Control: no-store\r\n%s\r\n", c->keep_alive ? "" : "Connection: close\r\n");
+    } else {
+        c->out_len = sprintf(c->out, "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n"
+                "Cache-Control: no-store\r\n%s\r\n", (unsigned long)size,
+                c->keep_alive ? "" : "Connection: close\r\n");
+        /* A small body goes out with the head, in a single segment */
+        if(size <= ORIGIN_OUT_SZ - c->out_len) {
+            memcpy(c->out + c->out_len, s_body, size);
+            c->out_len += size;
+            c->body_left = 0;
+            c->body_done = 1;
+        }
+    }
+    return delay;
+}
+
+/* Reads requests until one is complete, returns -1 once the connection is to be closed */
+static int read_request(struct origin_conn *c) {
+    for(;;) {
+        if(c->in_len > 0) {
+            int status = http_parse_head(&c->parser, c->in, c->in_len);
+            if(status == HTTP_PARSE_ERROR || (status == HTTP_PARSE_DONE &&
+                        c->parser.body != HTTP_BODY_NONE)) {
+                /* Load tests only ever GET */
+                return -1;
+            }
+            if(status == HTTP_PARSE_DONE) {
+                return 1;
+            }
+        }
+        if(c->in_len == sizeof(c->in)) {
+            return -1;
+        }
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if(n > 0) {
+            c->in_len += n;
+        } else if(n == 0) {
+            return -1;
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if(errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+static void origin_handler(ConnectionPool *pool, int fd, unsigned int events, void *data) {
+    (void)pool;
+    (void)fd;
+    struct origin_conn *c = data;
+
+    if(events & CONN_EV_ERROR) {
+        origin_close(c);
+        return;
+    }
+    for(;;) {
+        if(c->state == ORIGIN_DELAYED) {
+            /* What comes meanwhile is read once the response is out */
+            return;
+        }
+        if(c->state == ORIGIN_READING) {
+            int status = read_request(c);
+            if(status == -1) {
+                origin_close(c);
+                return;
+            }
+            if(status == 0) {
+                return;
+            }
+            c->w->requests++;
+            uint64_t delay = prepare_response(c);
+            if(delay > 0) {
+                c->state = ORIGIN_DELAYED;
+                timer_arm(c->w->timers, &c->timer, now_ms() + delay);
+                return;
+            }
+            c->state = ORIGIN_WRITING;
+        }
+        int status = send_response(c);
+        if(status == -1 || (status == 1 && !c->keep_alive)) {
+            origin_close(c);
+            return;
+        }
+        if(status == 0) {
+            conn_modify_fd(c->w->pool, c->fd, CONN_EV_WRITE);
+            return;
+        }
+        /* The next request may be there already */
+        size_t head_len = c->parser.head_len;
+        memmove(c->in, c->in + head_len, c->in_len - head_len);
+        c->in_len -= head_len;
+        http_parser_init(&c->parser, HTTP_REQUEST, 0);
+        c->state = ORIGIN_READING;
+        conn_modify_fd(c->w->pool, c->fd, CONN_EV_READ);
+    }
+}
+
+static void on_accept(int connfd, void *data) {
+    struct origin_worker *w = data;
+    struct origin_conn *c = malloc(sizeof(*c));
+    if(c == NULL) {
+        close(connfd);
+        return;
+    }
+    int yes = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    c->fd = connfd;
+    c->w = w;
+    c->state = ORIGIN_READING;
+    c->in_len = 0;
+    http_parser_init(&c->parser, HTTP_REQUEST, 0);
+    timer_init(&c->timer, delay_expired, c);
+    if(conn_register_fd(w->pool, connfd, CONN_EV_READ, origin_handler, c) == -1) {
+        close(connfd);
+        free(c);
+        return;
+    }
+    origin_handler(w->pool, connfd, CONN_EV_READ, c);
+}
+
+static void accept_handler(ConnectionPool *pool, int fd, unsigned int events, void *data) {
+    (void)pool;
+    (void)fd;
+    (void)events;
+    struct origin_worker *w = data;
+    acceptor_drain(w->acceptor);
+}
+
+static int listen_port(unsigned int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    int yes = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1 ||
+            bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(fd, 4096) == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *worker_main(void *arg) {
+    struct origin_worker *w = arg;
+    while(s_running) {
+        uint64_t now = now_ms();
+        if(conn_dispatch(w->pool, timer_wheel_timeout(w->timers, now, ORIGIN_TICK_MS)) == -1) {
+            break;
+        }
+        timer_wheel_advance(w->timers, now_ms());
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -p <port> [-t <threads>] [-s <default body size>]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int port = 0, nthreads = 1;
+    int opt;
+    while((opt = getopt(argc, argv, "p:t:s:")) != -1) {
+        switch(opt) {
+            case 'p':
+                port = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                nthreads = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                s_default_size = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(port == 0 || port > 65535 || nthreads == 0 || nthreads > ORIGIN_MAX_THREADS) {
+        usage(argv[0]);
+    }
+
+    /* As many connections as the proxy can throw at it */
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    memset(s_body, 'x', sizeof(s_body));
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = stop_handler;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct origin_worker workers[ORIGIN_MAX_THREADS];
+    for(unsigned int i = 0; i < nthreads; ++i) {
+        struct origin_worker *w = &workers[i];
+        w->id = i;
+        w->requests = 0;
+        if((w->listenfd = listen_port(port)) == -1 ||
+                (w->pool = conn_pool_init()) == NULL ||
+                (w->timers = timer_wheel_init(now_ms())) == NULL ||
+                (w->acceptor = acceptor_init(w->listenfd, on_accept, w)) == NULL ||
+                conn_register_fd(w->pool, w->listenfd, CONN_EV_READ, accept_handler, w) == -1) {
+            return EXIT_FAILURE;
+        }
+    }
+    for(unsigned int i = 0; i < nthreads; ++i) {
+        if(pthread_create(&workers[i].thread_id, NULL, worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "origin: pthread_create failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    printf("Origin is now listening on port %u (%u threads)\n", port, nthreads);
+    fflush(stdout);
+
+    unsigned long requests = 0;
+    for(unsigned int i = 0; i < nthreads; ++i) {
+        pthread_join(workers[i].thread_id, NULL);
+        requests += workers[i].requests;
+    }
+    printf("Origin served %lu requests\n", requests);
+    return EXIT_SUCCESS;
+}
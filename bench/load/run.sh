@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Runs the load scenarios over loopback: an origin stub, the proxy in
+# front of it, and the load generator against both. Every scenario
+# prints a line of JSON, and the whole run is gathered into a JSON
+# array in $LOAD_OUT, so that runs of two builds can be compared.
+#
+#   LOAD_DURATION   seconds per scenario (2)
+#   LOAD_MAX_CONNS  most concurrent connections of the sweep (1000,
+#                   up to 100000 given enough descriptors)
+#   LOAD_THREADS    threads of the proxy, the origin and the generator
+#                   (the number of cores)
+#   LOAD_OUT        where the results go (bin/load.json)
+#
+set -u
+
+BIN=${BIN:-bin}
+DURATION=${LOAD_DURATION:-2}
+MAX_CONNS=${LOAD_MAX_CONNS:-1000}
+THREADS=${LOAD_THREADS:-$(nproc)}
+OUT=${LOAD_OUT:-$BIN/load.json}
+ORIGIN_PORT=${LOAD_ORIGIN_PORT:-18480}
+PROXY_PORT=${LOAD_PROXY_PORT:-18481}
+ORIGIN=127.0.0.1:$ORIGIN_PORT
+PROXY=127.0.0.1:$PROXY_PORT
+
+# As many descriptors as allowed, for the sweep
+ulimit -n "$(ulimit -Hn)" 2>/dev/null
+
+"$BIN/origin" -p "$ORIGIN_PORT" -t "$THREADS" > /dev/null &
+ORIGIN_PID=$!
+"$BIN/proxy" -p "$PROXY_PORT" -t "$THREADS" > /dev/null &
+PROXY_PID=$!
+trap 'kill -HUP $PROXY_PID 2>/dev/null; kill $ORIGIN_PID 2>/dev/null; wait' EXIT
+sleep 1
+
+FIRST=1
+echo "[" > "$OUT"
+scenario() {
+    name=$1
+    shift
+    result=$("$BIN/loadgen" -a "$ORIGIN" -d "$DURATION" -t "$THREADS" -n "$name" "$@")
+    [ -n "$result" ] || return
+    echo "$result"
+    if [ $FIRST -eq 0 ]; then
+        echo "," >> "$OUT"
+    fi
+    FIRST=0
+    printf "  %s" "$result" >> "$OUT"
+}
+
+# What the origin does without the proxy, the ceiling of everything else
+scenario direct-small-keepalive -k -p /bytes/128 -c 64
+
+scenario small-close            -x "$PROXY" -p /bytes/128 -c 64
+scenario small-keepalive        -x "$PROXY" -k -p /bytes/128 -c 64
+scenario large-close            -x "$PROXY" -p /bytes/1048576 -c 16
+scenario large-keepalive        -x "$PROXY" -k -p /bytes/1048576 -c 16
+scenario chunked-keepalive      -x "$PROXY" -k -p /chunked/65536 -c 64
+scenario small-chunks-keepalive -x "$PROXY" -k -p "/chunked/262144?chunk=64" -c 16
+scenario slow-origin-keepalive  -x "$PROXY" -k -p "/bytes/1024?delay=50" -c 256
+
+scenario tunnel-small-keepalive -x "$PROXY" -T -k -p /bytes/128 -c 64
+scenario tunnel-large-keepalive -x "$PROXY" -T -k -p /bytes/1048576 -c 16
+
+# Concurrent connections, each with a slow request in flight most of the time
+conns=10
+while [ "$conns" -le "$MAX_CONNS" ]; do
+    scenario "concurrency-$conns" -x "$PROXY" -k -p "/bytes/1024?delay=100" -c "$conns"
+    conns=$((conns * 10))
+done
+
+echo "" >> "$OUT"
+echo "]" >> "$OUT"
+echo "Results in $OUT"
@@ -0,0 +1,434 @@
+/*
+ * Latency of the operations of the PrioQueue and of the ConnectionPool,
+ * across sizes, orders of the values and patterns of churn, so that a
+ * replacement of either can be judged against them.
+ *
+ * Every case is run a few times to warm the caches and the branch
+ * predictors up, then repeated, and each repetition times a batch of
+ * operations. What is reported per operation is the median and the
+ * minimum over the repetitions, the mean with its standard deviation,
+ * in nanoseconds, and the median in cycles of the time stamp counter
+ * (which ticks at a constant rate, not at the rate of the core).
+ *
+ *   -f <substring>  runs only the cases whose name contains it
+ *   -r <repeats>    repetitions of every case (11)
+ *   -w <warm-ups>   runs of every case before it is timed (2)
+ *   -l              lists the cases
+ *
+ * Running a single case makes what perf(1) counts meaningful, e.g.
+ *
+ *   perf stat -e cycles,instructions,branch-misses,cache-misses \
+ *       ./bin/primitives_bench -f conn_copy_fd_sets/sparse/1000
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/select.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "prio.h"
+#include "conn.h"
+
+#define BENCH_MAX_REPEATS 101
+#define BENCH_PRIO_CAP    1024
+#define BENCH_PRIO_OPS    (1 << 18)
+#define BENCH_CONN_OPS    (1 << 18)
+#define BENCH_COPY_OPS    (1 << 16)
+#define BENCH_CONN_FDS    1000
+
+enum order {
+    ORDER_RANDOM,
+    ORDER_ASCENDING,   /* Every insert bubbles up to the root */
+    ORDER_DESCENDING   /* Every insert stays a leaf */
+};
+
+enum spread {
+    SPREAD_DENSE,      /* The lowest fds, as a fresh process gets them */
+    SPREAD_SPARSE,     /* Anywhere below FD_SETSIZE */
+    SPREAD_HIGH        /* The highest fds below FD_SETSIZE */
+};
+
+static const char *s_order_names[] = { "random", "ascending", "descending" };
+static const char *s_spread_names[] = { "dense", "sparse", "high" };
+
+/* Ticks of the timed parts of a run, and the operations they did */
+struct timing {
+    uint64_t start;
+    uint64_t ticks;
+    long ops;
+};
+
+struct bench_case {
+    char name[64];
+    void (*run)(const struct bench_case *c, struct timing *t);
+    int size;
+    int param;
+};
+
+static volatile int s_sink;
+static double s_ns_per_tick = 1.0;
+
+/* The time stamp counter where there is one, nanoseconds otherwise */
+static uint64_t ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void calibrate(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    double start = now_ns();
+    uint64_t start_ticks = ticks();
+    while(now_ns() - start < 50e6) {
+    }
+    s_ns_per_tick = (now_ns() - start) / (ticks() - start_ticks);
+#endif
+}
+
+/* Parts of a run can be timed, only the sum of them is reported */
+static void timing_start(struct timing *t) {
+    t->start = ticks();
+}
+
+static void timing_stop(struct timing *t, long ops) {
+    t->ticks += ticks() - t->start;
+    t->ops += ops;
+}
+
+/* Cheap and deterministic, so that every repetition does the same work */
+static unsigned int next_rand(unsigned int *state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+static int value_at(enum order order, int i, unsigned int *state) {
+    switch(order) {
+        case ORDER_ASCENDING:
+            return i;
+        case ORDER_DESCENDING:
+            return BENCH_PRIO_OPS - i;
+        default:
+            return (int)(next_rand(state) & 0x7FFFFFFF);
+    }
+}
+
+static PrioQueue *new_queue(void) {
+    PrioQueue *pq = prio_init();
+    if(pq == NULL) {
+        fprintf(stderr, "primitives_bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return pq;
+}
+
+/* Fills empty queues up to size, over and over, emptying them is not timed */
+static void prio_insert_case(const struct bench_case *c, struct timing *t) {
+    PrioQueue *pq = new_queue();
+    unsigned int state = 1;
+    int max;
+    while(t->ops < BENCH_PRIO_OPS) {
+        int base = (int)t->ops;
+        timing_start(t);
+        for(int i = 0; i < c->size; ++i) {
+            prio_insert(pq, value_at(c->param, base + i, &state));
+        }
+        timing_stop(t, c->size);
+        while(prio_remove_max(pq, &max) == 0) {
+        }
+    }
+    prio_destroy(pq);
+}
+
+/* Empties queues of size values, over and over, filling them is not timed */
+static void prio_remove_max_case(const struct bench_case *c, struct timing *t) {
+    PrioQueue *pq = new_queue();
+    unsigned int state = 1;
+    int max = 0;
+    while(t->ops < BENCH_PRIO_OPS) {
+        for(int i = 0; i < c->size; ++i) {
+            prio_insert(pq, value_at(c->param, (int)t->ops + i, &state));
+        }
+        timing_start(t);
+        for(int i = 0; i < c->size; ++i) {
+            prio_remove_max(pq, &max);
+        }
+        timing_stop(t, c->size);
+    }
+    s_sink = max;
+    prio_destroy(pq);
+}
+
+static void prio_peek_max_case(const struct bench_case *c, struct timing *t) {
+    PrioQueue *pq = new_queue();
+    unsigned int state = 1;
+    for(int i = 0; i < c->size; ++i) {
+        prio_insert(pq, value_at(c->param, i, &state));
+    }
+    int max, sum = 0;
+    timing_start(t);
+    for(long i = 0; i < BENCH_PRIO_OPS; ++i) {
+        prio_peek_max(pq, &max);
+        sum += max;
+    }
+    timing_stop(t, BENCH_PRIO_OPS);
+    s_sink = sum;
+    prio_destroy(pq);
+}
+
+/* A queue of steady size: the max goes, a new value comes in */
+static void prio_churn_case(const struct bench_case *c, struct timing *t) {
+    PrioQueue *pq = new_queue();
+    unsigned int state = 1;
+    for(int i = 0; i < c->size; ++i) {
+        prio_insert(pq, value_at(c->param, i, &state));
+    }
+    int max;
+    timing_start(t);
+    for(long i = 0; i < BENCH_PRIO_OPS; ++i) {
+        prio_remove_max(pq, &max);
+        prio_insert(pq, value_at(c->param, c->size + (int)i, &state));
+    }
+    timing_stop(t, BENCH_PRIO_OPS);
+    s_sink = max;
+    prio_destroy(pq);
+}
+
+static ConnectionPool *new_pool(ConnBackend backend) {
+    ConnectionPool *pool = conn_pool_init_backend(backend);
+    if(pool == NULL) {
+        fprintf(stderr, "primitives_bench: no %s pool\n", conn_backend_name(backend));
+        exit(EXIT_FAILURE);
+    }
+    return pool;
+}
+
+/* conn_destroy closes what is left in the pool, and the select pools hold made-up fds */
+static void drop_pool(ConnectionPool *pool, const int *fds, int n) {
+    for(int i = 0; i < n; ++i) {
+        conn_remove_fd(pool, fds[i]);
+    }
+    conn_destroy(pool);
+}
+
+/* The fds of a pool of size connections, the select backend takes any fd below FD_SETSIZE */
+static void pick_fds(enum spread spread, int size, int *fds) {
+    static char taken[FD_SETSIZE];
+    unsigned int state = 7;
+    memset(taken, 0, sizeof(taken));
+    for(int i = 0; i < size; ++i) {
+        switch(spread) {
+            case SPREAD_DENSE:
+                fds[i] = i;
+                break;
+            case SPREAD_HIGH:
+                fds[i] = FD_SETSIZE - 1 - i;
+                break;
+            default:
+                do {
+                    fds[i] = next_rand(&state) % FD_SETSIZE;
+                } while(taken[fds[i]]);
+                taken[fds[i]] = 1;
+                break;
+        }
+    }
+}
+
+/* What an event loop on select(2) does before every wait */
+static void conn_copy_fd_sets_case(const struct bench_case *c, struct timing *t) {
+    ConnectionPool *pool = new_pool(CONN_BACKEND_SELECT);
+    int fds[FD_SETSIZE];
+    pick_fds(c->param, c->size, fds);
+    for(int i = 0; i < c->size; ++i) {
+        conn_insert_fd(pool, fds[i]);
+    }
+    fd_set rd, wr;
+    int nfds, sum = 0;
+    timing_start(t);
+    for(long i = 0; i < BENCH_COPY_OPS; ++i) {
+        conn_copy_fd_sets(pool, &rd, &wr, &nfds);
+        sum += nfds;
+    }
+    timing_stop(t, BENCH_COPY_OPS);
+    s_sink = sum;
+    drop_pool(pool, fds, c->size);
+}
+
+/* Connections come and go in a pool of steady size, with a copy of the sets in between */
+static void conn_select_churn_case(const struct bench_case *c, struct timing *t) {
+    ConnectionPool *pool = new_pool(CONN_BACKEND_SELECT);
+    int fds[FD_SETSIZE];
+    pick_fds(c->param, c->size, fds);
+    for(int i = 0; i < c->size; ++i) {
+        conn_insert_fd(pool, fds[i]);
+    }
+    /* A closed fd is handed out again, the way the kernel reuses the lowest */
+    unsigned int state = 3;
+    fd_set rd, wr;
+    int nfds, sum = 0;
+    timing_start(t);
+    for(long i = 0; i < BENCH_CONN_OPS; ++i) {
+        int k = next_rand(&state) % c->size;
+        conn_remove_fd(pool, fds[k]);
+        conn_insert_fd(pool, fds[k]);
+        conn_copy_fd_sets(pool, &rd, &wr, &nfds);
+        sum += nfds;
+    }
+    timing_stop(t, BENCH_CONN_OPS);
+    s_sink = sum;
+    drop_pool(pool, fds, c->size);
+}
+
+/* Registering and removing real descriptors, in a pool of the default backend */
+static void conn_register_case(const struct bench_case *c, struct timing *t) {
+    ConnectionPool *pool = new_pool(conn_get_default_backend());
+    static int fds[BENCH_CONN_FDS];
+    for(int i = 0; i < c->size; ++i) {
+        if((fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+            perror("eventfd");
+            exit(EXIT_FAILURE);
+        }
+        conn_register_fd(pool, fds[i], CONN_EV_READ, NULL, NULL);
+    }
+    unsigned int state = 5;
+    timing_start(t);
+    for(long i = 0; i < BENCH_CONN_OPS; ++i) {
+        int k = next_rand(&state) % c->size;
+        conn_remove_fd(pool, fds[k]);
+        conn_register_fd(pool, fds[k], CONN_EV_READ, NULL, NULL);
+    }
+    timing_stop(t, BENCH_CONN_OPS);
+    drop_pool(pool, fds, c->size);
+    for(int i = 0; i < c->size; ++i) {
+        close(fds[i]);
+    }
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void run_case(const struct bench_case *c, int warmups, int repeats) {
+    double ns[BENCH_MAX_REPEATS], tsc[BENCH_MAX_REPEATS];
+    for(int i = 0; i < warmups; ++i) {
+        struct timing t = { 0, 0, 0 };
+        c->run(c, &t);
+    }
+    double sum = 0, sq = 0;
+    for(int i = 0; i < repeats; ++i) {
+        struct timing t = { 0, 0, 0 };
+        c->run(c, &t);
+        tsc[i] = (double)t.ticks / t.ops;
+        ns[i] = tsc[i] * s_ns_per_tick;
+        sum += ns[i];
+        sq += ns[i] * ns[i];
+    }
+    double mean = sum / repeats;
+    double var = repeats > 1 ? (sq - repeats * mean * mean) / (repeats - 1) : 0;
+    qsort(ns, repeats, sizeof(double), cmp_double);
+    qsort(tsc, repeats, sizeof(double), cmp_double);
+    printf("%-40s %9.2f %9.2f %9.2f ±%6.2f %10.1f\n", c->name, ns[repeats / 2], ns[0],
+            mean, var > 0 ? sqrt(var) : 0.0, tsc[repeats / 2]);
+    fflush(stdout);
+}
+
+static int add_case(struct bench_case *cases, int n, const char *op, const char *variant,
+        int size, int param, void (*run)(const struct bench_case *, struct timing *)) {
+    struct bench_case *c = &cases[n];
+    snprintf(c->name, sizeof(c->name), "%s/%s/%d", op, variant, size);
+    c->run = run;
+    c->size = size;
+    c->param = param;
+    return n + 1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-f <filter>] [-r <repeats>] [-w <warm-ups>] [-l]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *filter = NULL;
+    int repeats = 11, warmups = 2, list = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "f:r:w:l")) != -1) {
+        switch(opt) {
+            case 'f':
+                filter = optarg;
+                break;
+            case 'r':
+                repeats = atoi(optarg);
+                break;
+            case 'w':
+                warmups = atoi(optarg);
+                break;
+            case 'l':
+                list = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(repeats < 1 || repeats > BENCH_MAX_REPEATS || warmups < 0) {
+        usage(argv[0]);
+    }
+
+    static struct bench_case cases[128];
+    static const int prio_sizes[] = { 16, 256, BENCH_PRIO_CAP };
+    static const int conn_sizes[] = { 16, 256, BENCH_CONN_FDS };
+    int n = 0;
+    for(int s = 0; s < 3; ++s) {
+        for(int o = 0; o < 3; ++o) {
+            n = add_case(cases, n, "prio_insert", s_order_names[o], prio_sizes[s], o, prio_insert_case);
+            n = add_case(cases, n, "prio_remove_max", s_order_names[o], prio_sizes[s], o,
+                    prio_remove_max_case);
+            n = add_case(cases, n, "prio_churn", s_order_names[o], prio_sizes[s], o, prio_churn_case);
+        }
+        n = add_case(cases, n, "prio_peek_max", "random", prio_sizes[s], ORDER_RANDOM,
+                prio_peek_max_case);
+    }
+    for(int s = 0; s < 3; ++s) {
+        for(int d = 0; d < 3; ++d) {
+            n = add_case(cases, n, "conn_copy_fd_sets", s_spread_names[d], conn_sizes[s], d,
+                    conn_copy_fd_sets_case);
+            n = add_case(cases, n, "conn_select_churn", s_spread_names[d], conn_sizes[s], d,
+                    conn_select_churn_case);
+        }
+        n = add_case(cases, n, "conn_register", conn_backend_name(conn_get_default_backend()),
+                conn_sizes[s], 0, conn_register_case);
+    }
+
+    if(!list) {
+        calibrate();
+        printf("%-40s %9s %9s %9s %7s %10s\n", "ns/op", "median", "min", "mean", "sd",
+                "tsc/op");
+    }
+    for(int i = 0; i < n; ++i) {
+        if(filter != NULL && strstr(cases[i].name, filter) == NULL) {
+            continue;
+        }
+        if(list) {
+            printf("%s\n", cases[i].name);
+        } else {
+            run_case(&cases[i], warmups, repeats);
+        }
+    }
+    return EXIT_SUCCESS;
+}
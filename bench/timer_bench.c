@@ -0,0 +1,86 @@
+/*
+ * Cost of the timers of a busy worker. A million connections each
+ * have a timer, which is armed, pushed back as bytes move, and
+ * cancelled when the connection closes, while the wheel is advanced
+ * a millisecond at a time and the timers that are due expire.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "timer.h"
+
+#define BENCH_TIMERS     1000000
+#define BENCH_ITERATIONS 10000000
+
+static Timer s_timers[BENCH_TIMERS];
+static unsigned long s_expired;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Cheap and deterministic */
+static unsigned int next_rand(unsigned int *state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+static void on_expiry(Timer *timer, void *data) {
+    (void)timer;
+    (void)data;
+    s_expired++;
+}
+
+int main(void) {
+    uint64_t clock_ms = 0;
+    TimerWheel *wheel = timer_wheel_init(clock_ms);
+    if(wheel == NULL) {
+        return EXIT_FAILURE;
+    }
+    unsigned int state = 1;
+
+    /* Idle timeouts spread over a minute, as connections come in */
+    double start = now();
+    for(int i = 0; i < BENCH_TIMERS; ++i) {
+        timer_init(&s_timers[i], on_expiry, NULL);
+        timer_arm(wheel, &s_timers[i], clock_ms + 1000 + next_rand(&state) % 60000);
+    }
+    double arm = (now() - start) * 1e9 / BENCH_TIMERS;
+
+    /* Traffic pushes timers back, connections close, the clock moves */
+    start = now();
+    for(int i = 0; i < BENCH_ITERATIONS; ++i) {
+        unsigned int r = next_rand(&state);
+        Timer *timer = &s_timers[r % BENCH_TIMERS];
+        if(r % 16 == 0) {
+            timer_cancel(wheel, timer);
+        } else {
+            timer_arm(wheel, timer, clock_ms + 1000 + r % 60000);
+        }
+        if(i % 1000 == 0) {
+            timer_wheel_advance(wheel, ++clock_ms);
+        }
+    }
+    double rearm = (now() - start) * 1e9 / BENCH_ITERATIONS;
+
+    /* The wheel runs out, skipping the ticks where nothing is due */
+    long armed = timer_wheel_count(wheel);
+    start = now();
+    unsigned long wakeups = 0;
+    while(timer_wheel_count(wheel) > 0) {
+        clock_ms += timer_wheel_timeout(wheel, clock_ms, 1000);
+        timer_wheel_advance(wheel, clock_ms);
+        wakeups++;
+    }
+    double drain = now() - start;
+
+    printf("arm:           %6.1f ns per timer (%d timers)\n", arm, BENCH_TIMERS);
+    printf("re-arm/cancel: %6.1f ns per operation\n", rearm);
+    printf("expiry:        %6.1f ns per timer (%ld timers, %lu wakeups, %lu expired in all)\n",
+            armed > 0 ? drain * 1e9 / armed : 0.0, armed, wakeups, s_expired);
+    timer_wheel_destroy(wheel);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+/**
+ * @file acceptor.h
+ * @brief Takes the connections waiting on a listening
+ * socket. Every readiness event of the socket drains its
+ * backlog in one go with accept4(2), the connections come
+ * out non-blocking and close-on-exec, and are handed over
+ * one at a time.
+ *
+ * Errors that concern a single connection, which the peer
+ * may have reset before it was taken, are counted and
+ * skipped. Running out of descriptors is not fatal either:
+ * the acceptor keeps a descriptor in reserve, which it
+ * gives up to take the next connection and close it right
+ * away. The client sees its connection refused instead of
+ * waiting in the backlog, and the listening socket stops
+ * being ready, where it would otherwise wake the worker up
+ * over and over.
+ *
+ * An acceptor is not thread safe, it is meant to be owned
+ * by a single worker.
+ *
+ */
+
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+#include <stdint.h>
+
+/**
+ * @brief Receives a connection that was accepted, which it
+ * owns from then on.
+ *
+ */
+typedef void (*AcceptHandler)(int connfd, void *data);
+
+/**
+ * @brief The counters of an acceptor.
+ *
+ */
+typedef struct {
+    uint64_t accepted; /* Connections handed over */
+    uint64_t batches;  /* Drains that took a connection at least */
+    uint64_t shed;     /* Connections closed for lack of descriptors */
+    uint64_t errors;   /* Connections lost to a transient error */
+} AcceptStats;
+
+/**
+ * @struct Acceptor acceptor.h "include/acceptor.h"
+ * @brief The acceptor. The structure looks like this in the
+ * source file:
+ *
+ * ```
+ * struct acceptor {
+ *     int listenfd;
+ *     int reservefd;  // -1 while given up
+ *     AcceptHandler handler;
+ *     void *data;
+ *     AcceptStats stats;
+ * };
+ * ```
+ *
+ */
+typedef struct acceptor Acceptor;
+
+/**
+ * @brief Initializes an acceptor of the connections of
+ * listenfd, which must be non-blocking.
+ *
+ * @param listenfd The listening socket, which the acceptor
+ * does not own
+ * @param handler Called for every connection
+ * @param data Passed to handler
+ * @return On success, a pointer to the acceptor. Otherwise,
+ * it returns NULL.
+ *
+ */
+extern Acceptor *acceptor_init(int listenfd, AcceptHandler handler, void *data);
+
+/**
+ * @brief Takes every connection of the backlog, until
+ * accept4(2) would block.
+ *
+ * @param acceptor The acceptor
+ * @return The number of connections handed over. Otherwise,
+ * it returns -1, when the listening socket is no longer
+ * usable.
+ *
+ */
+extern int acceptor_drain(Acceptor *acceptor);
+
+/**
+ * @brief The counterpart of acceptor_drain for an accept
+ * that completed asynchronously, as a multishot accept of
+ * io_uring does. A connection is handed over, an error is
+ * dealt with as acceptor_drain would, shedding connections
+ * when the descriptors ran out.
+ *
+ * @param acceptor The acceptor
+ * @param res The result of the accept, a connection or a
+ * negated errno
+ * @return 0 on success. Otherwise, it returns -1, when the
+ * listening socket is no longer usable.
+ *
+ */
+extern int acceptor_complete(Acceptor *acceptor, int res);
+
+/**
+ * @brief Copies the counters of acceptor into stats.
+ *
+ * @param acceptor The acceptor
+ * @param stats Receives the counters
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int acceptor_get_stats(const Acceptor *acceptor, AcceptStats *stats);
+
+/**
+ * @brief Frees the block pointed to by acceptor and its
+ * reserve descriptor. The listening socket is left open.
+ *
+ * @param acceptor The acceptor
+ *
+ */
+extern void acceptor_destroy(Acceptor *acceptor);
+
+#endif /* ACCEPTOR_H */
@@ -0,0 +1,195 @@
+/**
+ * @file admission.h
+ * @brief Admission control of a worker, so that past its
+ * capacity the load it cannot take is turned away early
+ * and cheaply instead of slowing down every client.
+ *
+ * New connections are metered at accept time by token
+ * buckets, one for the worker and one for every client
+ * address, and a connection over either rate is reset
+ * before a byte of it is read. Requests are metered as
+ * their head is parsed by a limit on how many of them the
+ * worker relays at once, and one over the limit gets a
+ * 503 right away.
+ *
+ * The limit adapts to the queueing delay of the worker,
+ * the time a new client waits between its accept and its
+ * request being read. It is looked at every interval, the
+ * way CoDel does: when even the shortest delay of the
+ * interval was over the target, the worker is behind and
+ * the limit shrinks by a tenth. When the delay stayed
+ * below the target while the limit was reached, it grows
+ * by an eighth, up to the configured ceiling.
+ *
+ * The buckets of the clients are a table of fixed size
+ * where an address has two slots it may hash to. When
+ * both hold other addresses, the one whose bucket is the
+ * fullest, which has been quiet the longest, is taken
+ * over, so that the table never grows and a lookup never
+ * walks a chain.
+ *
+ * An admission is not thread safe, it is meant to be owned
+ * by a single worker. The rates are those of the worker.
+ *
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+
+/* Slots of the table of the buckets of the clients */
+#ifndef ADMISSION_CLIENT_SLOTS
+#define ADMISSION_CLIENT_SLOTS 4096
+#endif
+
+/* Queueing delay past which the worker is behind */
+#ifndef ADMISSION_TARGET_DELAY_US
+#define ADMISSION_TARGET_DELAY_US 5000
+#endif
+
+/* How often the concurrency limit is looked at */
+#ifndef ADMISSION_INTERVAL_US
+#define ADMISSION_INTERVAL_US 100000
+#endif
+
+/* The concurrency limit never shrinks below this */
+#ifndef ADMISSION_MIN_LIMIT
+#define ADMISSION_MIN_LIMIT 4
+#endif
+
+/**
+ * @brief What an admission lets in. A limit of 0 is no
+ * limit, a burst of 0 is that of a second at the rate.
+ *
+ */
+typedef struct {
+    unsigned int conn_rate;    /* New connections a second */
+    unsigned int conn_burst;   /* New connections at once over conn_rate */
+    unsigned int client_rate;  /* New connections a second of a client address */
+    unsigned int client_burst; /* Of a client address at once over client_rate */
+    unsigned int max_inflight; /* Ceiling of the concurrency limit */
+} AdmissionLimits;
+
+/**
+ * @brief The counters of an admission.
+ *
+ */
+typedef struct {
+    uint64_t accepted;     /* Connections let in */
+    uint64_t reset;        /* Connections over the rate of the worker */
+    uint64_t reset_client; /* Connections over the rate of their client */
+    uint64_t admitted;     /* Requests let in */
+    uint64_t shed;         /* Requests over the concurrency limit */
+    unsigned int limit;    /* The concurrency limit, 0 for none */
+    unsigned int inflight; /* Requests let in and not over yet */
+} AdmissionStats;
+
+/**
+ * @struct Admission admission.h "include/admission.h"
+ * @brief The admission control. The structure looks like
+ * this in the source file:
+ *
+ * ```
+ * struct bucket {
+ *     uint64_t tokens;        // in millionths of a token
+ *     uint64_t last_us;       // when it was last refilled
+ * };
+ *
+ * struct client_slot {
+ *     unsigned char addr[16]; // IPv4 addresses are mapped, all 0 if free
+ *     struct bucket bucket;
+ * };
+ *
+ * struct admission {
+ *     AdmissionLimits limits;
+ *     struct bucket conns;
+ *     struct client_slot *clients; // ADMISSION_CLIENT_SLOTS, NULL without client_rate
+ *     unsigned int limit;
+ *     unsigned int inflight;
+ *     unsigned int peak;           // of inflight over the interval
+ *     uint64_t interval_us;        // when the interval ends, 0 before a delay
+ *     uint64_t min_delay_us;       // over the interval
+ *     AdmissionStats stats;
+ * };
+ * ```
+ *
+ */
+typedef struct admission Admission;
+
+/**
+ * @brief Initializes an admission with its buckets full
+ * and its concurrency limit at the ceiling.
+ *
+ * @param limits What it lets in
+ * @return On success, a pointer to the admission.
+ * Otherwise, it returns NULL.
+ *
+ */
+extern Admission *admission_init(const AdmissionLimits *limits);
+
+/**
+ * @brief Takes a token from the bucket of the worker and
+ * from that of the address of the client of connfd, when
+ * both have one. Connections that are not over TCP only
+ * have the bucket of the worker.
+ *
+ * @param admission The admission
+ * @param connfd The connection just accepted
+ * @param now_us The time now in microseconds, of
+ * CLOCK_MONOTONIC
+ * @return 1 if the connection is let in, 0 if it is over
+ * a rate, in which case the caller resets it.
+ *
+ */
+extern int admission_accept(Admission *admission, int connfd, uint64_t now_us);
+
+/**
+ * @brief Lets a request in when fewer requests than the
+ * concurrency limit are in. Every request let in must be
+ * ended with admission_end.
+ *
+ * @param admission The admission
+ * @return 1 if the request is let in, 0 if it is shed.
+ *
+ */
+extern int admission_begin(Admission *admission);
+
+/**
+ * @brief Ends a request admission_begin let in.
+ *
+ * @param admission The admission
+ *
+ */
+extern void admission_end(Admission *admission);
+
+/**
+ * @brief Records the queueing delay of a new client, and
+ * adapts the concurrency limit once an interval is over.
+ *
+ * @param admission The admission
+ * @param delay_us The time from the accept to the request
+ * @param now_us The time now in microseconds
+ *
+ */
+extern void admission_observe(Admission *admission, uint64_t delay_us, uint64_t now_us);
+
+/**
+ * @brief Copies the counters of admission into stats.
+ *
+ * @param admission The admission
+ * @param stats Receives the counters
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int admission_get_stats(const Admission *admission, AdmissionStats *stats);
+
+/**
+ * @brief Frees the block pointed to by admission.
+ *
+ * @param admission The admission
+ *
+ */
+extern void admission_destroy(Admission *admission);
+
+#endif /* ADMISSION_H */
@@ -0,0 +1,318 @@
+/**
+ * @file balancer.h
+ * @brief Picks the backend of a request in reverse proxy
+ * mode, out of a fixed set of them, by one of three
+ * policies:
+ *
+ * - least outstanding requests: the backend with the
+ *   fewest requests in flight, taken from an indexed heap
+ *   of the backends keyed by that count. Ties go to the
+ *   backend picked the longest ago, so that an idle set
+ *   is gone through in turn.
+ * - power of two choices: the least loaded of two
+ *   backends drawn at random, which is nearly as good and
+ *   does not herd every worker onto the same backend.
+ * - consistent hashing: the backend that follows the hash
+ *   of the request on a ring where every backend has
+ *   `BALANCER_VNODES` points, so that a resource always
+ *   goes to the same backend, whose cache holds it, and
+ *   only the resources of a backend move when it leaves.
+ *
+ * Every backend has a circuit breaker fed with the outcome
+ * of its requests. It trips open after
+ * `BALANCER_TRIP_FAILURES` failures in a row, or once at
+ * least `BALANCER_TRIP_PERCENT` percent of the requests of
+ * a window of `BALANCER_WINDOW_MS` failed, given enough of
+ * them. An open backend takes no request for
+ * `BALANCER_OPEN_MS`, then goes half open: it takes one
+ * trial request at a time, and `BALANCER_TRIALS` of them
+ * going through close it again while one failing opens it
+ * again. Health probes, run elsewhere, tell the balancer
+ * whether a backend answers at all, and one that failed
+ * `BALANCER_PROBE_FALLS` probes in a row takes no request
+ * until `BALANCER_PROBE_RISES` of them went through.
+ *
+ * A backend that is down or open is out of rotation: the
+ * policies pick among the others as if it was not there,
+ * which consistent hashing does by moving on to the next
+ * point of the ring, so that only its resources move. With
+ * every backend out, a pick fails right away.
+ *
+ * A balancer is not thread safe, it is meant to be owned
+ * by a single worker, so the requests in flight it knows
+ * of are those of its worker.
+ *
+ */
+
+#ifndef BALANCER_H
+#define BALANCER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Backends of a balancer at most */
+#define BALANCER_MAX_BACKENDS 64
+
+/* Points of a backend on the ring of consistent hashing */
+#ifndef BALANCER_VNODES
+#define BALANCER_VNODES 160
+#endif
+
+/* Failures in a row that trip a breaker */
+#ifndef BALANCER_TRIP_FAILURES
+#define BALANCER_TRIP_FAILURES 5
+#endif
+
+/* Share of failed requests of a window, in percent, that trips a breaker */
+#ifndef BALANCER_TRIP_PERCENT
+#define BALANCER_TRIP_PERCENT 50
+#endif
+
+/* Requests a window needs before its share of failures counts */
+#ifndef BALANCER_MIN_REQUESTS
+#define BALANCER_MIN_REQUESTS 20
+#endif
+
+/* Length of a window of the share of failures */
+#ifndef BALANCER_WINDOW_MS
+#define BALANCER_WINDOW_MS 10000
+#endif
+
+/* Time an open breaker waits before it lets trial requests in */
+#ifndef BALANCER_OPEN_MS
+#define BALANCER_OPEN_MS 5000
+#endif
+
+/* Trial requests that must go through to close a half open breaker */
+#ifndef BALANCER_TRIALS
+#define BALANCER_TRIALS 3
+#endif
+
+/* Probes failing, and then going through, in a row that take a backend down, and up */
+#ifndef BALANCER_PROBE_FALLS
+#define BALANCER_PROBE_FALLS 2
+#endif
+#ifndef BALANCER_PROBE_RISES
+#define BALANCER_PROBE_RISES 2
+#endif
+
+/* Longest host, and port, of a backend */
+#define BALANCER_HOST_SZ 256
+#define BALANCER_PORT_SZ 8
+
+/**
+ * @brief How a balancer picks a backend.
+ *
+ */
+typedef enum {
+    BALANCE_LEAST_OUTSTANDING, /* "least" */
+    BALANCE_TWO_CHOICES,       /* "p2c" */
+    BALANCE_HASH               /* "hash" */
+} BalancePolicy;
+
+/**
+ * @brief The state of the circuit breaker of a backend.
+ *
+ */
+typedef enum {
+    BREAKER_CLOSED,    /* Requests go through */
+    BREAKER_OPEN,      /* No request goes through */
+    BREAKER_HALF_OPEN  /* One trial request at a time goes through */
+} BreakerState;
+
+/**
+ * @brief The counters and the state of a backend.
+ *
+ */
+typedef struct {
+    uint64_t picks;           /* Requests sent to it */
+    unsigned int outstanding; /* Of those, the ones in flight */
+    uint64_t failures;        /* Requests that failed */
+    uint64_t trips;           /* Times its breaker opened */
+    BreakerState breaker;
+    unsigned char healthy;    /* Its probes go through */
+} BackendStats;
+
+/**
+ * @struct Balancer balancer.h "include/balancer.h"
+ * @brief The balancer. The structure looks like this in
+ * the source file:
+ *
+ * ```
+ * struct backend {
+ *     char host[BALANCER_HOST_SZ];
+ *     char port[BALANCER_PORT_SZ];
+ *     uint64_t last_pick;      // seq of its last pick
+ *     unsigned char live;      // in rotation
+ *     unsigned int fails;      // in a row
+ *     unsigned int probes;     // failing, or going through, in a row
+ *     unsigned int trials;     // gone through since half open
+ *     unsigned int window_reqs;
+ *     unsigned int window_fails;
+ *     uint64_t window_ms;      // when the window started
+ *     uint64_t opened_ms;      // when the breaker opened
+ *     BackendStats stats;
+ * };
+ *
+ * struct ring_point {
+ *     uint64_t hash;
+ *     unsigned int backend;
+ * };
+ *
+ * struct balancer {
+ *     BalancePolicy policy;
+ *     unsigned int nbackends;
+ *     struct backend backends[BALANCER_MAX_BACKENDS];
+ *     unsigned int live[BALANCER_MAX_BACKENDS]; // the backends in rotation
+ *     unsigned int nlive;
+ *     PrioIndex *load;         // of those in rotation: outstanding requests, then the last pick
+ *     struct ring_point *ring; // sorted, BALANCER_VNODES per backend
+ *     uint64_t seq;            // of the picks
+ *     uint64_t rand;           // xorshift state of the two choices
+ * };
+ * ```
+ *
+ */
+typedef struct balancer Balancer;
+
+/**
+ * @brief Parses the name of a policy: "least", "p2c" or
+ * "hash".
+ *
+ * @param name The name
+ * @param policy Receives the policy
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int balancer_parse_policy(const char *name, BalancePolicy *policy);
+
+/**
+ * @brief Initializes a balancer of backends, each given as
+ * "host:port" ("[v6]:port" for an IPv6 address).
+ *
+ * @param policy How it picks a backend
+ * @param backends The backends
+ * @param nbackends How many there are, from 1 to
+ * `BALANCER_MAX_BACKENDS`
+ * @return On success, a pointer to the balancer.
+ * Otherwise, it returns NULL, when a backend cannot be
+ * parsed or memory cannot be allocated.
+ *
+ */
+extern Balancer *balancer_init(BalancePolicy policy, char *const *backends,
+        unsigned int nbackends);
+
+/**
+ * @brief Picks the backend of a request among those in
+ * rotation, which counts as in flight until it is
+ * released with balancer_release.
+ *
+ * @param balancer The balancer
+ * @param key What identifies the resource asked for,
+ * only consistent hashing looks at it
+ * @param key_len Its length
+ * @return The index of the backend. Otherwise, it returns
+ * -1, when every backend is down or open.
+ *
+ */
+extern int balancer_pick(Balancer *balancer, const char *key, size_t key_len);
+
+/**
+ * @brief Tells that a request of a backend is no longer
+ * in flight.
+ *
+ * @param balancer The balancer
+ * @param backend The index balancer_pick returned
+ *
+ */
+extern void balancer_release(Balancer *balancer, int backend);
+
+/**
+ * @brief Feeds the breaker of a backend with the outcome
+ * of a request it was picked for: whether it answered
+ * with a response head, or failed to be connected to or
+ * to answer in time. Outcomes that come while the breaker
+ * is open, of requests picked before it opened, are left
+ * out.
+ *
+ * @param balancer The balancer
+ * @param backend The index balancer_pick returned
+ * @param ok 1 if it answered, 0 if it failed
+ * @param now_ms The time now in milliseconds, of
+ * CLOCK_MONOTONIC
+ *
+ */
+extern void balancer_report(Balancer *balancer, int backend, int ok, uint64_t now_ms);
+
+/**
+ * @brief Records the outcome of a health probe of a
+ * backend.
+ *
+ * @param balancer The balancer
+ * @param backend The index of the backend
+ * @param ok 1 if the probe went through, 0 if it failed
+ *
+ */
+extern void balancer_probe(Balancer *balancer, int backend, int ok);
+
+/**
+ * @brief Lets the breakers open for `BALANCER_OPEN_MS`
+ * go half open. It is meant to be called each time the
+ * event loop wakes up.
+ *
+ * @param balancer The balancer
+ * @param now_ms The time now in milliseconds
+ *
+ */
+extern void balancer_tick(Balancer *balancer, uint64_t now_ms);
+
+/**
+ * @brief Returns the host of a backend.
+ *
+ * @param balancer The balancer
+ * @param backend The index of the backend
+ * @return The host, NULL for no such backend.
+ *
+ */
+extern const char *balancer_host(const Balancer *balancer, int backend);
+
+/**
+ * @brief Returns the port of a backend.
+ *
+ * @param balancer The balancer
+ * @param backend The index of the backend
+ * @return The port, NULL for no such backend.
+ *
+ */
+extern const char *balancer_port(const Balancer *balancer, int backend);
+
+/**
+ * @brief Returns the number of backends.
+ *
+ * @param balancer The balancer
+ * @return The number of backends, 0 if balancer is `NULL`.
+ *
+ */
+extern unsigned int balancer_count(const Balancer *balancer);
+
+/**
+ * @brief Copies the counters and the state of a backend
+ * to stats.
+ *
+ * @param balancer The balancer
+ * @param backend The index of the backend
+ * @param stats Where the counters are copied
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int balancer_get_stats(const Balancer *balancer, int backend, BackendStats *stats);
+
+/**
+ * @brief Frees the block pointed to by balancer.
+ *
+ * @param balancer The balancer
+ *
+ */
+extern void balancer_destroy(Balancer *balancer);
+
+#endif /* BALANCER_H */
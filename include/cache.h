@@ -0,0 +1,339 @@
+/**
+ * @file cache.h
+ * @brief An in-memory cache of HTTP responses shared by
+ * every worker. Responses are stored as they went out on
+ * the wire (head and body, chunked or not) under the
+ * origin and target of the GET request they answer, plus
+ * the values the request had for the headers named by the
+ * Vary header of the response. Only responses that carry
+ * an explicit freshness lifetime (Cache-Control max-age or
+ * s-maxage, or Expires) are stored, and a hit is served
+ * as long as that lifetime has not run out.
+ *
+ * The cache is split into shards, each with a lock of its
+ * own, an open-addressing index and a byte budget of its
+ * own. Within a shard, eviction follows a segmented LRU:
+ * new objects enter a probation segment and move to the
+ * protected one when they are hit again, so that a scan
+ * of objects requested once cannot flush the popular ones.
+ *
+ * Objects are reference counted, so a hit is served from
+ * the stored buffer without holding any lock, even if the
+ * object is evicted in the meantime.
+ *
+ * A `DiskCache` may be attached as a second tier. Every
+ * response that does not vary is then written through to
+ * it as well, and it is looked up on a miss in memory.
+ *
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "disk_cache.h"
+#include "http.h"
+
+/* Largest response that is stored */
+#ifndef HTTP_CACHE_MAX_OBJECT
+#define HTTP_CACHE_MAX_OBJECT (1024 * 1024)
+#endif
+
+/* Longest key (origin and target) that is stored */
+#define HTTP_CACHE_KEY_MAX 2048
+
+/* Longest Vary header, and the request values it selects */
+#define HTTP_CACHE_VARY_MAX 512
+
+/* iovecs filled in by http_cache_object_iov */
+#define HTTP_CACHE_IOV 3
+
+/* Room needed for the Age header of http_cache_object_iov */
+#define HTTP_CACHE_AGE_SZ 32
+
+/**
+ * @brief The counters of a cache, summed over its shards.
+ * The hit ratio is hits / lookups.
+ *
+ */
+typedef struct {
+    uint64_t lookups;     /* GET requests looked up */
+    uint64_t hits;        /* Served from the cache */
+    uint64_t misses;      /* Not found, expired or bypassed */
+    uint64_t stores;      /* Responses stored */
+    uint64_t evictions;   /* Objects dropped to make room */
+    uint64_t expired;     /* Objects dropped once stale */
+    uint64_t bytes_saved; /* Bytes served from the cache */
+    uint64_t bytes;       /* Bytes held right now */
+    uint64_t objects;     /* Objects held right now */
+} HttpCacheStats;
+
+/**
+ * @struct HttpCache cache.h "include/cache.h"
+ * @brief The cache, which may be shared by several threads.
+ * The structure looks like this in the source file:
+ *
+ * ```
+ * struct http_cache {
+ *     size_t max_object;
+ *     DiskCache *disk;
+ *     struct cache_shard shards[HTTP_CACHE_SHARDS];
+ * };
+ * ```
+ *
+ */
+typedef struct http_cache HttpCache;
+
+/**
+ * @struct CacheObject cache.h "include/cache.h"
+ * @brief A stored response, or one that is being stored.
+ * Once in the cache, an object never changes. The structure
+ * looks like this in the source file:
+ *
+ * ```
+ * struct cache_object {
+ *     uint64_t hash;
+ *     char *key;
+ *     char *vary;         // the Vary header of the response
+ *     char *vary_values;  // what the request had for it
+ *     char *data;         // head then body
+ *     size_t len;
+ *     size_t cap;
+ *     size_t head_len;
+ *     size_t max_len;
+ *     uint64_t stored_ms;
+ *     uint64_t expires_ms;
+ *     int refs;
+ *     int segment;
+ *     struct cache_object *prev; // LRU list of the segment
+ *     struct cache_object *next;
+ * };
+ * ```
+ *
+ */
+typedef struct cache_object CacheObject;
+
+/**
+ * @brief Initializes an empty cache that holds at most
+ * max_bytes bytes of responses.
+ *
+ * @param max_bytes The byte budget of the cache
+ * @return On success, a pointer to the new cache.
+ * Otherwise, it returns NULL.
+ *
+ */
+extern HttpCache *http_cache_init(size_t max_bytes);
+
+/**
+ * @brief Looks up the response to a request sent to origin.
+ * Requests other than GET are never looked up, and neither
+ * are those that ask for a fresh response (Cache-Control or
+ * Pragma no-cache).
+ *
+ * @param cache The cache
+ * @param origin The "host:port" the request is meant for
+ * @param req The request head in origin-form, as it is sent
+ * to the origin
+ * @param req_len The length of req
+ * @param obj Receives the object on a hit, which must be
+ * given back with http_cache_release
+ * @return 1 on a hit, 0 otherwise.
+ *
+ */
+extern int http_cache_lookup(HttpCache *cache, const char *origin, const char *req,
+        size_t req_len, CacheObject **obj);
+
+/**
+ * @brief Returns the hash of the key a request is looked
+ * up under, so that requests for the same response can be
+ * told apart from the others before it is stored.
+ *
+ * @param origin The "host:port" the request is meant for
+ * @param req The request head, as given to http_cache_lookup
+ * @param req_len The length of req
+ * @return The hash, or 0 if the request is never looked up
+ *
+ */
+extern uint64_t http_cache_key_hash(const char *origin, const char *req, size_t req_len);
+
+/**
+ * @brief Tells whether an object answers a request of the
+ * same key, which it does unless the request has other
+ * values for the headers the response varies on.
+ *
+ * @param obj The object, stored or being filled
+ * @param req The request head, as given to http_cache_lookup
+ * @param req_len The length of req
+ * @return 1 if it does, 0 otherwise.
+ *
+ */
+extern int http_cache_object_matches(const CacheObject *obj, const char *req, size_t req_len);
+
+/**
+ * @brief Looks up the response to a request in the disk tier,
+ * under the same conditions as http_cache_lookup.
+ *
+ * @param cache The cache
+ * @param origin The "host:port" the request is meant for
+ * @param req The request head, as given to http_cache_lookup
+ * @param req_len The length of req
+ * @param hit Receives where the body of the response is
+ * @param head Receives the head of the response
+ * @param head_sz The size of head
+ * @return 1 on a hit, 0 otherwise (or if no disk tier is
+ * attached).
+ *
+ */
+extern int http_cache_lookup_disk(HttpCache *cache, const char *origin, const char *req,
+        size_t req_len, DiskHit *hit, char *head, size_t head_sz);
+
+/**
+ * @brief Fills iov with the stored response, with an Age
+ * header added to its head.
+ *
+ * @param obj The object
+ * @param iov Receives `HTTP_CACHE_IOV` entries
+ * @param age A buffer of `HTTP_CACHE_AGE_SZ` bytes that
+ * holds the Age header and must outlive iov
+ * @return The number of entries of iov
+ *
+ */
+extern int http_cache_object_iov(const CacheObject *obj, struct iovec *iov, char *age);
+
+/**
+ * @brief Fills iov with the head of a disk hit, with an Age
+ * header added to it. The body is left to sendfile(2).
+ *
+ * @param hit The disk hit
+ * @param head The head copied out by the lookup
+ * @param iov Receives `HTTP_CACHE_IOV` entries at most
+ * @param age A buffer of `HTTP_CACHE_AGE_SZ` bytes that
+ * holds the Age header and must outlive iov
+ * @return The number of entries of iov
+ *
+ */
+extern int http_cache_disk_iov(const DiskHit *hit, char *head, struct iovec *iov, char *age);
+
+/**
+ * @brief Starts storing the response to a request if the
+ * request and the response allow it. The response head must
+ * have been parsed, the bytes that went out to the client
+ * (the head first) are then added with http_cache_fill_append.
+ *
+ * @param cache The cache
+ * @param origin The "host:port" the request was sent to
+ * @param req The request head, as given to http_cache_lookup
+ * @param req_len The length of req
+ * @param resp The buffer the response head was parsed from
+ * @param resp_parser The parser of the response head
+ * @return The object being filled, or NULL if the response
+ * may not be stored.
+ *
+ */
+extern CacheObject *http_cache_fill_start(HttpCache *cache, const char *origin,
+        const char *req, size_t req_len, const char *resp, const HttpParser *resp_parser);
+
+/**
+ * @brief Adds n bytes of the response to the object.
+ *
+ * @param obj The object being filled
+ * @param buf The bytes
+ * @param n The number of bytes
+ * @return 0 on success. Otherwise, it returns -1, for
+ * instance when the response is too large to be stored.
+ *
+ */
+extern int http_cache_fill_append(CacheObject *obj, const void *buf, size_t n);
+
+/**
+ * @brief Adds the next n bytes read from fd to the object.
+ * It is meant for a pipe the bytes were just teed into, so
+ * all of them can be read right away.
+ *
+ * @param obj The object being filled
+ * @param fd The file descriptor to read from
+ * @param n The number of bytes
+ * @return 0 once the n bytes were read. Otherwise, it
+ * returns -1.
+ *
+ */
+extern int http_cache_fill_read(CacheObject *obj, int fd, size_t n);
+
+/**
+ * @brief Stores the object, once the whole response is in.
+ * It replaces the object stored for the same request, and
+ * evicts objects of the shard until it fits its budget. The
+ * caller gives up its reference in any case.
+ *
+ * @param cache The cache
+ * @param obj The object being filled
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int http_cache_fill_finish(HttpCache *cache, CacheObject *obj);
+
+/**
+ * @brief Points data at the bytes of an object, as they went
+ * out on the wire. Those of an object being filled grow with
+ * each http_cache_fill_append and may move, so only the thread
+ * that fills it may read them until it is stored.
+ *
+ * @param obj The object
+ * @param data Receives the bytes
+ * @return The number of bytes
+ *
+ */
+extern size_t http_cache_object_data(const CacheObject *obj, const char **data);
+
+/**
+ * @brief Takes another reference to an object, stored or
+ * being filled.
+ *
+ * @param obj The object
+ * @return obj
+ *
+ */
+extern CacheObject *http_cache_retain(CacheObject *obj);
+
+/**
+ * @brief Gives back a reference to an object, freeing it if
+ * it was the last one. It also drops an object being filled.
+ *
+ * @param obj The object, may be `NULL`
+ *
+ */
+extern void http_cache_release(CacheObject *obj);
+
+/**
+ * @brief Makes disk the second tier of the cache. The disk
+ * cache must outlive the cache.
+ *
+ * @param cache The cache
+ * @param disk The disk tier, or `NULL` to detach it
+ *
+ */
+extern void http_cache_attach_disk(HttpCache *cache, DiskCache *disk);
+
+/**
+ * @brief Copies the counters of the cache into stats.
+ *
+ * @param cache The cache
+ * @param stats Receives the counters
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int http_cache_get_stats(HttpCache *cache, HttpCacheStats *stats);
+
+/**
+ * @brief Frees the block pointed to by cache. Objects still
+ * referenced elsewhere are freed when they are released.
+ *
+ * @param cache The cache
+ *
+ */
+extern void http_cache_destroy(HttpCache *cache);
+
+#endif /* CACHE_H */
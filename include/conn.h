@@ -3,42 +3,74 @@
  * @brief This interface is the specification
  * for the `ConnectionPool` object which handles
  * all of the current connections that the
- * proxy server is handling. It is important
- * to note that each function occurs atomically
- * in terms of multiple threads calling the 
- * functions. This is done through a simple mutex
- * that locks before the function runs and 
- * after the function runs so that data is consistent
- * and synchronized across each thread.
+ * proxy server is handling. A pool is the event
+ * loop of a single thread: every connection is
+ * registered with the interest (read and/or write)
+ * the caller has in it along with a handler that
+ * is invoked when the connection becomes ready.
+ * The readiness notification itself is done by a
+ * backend which is picked when the pool is created.
+ * A pool is not meant to be shared between threads;
+ * each thread that runs an event loop owns its own
+ * pool.
  *
  */
 
 #ifndef CONN_H
 #define CONN_H
 
+#include <stddef.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 
-/* TODO Swapping to a more scalable version */
+/**
+ * @brief The readiness notification mechanism that
+ * backs a connection pool. The select(2) backend is
+ * level-triggered and bounded by FD_SETSIZE. The epoll(7)
+ * backend is edge-triggered and only bounded by the
+ * file descriptor limit of the process. The io_uring(7)
+ * backend reports readiness the same way as epoll through
+ * multishot polls and is the only one that supports the
+ * `conn_async_*` completion operations. The backend that
+ * `conn_pool_init` uses is picked at build time with
+ * `make CONN_BACKEND=<select|epoll|uring>` (epoll by default).
+ *
+ */
+typedef enum {
+    CONN_BACKEND_SELECT,
+    CONN_BACKEND_EPOLL,
+    CONN_BACKEND_URING
+} ConnBackend;
+
+/* Interest and readiness flags */
+#define CONN_EV_READ  0x1
+#define CONN_EV_WRITE 0x2
+#define CONN_EV_ERROR 0x4 /* Only ever reported, never registered */
+
+/* Flags of the completion operations */
+#define CONN_ASYNC_LINK 0x1 /* The next operation starts once this one is done */
 
 /**
  * @struct ConnectionPool conn.h include/conn.h
  * @brief This is the object that represents
  * the connection pool. This is the object
  * responsible for holding each of the user's
- * connection that can later be passed to an
- * event handler like `select(2)` and, then,
- * further processes the connections that correspond
- * to some socket file descriptor. The structure looks
- * like this in the source file:
+ * connection along with the state the caller
+ * attached to it. The pool hands its connections
+ * to the backend (`select(2)`, `epoll(7)` or `io_uring(7)`) and
+ * dispatches readiness back to the handler of each
+ * connection. The structure looks like this in the
+ * source file:
  *
  * ```
  * struct connectionPool {
- *     unsigned int pool_size; // capped at FD_SETSIZE
- *     struct {
- *         fd_set rd_set;
- *         fd_set wr_set;
- *     } rdwr_fd_sets; 
- *     PrioQueue *pq;
+ *     unsigned int pool_size;
+ *     ConnBackend backend_type;
+ *     const struct conn_backend_ops *ops;
+ *     void *backend;
+ *     struct conn_slot *slots; // indexed by fd
+ *     unsigned int nslots;
+ *     struct conn_event events[CONN_MAX_EVENTS];
  * };
  *
  * ```
@@ -47,12 +79,52 @@
 
 typedef struct connectionPool ConnectionPool;
 
+/**
+ * @brief The function invoked by `conn_dispatch` when a
+ * registered connection becomes ready. Since the epoll
+ * backend is edge-triggered, a handler must keep reading
+ * (or writing) until the call fails with EAGAIN, otherwise
+ * it will not be notified again for the data that is left.
+ * A handler is allowed to register, modify and remove any
+ * connection of the pool, including its own.
+ *
+ * @param conn_pool The pool the connection is registered in
+ * @param fd The file descriptor that became ready
+ * @param events A mask of `CONN_EV_READ`, `CONN_EV_WRITE`
+ * and `CONN_EV_ERROR`
+ * @param data The state that was attached to fd when it
+ * was registered
+ *
+ */
+typedef void (*ConnHandler)(ConnectionPool *conn_pool, int fd,
+        unsigned int events, void *data);
+
+/**
+ * @brief The function invoked by `conn_dispatch` when a
+ * completion operation (`conn_async_*`) finishes. For
+ * multishot operations (accept and recv) it is invoked
+ * once for every accepted connection or received chunk.
+ *
+ * @param conn_pool The pool the operation was submitted to
+ * @param fd The file descriptor the operation was submitted on
+ * @param res The result of the operation as the matching
+ * system call would return it, except that errors are
+ * returned as a negated errno value
+ * @param buf For recv, the received bytes. The buffer belongs
+ * to the pool and is only valid until the next `conn_dispatch`.
+ * It is `NULL` for every other operation.
+ * @param data The state passed when the operation was submitted
+ *
+ */
+typedef void (*ConnCompletion)(ConnectionPool *conn_pool, int fd, int res,
+        const void *buf, void *data);
+
 /**
  * @brief Initializes a new connection pool to handle
- * user connections. The caller should be using
- * a function like `select(2)` to handle the pool.
- * The initialiation fails if memory allocation
- * for the ConnectionPool fails.
+ * user connections with the backend picked at build
+ * time. The initialiation fails if memory allocation
+ * for the ConnectionPool fails or if the backend
+ * could not be set up.
  *
  * @return On success, it returns a pointer to the
  * new connection pool. Otherwise, on failure, it
@@ -61,21 +133,80 @@ typedef struct connectionPool ConnectionPool;
  */
 extern ConnectionPool *conn_pool_init(void);
 
-/** 
+/**
+ * @brief Works the same as `conn_pool_init` except that the
+ * caller picks the backend of the pool.
+ *
+ * @param backend The backend that reports readiness
+ * @return On success, it returns a pointer to the
+ * new connection pool. Otherwise, on failure, it
+ * returns NULL.
+ *
+ */
+extern ConnectionPool *conn_pool_init_backend(ConnBackend backend);
+
+/**
+ * @brief Registers a new connection into the connection pool
+ * along with the interest `events` the caller has in it, the
+ * handler invoked when it becomes ready and the per-connection
+ * state `data` that is handed back to that handler. The
+ * function fails if fd is already in the pool, if fd is
+ * out of range for the backend (FD_SETSIZE for select(2))
+ * or if the backend refuses the file descriptor.
+ *
+ * @param conn_pool A pointer to a connection pool
+ * @param fd The file descriptor of the new connection
+ * @param events A mask of `CONN_EV_READ` and `CONN_EV_WRITE`
+ * @param handler The function called on readiness. It may be
+ * `NULL`, in which case readiness of fd is ignored.
+ * @param data The per-connection state passed to handler
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int conn_register_fd(ConnectionPool *conn_pool, int fd,
+        unsigned int events, ConnHandler handler, void *data);
+
+/**
+ * @brief Replaces the interest of a connection that is
+ * already in the pool. The call fails if fd is not in the pool.
+ *
+ * @param conn_pool A pointer to a connection pool
+ * @param fd The file descriptor of the connection
+ * @param events A mask of `CONN_EV_READ` and `CONN_EV_WRITE`
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int conn_modify_fd(ConnectionPool *conn_pool, int fd,
+        unsigned int events);
+
+/**
+ * @brief Returns the per-connection state that was attached
+ * to fd when it was registered.
+ *
+ * @param conn_pool A pointer to a connection pool
+ * @param fd The file descriptor of the connection
+ * @return The state of the connection, or `NULL` if fd is
+ * not in the pool.
+ *
+ */
+extern void *conn_get_data(ConnectionPool *conn_pool, int fd);
+
+/**
  * @brief Inserts a new connection into the connection
  * pool. The new connection is described by the
  * file descriptor fd and the connection pool
- * is represented as conn_pool. The function fails
- * if including this new connection exceeds the maximum 
- * number of possible connections that select(2) 
- * can handle. In this case, it is FD_SETSIZE 
- * (which is defined to be 1024 as specified in select(2)) 
- * connections. The function also fails if the conn_pool
- * pointer points to a `NULL` address. If the connection
- * pool holds the current fd already, nothing is done,
- * but the call succeeds.
- *
- * @param conn_pool A pointer to a connection pool 
+ * is represented as conn_pool. The connection is
+ * registered for both reading and writing without
+ * a handler. The function fails if including this
+ * new connection exceeds the maximum number of
+ * possible connections that the backend can handle.
+ * For select(2), it is FD_SETSIZE (which is defined
+ * to be 1024 as specified in select(2)) connections.
+ * The function also fails if the conn_pool
+ * pointer points to a `NULL` address or if the
+ * connection pool holds the current fd already.
+ *
+ * @param conn_pool A pointer to a connection pool
  * that holds all of the current connections
  * @param fd The socket file descriptor that represents
  * the new connection
@@ -84,17 +215,18 @@ extern ConnectionPool *conn_pool_init(void);
  *
  */
 
-extern int conn_insert_fd(ConnectionPool *conn_pool, int fd); 
+extern int conn_insert_fd(ConnectionPool *conn_pool, int fd);
 
 /**
- * @brief Removes a connection from the connection pool. 
- * The connection that gets removed is specified by 
- * the file descriptor fd. In addition, it also fails 
+ * @brief Removes a connection from the connection pool.
+ * The connection that gets removed is specified by
+ * the file descriptor fd. In addition, it also fails
  * if conn_pool is `NULL`. If fd is not in the pool, then
  * the call still succeeds. The call, however, does fail
  * if the pool size is currently less than or equal to 0.
+ * The file descriptor itself is left open.
  *
- * @param conn_pool A pointer to a connection pool 
+ * @param conn_pool A pointer to a connection pool
  * that holds all of the current connections
  * @param fd The socket file descriptor that represents
  * the connection to remove
@@ -106,16 +238,125 @@ extern int conn_insert_fd(ConnectionPool *conn_pool, int fd);
 extern int conn_remove_fd(ConnectionPool *conn_pool, int fd);
 
 /**
- * TODO honestly fix this and make it mroe clear 
+ * @brief Waits up to timeout_ms milliseconds for any of the
+ * connections in the pool to become ready and invokes the
+ * handler of each ready connection, as well as the completion
+ * function of every finished `conn_async_*` operation. A timeout of -1 waits
+ * until something is ready. Being interrupted by a signal
+ * is not an error; the call simply returns 0 so that the
+ * caller can check whatever the signal handler changed.
+ *
+ * @param conn_pool A pointer to a connection pool
+ * @param timeout_ms The longest time to wait, or -1
+ * @return The number of handlers and completion functions
+ * that were invoked on success. Otherwise, it returns -1.
+ *
+ */
+extern int conn_dispatch(ConnectionPool *conn_pool, int timeout_ms);
+
+/**
+ * @brief Submits a multishot accept(2) on the listening socket
+ * listenfd. complete is invoked with the accepted (non-blocking,
+ * close-on-exec) socket as res for every new connection until
+ * the operation is cancelled with `conn_async_cancel`. Like every
+ * other completion operation, it is only queued here and handed
+ * to the kernel in a batch by the next `conn_dispatch`. The call
+ * fails with errno set to ENOTSUP if the pool is not backed by
+ * io_uring.
+ *
+ * @param conn_pool A pointer to a connection pool
+ * @param listenfd The listening socket
+ * @param complete The function called for every connection
+ * @param data The state passed to complete
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int conn_async_accept(ConnectionPool *conn_pool, int listenfd,
+        ConnCompletion complete, void *data);
+
+/**
+ * @brief Submits a recv(2) on fd into buffers provided by the
+ * pool, so no buffer has to be set aside for an idle connection.
+ * The receive is multishot: complete is invoked for every chunk
+ * that arrives until the peer closes the connection (res is 0),
+ * an error occurs or the operation is cancelled. If the receive
+ * directly follows an operation submitted with `CONN_ASYNC_LINK`,
+ * it is a single receive that only starts once that operation
+ * is done. Fails with ENOTSUP if the pool is not backed by io_uring.
+ *
+ * @param conn_pool A pointer to a connection pool
+ * @param fd The socket to receive from
+ * @param complete The function called for every chunk
+ * @param data The state passed to complete
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int conn_async_recv(ConnectionPool *conn_pool, int fd,
+        ConnCompletion complete, void *data);
+
+/**
+ * @brief Submits a send(2) of len bytes of buf on fd. buf must
+ * stay valid until complete is invoked. With `CONN_ASYNC_LINK`
+ * in flags, the next operation submitted to the pool only starts
+ * once this one succeeded, which makes a send followed by a recv
+ * a single round trip to the kernel. Fails with ENOTSUP if the
+ * pool is not backed by io_uring.
+ *
+ * @param conn_pool A pointer to a connection pool
+ * @param fd The socket to send on
+ * @param buf The bytes to send
+ * @param len The number of bytes to send
+ * @param flags 0 or `CONN_ASYNC_LINK`
+ * @param complete The function called with the number of bytes sent
+ * @param data The state passed to complete
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int conn_async_send(ConnectionPool *conn_pool, int fd,
+        const void *buf, size_t len, unsigned int flags,
+        ConnCompletion complete, void *data);
+
+/**
+ * @brief Submits a connect(2) of the socket fd to addr. addr
+ * must stay valid until complete is invoked. Fails with ENOTSUP
+ * if the pool is not backed by io_uring.
+ *
+ * @param conn_pool A pointer to a connection pool
+ * @param fd The socket to connect
+ * @param addr The address to connect to
+ * @param addrlen The length of addr
+ * @param flags 0 or `CONN_ASYNC_LINK`
+ * @param complete The function called with 0 once connected
+ * @param data The state passed to complete
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int conn_async_connect(ConnectionPool *conn_pool, int fd,
+        const struct sockaddr *addr, socklen_t addrlen, unsigned int flags,
+        ConnCompletion complete, void *data);
+
+/**
+ * @brief Cancels every completion operation that is pending on
+ * fd. Each of them is completed with -ECANCELED, so the state
+ * that was passed along with them must stay valid until then.
+ *
+ * @param conn_pool A pointer to a connection pool
+ * @param fd The file descriptor whose operations are cancelled
+ * @return 0 on success. Otherwise, it returns -1.
  *
+ */
+extern int conn_async_cancel(ConnectionPool *conn_pool, int fd);
+
+/**
  * @brief This function shuts down any of the connections
  * that are still in the pool. The function invokes
- * the shutdown(2) to shut down any socket file 
- * descriptors that belong to that connection. In 
- * addition, calling this function will free the 
+ * shutdown(2) and close(2) on every file descriptor
+ * that is still registered, so the caller should remove
+ * the connections it wants to keep open first. In
+ * addition, calling this function will free the
  * block being pointed to by conn_pool.
  *
- * @param conn_pool A pointer to a connection pool 
+ * @param conn_pool A pointer to a connection pool
  * that holds all of the current connections
  *
  */
@@ -123,43 +364,47 @@ extern int conn_remove_fd(ConnectionPool *conn_pool, int fd);
 extern void conn_destroy(ConnectionPool *conn_pool);
 
 /**
- * @brief This function takes as argument a pointer 
- * to a connection pool. The caller specifies the 
- * argument rd_set_cpy (which is the read set that 
- * will be passed to select(2)) and wr_set_cpy 
- * (which is the write set that will be passed to 
- * select), and the connection pool's fd sets are 
- * copied over to the respective copy set. The function 
- * fails if either of the pointers to the sets point 
- * to a `NULL` reference or if the connection pool 
+ * @brief This function takes as argument a pointer
+ * to a connection pool. The caller specifies the
+ * argument rd_set_cpy (which is the read set that
+ * will be passed to select(2)) and wr_set_cpy
+ * (which is the write set that will be passed to
+ * select), and the connection pool's fd sets are
+ * copied over to the respective copy set. The function
+ * fails if either of the pointers to the sets point
+ * to a `NULL` reference or if the connection pool
  * points to a `NULL` value. This function also takes in a `nfds`
- * argument which is a pointer to an integer value. The max 
- * file descriptor value is copied over to that pointer.
+ * argument which is a pointer to an integer value. One more
+ * than the highest file descriptor in the pool, the nfds
+ * argument of select(2), is copied over to that pointer, or
+ * 0 when the pool is empty. It stays exact whichever order
+ * file descriptors are inserted and removed in.
  * If `nfds` points to a `NULL` value, then the function
- * call fails.
+ * call fails. It also fails if the pool is not backed
+ * by select(2).
  *
- * @param conn_pool A pointer to a connection pool 
+ * @param conn_pool A pointer to a connection pool
  * that holds all of the current connections
  * @param rd_set_cpy The read set passed by the caller
  * in which the function copies the pool's read set
  * to rd_set_cpy
  * @param wr_set_cpy The write set passed by the caller
  * in which the function copies the pool's write set
- * to wr_set_cpy 
- * @param nfds The pointer to an integer that will 
- * have its value to that address replaced by the 
- * current max file descriptor value
+ * to wr_set_cpy
+ * @param nfds The pointer to an integer that will
+ * have its value to that address replaced by one
+ * more than the current max file descriptor value
  * @return 0 if the copying succeeds. Otherwise, -1.
  *
  */
 
-extern int conn_copy_fd_sets(ConnectionPool *conn_pool, 
+extern int conn_copy_fd_sets(ConnectionPool *conn_pool,
         fd_set *rd_set_cpy, fd_set *wr_set_cpy, int *nfds);
 
 /*
- * @brief This function takes as argument a pointer to a 
+ * @brief This function takes as argument a pointer to a
  * connection pool, specified by conn_pool. On success,
- * it returns the number of connections held by the 
+ * it returns the number of connections held by the
  * connection pool. The call fails if conn_pool points
  * to a `NULL` pointer.
  *
@@ -172,4 +417,33 @@ extern int conn_copy_fd_sets(ConnectionPool *conn_pool,
  */
 extern int conn_get_pool_size(ConnectionPool *conn_pool);
 
+/**
+ * @brief Returns the backend of the pool, or -1 if
+ * conn_pool is `NULL`.
+ *
+ * @param conn_pool A pointer to a connection pool
+ * @return The backend the pool was created with
+ *
+ */
+extern int conn_get_backend(ConnectionPool *conn_pool);
+
+/**
+ * @brief Returns the backend `conn_pool_init` uses, which
+ * is the one picked at build time.
+ *
+ * @return The default backend
+ *
+ */
+extern ConnBackend conn_get_default_backend(void);
+
+/**
+ * @brief Returns a printable name ("select", "epoll", ...)
+ * of the backend, or `NULL` if it is not a known one.
+ *
+ * @param backend A backend
+ * @return The name of the backend
+ *
+ */
+extern const char *conn_backend_name(ConnBackend backend);
+
 #endif /* CONN_H */
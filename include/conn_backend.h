@@ -0,0 +1,95 @@
+/**
+ * @file conn_backend.h
+ * @brief Internal interface between the `ConnectionPool`
+ * front end in src/conn.c and the readiness backends
+ * (src/conn_select.c, src/conn_epoll.c, src/conn_uring.c). The front end
+ * owns the per-connection state and the pool size, a
+ * backend only tracks the interest of each file descriptor
+ * and reports which of them are ready. Nothing outside
+ * of the connection pool should include this file.
+ *
+ */
+
+#ifndef CONN_BACKEND_H
+#define CONN_BACKEND_H
+
+#include <sys/select.h>
+
+#include "conn.h"
+
+/* Max number of ready connections reported by one wait */
+#define CONN_MAX_EVENTS 256
+
+/* Set in conn_event.events for a finished completion operation */
+#define CONN_EV_COMPLETE 0x100
+
+/**
+ * @brief A single report of a backend. It is either the
+ * readiness of a registered fd or, with `CONN_EV_COMPLETE`,
+ * the result of a completion operation.
+ *
+ */
+struct conn_event {
+    int fd;
+    unsigned int events; /* CONN_EV_* */
+    int res;
+    const void *buf;
+    ConnCompletion complete;
+    void *data;
+};
+
+enum conn_async_kind {
+    CONN_ASYNC_ACCEPT,
+    CONN_ASYNC_RECV,
+    CONN_ASYNC_SEND,
+    CONN_ASYNC_CONNECT,
+    CONN_ASYNC_CANCEL
+};
+
+/**
+ * @brief A completion operation handed to the backend.
+ *
+ */
+struct conn_async_req {
+    enum conn_async_kind kind;
+    int fd;
+    unsigned int flags; /* CONN_ASYNC_* */
+    const void *buf;
+    size_t len;
+    const struct sockaddr *addr;
+    socklen_t addrlen;
+    ConnCompletion complete;
+    void *data;
+};
+
+/**
+ * @brief The operations every backend implements. All of
+ * them return -1 on failure, like the rest of the pool.
+ * `async` is `NULL` for backends without completion operations.
+ * `max_fd` is the first file descriptor the backend can
+ * not handle, or 0 if there is no such bound.
+ *
+ */
+struct conn_backend_ops {
+    const char *name;
+    unsigned int max_fd;
+    void *(*init)(void);
+    void (*destroy)(void *backend);
+    int (*add)(void *backend, int fd, unsigned int events);
+    int (*mod)(void *backend, int fd, unsigned int events);
+    int (*del)(void *backend, int fd);
+    /* Returns the number of filled events, 0 on timeout or EINTR */
+    int (*wait)(void *backend, struct conn_event *events,
+            int max_events, int timeout_ms);
+    int (*async)(void *backend, const struct conn_async_req *req);
+};
+
+extern const struct conn_backend_ops conn_select_ops;
+extern const struct conn_backend_ops conn_epoll_ops;
+extern const struct conn_backend_ops conn_uring_ops;
+
+/* select(2) specific, used by conn_copy_fd_sets */
+extern int conn_select_copy_fd_sets(void *backend,
+        fd_set *rd_set_cpy, fd_set *wr_set_cpy, int *nfds);
+
+#endif /* CONN_BACKEND_H */
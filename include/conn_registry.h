@@ -0,0 +1,148 @@
+/**
+ * @file conn_registry.h
+ * @brief The registry of the connections of every worker.
+ * A `ConnectionPool` belongs to the thread that runs it,
+ * so what the workers have open is only known to each of
+ * them. The registry is where they record it for the
+ * other threads: every connection a worker takes on is
+ * inserted, and removed once it is closed, and any thread
+ * may look a connection up or go over all of them.
+ *
+ * The registry is split into shards by fd, so that the
+ * consecutive fds of a busy worker fall into different
+ * shards. Every shard has a lock of its own and sits in
+ * cache lines of its own, so that workers rarely wait on
+ * each other and do not bounce the lines of the shards
+ * they are not using.
+ *
+ */
+
+#ifndef CONN_REGISTRY_H
+#define CONN_REGISTRY_H
+
+#include <stdint.h>
+
+/* Shards of a registry when none is asked for */
+#define CONN_REGISTRY_SHARDS 64
+
+/**
+ * @brief What the registry knows of a connection.
+ *
+ */
+typedef struct {
+    unsigned int worker; /* The worker that owns the connection */
+    uint64_t since_ms;   /* When it was opened (monotonic clock) */
+} ConnInfo;
+
+/**
+ * @brief Called for every connection of the registry by
+ * conn_registry_foreach. The shard of the connection is
+ * locked while it runs, so it must not use the registry.
+ *
+ * @return 0 to go on, anything else to stop
+ *
+ */
+typedef int (*ConnVisitor)(int fd, const ConnInfo *info, void *arg);
+
+/**
+ * @struct ConnRegistry conn_registry.h "include/conn_registry.h"
+ * @brief The registry. The structure looks like this in the
+ * source file:
+ *
+ * ```
+ * struct conn_shard {
+ *     pthread_mutex_t lock;
+ *     struct conn_entry *entries; // indexed by fd / nshards
+ *     unsigned int nentries;
+ *     unsigned int count;
+ * } __attribute__((aligned(64)));
+ *
+ * struct conn_registry {
+ *     unsigned int nshards;  // a power of two
+ *     struct conn_shard *shards;
+ * };
+ * ```
+ *
+ */
+typedef struct conn_registry ConnRegistry;
+
+/**
+ * @brief Initializes an empty registry.
+ *
+ * @param nshards The number of shards, a power of two, or 0
+ * for `CONN_REGISTRY_SHARDS`
+ * @return On success, a pointer to the registry. Otherwise,
+ * it returns NULL.
+ *
+ */
+extern ConnRegistry *conn_registry_init(unsigned int nshards);
+
+/**
+ * @brief Records the connection fd.
+ *
+ * @param registry The registry
+ * @param fd The connection
+ * @param info What to record of it
+ * @return 0 on success. Otherwise, it returns -1, for
+ * instance when fd is in the registry already.
+ *
+ */
+extern int conn_registry_insert(ConnRegistry *registry, int fd, const ConnInfo *info);
+
+/**
+ * @brief Forgets the connection fd. It must be called before
+ * fd is closed, since another thread may get the same fd
+ * for a new connection right after.
+ *
+ * @param registry The registry
+ * @param fd The connection
+ * @return 0 on success. Otherwise, it returns -1, when fd
+ * is not in the registry.
+ *
+ */
+extern int conn_registry_remove(ConnRegistry *registry, int fd);
+
+/**
+ * @brief Looks the connection fd up.
+ *
+ * @param registry The registry
+ * @param fd The connection
+ * @param info Receives what is recorded of it, may be `NULL`
+ * @return 1 if fd is in the registry, 0 otherwise.
+ *
+ */
+extern int conn_registry_lookup(ConnRegistry *registry, int fd, ConnInfo *info);
+
+/**
+ * @brief Calls visit for every connection of the registry,
+ * a shard at a time, so connections inserted or removed
+ * meanwhile by other threads may or may not be visited.
+ *
+ * @param registry The registry
+ * @param visit Called for every connection
+ * @param arg Passed to visit
+ * @return The number of connections visited, or -1 on error.
+ *
+ */
+extern long conn_registry_foreach(ConnRegistry *registry, ConnVisitor visit, void *arg);
+
+/**
+ * @brief Returns the number of connections in the registry.
+ *
+ * @param registry The registry
+ * @return The number of connections, or -1 if registry is
+ * `NULL`
+ *
+ */
+extern long conn_registry_count(ConnRegistry *registry);
+
+/**
+ * @brief Frees the block pointed to by registry, which no
+ * thread may use anymore.
+ *
+ * @param registry The registry
+ *
+ */
+extern void conn_registry_destroy(ConnRegistry *registry);
+
+#endif /* CONN_REGISTRY_H */
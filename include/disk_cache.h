@@ -0,0 +1,152 @@
+/**
+ * @file disk_cache.h
+ * @brief The on-disk tier of the response cache. Responses
+ * are appended to a data file of a fixed size, allocated
+ * up front and written as a circular log: once the write
+ * position wraps around, the oldest records are written
+ * over, which is all the eviction there is. Records never
+ * move and are never rewritten, so a hit is sent to the
+ * client with sendfile(2) straight from the page cache.
+ *
+ * The index lives in a second file that is mmap'd, an
+ * open-addressing table of fixed-size slots. Since it is
+ * the file itself that is updated, a restart finds every
+ * entry in place. Each slot carries a checksum and points
+ * at a record whose header repeats its position and hash,
+ * so after a crash (the index was not closed cleanly) the
+ * entries that were torn or written over are dropped when
+ * the cache is opened again.
+ *
+ * A disk cache may be shared by several threads.
+ *
+ */
+
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/**
+ * @brief The counters of a disk cache.
+ *
+ */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stores;
+    uint64_t overwritten; /* Entries lost to the log wrapping around */
+    uint64_t expired;
+    uint64_t bytes_saved; /* Bytes served from the disk */
+    uint64_t recovered;   /* Entries found valid when the cache was opened */
+    uint64_t dropped;     /* Entries found invalid when the cache was opened */
+    uint64_t entries;     /* Entries in the index right now */
+} DiskCacheStats;
+
+/**
+ * @brief Where a hit is found in the data file. The head of
+ * the response is copied out by the lookup, the body is
+ * meant to be sent with sendfile(fd, &off, len).
+ *
+ */
+typedef struct {
+    int fd;          /* The data file */
+    off_t off;       /* Where the body starts */
+    size_t len;      /* Length of the body */
+    size_t head_len; /* Length of the head copied out */
+    time_t stored;   /* When the response was stored */
+} DiskHit;
+
+/**
+ * @struct DiskCache disk_cache.h "include/disk_cache.h"
+ * @brief The disk tier. The structure looks like this in the
+ * source file:
+ *
+ * ```
+ * struct disk_cache {
+ *     pthread_mutex_t lock;
+ *     int datafd;
+ *     int indexfd;
+ *     struct disk_header *header; // mmap'd index file
+ *     struct disk_slot *slots;
+ *     uint64_t mask;
+ *     uint64_t nentries;
+ *     DiskCacheStats stats;
+ * };
+ * ```
+ *
+ */
+typedef struct disk_cache DiskCache;
+
+/**
+ * @brief Opens the disk cache whose files are path.data and
+ * path.index, creating them if they do not exist (or if they
+ * were made for another size). The data file is allocated to
+ * data_bytes right away. Entries of an index that was not
+ * closed cleanly are checked against the data file and the
+ * invalid ones are dropped.
+ *
+ * @param path The path of the files, without their suffix
+ * @param data_bytes The size of the data file
+ * @return On success, a pointer to the cache. Otherwise, it
+ * returns NULL.
+ *
+ */
+extern DiskCache *disk_cache_open(const char *path, size_t data_bytes);
+
+/**
+ * @brief Appends a response to the log and indexes it under
+ * key, replacing the entry the key had.
+ *
+ * @param cache The cache
+ * @param key The key of the response
+ * @param data The response, its head then its body
+ * @param head_len The length of the head
+ * @param len The length of data
+ * @param stored When the response was stored (wall clock)
+ * @param expires When the response goes stale (wall clock)
+ * @return 0 on success. Otherwise, it returns -1, for instance
+ * when the response is too large for the log.
+ *
+ */
+extern int disk_cache_store(DiskCache *cache, const char *key, const char *data,
+        size_t head_len, size_t len, time_t stored, time_t expires);
+
+/**
+ * @brief Looks key up. On a hit, the head of the response is
+ * copied into head and hit tells where its body is.
+ *
+ * @param cache The cache
+ * @param key The key of the response
+ * @param hit Receives the position of the response
+ * @param head Receives the head of the response
+ * @param head_sz The size of head
+ * @return 1 on a hit, 0 otherwise.
+ *
+ */
+extern int disk_cache_lookup(DiskCache *cache, const char *key, DiskHit *hit,
+        char *head, size_t head_sz);
+
+/**
+ * @brief Copies the counters of the cache into stats.
+ *
+ * @param cache The cache
+ * @param stats Receives the counters
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int disk_cache_get_stats(DiskCache *cache, DiskCacheStats *stats);
+
+/**
+ * @brief Flushes the index and the data file to the disk and
+ * marks the index as closed cleanly, so that the next open
+ * trusts it as is. Then frees the block pointed to by cache.
+ *
+ * @param cache The cache
+ *
+ */
+extern void disk_cache_close(DiskCache *cache);
+
+#endif /* DISK_CACHE_H */
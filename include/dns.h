@@ -0,0 +1,229 @@
+/**
+ * @file dns.h
+ * @brief A non-blocking DNS stub resolver and the cache
+ * in front of it. getaddrinfo(3) blocks the calling
+ * thread until the answer comes back, which stalls every
+ * connection of a worker for as long as the nameserver
+ * takes. Instead, each worker sends its queries over
+ * UDP sockets driven by its own `ConnectionPool` and gets
+ * called back once the answer is in. Every query has a
+ * socket, so a source port, of its own and a random id,
+ * which an off-path spoofer would have to guess both of.
+ *
+ * Answers go into a cache shared by every worker. It is
+ * split into shards with a lock of their own, so workers
+ * rarely wait on each other. Entries live as long as the
+ * TTL of the answer says, and names that do not exist
+ * are cached too (for the negative TTL of their zone).
+ * Lookups of a name that is already being resolved by the
+ * same worker wait for that query instead of sending one
+ * more.
+ *
+ */
+
+#ifndef DNS_H
+#define DNS_H
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "conn.h"
+
+/* Longest name that can be resolved, without its final nul */
+#define DNS_NAME_MAX 253
+
+/* Max number of addresses kept for one name */
+#define DNS_MAX_ADDRS 8
+
+/* Status passed to a DnsCallback */
+#define DNS_OK             0
+#define DNS_ERR_NOTFOUND  -1 /* The name has no address (NXDOMAIN or no data) */
+#define DNS_ERR_SERVFAIL  -2 /* The nameserver failed or refused to answer */
+#define DNS_ERR_TIMEOUT   -3 /* No answer after every retry */
+#define DNS_ERR_FORMAT    -4 /* The name is not a valid host name */
+
+/**
+ * @brief One address of a name.
+ *
+ */
+typedef struct {
+    int family; /* AF_INET or AF_INET6 */
+    union {
+        struct in_addr v4;
+        struct in6_addr v6;
+    } addr;
+} DnsAddr;
+
+/**
+ * @brief Called once a name is resolved. addrs is only valid
+ * during the call and naddrs is 0 unless status is `DNS_OK`.
+ *
+ */
+typedef void (*DnsCallback)(int status, const DnsAddr *addrs, unsigned int naddrs,
+        void *data);
+
+/**
+ * @struct DnsCache dns.h "include/dns.h"
+ * @brief The cache of answers, which may be shared by
+ * several resolvers (and threads). The structure looks
+ * like this in the source file:
+ *
+ * ```
+ * struct dns_cache {
+ *     struct dns_shard shards[DNS_CACHE_SHARDS];
+ * };
+ * ```
+ *
+ */
+typedef struct dns_cache DnsCache;
+
+/**
+ * @struct DnsResolver dns.h "include/dns.h"
+ * @brief The resolver of one event loop. It is only ever
+ * used by the thread of that event loop. The structure
+ * looks like this in the source file:
+ *
+ * ```
+ * struct dns_resolver {
+ *     ConnectionPool *conn_pool;
+ *     DnsCache *cache;
+ *     struct sockaddr_storage ns; // the nameserver
+ *     socklen_t nslen;
+ *     unsigned int timeout_ms;
+ *     struct dns_query *queries;  // in flight, each with a socket connected to ns
+ *     uint16_t ids[DNS_ID_BATCH]; // query ids drawn from getrandom(2)
+ *     unsigned int nids;
+ * };
+ * ```
+ *
+ */
+typedef struct dns_resolver DnsResolver;
+
+/**
+ * @brief Initializes an empty cache.
+ *
+ * @return On success, a pointer to the new cache.
+ * Otherwise, it returns NULL.
+ *
+ */
+extern DnsCache *dns_cache_init(void);
+
+/**
+ * @brief Looks name up in the cache. Expired entries are
+ * never returned.
+ *
+ * @param cache The cache
+ * @param name The name, in lower case and without a final dot
+ * @param addrs Receives up to `DNS_MAX_ADDRS` addresses
+ * @param naddrs Receives the number of addresses
+ * @return `DNS_OK` or `DNS_ERR_NOTFOUND` for a positive or a
+ * negative entry, 1 if the cache has no entry for the name.
+ *
+ */
+extern int dns_cache_lookup(DnsCache *cache, const char *name, DnsAddr *addrs,
+        unsigned int *naddrs);
+
+/**
+ * @brief Adds the answer for name to the cache, replacing
+ * any previous one. When the shard of the name is full,
+ * its oldest entry is dropped.
+ *
+ * @param cache The cache
+ * @param name The name, in lower case and without a final dot
+ * @param status `DNS_OK` or `DNS_ERR_NOTFOUND`
+ * @param addrs The addresses of the name
+ * @param naddrs The number of addresses, at most `DNS_MAX_ADDRS`
+ * @param ttl How many seconds the answer may be used for
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int dns_cache_insert(DnsCache *cache, const char *name, int status,
+        const DnsAddr *addrs, unsigned int naddrs, unsigned int ttl);
+
+/**
+ * @brief Frees the block pointed to by cache. No resolver
+ * may use it anymore.
+ *
+ * @param cache The cache
+ *
+ */
+extern void dns_cache_destroy(DnsCache *cache);
+
+/**
+ * @brief Initializes a resolver that sends its queries to the
+ * nameserver ns, whose socket is driven by conn_pool. When ns
+ * is `NULL`, the first nameserver of /etc/resolv.conf is used
+ * (or 127.0.0.1 if there is none).
+ *
+ * @param conn_pool The event loop of the resolver
+ * @param cache The cache of answers
+ * @param ns The address of the nameserver, or `NULL`
+ * @param nslen The length of ns
+ * @param timeout_ms How long to wait for an answer before
+ * the query is sent again
+ * @return On success, a pointer to the new resolver.
+ * Otherwise, it returns NULL.
+ *
+ */
+extern DnsResolver *dns_resolver_init(ConnectionPool *conn_pool, DnsCache *cache,
+        const struct sockaddr *ns, socklen_t nslen, unsigned int timeout_ms);
+
+/**
+ * @brief Resolves name to its IPv4 addresses, or to its IPv6
+ * ones if it has none. Address literals and names found in
+ * the cache are answered right away: cb is called before the
+ * function returns. Otherwise, cb is called from the event
+ * loop once the answer arrives.
+ *
+ * @param resolver The resolver of the event loop
+ * @param name The name to resolve
+ * @param cb Called with the answer
+ * @param data Passed on to cb
+ * @return 0 if cb was already called, 1 if the lookup is
+ * pending. Otherwise, it returns -1 and cb is never called.
+ *
+ */
+extern int dns_resolve(DnsResolver *resolver, const char *name, DnsCallback cb,
+        void *data);
+
+/**
+ * @brief Forgets every pending lookup made with data, whose
+ * callbacks will not be called. The queries themselves go on
+ * so that their answers still reach the cache.
+ *
+ * @param resolver The resolver of the event loop
+ * @param data The data the lookups were made with
+ *
+ */
+extern void dns_cancel(DnsResolver *resolver, void *data);
+
+/**
+ * @brief Sends again the queries whose answer is late, and
+ * fails the lookups of those that were sent too many times.
+ * It is meant to be called each time the event loop wakes up.
+ *
+ * @param resolver The resolver of the event loop
+ *
+ */
+extern void dns_resolver_tick(DnsResolver *resolver);
+
+/**
+ * @brief Returns the number of queries in flight.
+ *
+ * @param resolver The resolver of the event loop
+ * @return The number of queries, or -1 if resolver is `NULL`
+ *
+ */
+extern int dns_get_pending(DnsResolver *resolver);
+
+/**
+ * @brief Forgets every pending lookup (their callbacks are
+ * not called), closes the socket and frees the block pointed
+ * to by resolver. The cache is left as is.
+ *
+ * @param resolver The resolver of the event loop
+ *
+ */
+extern void dns_resolver_destroy(DnsResolver *resolver);
+
+#endif /* DNS_H */
@@ -0,0 +1,156 @@
+/**
+ * @file health.h
+ * @brief Active health checks of the backends of a
+ * balancer. Every backend is probed once an interval,
+ * the probes of the backends spread over it, and the
+ * outcome of each probe goes to the balancer, which takes
+ * a backend out of rotation once enough of them failed in
+ * a row and back in once enough went through.
+ *
+ * A probe connects to the backend and, given a path, sends
+ * it `GET <path>` and waits for the status line, which has
+ * to be a 2xx or a 3xx. Without a path, the connect(2)
+ * going through is enough. A probe that takes longer than
+ * its timeout fails.
+ *
+ * The probes are driven by the event loop of the worker
+ * that owns the balancer, the name of a backend is looked
+ * up with a resolver of their own and nothing blocks, so
+ * that a backend that hangs costs the worker a socket and
+ * no time. The checker also lets the breakers of the
+ * balancer that have been open long enough go half open.
+ *
+ */
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdint.h>
+
+#include "balancer.h"
+#include "conn.h"
+#include "dns.h"
+
+/* Time between two probes of a backend */
+#ifndef HEALTH_INTERVAL_MS
+#define HEALTH_INTERVAL_MS 2000
+#endif
+
+/* Time a probe has to go through */
+#ifndef HEALTH_TIMEOUT_MS
+#define HEALTH_TIMEOUT_MS 1000
+#endif
+
+/* Longest path a probe asks for */
+#define HEALTH_PATH_SZ 256
+
+/**
+ * @brief The counters of a checker.
+ *
+ */
+typedef struct {
+    uint64_t probes;   /* Probes over */
+    uint64_t failures; /* Of those, the ones that failed */
+    uint64_t timeouts; /* Of those, the ones that took too long */
+} HealthStats;
+
+/**
+ * @struct HealthChecker health.h "include/health.h"
+ * @brief The checker of the backends of a balancer. The
+ * structure looks like this in the source file:
+ *
+ * ```
+ * struct probe {
+ *     HealthChecker *checker;
+ *     unsigned int backend;
+ *     enum probe_state state;
+ *     int fd;
+ *     uint64_t due_ms;  // of the next probe when idle, of its timeout otherwise
+ *     size_t off;       // of the request sent, then of the status line read
+ *     char status[16];
+ * };
+ *
+ * struct health_checker {
+ *     ConnectionPool *conn_pool;
+ *     DnsCache *dns_cache;
+ *     int owns_cache;
+ *     DnsResolver *resolver;
+ *     Balancer *balancer;
+ *     char path[HEALTH_PATH_SZ]; // empty for a connect(2) only
+ *     unsigned int interval_ms;
+ *     unsigned int timeout_ms;
+ *     struct probe *probes;      // one for every backend
+ *     unsigned int nprobes;
+ *     HealthStats stats;
+ * };
+ * ```
+ *
+ */
+typedef struct health_checker HealthChecker;
+
+/**
+ * @brief Initializes the checker of the backends of
+ * balancer, whose first probes go out over the first
+ * interval.
+ *
+ * @param conn_pool The event loop of the worker
+ * @param dns_cache The cache of DNS answers, or `NULL` for
+ * one of the checker's own
+ * @param balancer The balancer, which the worker owns
+ * @param path The path a probe asks for, or `NULL` for a
+ * connect(2) only
+ * @param interval_ms Time between two probes of a
+ * backend, 0 for `HEALTH_INTERVAL_MS`
+ * @param timeout_ms Time a probe has to go through, 0 for
+ * `HEALTH_TIMEOUT_MS`
+ * @return On success, a pointer to the checker. Otherwise,
+ * it returns NULL.
+ *
+ */
+extern HealthChecker *health_init(ConnectionPool *conn_pool, DnsCache *dns_cache,
+        Balancer *balancer, const char *path, unsigned int interval_ms,
+        unsigned int timeout_ms);
+
+/**
+ * @brief Tells how long the event loop of the worker may
+ * sleep before a probe is due or times out.
+ *
+ * @param checker The checker
+ * @param max_ms The longest sleep to return
+ * @return The time to sleep in milliseconds, at most
+ * max_ms.
+ *
+ */
+extern int health_timeout(HealthChecker *checker, int max_ms);
+
+/**
+ * @brief Starts the probes that are due, fails those that
+ * took too long and lets the breakers of the balancer go
+ * half open. It is meant to be called each time the event
+ * loop wakes up.
+ *
+ * @param checker The checker
+ *
+ */
+extern void health_tick(HealthChecker *checker);
+
+/**
+ * @brief Copies the counters of checker into stats.
+ *
+ * @param checker The checker
+ * @param stats Receives the counters
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int health_get_stats(const HealthChecker *checker, HealthStats *stats);
+
+/**
+ * @brief Closes the probes in flight and frees the block
+ * pointed to by checker. The balancer is left as is.
+ *
+ * @param checker The checker
+ *
+ */
+extern void health_destroy(HealthChecker *checker);
+
+#endif /* HEALTH_H */
@@ -0,0 +1,218 @@
+/**
+ * @file http.h
+ * @brief A resumable HTTP/1.x message parser. The head
+ * of a request or of a response is parsed as its bytes
+ * arrive, across any number of partial reads, without
+ * rescanning what was already seen. Nothing is copied
+ * and nothing is allocated: the method, the target, the
+ * reason phrase and the headers are recorded as slices
+ * (offset and length) into the buffer the head is read
+ * into. Once the head is complete, the parser follows the
+ * framing of the body (Content-Length, chunked or until
+ * the connection closes) to find where the message ends,
+ * again without copying the body anywhere.
+ *
+ * Unlike the other objects of the proxy, the parser is
+ * not opaque: it is meant to be embedded into the state
+ * of a connection so that parsing never allocates.
+ *
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Max number of headers recorded for one message */
+#define HTTP_MAX_HEADERS 64
+
+/* Return values of the parsing functions */
+#define HTTP_PARSE_ERROR -1
+#define HTTP_PARSE_AGAIN  0 /* Every byte was consumed, more are needed */
+#define HTTP_PARSE_DONE   1 /* The head (or the body) is complete */
+
+/* Flags of http_parser_init */
+#define HTTP_PARSER_NO_BODY 0x1 /* A response to HEAD, it never has a body */
+
+typedef enum {
+    HTTP_REQUEST,
+    HTTP_RESPONSE
+} HttpKind;
+
+/**
+ * @brief How the end of the body of a message is found.
+ *
+ */
+typedef enum {
+    HTTP_BODY_NONE,       /* The message ends with its head */
+    HTTP_BODY_LENGTH,     /* Content-Length bytes follow the head */
+    HTTP_BODY_CHUNKED,    /* Transfer-Encoding: chunked */
+    HTTP_BODY_UNTIL_CLOSE /* A response that ends when the connection does */
+} HttpBody;
+
+/**
+ * @brief What went wrong when a function returned
+ * `HTTP_PARSE_ERROR`.
+ *
+ */
+typedef enum {
+    HTTP_ERR_NONE,
+    HTTP_ERR_SYNTAX,           /* Malformed start line, header or chunk */
+    HTTP_ERR_VERSION,          /* Not HTTP/1.x */
+    HTTP_ERR_TOO_MANY_HEADERS, /* More than HTTP_MAX_HEADERS headers */
+    HTTP_ERR_CONTENT_LENGTH,   /* Invalid or conflicting Content-Length */
+    HTTP_ERR_FRAMING           /* Both Transfer-Encoding and Content-Length */
+} HttpError;
+
+/**
+ * @brief A part of the buffer the head was parsed from.
+ *
+ */
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+} HttpSlice;
+
+typedef struct {
+    HttpSlice name;
+    HttpSlice value;
+} HttpHeader;
+
+/**
+ * @struct HttpParser http.h "include/http.h"
+ * @brief The state of the parser and what it found so
+ * far. Every field is set once `http_parse_head` returned
+ * `HTTP_PARSE_DONE`. The fields starting with an underscore
+ * are internal.
+ *
+ */
+typedef struct http_parser {
+    HttpKind kind;
+    HttpError error;
+    HttpSlice method;        /* Requests only */
+    HttpSlice target;        /* Requests only */
+    HttpSlice reason;        /* Responses only */
+    int status;              /* Responses only */
+    int version_major;
+    int version_minor;
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    unsigned int nheaders;
+    size_t head_len;         /* Length of the head, including its last CRLF */
+    HttpBody body;
+    int64_t content_length;  /* -1 if there is no Content-Length */
+    unsigned char keep_alive;
+    unsigned char upgrade;   /* Connection: upgrade was asked for */
+
+    int _state;
+    unsigned int _flags;
+    size_t _pos;             /* Bytes of the head consumed so far */
+    size_t _mark;            /* Start of the token being parsed */
+    unsigned char _conn_close;
+    unsigned char _conn_keep_alive;
+    unsigned char _te_chunked;
+    int _chunk_state;
+    uint64_t _remaining;     /* Body bytes left in the message or chunk */
+} HttpParser;
+
+/**
+ * @brief Resets the parser to parse a new message of the
+ * given kind. Parsers are reused between the messages of
+ * a persistent connection by calling this function again.
+ *
+ * @param parser The parser to reset
+ * @param kind Whether a request or a response is parsed
+ * @param flags 0 or `HTTP_PARSER_NO_BODY`
+ *
+ */
+extern void http_parser_init(HttpParser *parser, HttpKind kind, unsigned int flags);
+
+/**
+ * @brief Parses the head of a message. buf holds every byte
+ * of the message received so far, starting with its first one,
+ * and len is their number. The same buffer (possibly with more
+ * bytes appended) is passed again after `HTTP_PARSE_AGAIN`,
+ * parsing resumes at the first byte that was not seen yet.
+ * Every slice of the parser is relative to buf.
+ *
+ * @param parser The parser of the message
+ * @param buf The bytes of the message received so far
+ * @param len The number of bytes in buf
+ * @return `HTTP_PARSE_DONE` once the head is complete (the body,
+ * if any, starts at buf + parser->head_len), `HTTP_PARSE_AGAIN`
+ * if more bytes are needed or `HTTP_PARSE_ERROR`.
+ *
+ */
+extern int http_parse_head(HttpParser *parser, const char *buf, size_t len);
+
+/**
+ * @brief Follows the body of a message whose head is complete.
+ * buf holds the next len bytes of the body, wherever they
+ * are stored: the body is only looked at to find its end, so
+ * chunks of it can be passed as they are forwarded.
+ *
+ * @param parser The parser of the message
+ * @param buf The next bytes of the body
+ * @param len The number of bytes in buf
+ * @param consumed Set to the number of bytes of buf that belong
+ * to the message. It is only less than len when the message
+ * ends within buf, the rest belongs to the next message.
+ * @return `HTTP_PARSE_DONE` once the message is complete,
+ * `HTTP_PARSE_AGAIN` if the body goes on or `HTTP_PARSE_ERROR`.
+ *
+ */
+extern int http_parse_body(HttpParser *parser, const char *buf, size_t len,
+        size_t *consumed);
+
+/**
+ * @brief Returns the number of body bytes that may be forwarded
+ * blindly, without passing them through `http_parse_body`, because
+ * they are all part of the body. That is what is left of the
+ * Content-Length or of the current chunk, and unbounded
+ * (UINT64_MAX) for a body that lasts until the connection closes.
+ *
+ * @param parser The parser of the message
+ * @return The number of bytes
+ *
+ */
+extern uint64_t http_body_remaining(const HttpParser *parser);
+
+/**
+ * @brief Accounts for n body bytes that were forwarded
+ * blindly, n being at most `http_body_remaining`. This is
+ * how bodies moved with splice(2), which are never seen,
+ * are followed.
+ *
+ * @param parser The parser of the message
+ * @param n The number of bytes forwarded
+ * @return `HTTP_PARSE_DONE` once the message is complete,
+ * `HTTP_PARSE_AGAIN` if the body goes on or `HTTP_PARSE_ERROR`.
+ *
+ */
+extern int http_body_skip(HttpParser *parser, uint64_t n);
+
+/**
+ * @brief Looks up the first header called name (compared
+ * case-insensitively) in a parsed head.
+ *
+ * @param parser The parser of the message
+ * @param buf The buffer the head was parsed from
+ * @param name The name of the header
+ * @return The header, or `NULL` if the message has none
+ *
+ */
+extern const HttpHeader *http_find_header(const HttpParser *parser,
+        const char *buf, const char *name);
+
+/**
+ * @brief Compares a slice of buf with a string, case-insensitively.
+ *
+ * @param buf The buffer the slice points into
+ * @param slice The slice
+ * @param s A nul-terminated string
+ * @return 1 if both are equal, 0 otherwise
+ *
+ */
+extern int http_slice_eq(const char *buf, HttpSlice slice, const char *s);
+
+#endif /* HTTP_H */
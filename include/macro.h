@@ -25,14 +25,25 @@
 
 /* Used for the current running server */
 #define MAX_BACKLOG_SZ          1024
+#define ACCEPT_DEFER_SECS       5    /* Connections wait for their request in the kernel */
+#define TCP_FASTOPEN_QLEN       256  /* Pending Fast Open connections of a listener */
+#define ADMIN_IO_TIMEOUT_SECS   1    /* A client of the metrics endpoint gets this long */
 #define PROXY_SERVER_RUNNING    1
 #define PROXY_SERVER_TERMINATED 0
 
 /* Used for command line opt parsing */
-#define P_USAGE_EXIT(prog)                              \
-    do {                                                \
-        fprintf(stderr, "Usage: %s -p <port>\n", prog); \
-        exit(EXIT_FAILURE);                             \
-    } while(0);                                         \
+#define P_USAGE_EXIT(prog)                                                   \
+    do {                                                                     \
+        fprintf(stderr, "Usage: %s -p <port> [-t <threads>] [-c <cache MB>]" \
+                " [-d <disk cache path>] [-D <disk cache MB>]"               \
+                " [-m <metrics port>] [-r <conns/s>]"                        \
+                " [-R <conns/s of a client>] [-l <max requests at once>]"    \
+                " [-u <backend host:port>]... [-b least|p2c|hash]"           \
+                " [-H <health check path>]\n"                                \
+                "-r, -R and -l are split among the threads, rounded up,"     \
+                " and a thread takes at least %d requests at once\n",        \
+                prog, ADMISSION_MIN_LIMIT);                                  \
+        exit(EXIT_FAILURE);                                                  \
+    } while(0);                                                              \
 
 #endif /* MACRO_H */
@@ -0,0 +1,308 @@
+/**
+ * @file metrics.h
+ * @brief The latency histograms and the counters of a
+ * worker. Every worker records into metrics of its own, so
+ * recording takes no lock and no atomic read-modify-write:
+ * a worker is the only writer of its metrics, and what it
+ * stores are plain relaxed stores that another thread may
+ * read at any time. A reader merges the metrics of every
+ * worker into a snapshot of its own, which may be a few
+ * updates behind but never sees a value torn in half.
+ *
+ * A histogram counts microseconds in log-linear buckets,
+ * the way HdrHistogram does: 32 buckets for each power of
+ * two, so that a value is known to within 1/32 of it from
+ * a microsecond up to about 19 hours, in a fixed 8 kB.
+ *
+ * The counters of the other modules of a worker (its
+ * acceptor, admission control, idle pool, relays, health
+ * checks and balancer) are kept by those modules, which
+ * only their worker may read. The worker copies them into
+ * its metrics now and then with metrics_set, so that they
+ * reach the reader the same way.
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "balancer.h"
+
+/* Bits of a value kept below its highest bit, 2^5 buckets per power of two */
+#define METRICS_SUB_BITS 5
+
+/* Values are clamped below 2^METRICS_MAX_BITS microseconds */
+#define METRICS_MAX_BITS 36
+
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+
+/**
+ * @brief The latencies a worker records, in microseconds.
+ *
+ */
+typedef enum {
+    METRIC_ACCEPT_TO_FIRST_BYTE, /* From the accept to the first byte of the request */
+    METRIC_UPSTREAM_CONNECT,     /* From connect(2) to the origin being connected */
+    METRIC_TIME_TO_FIRST_BYTE,   /* From the request head to the first byte of the response */
+    METRIC_REQUEST_TIME,         /* From the first byte of the request to the end of the response */
+    METRIC_HISTS
+} MetricHist;
+
+/**
+ * @brief The counters of a worker.
+ *
+ */
+typedef enum {
+    METRIC_CONNS_OPENED,        /* Client connections taken on */
+    METRIC_CONNS_CLOSED,        /* Client connections closed */
+    METRIC_REQUESTS,            /* Request heads read */
+    METRIC_BYTES_IN,            /* Bytes of the clients relayed */
+    METRIC_BYTES_OUT,           /* Bytes sent to the clients */
+    METRIC_ERR_BAD_REQUEST,     /* 400 */
+    METRIC_ERR_HEAD_TOO_LARGE,  /* 431 */
+    METRIC_ERR_BAD_GATEWAY,     /* 502 */
+    METRIC_ERR_GATEWAY_TIMEOUT, /* 504 */
+    METRIC_ERR_CLIENT_TIMEOUT,  /* Clients too slow to send their head */
+    METRIC_ERR_IDLE_TIMEOUT,    /* Relays where no byte moved for too long */
+    METRIC_ERR_ABORTED,         /* Exchanges broken midway by either peer */
+    METRIC_ERR_OVERLOADED,      /* 503, requests over the concurrency limit */
+    METRIC_ERR_NO_BACKEND,      /* 503, requests with every backend down or open */
+    /* Copied by the worker from the stats of its modules */
+    METRIC_ACCEPT_BATCHES,      /* Drains of the listening socket that took a connection */
+    METRIC_ACCEPT_SHED,         /* Connections closed for lack of descriptors */
+    METRIC_ACCEPT_ERRORS,       /* Connections lost to a transient error */
+    METRIC_ADMISSION_RESET,     /* Connections over the rate of the worker */
+    METRIC_ADMISSION_RESET_CLIENT, /* Connections over the rate of their client */
+    METRIC_ADMISSION_LIMIT,     /* The concurrency limit, 0 for none */
+    METRIC_ADMISSION_INFLIGHT,  /* Requests let in and not over yet */
+    METRIC_POOL_HITS,           /* Idle upstream connections reused */
+    METRIC_POOL_MISSES,         /* Requests that found none */
+    METRIC_POOL_STALE,          /* Idle upstream connections found closed */
+    METRIC_POOL_EXPIRED,        /* Idle for too long */
+    METRIC_POOL_EVICTED,        /* Over the idle connections of their origin */
+    METRIC_POOL_IDLE,           /* Idle upstream connections kept */
+    METRIC_TUNNELS_OPENED,      /* Tunnels and upgrades the origin was connected for */
+    METRIC_TUNNELS_ACTIVE,      /* Of those, the ones open */
+    METRIC_COLLAPSE_LEADERS,    /* Misses that fetched a response others could follow */
+    METRIC_COLLAPSE_FOLLOWERS,  /* Misses that followed the fetch of another one */
+    METRIC_COLLAPSE_FALLBACKS,  /* Followers that fetched the response on their own */
+    METRIC_COLLAPSE_TIMEOUTS,   /* Of those, the ones whose leader had no head in time */
+    METRIC_HEALTH_PROBES,       /* Health probes over */
+    METRIC_HEALTH_FAILURES,     /* Of those, the ones that failed */
+    METRIC_HEALTH_TIMEOUTS,     /* Of those, the ones that took too long */
+    /* Copied by the reader, the caches are shared by the workers */
+    METRIC_CACHE_LOOKUPS,       /* GET requests looked up in the response cache */
+    METRIC_CACHE_HITS,          /* Served from it */
+    METRIC_CACHE_STORES,        /* Responses stored */
+    METRIC_CACHE_EVICTIONS,     /* Objects dropped to make room */
+    METRIC_CACHE_EXPIRED,       /* Objects dropped once stale */
+    METRIC_CACHE_BYTES_SAVED,   /* Bytes served from it */
+    METRIC_CACHE_BYTES,         /* Bytes held */
+    METRIC_CACHE_OBJECTS,       /* Objects held */
+    METRIC_DISK_HITS,           /* Served from the disk cache */
+    METRIC_DISK_STORES,         /* Responses written to it */
+    METRIC_DISK_OVERWRITTEN,    /* Entries lost to its log wrapping around */
+    METRIC_DISK_ENTRIES,        /* Entries of its index */
+    METRIC_COUNTERS
+} MetricCounter;
+
+/**
+ * @brief The counters of a backend, copied by the worker
+ * from its balancer. Merged, the states count the workers
+ * they hold in.
+ *
+ */
+typedef enum {
+    METRIC_BACKEND_REQUESTS, /* Requests sent to it */
+    METRIC_BACKEND_FAILURES, /* Of those, the ones that failed */
+    METRIC_BACKEND_TRIPS,    /* Times its breaker opened */
+    METRIC_BACKEND_OPEN,     /* 1 while its breaker is not closed */
+    METRIC_BACKEND_DOWN,     /* 1 while its probes fail */
+    METRIC_BACKEND_COUNTERS
+} MetricBackendCounter;
+
+/**
+ * @struct Metrics metrics.h "include/metrics.h"
+ * @brief The metrics of a worker. The structure looks like
+ * this in the source file:
+ *
+ * ```
+ * struct metric_hist {
+ *     uint64_t buckets[METRICS_BUCKETS];
+ *     uint64_t sum;           // of the values, in microseconds
+ * };
+ *
+ * struct metrics {
+ *     uint64_t counters[METRIC_COUNTERS];
+ *     uint64_t backends[BALANCER_MAX_BACKENDS][METRIC_BACKEND_COUNTERS];
+ *     struct metric_hist hists[METRIC_HISTS];
+ * } __attribute__((aligned(64)));
+ * ```
+ *
+ */
+typedef struct metrics Metrics;
+
+/**
+ * @brief Initializes metrics where everything is 0.
+ *
+ * @return On success, a pointer to the metrics. Otherwise,
+ * it returns NULL.
+ *
+ */
+extern Metrics *metrics_init(void);
+
+/**
+ * @brief Adds n to a counter. Only the thread that owns
+ * the metrics may call it.
+ *
+ * @param metrics The metrics, or `NULL` to record nothing
+ * @param counter The counter
+ * @param n What is added
+ *
+ */
+extern void metrics_add(Metrics *metrics, MetricCounter counter, uint64_t n);
+
+/**
+ * @brief Sets a counter to value, for those the worker
+ * copies from the stats of another module, or the reader
+ * from the shared caches into a snapshot of its own. Only
+ * the thread that owns the metrics may call it.
+ *
+ * @param metrics The metrics, or `NULL` to record nothing
+ * @param counter The counter
+ * @param value Its value
+ *
+ */
+extern void metrics_set(Metrics *metrics, MetricCounter counter, uint64_t value);
+
+/**
+ * @brief Sets a counter of a backend to value. Only the
+ * thread that owns the metrics may call it.
+ *
+ * @param metrics The metrics, or `NULL` to record nothing
+ * @param backend The index of the backend, below
+ * `BALANCER_MAX_BACKENDS`
+ * @param counter The counter
+ * @param value Its value
+ *
+ */
+extern void metrics_set_backend(Metrics *metrics, unsigned int backend,
+        MetricBackendCounter counter, uint64_t value);
+
+/**
+ * @brief Records a latency into a histogram. Only the
+ * thread that owns the metrics may call it.
+ *
+ * @param metrics The metrics, or `NULL` to record nothing
+ * @param hist The histogram
+ * @param us The latency in microseconds
+ *
+ */
+extern void metrics_observe(Metrics *metrics, MetricHist hist, uint64_t us);
+
+/**
+ * @brief Returns the index of the bucket of a value.
+ *
+ * @param us The value in microseconds
+ * @return The index, below `METRICS_BUCKETS`
+ *
+ */
+extern unsigned int metrics_bucket(uint64_t us);
+
+/**
+ * @brief Returns the highest value a bucket counts.
+ *
+ * @param bucket The index of the bucket
+ * @return The value in microseconds
+ *
+ */
+extern uint64_t metrics_bucket_max(unsigned int bucket);
+
+/**
+ * @brief Returns the value of a counter.
+ *
+ * @param metrics The metrics
+ * @param counter The counter
+ * @return The value, 0 if metrics is `NULL`
+ *
+ */
+extern uint64_t metrics_get(const Metrics *metrics, MetricCounter counter);
+
+/**
+ * @brief Returns the value of a counter of a backend.
+ *
+ * @param metrics The metrics
+ * @param backend The index of the backend
+ * @param counter The counter
+ * @return The value, 0 if metrics is `NULL` or there is
+ * no such backend
+ *
+ */
+extern uint64_t metrics_get_backend(const Metrics *metrics, unsigned int backend,
+        MetricBackendCounter counter);
+
+/**
+ * @brief Returns the latency below which a fraction q of
+ * the values of a histogram fall, to within the width of
+ * its bucket.
+ *
+ * @param metrics The metrics
+ * @param hist The histogram
+ * @param q The fraction, from 0 to 1
+ * @return The latency in microseconds, 0 for an empty
+ * histogram
+ *
+ */
+extern uint64_t metrics_percentile(const Metrics *metrics, MetricHist hist, double q);
+
+/**
+ * @brief Adds every counter and histogram of src to those
+ * of dst. src may be written by its owner meanwhile, dst
+ * must belong to the calling thread.
+ *
+ * @param dst The metrics added to
+ * @param src The metrics added
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int metrics_merge(Metrics *dst, const Metrics *src);
+
+/**
+ * @brief Writes metrics to out in the text format of
+ * Prometheus. Histograms are in seconds, with a fixed set
+ * of bucket bounds from 100 µs to 10 s.
+ *
+ * @param metrics The metrics
+ * @param out Where they are written
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int metrics_format(const Metrics *metrics, FILE *out);
+
+/**
+ * @brief Writes the counters of the backends to out in
+ * the text format of Prometheus, labelled with their
+ * names.
+ *
+ * @param metrics The metrics
+ * @param names The backends, as given to balancer_init
+ * @param nbackends How many there are
+ * @param out Where they are written
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int metrics_format_backends(const Metrics *metrics, char *const *names,
+        unsigned int nbackends, FILE *out);
+
+/**
+ * @brief Frees the block pointed to by metrics.
+ *
+ * @param metrics The metrics
+ *
+ */
+extern void metrics_destroy(Metrics *metrics);
+
+#endif /* METRICS_H */
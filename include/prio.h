@@ -10,11 +10,16 @@
  * bounded by a fixed size of 1024. The priority
  * queue is implemented by a max heap.
  *
+ * PrioIndex is the keyed counterpart of it, where the
+ * priority of a key can be changed or removed in place.
+ *
  */
 
 #ifndef PRIO_H
 #define PRIO_H
 
+#include <stdint.h>
+
 /**
  * @struct PrioQueue prio.h "include/prio.h"
  * @brief This is the structure that represents
@@ -111,6 +116,104 @@ extern int prio_remove_max(PrioQueue *pq, int *get_max);
  */
 extern void prio_destroy(PrioQueue *pq);
 
+/**
+ * @struct PrioIndex prio.h "include/prio.h"
+ * @brief An indexed priority queue: a binary heap of keys,
+ * from 0 to a capacity, each with a priority that can be
+ * changed or removed in place, which PrioQueue cannot do.
+ * A key knows where it sits in the heap, so that an
+ * update only moves it up or down from there. Where
+ * PrioQueue yields the greatest value, it yields the key
+ * of the least priority. The structure is implemented as
+ * the following inside the source file:
+ *
+ * ```
+ * struct prio_index {
+ *     unsigned int capacity;
+ *     unsigned int len;
+ *     unsigned int *heap;  // keys, in heap order
+ *     unsigned int *pos;   // where a key is in heap, capacity if absent
+ *     int64_t *prio;       // of every key
+ * };
+ * ```
+ */
+typedef struct prio_index PrioIndex;
+
+/**
+ * @brief Initializes an empty indexed priority queue of
+ * the keys from 0 to capacity - 1.
+ *
+ * @param capacity The number of keys
+ * @return On success, a pointer to the queue. Otherwise,
+ * it returns NULL.
+ *
+ */
+extern PrioIndex *prio_index_init(unsigned int capacity);
+
+/**
+ * @brief Sets the priority of key, which is inserted if
+ * it is not in the queue yet.
+ *
+ * @param pi A pointer to an indexed priority queue
+ * @param key The key, below the capacity
+ * @param prio Its priority
+ * @return 0 if the call succeeds. -1, otherwise.
+ *
+ */
+extern int prio_index_set(PrioIndex *pi, unsigned int key, int64_t prio);
+
+/**
+ * @brief Copies the priority of key to `prio`.
+ *
+ * @param pi A pointer to an indexed priority queue
+ * @param key The key
+ * @param prio Where the priority is copied
+ * @return 0 if the call succeeds. -1, otherwise, when
+ * key is not in the queue.
+ *
+ */
+extern int prio_index_get(const PrioIndex *pi, unsigned int key, int64_t *prio);
+
+/**
+ * @brief Removes key from the queue.
+ *
+ * @param pi A pointer to an indexed priority queue
+ * @param key The key
+ * @return 0 if the call succeeds. -1, otherwise, when
+ * key is not in the queue.
+ *
+ */
+extern int prio_index_remove(PrioIndex *pi, unsigned int key);
 
+/**
+ * @brief Copies the key of the least priority, and that
+ * priority, without removing it.
+ *
+ * @param pi A pointer to an indexed priority queue
+ * @param key Where the key is copied
+ * @param prio Where its priority is copied, or `NULL`
+ * @return 0 if the call succeeds. -1, otherwise, when the
+ * queue is empty.
+ *
+ */
+extern int prio_index_peek_min(const PrioIndex *pi, unsigned int *key, int64_t *prio);
+
+/**
+ * @brief Returns the number of keys in the queue.
+ *
+ * @param pi A pointer to an indexed priority queue
+ * @return The number of keys, 0 if pi is `NULL`.
+ *
+ */
+extern unsigned int prio_index_len(const PrioIndex *pi);
+
+/**
+ * @brief This function frees the indexed priority queue
+ * `pi` and its arrays.
+ *
+ * @param pi A pointer to an indexed priority queue
+ *
+ */
+extern void prio_index_destroy(PrioIndex *pi);
 
 #endif /* PRIO_H */
@@ -0,0 +1,404 @@
+/**
+ * @file relay.h
+ * @brief The forward proxy itself. A relay takes an
+ * accepted client connection, reads the HTTP request
+ * head, connects to the origin server the request is
+ * meant for and then moves the bytes of the request
+ * and of the response between both sockets with
+ * splice(2) through a pipe pair of the connection, so
+ * that bodies are never copied into user space. Every
+ * socket of a relay is driven by the `ConnectionPool`
+ * of the worker that accepted the client, and so is the
+ * resolution of the name of the origin. GET requests are
+ * answered from the response cache when it holds a fresh
+ * response, and the responses it may store are copied
+ * into it on their way to the client. Concurrent misses
+ * of a worker for the same response are collapsed into
+ * a single fetch from the origin, whose response is sent
+ * to all of them as it comes.
+ *
+ * On io_uring, a new connection to the origin is a
+ * connect(2) linked to the send(2) of the request head,
+ * both queued with the rest of the batch of the worker
+ * and completed by the kernel with no readiness poll in
+ * between. Everything else, the request head of the
+ * client and the bodies spliced through pipes, stays
+ * driven by readiness, which splice(2) needs.
+ *
+ * A client connection stays open across requests for as
+ * long as both the client and the origin let it. Requests
+ * the client pipelines are read from the same buffer and
+ * relayed one at a time, in the order they came, so that
+ * the responses go back in that order too.
+ *
+ * Given a balancer, the relays act as a reverse proxy
+ * instead: every request goes to one of its backends,
+ * whatever its target or Host header names, and CONNECT
+ * is refused. The Host header still keys the cache. Each
+ * request tells the breaker of its backend whether it got
+ * a response head, and when every backend is down or open
+ * the client gets a 503 right away.
+ *
+ * A CONNECT request opens a tunnel: once the origin is
+ * connected, the client is told so with a 200 and the
+ * bytes are spliced both ways as they are, until each
+ * side has closed its half of the stream. An idle tunnel
+ * only waits on its two sockets.
+ *
+ * Relays and their I/O buffers come from slabs of the
+ * worker, so that once they have grown to the peak load,
+ * relaying a request allocates nothing.
+ *
+ * Every relay has a timer on the timing wheel of the
+ * worker. A client has a deadline to send its request
+ * head and the origin one to answer it, and a relay where
+ * no byte moves for a while is closed, so that slow or
+ * silent peers cannot hold connections forever.
+ *
+ */
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdint.h>
+
+#include "admission.h"
+#include "balancer.h"
+#include "cache.h"
+#include "conn.h"
+#include "conn_registry.h"
+#include "dns.h"
+#include "metrics.h"
+#include "slab.h"
+#include "timer.h"
+#include "upstream.h"
+
+/* Idle connections kept for each origin, 0 disables the reuse */
+#ifndef RELAY_UPSTREAM_MAX_IDLE
+#define RELAY_UPSTREAM_MAX_IDLE 16
+#endif
+
+/* How long an upstream connection may stay idle */
+#ifndef RELAY_UPSTREAM_IDLE_MS
+#define RELAY_UPSTREAM_IDLE_MS 30000
+#endif
+
+/* How long to wait for the nameserver before asking again */
+#ifndef RELAY_DNS_TIMEOUT_MS
+#define RELAY_DNS_TIMEOUT_MS 1000
+#endif
+
+/* How long a client has to send its whole request head */
+#ifndef RELAY_HEAD_TIMEOUT_MS
+#define RELAY_HEAD_TIMEOUT_MS 10000
+#endif
+
+/* How long the origin has to connect and answer with a head */
+#ifndef RELAY_UPSTREAM_TIMEOUT_MS
+#define RELAY_UPSTREAM_TIMEOUT_MS 30000
+#endif
+
+/* How long a relay may go without moving a byte */
+#ifndef RELAY_IDLE_TIMEOUT_MS
+#define RELAY_IDLE_TIMEOUT_MS 60000
+#endif
+
+/* How long a collapsed miss waits for the head of the response before it fetches it itself */
+#ifndef RELAY_COLLAPSE_TIMEOUT_MS
+#define RELAY_COLLAPSE_TIMEOUT_MS 5000
+#endif
+
+/**
+ * @brief The counters of the CONNECT tunnels of a worker.
+ * The bytes are those of the tunnels that are closed.
+ *
+ */
+typedef struct {
+    uint64_t opened;     /* Tunnels the origin was connected for */
+    uint64_t active;     /* Tunnels open right now */
+    uint64_t bytes_up;   /* Bytes relayed from the clients to the origins */
+    uint64_t bytes_down; /* Bytes relayed from the origins to the clients */
+} RelayTunnelStats;
+
+/**
+ * @brief The counters of the collapsed forwarding of a worker.
+ *
+ */
+typedef struct {
+    uint64_t leaders;   /* Misses that fetched a response others could follow */
+    uint64_t followers; /* Misses that followed the fetch of another one */
+    uint64_t fallbacks; /* Followers that fetched the response on their own */
+    uint64_t timeouts;  /* Of those, the ones whose leader had no head in time */
+} RelayCollapseStats;
+
+/**
+ * @brief The counters of the relays of a worker that timed out.
+ *
+ */
+typedef struct {
+    uint64_t head;     /* Clients that did not send their head in time */
+    uint64_t upstream; /* Origins that did not answer in time */
+    uint64_t idle;     /* Relays where no byte moved for too long */
+} RelayTimeoutStats;
+
+/**
+ * @struct RelayCtx relay.h "include/relay.h"
+ * @brief The per-worker state of the relays. It keeps
+ * track of every relay the worker runs so that they
+ * can be torn down along with the worker. A context
+ * is only ever used by the thread of its worker. The
+ * structure looks like this in the source file:
+ *
+ * ```
+ * struct relay_ctx {
+ *     ConnectionPool *conn_pool;
+ *     UpstreamPool *upstreams;
+ *     DnsCache *dns_cache;
+ *     DnsResolver *resolver;
+ *     int owns_cache;
+ *     HttpCache *cache;
+ *     Slab *relay_slab;
+ *     Slab *buf_slab;
+ *     RelayTunnelStats tunnels;
+ *     RelayCollapseStats collapse;
+ *     struct relay *leaders[RELAY_LEADER_BUCKETS]; // by cache key
+ *     TimerWheel *timers;
+ *     unsigned int timeout_ms[4]; // head, upstream, idle, collapse
+ *     RelayTimeoutStats timeouts;
+ *     ConnRegistry *registry;
+ *     unsigned int worker;
+ *     Metrics *metrics;
+ *     Admission *admission;
+ *     Balancer *balancer;   // reverse proxy mode if not NULL
+ *     struct relay *relays; // doubly linked list
+ *     unsigned int nrelays;
+ *     struct relay_connect *orphans; // connects in the kernel of relays gone
+ * };
+ * ```
+ *
+ */
+typedef struct relay_ctx RelayCtx;
+
+/**
+ * @brief Initializes the relay state of a worker whose
+ * event loop is conn_pool. Origin names are resolved with
+ * the nameserver of /etc/resolv.conf and their addresses
+ * go into dns_cache, which workers may share.
+ *
+ * @param conn_pool The connection pool of the worker
+ * @param dns_cache The cache of DNS answers, or `NULL` for
+ * one of the context's own
+ * @param cache The response cache, which workers may share,
+ * or `NULL` to relay every request to its origin
+ * @return On success, a pointer to the new context.
+ * Otherwise, it returns NULL.
+ *
+ */
+extern RelayCtx *relay_ctx_init(ConnectionPool *conn_pool, DnsCache *dns_cache,
+        HttpCache *cache);
+
+/**
+ * @brief Starts relaying the client connection connfd,
+ * which must be a non-blocking socket. The relay owns
+ * connfd from then on and closes it once the client
+ * is done with it, even if the call fails.
+ *
+ * @param ctx The relay state of the worker
+ * @param connfd The accepted client connection
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int relay_start(RelayCtx *ctx, int connfd);
+
+/**
+ * @brief Returns the number of relays that are running.
+ *
+ * @param ctx The relay state of the worker
+ * @return The number of relays, or -1 if ctx is `NULL`
+ *
+ */
+extern int relay_get_count(RelayCtx *ctx);
+
+/**
+ * @brief Copies the counters of the idle upstream
+ * connections of the worker to stats.
+ *
+ * @param ctx The relay state of the worker
+ * @param stats Where the counters are copied
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int relay_get_upstream_stats(RelayCtx *ctx, UpstreamStats *stats);
+
+/**
+ * @brief Copies the counters of the allocators of the
+ * worker, the one of the relays and the one of their
+ * I/O buffers, to relays and buffers.
+ *
+ * @param ctx The relay state of the worker
+ * @param relays Where the counters of the relays are copied
+ * @param buffers Where the counters of the buffers are copied
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int relay_get_alloc_stats(RelayCtx *ctx, SlabStats *relays, SlabStats *buffers);
+
+/**
+ * @brief Copies the counters of the CONNECT tunnels of
+ * the worker to stats.
+ *
+ * @param ctx The relay state of the worker
+ * @param stats Where the counters are copied
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int relay_get_tunnel_stats(RelayCtx *ctx, RelayTunnelStats *stats);
+
+/**
+ * @brief Copies the counters of the collapsed forwarding
+ * of the worker to stats.
+ *
+ * @param ctx The relay state of the worker
+ * @param stats Where the counters are copied
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int relay_get_collapse_stats(RelayCtx *ctx, RelayCollapseStats *stats);
+
+/**
+ * @brief Copies the counters of the relays of the worker
+ * that timed out to stats.
+ *
+ * @param ctx The relay state of the worker
+ * @param stats Where the counters are copied
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int relay_get_timeout_stats(RelayCtx *ctx, RelayTimeoutStats *stats);
+
+/**
+ * @brief Sets the timeouts of the worker in place of
+ * `RELAY_HEAD_TIMEOUT_MS`, `RELAY_UPSTREAM_TIMEOUT_MS` and
+ * `RELAY_IDLE_TIMEOUT_MS`. They apply to the deadlines
+ * armed from then on.
+ *
+ * @param ctx The relay state of the worker
+ * @param head_ms How long a client has to send its head
+ * @param upstream_ms How long the origin has to answer
+ * @param idle_ms How long a relay may go without moving a byte
+ * @return 0 on success. Otherwise, it returns -1, when a
+ * timeout is 0.
+ *
+ */
+extern int relay_ctx_set_timeouts(RelayCtx *ctx, unsigned int head_ms,
+        unsigned int upstream_ms, unsigned int idle_ms);
+
+/**
+ * @brief Sets how long a miss that follows the fetch of
+ * the same response waits for its head, in place of
+ * `RELAY_COLLAPSE_TIMEOUT_MS`, before it asks the origin
+ * itself. It applies to the misses from then on.
+ *
+ * @param ctx The relay state of the worker
+ * @param collapse_ms The timeout, 0 to never collapse misses
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int relay_ctx_set_collapse_timeout(RelayCtx *ctx, unsigned int collapse_ms);
+
+/**
+ * @brief Has the client connections of the worker recorded
+ * in registry, which the workers may share, for as long as
+ * they are relayed. It must be called before the first
+ * relay starts.
+ *
+ * @param ctx The relay state of the worker
+ * @param registry The registry, or `NULL` for none
+ * @param worker The worker the connections are recorded for
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int relay_ctx_set_registry(RelayCtx *ctx, ConnRegistry *registry,
+        unsigned int worker);
+
+/**
+ * @brief Has the relays of the worker record their
+ * latencies and counters into metrics, which only the
+ * worker writes. It must be called before the first
+ * relay starts.
+ *
+ * @param ctx The relay state of the worker
+ * @param metrics The metrics, or `NULL` for none
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int relay_ctx_set_metrics(RelayCtx *ctx, Metrics *metrics);
+
+/**
+ * @brief Has the relays of the worker let their requests
+ * in through admission, which the worker owns. A request
+ * over its concurrency limit is answered with a 503 as
+ * soon as its head is parsed, and the time new clients
+ * wait for their request to be read tells it how far
+ * behind the worker is. It must be called before the
+ * first relay starts.
+ *
+ * @param ctx The relay state of the worker
+ * @param admission The admission, or `NULL` to let every
+ * request in
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int relay_ctx_set_admission(RelayCtx *ctx, Admission *admission);
+
+/**
+ * @brief Has the relays of the worker send every request
+ * to a backend balancer picks, which the worker owns, the
+ * way a reverse proxy does. A backend counts a request as
+ * in flight from the moment it is picked until its
+ * response is over or it failed. It must be called before
+ * the first relay starts.
+ *
+ * @param ctx The relay state of the worker
+ * @param balancer The balancer, or `NULL` to relay every
+ * request to the origin it names
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int relay_ctx_set_balancer(RelayCtx *ctx, Balancer *balancer);
+
+/**
+ * @brief Tells how long the event loop of the worker may
+ * sleep before a relay times out.
+ *
+ * @param ctx The relay state of the worker
+ * @param max_ms The longest sleep to return
+ * @return The milliseconds to sleep, at most max_ms
+ *
+ */
+extern int relay_ctx_timeout(RelayCtx *ctx, int max_ms);
+
+/**
+ * @brief Does the periodic housekeeping of the relays,
+ * such as closing the upstream connections that have
+ * been idle for too long, asking the nameserver again
+ * for late answers and timing out the relays whose
+ * deadline passed. It is meant to be called each
+ * time the event loop of the worker wakes up.
+ *
+ * @param ctx The relay state of the worker
+ *
+ */
+extern void relay_ctx_tick(RelayCtx *ctx);
+
+/**
+ * @brief Closes every relay that is still running and
+ * frees the block pointed to by ctx. The connection pool
+ * of the worker is left as is.
+ *
+ * @param ctx The relay state of the worker
+ *
+ */
+extern void relay_ctx_destroy(RelayCtx *ctx);
+
+#endif /* RELAY_H */
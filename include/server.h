@@ -2,7 +2,8 @@
  * @file server.h
  * @brief This has a single function 
  * where it begins to run the proxy 
- * server.
+ * server along with the configuration
+ * it is run with.
  *
  */
 
@@ -10,28 +11,70 @@
 #define SERVER_H
 
 /**
- * @brief This starts up a server on 
- * the calling thread. It takes as argument a 
- * port which must be an integer value. The 
- * server will create a new TCP socket that binds 
- * to the port specified by the argument *port*. 
- * Then, the server will be set up to listen for
- * any new TCP connections and accept such
- * connections. A client can send any HTTP
+ * @struct ProxyConfig server.h "include/server.h"
+ * @brief The options the proxy server is run with.
+ * A zero value picks the default of an option.
+ *
+ */
+typedef struct proxy_config {
+    char *port;             /* Port the listening sockets bind to */
+    unsigned int nworkers;  /* Worker threads, 0 for one per core */
+    unsigned int cache_mb;  /* Budget of the response cache in MB, 0 for 64 */
+    char *disk_cache;       /* Path of the disk cache files, NULL for none */
+    unsigned int disk_cache_mb; /* Size of the disk cache in MB, 0 for 256 */
+    char *metrics_port;     /* Loopback port of the metrics endpoint, NULL for none */
+    unsigned int conn_rate;    /* New connections a second, 0 for no limit */
+    unsigned int client_rate;  /* New connections a second of a client address, 0 for no limit */
+    unsigned int max_inflight; /* Requests relayed at once at most, 0 for no limit */
+    char **backends;           /* "host:port" of the backends, a reverse proxy if any */
+    unsigned int nbackends;
+    char *balance;             /* "least", "p2c" or "hash", NULL for "least" */
+    char *health_path;         /* Path the health probes ask for, NULL to only connect */
+} ProxyConfig;
+
+/**
+ * @brief This starts up a server with the 
+ * configuration *config*. The port of the
+ * configuration must be an integer value. The 
+ * server starts *nworkers* worker threads. Each 
+ * of them creates a new TCP socket that binds 
+ * to the port (all of them with SO_REUSEPORT, so
+ * the kernel spreads new connections across them)
+ * and runs an event loop of its own on it. The
+ * calling thread waits until the server is told
+ * to terminate with SIGHUP, in which case every
+ * worker is shut down.
+ * With a metrics port, a thread of its own answers
+ * `GET /metrics` on loopback with the latencies and
+ * counters of every worker merged, in the text format
+ * of Prometheus.
+ * Connections over the rates are reset as they are
+ * accepted, and requests over the concurrency limit,
+ * which shrinks as the workers fall behind, are answered
+ * with a 503.
+ * With backends, the server is a reverse proxy instead,
+ * and every request goes to the backend the balance
+ * policy picks, out of the requests each worker has in
+ * flight or by the hash of its target. The backends are
+ * probed in the background, and those that fail their
+ * probes or trip their circuit breaker are out of
+ * rotation until they recover.
+ * A client can send any HTTP
  * request and the server will handle the request 
  * by directing the request to the actual server 
- * the user wants to access. The function fails 
+ * the user wants to access. A client connection
+ * persists across requests, pipelined ones included,
+ * unless either side asks to close it. The function fails 
  * when any of the socket system calls, memory 
  * allocation calls, or any other system calls
  * fail. It also fails if the port is not a
  * short integer when parsed by the function. 
  *
- * @param port The port the server has its listening socket 
- *             bind to.
+ * @param config The options the server is run with
  * @return 0 if server successfully runs and terminates. 
  * Otherwise, it returns -1.
  *
  */
-int run_proxy_server(char *port);
+int run_proxy_server(const ProxyConfig *config);
 
 #endif /* SERVER_H */
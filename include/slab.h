@@ -0,0 +1,123 @@
+/**
+ * @file slab.h
+ * @brief An allocator of objects of a single size. Memory is
+ * obtained from the system a slab at a time, a block of pages
+ * that holds several objects, and objects that are given back
+ * go on a free list that the next ones are taken from, the
+ * most recently freed first, while it is still warm in the
+ * CPU caches. Once the slabs hold as many objects as the peak
+ * load needed, handing objects out and taking them back costs
+ * neither a system call nor a call to malloc.
+ *
+ * Objects are aligned to what the slab is made with, so that
+ * a slab of page-aligned objects is a pool of I/O buffers.
+ * Slabs go back to the system only when the whole allocator
+ * is destroyed, so its footprint is that of the peak load.
+ *
+ * An allocator is not thread safe, it is meant to be owned
+ * by a single worker.
+ *
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Alignment of the objects when none is asked for */
+#define SLAB_MIN_ALIGN 16
+
+/* Size of a slab, unless the objects are too large for it */
+#define SLAB_SIZE (64 * 1024)
+
+/* Objects a slab holds at least */
+#define SLAB_MIN_OBJECTS 8
+
+/**
+ * @brief The counters of an allocator.
+ *
+ */
+typedef struct {
+    uint64_t allocs;      /* Objects handed out */
+    uint64_t frees;       /* Objects given back */
+    uint64_t outstanding; /* Objects handed out right now */
+    uint64_t peak;        /* Most objects handed out at once */
+    uint64_t capacity;    /* Objects the slabs hold */
+    uint64_t slabs;       /* Slabs obtained from the system */
+} SlabStats;
+
+/**
+ * @struct Slab slab.h "include/slab.h"
+ * @brief The allocator. The structure looks like this in the
+ * source file:
+ *
+ * ```
+ * struct slab {
+ *     size_t obj_size;    // rounded up to the alignment
+ *     size_t slab_size;
+ *     size_t per_slab;
+ *     void *free_list;    // linked through the free objects
+ *     void **slabs;
+ *     size_t nslabs;
+ *     size_t cap;
+ *     SlabStats stats;
+ * };
+ * ```
+ *
+ */
+typedef struct slab Slab;
+
+/**
+ * @brief Initializes an allocator of objects of obj_size bytes.
+ * No slab is obtained until the first object is asked for.
+ *
+ * @param obj_size The size of an object
+ * @param align The alignment of the objects, a power of two up
+ * to the page size, or 0 for `SLAB_MIN_ALIGN`
+ * @return On success, a pointer to the allocator. Otherwise,
+ * it returns NULL.
+ *
+ */
+extern Slab *slab_init(size_t obj_size, size_t align);
+
+/**
+ * @brief Hands out an object, whose contents are undefined.
+ *
+ * @param slab The allocator
+ * @return On success, a pointer to the object. Otherwise, it
+ * returns NULL, when no slab could be obtained.
+ *
+ */
+extern void *slab_alloc(Slab *slab);
+
+/**
+ * @brief Takes back an object handed out by slab.
+ *
+ * @param slab The allocator
+ * @param obj The object, may be `NULL`
+ *
+ */
+extern void slab_free(Slab *slab, void *obj);
+
+/**
+ * @brief Copies the counters of the allocator into stats.
+ *
+ * @param slab The allocator
+ * @param stats Receives the counters
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int slab_get_stats(Slab *slab, SlabStats *stats);
+
+/**
+ * @brief Gives every slab back to the system, whether or not
+ * its objects were freed, and frees the block pointed to by
+ * slab.
+ *
+ * @param slab The allocator
+ *
+ */
+extern void slab_destroy(Slab *slab);
+
+#endif /* SLAB_H */
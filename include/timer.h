@@ -0,0 +1,175 @@
+/**
+ * @file timer.h
+ * @brief A hierarchical timing wheel. Time is counted in
+ * ticks of a millisecond and the wheel has levels of 64
+ * slots each, every slot of a level spanning as many ticks
+ * as the whole level below it, so that four levels cover
+ * more than four hours. A timer goes into the slot of the
+ * level its expiry falls in, and when the wheel reaches a
+ * slot of an upper level, the timers it holds move down to
+ * the level below, until they are in the lowest one, whose
+ * slots expire.
+ *
+ * Timers are embedded in the structures they time out, so
+ * arming, cancelling and arming them again only links or
+ * unlinks them from a list, whatever the number of timers.
+ * Each level also keeps a bitmap of its slots that are not
+ * empty, which tells how long the event loop may sleep and
+ * lets the wheel skip the ticks where nothing happens.
+ *
+ * A wheel is not thread safe, it is meant to be owned by a
+ * single worker.
+ *
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/* Levels of the wheel, and the slots of a level */
+#define TIMER_LEVELS     4
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS      (1 << TIMER_LEVEL_BITS)
+
+/* Timers further away than this are moved down once it passes */
+#define TIMER_MAX_DELAY_MS (((uint64_t)1 << (TIMER_LEVELS * TIMER_LEVEL_BITS)) - 1)
+
+typedef struct timer Timer;
+
+/**
+ * @brief Called once timer expires. The timer is no longer
+ * armed by then, so it may be armed again right away.
+ *
+ */
+typedef void (*TimerHandler)(Timer *timer, void *data);
+
+/**
+ * @brief A timer, embedded in whatever it times out. Its
+ * fields belong to the wheel once it is initialized.
+ *
+ */
+struct timer {
+    struct timer *prev;  /* The slot the timer is in, NULL when not armed */
+    struct timer *next;
+    unsigned int slot;   /* Level and slot, so that cancelling finds its bitmap */
+    uint64_t expires_ms;
+    TimerHandler handler;
+    void *data;
+};
+
+/**
+ * @struct TimerWheel timer.h "include/timer.h"
+ * @brief The wheel. The structure looks like this in the
+ * source file:
+ *
+ * ```
+ * struct timer_wheel {
+ *     uint64_t now;                        // the last tick run
+ *     uint64_t occupied[TIMER_LEVELS];     // slots that are not empty
+ *     Timer slots[TIMER_LEVELS][TIMER_SLOTS];  // list heads
+ *     long count;
+ * };
+ * ```
+ *
+ */
+typedef struct timer_wheel TimerWheel;
+
+/**
+ * @brief Initializes a wheel whose clock starts at now_ms.
+ *
+ * @param now_ms The current time, from a monotonic clock
+ * @return On success, a pointer to the wheel. Otherwise, it
+ * returns NULL.
+ *
+ */
+extern TimerWheel *timer_wheel_init(uint64_t now_ms);
+
+/**
+ * @brief Initializes timer, which is not armed.
+ *
+ * @param timer The timer
+ * @param handler Called with data once the timer expires
+ * @param data Passed to handler
+ *
+ */
+extern void timer_init(Timer *timer, TimerHandler handler, void *data);
+
+/**
+ * @brief Arms timer to expire at expires_ms, on the clock of
+ * the wheel. A timer that is already armed is moved. A timer
+ * whose expiry has passed expires on the next tick.
+ *
+ * @param wheel The wheel
+ * @param timer The timer
+ * @param expires_ms When the timer expires
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int timer_arm(TimerWheel *wheel, Timer *timer, uint64_t expires_ms);
+
+/**
+ * @brief Disarms timer, if it is armed.
+ *
+ * @param wheel The wheel
+ * @param timer The timer
+ *
+ */
+extern void timer_cancel(TimerWheel *wheel, Timer *timer);
+
+/**
+ * @brief Tells whether timer is armed.
+ *
+ * @param timer The timer
+ * @return 1 if the timer is armed, 0 otherwise.
+ *
+ */
+extern int timer_is_armed(const Timer *timer);
+
+/**
+ * @brief Moves the clock of the wheel to now_ms and calls the
+ * handler of every timer that expired by then, in the order
+ * of their expiry. Handlers may arm and cancel timers.
+ *
+ * @param wheel The wheel
+ * @param now_ms The current time
+ * @return The number of timers that expired, or -1 if wheel
+ * is `NULL`.
+ *
+ */
+extern int timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms);
+
+/**
+ * @brief Tells how long the event loop may sleep before the
+ * wheel has something to do. The wheel may only have timers
+ * to move down by then, so it can wake up early, but never
+ * late.
+ *
+ * @param wheel The wheel
+ * @param now_ms The current time
+ * @param max_ms The longest sleep to return
+ * @return The milliseconds to sleep, at most max_ms. It is
+ * max_ms when no timer is armed.
+ *
+ */
+extern int timer_wheel_timeout(TimerWheel *wheel, uint64_t now_ms, int max_ms);
+
+/**
+ * @brief Returns the number of timers that are armed.
+ *
+ * @param wheel The wheel
+ * @return The number of timers, or -1 if wheel is `NULL`
+ *
+ */
+extern long timer_wheel_count(TimerWheel *wheel);
+
+/**
+ * @brief Frees the block pointed to by wheel. The timers
+ * still armed are left as they are, they are not called.
+ *
+ * @param wheel The wheel
+ *
+ */
+extern void timer_wheel_destroy(TimerWheel *wheel);
+
+#endif /* TIMER_H */
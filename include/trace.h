@@ -0,0 +1,54 @@
+/**
+ * @file trace.h
+ * @brief Static tracepoints (USDT probes) on the life of a
+ * connection, for perf and bpftrace. A probe compiles to a
+ * single nop and a note in the ELF file that tells a tracer
+ * where it is and where its arguments live, so that it costs
+ * next to nothing until a tracer attaches to it. Arguments
+ * are only ever values the proxy has at hand anyway.
+ *
+ * The probes need `<sys/sdt.h>` (systemtap-sdt-dev). Without
+ * it, or when built with `make TRACE=0` (which defines
+ * `PROXY_NO_TRACE`), they compile to nothing.
+ *
+ * Every probe belongs to the provider `proxy`. Timestamps
+ * are in microseconds of CLOCK_MONOTONIC, the clock of
+ * `nsecs` in bpftrace.
+ *
+ * | Probe        | Arguments                                          |
+ * |--------------|----------------------------------------------------|
+ * | accept       | worker, fd                                         |
+ * | conn_insert  | fd, events, fds in the pool                        |
+ * | conn_remove  | fd, fds in the pool                                |
+ * | request      | fd, µs from the first byte to the whole head       |
+ * | upstream     | fd, upstream fd, µs to connect, reused (1) or not  |
+ * | first_byte   | fd, µs from the request head to the first byte out |
+ * | close        | fd, accept timestamp, bytes in, bytes out          |
+ *
+ * bench/trace/stages.bt turns them into a breakdown of the
+ * latency of every stage of a request.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#if !defined(PROXY_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROXY_TRACE_ENABLED 1
+#endif
+#endif
+
+#ifdef PROXY_TRACE_ENABLED
+#define TRACE2(name, a, b)       DTRACE_PROBE2(proxy, name, a, b)
+#define TRACE3(name, a, b, c)    DTRACE_PROBE3(proxy, name, a, b, c)
+#define TRACE4(name, a, b, c, d) DTRACE_PROBE4(proxy, name, a, b, c, d)
+#else
+/* The arguments are not evaluated, only kept from looking unused */
+#define TRACE2(name, a, b)       do { (void)sizeof(a); (void)sizeof(b); } while(0)
+#define TRACE3(name, a, b, c)    do { TRACE2(name, a, b); (void)sizeof(c); } while(0)
+#define TRACE4(name, a, b, c, d) do { TRACE3(name, a, b, c); (void)sizeof(d); } while(0)
+#endif
+
+#endif /* TRACE_H */
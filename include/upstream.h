@@ -0,0 +1,149 @@
+/**
+ * @file upstream.h
+ * @brief The pool of idle persistent connections to
+ * origin servers. Once a response is over, the relay
+ * hands its upstream socket back to the pool instead
+ * of closing it, and the next request for the same
+ * origin (host and port) takes it back rather than
+ * paying for a new TCP connect. This pool has nothing
+ * to do with the `ConnectionPool` of conn.h, which
+ * drives the sockets of a worker: the sockets kept
+ * here are idle and not registered anywhere.
+ *
+ * Each worker has its own pool, which is only ever
+ * used by the thread of that worker.
+ *
+ */
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+/* Longest "host:port" an origin can be keyed by */
+#define UPSTREAM_KEY_SZ 264
+
+/**
+ * @brief The counters of a pool. A get is a hit when
+ * it hands out an idle connection and a miss otherwise.
+ * Connections that are dropped without being reused are
+ * counted by the reason they were dropped for.
+ *
+ */
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stale;   /* Found closed (or unusable) when taken */
+    unsigned long expired; /* Idle for longer than the idle timeout */
+    unsigned long evicted; /* Dropped because the origin had max_idle */
+    unsigned int idle;     /* Connections currently kept */
+} UpstreamStats;
+
+/**
+ * @struct UpstreamPool upstream.h "include/upstream.h"
+ * @brief The idle connections of a worker. Origins are
+ * kept in a hash table, and the idle connections of an
+ * origin in a list with the most recently used first,
+ * so that a get is O(1). Every idle connection is also
+ * on a list ordered by the time it went idle, which
+ * lets expiry stop at the first connection that is
+ * still young. Origins left without idle connections
+ * and taken connections are kept on free lists for
+ * reuse, so that a pool that has warmed up no longer
+ * allocates. The structure looks like this in the
+ * source file:
+ *
+ * ```
+ * struct upstream_pool {
+ *     unsigned int max_idle;
+ *     unsigned int idle_timeout_ms;
+ *     struct origin *buckets[UPSTREAM_BUCKETS];
+ *     struct idle_conn *oldest; // the list ordered by time
+ *     struct idle_conn *newest;
+ *     struct idle_conn *free_conns;
+ *     struct origin *free_origins;
+ *     UpstreamStats stats;
+ * };
+ * ```
+ *
+ */
+typedef struct upstream_pool UpstreamPool;
+
+/**
+ * @brief Initializes an empty pool.
+ *
+ * @param max_idle The number of idle connections kept
+ * for each origin, 0 disables the pool
+ * @param idle_timeout_ms How long a connection may stay
+ * idle before it is closed
+ * @return On success, a pointer to the new pool.
+ * Otherwise, it returns NULL.
+ *
+ */
+extern UpstreamPool *upstream_pool_init(unsigned int max_idle,
+        unsigned int idle_timeout_ms);
+
+/**
+ * @brief Takes an idle connection to host:port out of the
+ * pool. Before it is handed out, a connection is checked
+ * to still be open and to have no pending bytes; those
+ * that fail the check are closed and the next one is
+ * tried.
+ *
+ * @param pool The pool of the worker
+ * @param host The host of the origin
+ * @param port The port of the origin
+ * @return A connected socket owned by the caller, or -1 if
+ * the pool has none for the origin (a miss).
+ *
+ */
+extern int upstream_pool_get(UpstreamPool *pool, const char *host,
+        const char *port);
+
+/**
+ * @brief Gives an idle connection to host:port to the pool,
+ * which owns fd from then on. When the origin already has
+ * max_idle connections, its least recently used one is
+ * closed to make room.
+ *
+ * @param pool The pool of the worker
+ * @param host The host of the origin
+ * @param port The port of the origin
+ * @param fd A connected socket with no request in flight
+ * @return 0 if the connection is kept. Otherwise, fd is
+ * closed and it returns -1.
+ *
+ */
+extern int upstream_pool_put(UpstreamPool *pool, const char *host,
+        const char *port, int fd);
+
+/**
+ * @brief Closes the connections that have been idle for
+ * longer than the idle timeout. It only looks at the
+ * connections it closes, so it can be called as often as
+ * the event loop of the worker wakes up.
+ *
+ * @param pool The pool of the worker
+ * @return The number of connections closed
+ *
+ */
+extern unsigned int upstream_pool_expire(UpstreamPool *pool);
+
+/**
+ * @brief Copies the counters of the pool to stats.
+ *
+ * @param pool The pool of the worker
+ * @param stats Where the counters are copied
+ * @return 0 on success. Otherwise, it returns -1.
+ *
+ */
+extern int upstream_pool_get_stats(UpstreamPool *pool, UpstreamStats *stats);
+
+/**
+ * @brief Closes every idle connection and frees the block
+ * pointed to by pool.
+ *
+ * @param pool The pool of the worker
+ *
+ */
+extern void upstream_pool_destroy(UpstreamPool *pool);
+
+#endif /* UPSTREAM_H */
@@ -0,0 +1,58 @@
+/**
+ * @file util.h
+ * @brief Helpers every module needs: the time of the
+ * monotonic clock, which deadlines, timeouts and latencies
+ * are counted in, and the FNV-1a hash that keys the hash
+ * tables, the ring of the balancer and the disk index.
+ *
+ */
+
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The offset basis of FNV-1a, 64 bits, the hash to start from */
+#define UTIL_FNV1A_BASIS 14695981039346656037ull
+
+/**
+ * @brief Returns the time of CLOCK_MONOTONIC.
+ *
+ * @return The time in milliseconds.
+ *
+ */
+extern uint64_t util_now_ms(void);
+
+/**
+ * @brief Returns the time of CLOCK_MONOTONIC.
+ *
+ * @return The time in microseconds.
+ *
+ */
+extern uint64_t util_now_us(void);
+
+/**
+ * @brief Hashes bytes with FNV-1a, 64 bits. The hash of
+ * several buffers in a row is that of the first passed
+ * on to the next as h.
+ *
+ * @param buf The bytes
+ * @param len How many there are
+ * @param h The hash so far, `UTIL_FNV1A_BASIS` to start
+ * @return The hash.
+ *
+ */
+extern uint64_t util_fnv1a(const void *buf, size_t len, uint64_t h);
+
+/**
+ * @brief Hashes a string, without its nul, with FNV-1a,
+ * 64 bits.
+ *
+ * @param s The string
+ * @return The hash.
+ *
+ */
+extern uint64_t util_fnv1a_str(const char *s);
+
+#endif /* UTIL_H */
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "acceptor.h"
+
+struct acceptor {
+    int listenfd;
+    int reservefd;
+    AcceptHandler handler;
+    void *data;
+    AcceptStats stats;
+};
+
+static int open_reserve(void) {
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+Acceptor *acceptor_init(int listenfd, AcceptHandler handler, void *data) {
+    if(listenfd < 0 || handler == NULL) {
+        return NULL;
+    }
+    Acceptor *acceptor = calloc(1, sizeof(Acceptor));
+    if(acceptor == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    if((acceptor->reservefd = open_reserve()) == -1) {
+        perror("open");
+        free(acceptor);
+        return NULL;
+    }
+    acceptor->listenfd = listenfd;
+    acceptor->handler = handler;
+    acceptor->data = data;
+    return acceptor;
+}
+
+/*
+ * Errors of a connection that went wrong before it was taken,
+ * accept(2) passes the pending network errors of the new socket on
+ */
+static int is_transient(int err) {
+    switch(err) {
+        case ECONNABORTED:
+        case EPROTO:
+        case EPERM:
+        case ENETDOWN:
+        case ENETUNREACH:
+        case ENONET:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+        case ENOPROTOOPT:
+        case EOPNOTSUPP:
+        case ETIMEDOUT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Out of descriptors: the reserve makes room for the next connection,
+ * which is closed right away so that it leaves the backlog. Returns
+ * -1 when nothing was shed, for lack of a reserve or of a connection,
+ * since accept(2) fails with EMFILE whether the backlog is empty or not.
+ */
+static int shed(Acceptor *acceptor) {
+    if(acceptor->reservefd == -1) {
+        return -1;
+    }
+    close(acceptor->reservefd);
+    int connfd = accept4(acceptor->listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if(connfd != -1) {
+        close(connfd);
+        acceptor->stats.shed++;
+    }
+    /* Another thread may take the descriptor first, the next drain tries again */
+    acceptor->reservefd = open_reserve();
+    return connfd != -1 ? 0 : -1;
+}
+
+int acceptor_drain(Acceptor *acceptor) {
+    if(acceptor == NULL) {
+        return -1;
+    }
+    if(acceptor->reservefd == -1) {
+        acceptor->reservefd = open_reserve();
+    }
+
+    int n = 0;
+    for(;;) {
+        int connfd = accept4(acceptor->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(connfd != -1) {
+            acceptor->stats.accepted++;
+            n++;
+            acceptor->handler(connfd, acceptor->data);
+            continue;
+        }
+        if(errno == EINTR) {
+            continue;
+        }
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* The backlog is drained */
+            break;
+        }
+        if(is_transient(errno)) {
+            acceptor->stats.errors++;
+            continue;
+        }
+        if(errno == EMFILE || errno == ENFILE) {
+            if(shed(acceptor) == 0) {
+                continue;
+            }
+            break;
+        }
+        if(errno == ENOBUFS || errno == ENOMEM) {
+            /* Left in the backlog until memory is back */
+            break;
+        }
+        perror("accept4");
+        return -1;
+    }
+    if(n > 0) {
+        acceptor->stats.batches++;
+    }
+    return n;
+}
+
+int acceptor_complete(Acceptor *acceptor, int res) {
+    if(acceptor == NULL) {
+        return -1;
+    }
+    if(res >= 0) {
+        acceptor->stats.accepted++;
+        acceptor->handler(res, acceptor->data);
+        return 0;
+    }
+    int err = -res;
+    if(is_transient(err)) {
+        acceptor->stats.errors++;
+        return 0;
+    }
+    if(err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM ||
+            err == EINTR || err == EAGAIN) {
+        /* Whatever is left is taken, or shed, the way readiness would */
+        return acceptor_drain(acceptor) == -1 ? -1 : 0;
+    }
+    errno = err;
+    perror("accept");
+    return -1;
+}
+
+int acceptor_get_stats(const Acceptor *acceptor, AcceptStats *stats) {
+    if(acceptor == NULL || stats == NULL) {
+        return -1;
+    }
+    *stats = acceptor->stats;
+    return 0;
+}
+
+void acceptor_destroy(Acceptor *acceptor) {
+    if(acceptor == NULL) {
+        return;
+    }
+    if(acceptor->reservefd != -1) {
+        close(acceptor->reservefd);
+    }
+    free(acceptor);
+}
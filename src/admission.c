@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "admission.h"
+#include "util.h"
+
+/* Tokens are counted in millionths, a second at a rate of 1 adds one */
+#define TOKEN 1000000ull
+
+struct bucket {
+    uint64_t tokens;
+    uint64_t last_us;
+};
+
+struct client_slot {
+    unsigned char addr[16];
+    struct bucket bucket;
+};
+
+struct admission {
+    AdmissionLimits limits;
+    struct bucket conns;
+    struct client_slot *clients;
+    unsigned int limit;
+    unsigned int inflight;
+    unsigned int peak;
+    uint64_t interval_us;
+    uint64_t min_delay_us;
+    AdmissionStats stats;
+};
+
+Admission *admission_init(const AdmissionLimits *limits) {
+    if(limits == NULL) {
+        return NULL;
+    }
+    Admission *admission = calloc(1, sizeof(Admission));
+    if(admission == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    admission->limits = *limits;
+    if(admission->limits.conn_burst == 0) {
+        admission->limits.conn_burst = limits->conn_rate;
+    }
+    if(admission->limits.client_burst == 0) {
+        admission->limits.client_burst = limits->client_rate;
+    }
+    if(limits->client_rate > 0) {
+        admission->clients = calloc(ADMISSION_CLIENT_SLOTS, sizeof(struct client_slot));
+        if(admission->clients == NULL) {
+            perror("calloc");
+            free(admission);
+            return NULL;
+        }
+    }
+    admission->conns.tokens = (uint64_t)admission->limits.conn_burst * TOKEN;
+    admission->limit = limits->max_inflight;
+    if(admission->limit > 0 && admission->limit < ADMISSION_MIN_LIMIT) {
+        admission->limit = ADMISSION_MIN_LIMIT;
+    }
+    return admission;
+}
+
+/* Adds the tokens of the time since the last refill, up to burst */
+static void refill(struct bucket *b, unsigned int rate, unsigned int burst, uint64_t now_us) {
+    uint64_t cap = (uint64_t)burst * TOKEN;
+    if(now_us > b->last_us) {
+        uint64_t elapsed = now_us - b->last_us;
+        /* Past the time to fill up from empty, the product could overflow */
+        if(elapsed >= cap / rate) {
+            b->tokens = cap;
+        } else if((b->tokens += elapsed * rate) > cap) {
+            b->tokens = cap;
+        }
+    }
+    b->last_us = now_us;
+}
+
+/* The address of the peer of connfd, returns 0 when it has none on IP */
+static int peer_addr(int connfd, unsigned char *addr) {
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    if(getpeername(connfd, (struct sockaddr *)&ss, &len) == -1) {
+        return 0;
+    }
+    if(ss.ss_family == AF_INET) {
+        /* ::ffff:a.b.c.d */
+        memset(addr, 0, 10);
+        addr[10] = addr[11] = 0xff;
+        memcpy(addr + 12, &((struct sockaddr_in *)&ss)->sin_addr, 4);
+        return 1;
+    }
+    if(ss.ss_family == AF_INET6) {
+        memcpy(addr, &((struct sockaddr_in6 *)&ss)->sin6_addr, 16);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * The bucket of addr, refilled. An address missing from both of its
+ * slots takes over the one with the most tokens, and starts full.
+ */
+static struct bucket *client_bucket(Admission *admission, const unsigned char *addr,
+        uint64_t now_us) {
+    unsigned int rate = admission->limits.client_rate;
+    unsigned int burst = admission->limits.client_burst;
+    uint64_t h = util_fnv1a(addr, 16, UTIL_FNV1A_BASIS);
+    struct client_slot *slots[2] = {
+        &admission->clients[h % ADMISSION_CLIENT_SLOTS],
+        &admission->clients[(h >> 32) % ADMISSION_CLIENT_SLOTS]
+    };
+    for(int i = 0; i < 2; ++i) {
+        if(memcmp(slots[i]->addr, addr, 16) == 0) {
+            refill(&slots[i]->bucket, rate, burst, now_us);
+            return &slots[i]->bucket;
+        }
+    }
+    for(int i = 0; i < 2; ++i) {
+        refill(&slots[i]->bucket, rate, burst, now_us);
+    }
+    struct client_slot *slot = slots[0];
+    if(slots[1]->bucket.tokens > slot->bucket.tokens) {
+        slot = slots[1];
+    }
+    memcpy(slot->addr, addr, 16);
+    slot->bucket.tokens = (uint64_t)burst * TOKEN;
+    return &slot->bucket;
+}
+
+int admission_accept(Admission *admission, int connfd, uint64_t now_us) {
+    if(admission == NULL) {
+        return 1;
+    }
+    AdmissionLimits *limits = &admission->limits;
+    if(limits->conn_rate > 0) {
+        refill(&admission->conns, limits->conn_rate, limits->conn_burst, now_us);
+        if(admission->conns.tokens < TOKEN) {
+            admission->stats.reset++;
+            return 0;
+        }
+    }
+    unsigned char addr[16];
+    if(admission->clients != NULL && peer_addr(connfd, addr)) {
+        struct bucket *b = client_bucket(admission, addr, now_us);
+        if(b->tokens < TOKEN) {
+            admission->stats.reset_client++;
+            return 0;
+        }
+        b->tokens -= TOKEN;
+    }
+    if(limits->conn_rate > 0) {
+        admission->conns.tokens -= TOKEN;
+    }
+    admission->stats.accepted++;
+    return 1;
+}
+
+int admission_begin(Admission *admission) {
+    if(admission == NULL) {
+        return 1;
+    }
+    if(admission->limit > 0 && admission->inflight >= admission->limit) {
+        admission->stats.shed++;
+        return 0;
+    }
+    admission->inflight++;
+    if(admission->inflight > admission->peak) {
+        admission->peak = admission->inflight;
+    }
+    admission->stats.admitted++;
+    return 1;
+}
+
+void admission_end(Admission *admission) {
+    if(admission == NULL || admission->inflight == 0) {
+        return;
+    }
+    admission->inflight--;
+}
+
+/* The interval is over, the limit follows its shortest delay */
+static void adapt_limit(Admission *admission) {
+    unsigned int max = admission->limits.max_inflight;
+    unsigned int limit = admission->limit;
+    if(admission->min_delay_us > ADMISSION_TARGET_DELAY_US) {
+        limit -= limit / 10 + 1;
+        if(limit < ADMISSION_MIN_LIMIT) {
+            limit = ADMISSION_MIN_LIMIT;
+        }
+    } else if(admission->peak >= limit) {
+        limit += limit / 8 + 1;
+        if(limit > max) {
+            limit = max;
+        }
+    }
+    admission->limit = limit;
+}
+
+void admission_observe(Admission *admission, uint64_t delay_us, uint64_t now_us) {
+    if(admission == NULL || admission->limit == 0) {
+        return;
+    }
+    if(admission->interval_us != 0 && now_us >= admission->interval_us) {
+        adapt_limit(admission);
+        admission->interval_us = 0;
+    }
+    if(admission->interval_us == 0) {
+        admission->interval_us = now_us + ADMISSION_INTERVAL_US;
+        admission->min_delay_us = delay_us;
+        admission->peak = admission->inflight;
+    } else if(delay_us < admission->min_delay_us) {
+        admission->min_delay_us = delay_us;
+    }
+}
+
+int admission_get_stats(const Admission *admission, AdmissionStats *stats) {
+    if(admission == NULL || stats == NULL) {
+        return -1;
+    }
+    *stats = admission->stats;
+    stats->limit = admission->limit;
+    stats->inflight = admission->inflight;
+    return 0;
+}
+
+void admission_destroy(Admission *admission) {
+    if(admission == NULL) {
+        return;
+    }
+    free(admission->clients);
+    free(admission);
+}
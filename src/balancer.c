@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "balancer.h"
+#include "prio.h"
+#include "util.h"
+
+/* The last pick of a backend takes the low bits of its priority */
+#define SEQ_BITS 40
+
+struct backend {
+    char host[BALANCER_HOST_SZ];
+    char port[BALANCER_PORT_SZ];
+    uint64_t last_pick;
+    unsigned char live;
+    unsigned int fails;
+    unsigned int probes;
+    unsigned int trials;
+    unsigned int window_reqs;
+    unsigned int window_fails;
+    uint64_t window_ms;
+    uint64_t opened_ms;
+    BackendStats stats;
+};
+
+struct ring_point {
+    uint64_t hash;
+    unsigned int backend;
+};
+
+struct balancer {
+    BalancePolicy policy;
+    unsigned int nbackends;
+    struct backend backends[BALANCER_MAX_BACKENDS];
+    unsigned int live[BALANCER_MAX_BACKENDS];
+    unsigned int nlive;
+    PrioIndex *load;
+    struct ring_point *ring;
+    uint64_t seq;
+    uint64_t rand;
+};
+
+int balancer_parse_policy(const char *name, BalancePolicy *policy) {
+    if(name == NULL || policy == NULL) {
+        return -1;
+    }
+    if(strcmp(name, "least") == 0) {
+        *policy = BALANCE_LEAST_OUTSTANDING;
+    } else if(strcmp(name, "p2c") == 0) {
+        *policy = BALANCE_TWO_CHOICES;
+    } else if(strcmp(name, "hash") == 0) {
+        *policy = BALANCE_HASH;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Splits "host:port" or "[v6]:port", the port is required */
+static int parse_backend(const char *s, struct backend *be) {
+    const char *host = s, *host_end, *colon;
+    if(s[0] == '[') {
+        host = s + 1;
+        host_end = strchr(host, ']');
+        if(host_end == NULL || host_end[1] != ':') {
+            return -1;
+        }
+        colon = host_end + 1;
+    } else {
+        colon = strchr(s, ':');
+        if(colon == NULL || strchr(colon + 1, ':') != NULL) {
+            return -1;
+        }
+        host_end = colon;
+    }
+    size_t host_len = host_end - host;
+    const char *port = colon + 1;
+    size_t port_len = strlen(port);
+    if(host_len == 0 || host_len >= BALANCER_HOST_SZ ||
+            port_len == 0 || port_len >= BALANCER_PORT_SZ ||
+            strspn(port, "0123456789") != port_len) {
+        return -1;
+    }
+    memcpy(be->host, host, host_len);
+    be->host[host_len] = '\0';
+    memcpy(be->port, port, port_len + 1);
+    return 0;
+}
+
+/* FNV-1a, 64 bits, with the finalizer of splitmix64 so that close keys land far apart */
+static uint64_t hash_bytes(const char *s, size_t len) {
+    uint64_t h = util_fnv1a(s, len, UTIL_FNV1A_BASIS);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+static int cmp_points(const void *a, const void *b) {
+    const struct ring_point *p = a, *q = b;
+    return (p->hash > q->hash) - (p->hash < q->hash);
+}
+
+static int build_ring(Balancer *balancer) {
+    size_t npoints = (size_t)balancer->nbackends * BALANCER_VNODES;
+    balancer->ring = malloc(npoints * sizeof(struct ring_point));
+    if(balancer->ring == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for(unsigned int i = 0; i < balancer->nbackends; ++i) {
+        const struct backend *be = &balancer->backends[i];
+        for(unsigned int v = 0; v < BALANCER_VNODES; ++v) {
+            char name[BALANCER_HOST_SZ + BALANCER_PORT_SZ + 16];
+            int len = snprintf(name, sizeof(name), "%s:%s#%u", be->host, be->port, v);
+            struct ring_point *p = &balancer->ring[i * BALANCER_VNODES + v];
+            p->hash = hash_bytes(name, len);
+            p->backend = i;
+        }
+    }
+    qsort(balancer->ring, npoints, sizeof(struct ring_point), cmp_points);
+    return 0;
+}
+
+Balancer *balancer_init(BalancePolicy policy, char *const *backends,
+        unsigned int nbackends) {
+    if(backends == NULL || nbackends == 0 || nbackends > BALANCER_MAX_BACKENDS) {
+        return NULL;
+    }
+    Balancer *balancer = calloc(1, sizeof(Balancer));
+    if(balancer == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    balancer->policy = policy;
+    balancer->nbackends = nbackends;
+    balancer->nlive = nbackends;
+    for(unsigned int i = 0; i < nbackends; ++i) {
+        balancer->live[i] = i;
+        balancer->backends[i].live = 1;
+        balancer->backends[i].stats.healthy = 1;
+        if(backends[i] == NULL || parse_backend(backends[i], &balancer->backends[i]) == -1) {
+            fprintf(stderr, "Could not parse the backend %s\n",
+                    backends[i] != NULL ? backends[i] : "(null)");
+            free(balancer);
+            return NULL;
+        }
+    }
+
+    int status = 0;
+    if(policy == BALANCE_LEAST_OUTSTANDING) {
+        if((balancer->load = prio_index_init(nbackends)) == NULL) {
+            status = -1;
+        }
+        for(unsigned int i = 0; status == 0 && i < nbackends; ++i) {
+            status = prio_index_set(balancer->load, i, i);
+        }
+    } else if(policy == BALANCE_HASH) {
+        status = build_ring(balancer);
+    }
+    if(status == -1) {
+        balancer_destroy(balancer);
+        return NULL;
+    }
+    /* Workers draw different pairs */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    balancer->rand = ((uint64_t)ts.tv_nsec << 1) | 1;
+    return balancer;
+}
+
+/* Ties of outstanding requests go to the backend picked the longest ago */
+static int64_t load_of(const struct backend *be) {
+    return ((int64_t)be->stats.outstanding << SEQ_BITS) |
+        (int64_t)(be->last_pick & (((uint64_t)1 << SEQ_BITS) - 1));
+}
+
+static uint64_t next_rand(Balancer *balancer) {
+    uint64_t x = balancer->rand;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return balancer->rand = x;
+}
+
+/* Whether a backend may take a request, a half open one takes a single trial at once */
+static int in_rotation(const struct backend *be) {
+    if(!be->stats.healthy) {
+        return 0;
+    }
+    return be->stats.breaker == BREAKER_CLOSED ||
+        (be->stats.breaker == BREAKER_HALF_OPEN && be->stats.outstanding == 0);
+}
+
+/* Follows a change of the load or of the state of a backend */
+static void update_backend(Balancer *balancer, unsigned int i) {
+    struct backend *be = &balancer->backends[i];
+    unsigned char live = in_rotation(be);
+    if(live != be->live) {
+        be->live = live;
+        balancer->nlive = 0;
+        for(unsigned int j = 0; j < balancer->nbackends; ++j) {
+            if(balancer->backends[j].live) {
+                balancer->live[balancer->nlive++] = j;
+            }
+        }
+    }
+    if(balancer->load == NULL) {
+        return;
+    }
+    if(live) {
+        prio_index_set(balancer->load, i, load_of(be));
+    } else {
+        prio_index_remove(balancer->load, i);
+    }
+}
+
+static unsigned int pick_two_choices(Balancer *balancer) {
+    unsigned int n = balancer->nlive;
+    if(n == 1) {
+        return balancer->live[0];
+    }
+    uint64_t r = next_rand(balancer);
+    unsigned int i = balancer->live[r % n];
+    /* A second backend, never the first one */
+    unsigned int j = balancer->live[(r % n + 1 + (r >> 32) % (n - 1)) % n];
+    return load_of(&balancer->backends[j]) < load_of(&balancer->backends[i]) ? j : i;
+}
+
+static unsigned int pick_hash(const Balancer *balancer, const char *key, size_t key_len) {
+    uint64_t h = hash_bytes(key, key_len);
+    size_t lo = 0, hi = (size_t)balancer->nbackends * BALANCER_VNODES;
+    /* The first point at or after h, the ring wraps around */
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(balancer->ring[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    /* The points of the backends out of rotation are passed over */
+    size_t npoints = (size_t)balancer->nbackends * BALANCER_VNODES;
+    for(;; ++lo) {
+        if(lo == npoints) {
+            lo = 0;
+        }
+        if(balancer->backends[balancer->ring[lo].backend].live) {
+            return balancer->ring[lo].backend;
+        }
+    }
+}
+
+int balancer_pick(Balancer *balancer, const char *key, size_t key_len) {
+    if(balancer == NULL || balancer->nlive == 0) {
+        return -1;
+    }
+    unsigned int i = 0;
+    switch(balancer->policy) {
+        case BALANCE_LEAST_OUTSTANDING:
+            if(prio_index_peek_min(balancer->load, &i, NULL) == -1) {
+                return -1;
+            }
+            break;
+        case BALANCE_TWO_CHOICES:
+            i = pick_two_choices(balancer);
+            break;
+        case BALANCE_HASH:
+            i = pick_hash(balancer, key != NULL ? key : "", key != NULL ? key_len : 0);
+            break;
+    }
+    struct backend *be = &balancer->backends[i];
+    be->stats.picks++;
+    be->stats.outstanding++;
+    be->last_pick = ++balancer->seq;
+    update_backend(balancer, i);
+    return i;
+}
+
+void balancer_release(Balancer *balancer, int backend) {
+    if(balancer == NULL || backend < 0 || (unsigned int)backend >= balancer->nbackends) {
+        return;
+    }
+    struct backend *be = &balancer->backends[backend];
+    if(be->stats.outstanding == 0) {
+        return;
+    }
+    be->stats.outstanding--;
+    update_backend(balancer, backend);
+}
+
+static void trip(struct backend *be, uint64_t now_ms) {
+    be->stats.breaker = BREAKER_OPEN;
+    be->stats.trips++;
+    be->opened_ms = now_ms;
+}
+
+static void close_breaker(struct backend *be, uint64_t now_ms) {
+    be->stats.breaker = BREAKER_CLOSED;
+    be->fails = 0;
+    be->window_reqs = be->window_fails = 0;
+    be->window_ms = now_ms;
+}
+
+void balancer_report(Balancer *balancer, int backend, int ok, uint64_t now_ms) {
+    if(balancer == NULL || backend < 0 || (unsigned int)backend >= balancer->nbackends) {
+        return;
+    }
+    struct backend *be = &balancer->backends[backend];
+    if(!ok) {
+        be->stats.failures++;
+    }
+    switch(be->stats.breaker) {
+        case BREAKER_CLOSED:
+            if(now_ms - be->window_ms >= BALANCER_WINDOW_MS) {
+                be->window_reqs = be->window_fails = 0;
+                be->window_ms = now_ms;
+            }
+            be->window_reqs++;
+            if(ok) {
+                be->fails = 0;
+                break;
+            }
+            be->fails++;
+            be->window_fails++;
+            if(be->fails >= BALANCER_TRIP_FAILURES ||
+                    (be->window_reqs >= BALANCER_MIN_REQUESTS &&
+                     be->window_fails * 100 >= be->window_reqs * BALANCER_TRIP_PERCENT)) {
+                trip(be, now_ms);
+            }
+            break;
+        case BREAKER_HALF_OPEN:
+            if(!ok) {
+                trip(be, now_ms);
+            } else if(++be->trials >= BALANCER_TRIALS) {
+                close_breaker(be, now_ms);
+            }
+            break;
+        case BREAKER_OPEN:
+            break;
+    }
+    update_backend(balancer, backend);
+}
+
+void balancer_probe(Balancer *balancer, int backend, int ok) {
+    if(balancer == NULL || backend < 0 || (unsigned int)backend >= balancer->nbackends) {
+        return;
+    }
+    struct backend *be = &balancer->backends[backend];
+    /* Only the probes in a row that disagree with its health count */
+    if(!ok == !be->stats.healthy) {
+        be->probes = 0;
+        return;
+    }
+    unsigned int needed = BALANCER_PROBE_RISES;
+    if(be->stats.healthy) {
+        needed = BALANCER_PROBE_FALLS;
+    }
+    if(++be->probes >= needed) {
+        be->stats.healthy = !be->stats.healthy;
+        be->probes = 0;
+        update_backend(balancer, backend);
+    }
+}
+
+void balancer_tick(Balancer *balancer, uint64_t now_ms) {
+    if(balancer == NULL) {
+        return;
+    }
+    for(unsigned int i = 0; i < balancer->nbackends; ++i) {
+        struct backend *be = &balancer->backends[i];
+        if(be->stats.breaker == BREAKER_OPEN && now_ms - be->opened_ms >= BALANCER_OPEN_MS) {
+            be->stats.breaker = BREAKER_HALF_OPEN;
+            be->trials = 0;
+            update_backend(balancer, i);
+        }
+    }
+}
+
+const char *balancer_host(const Balancer *balancer, int backend) {
+    if(balancer == NULL || backend < 0 || (unsigned int)backend >= balancer->nbackends) {
+        return NULL;
+    }
+    return balancer->backends[backend].host;
+}
+
+const char *balancer_port(const Balancer *balancer, int backend) {
+    if(balancer == NULL || backend < 0 || (unsigned int)backend >= balancer->nbackends) {
+        return NULL;
+    }
+    return balancer->backends[backend].port;
+}
+
+unsigned int balancer_count(const Balancer *balancer) {
+    if(balancer == NULL) {
+        return 0;
+    }
+    return balancer->nbackends;
+}
+
+int balancer_get_stats(const Balancer *balancer, int backend, BackendStats *stats) {
+    if(balancer == NULL || stats == NULL || backend < 0 ||
+            (unsigned int)backend >= balancer->nbackends) {
+        return -1;
+    }
+    *stats = balancer->backends[backend].stats;
+    return 0;
+}
+
+void balancer_destroy(Balancer *balancer) {
+    if(balancer == NULL) {
+        return;
+    }
+    prio_index_destroy(balancer->load);
+    free(balancer->ring);
+    free(balancer);
+}
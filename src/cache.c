@@ -0,0 +1,775 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "macro.h"
+#include "util.h"
+
+#define HTTP_CACHE_SHARDS      16
+#define CACHE_SHARD_SLOTS      64 /* Initial size of the index of a shard */
+#define CACHE_PROTECTED_PCT    80 /* Share of a shard the protected segment may take */
+
+enum cache_segment {
+    SEG_PROBATION,
+    SEG_PROTECTED,
+    SEG_NONE        /* Being filled, or dropped from the cache */
+};
+
+struct cache_object {
+    uint64_t hash;
+    char *key;
+    char *vary;
+    char *vary_values;
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t head_len;
+    size_t max_len;
+    uint64_t stored_ms;
+    uint64_t expires_ms;
+    int refs;
+    int segment;
+    struct cache_object *prev;
+    struct cache_object *next;
+};
+
+struct cache_slot {
+    uint64_t hash;
+    CacheObject *obj; /* NULL if the slot is empty */
+};
+
+struct cache_lru {
+    CacheObject *head; /* Most recently used */
+    CacheObject *tail;
+    size_t bytes;
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_slot *slots;
+    size_t mask;
+    size_t nobjects;
+    size_t max_bytes;
+    struct cache_lru segs[2];
+    HttpCacheStats stats;
+};
+
+struct http_cache {
+    size_t max_object;
+    DiskCache *disk;
+    struct cache_shard shards[HTTP_CACHE_SHARDS];
+};
+
+/* Bytes an object is charged for */
+static size_t object_size(const CacheObject *obj) {
+    return sizeof(CacheObject) + strlen(obj->key) + strlen(obj->vary) +
+        strlen(obj->vary_values) + 3 + obj->len;
+}
+
+static void free_object(CacheObject *obj) {
+    free(obj->key);
+    free(obj->data);
+    free(obj);
+}
+
+HttpCache *http_cache_init(size_t max_bytes) {
+    HttpCache *cache = calloc(1, sizeof(HttpCache));
+    if(cache == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    size_t shard_bytes = max_bytes / HTTP_CACHE_SHARDS;
+    cache->max_object = shard_bytes < HTTP_CACHE_MAX_OBJECT ? shard_bytes : HTTP_CACHE_MAX_OBJECT;
+    for(int i = 0; i < HTTP_CACHE_SHARDS; ++i) {
+        struct cache_shard *shard = &cache->shards[i];
+        shard->slots = calloc(CACHE_SHARD_SLOTS, sizeof(struct cache_slot));
+        if(shard->slots == NULL) {
+            perror("calloc");
+            http_cache_destroy(cache);
+            return NULL;
+        }
+        shard->mask = CACHE_SHARD_SLOTS - 1;
+        shard->max_bytes = shard_bytes;
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    return cache;
+}
+
+/* The low bits pick the slot, the high ones the shard */
+static struct cache_shard *get_shard(HttpCache *cache, uint64_t hash) {
+    return &cache->shards[(hash >> 60) % HTTP_CACHE_SHARDS];
+}
+
+/*
+ * Header helpers. Requests are given as the head that was sent to
+ * the origin (the parser of the client's head is gone by the time
+ * the response comes back), so their headers are found by scanning
+ * the raw lines.
+ */
+
+static const char *trim(const char *s, const char *end, const char **out_end) {
+    while(s < end && (*s == ' ' || *s == '\t')) {
+        ++s;
+    }
+    while(end > s && (end[-1] == ' ' || end[-1] == '\t')) {
+        --end;
+    }
+    *out_end = end;
+    return s;
+}
+
+/* Finds the value of the first header called name, returns its length or -1 */
+static int raw_header(const char *head, size_t len, const char *name, const char **value) {
+    const char *end = head + len;
+    const char *line = memchr(head, '\n', len);
+    size_t name_len = strlen(name);
+
+    while(line != NULL && ++line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if(eol == NULL) {
+            break;
+        }
+        const char *colon = memchr(line, ':', eol - line);
+        if(colon != NULL && (size_t)(colon - line) == name_len &&
+                strncasecmp(line, name, name_len) == 0) {
+            const char *value_end;
+            *value = trim(colon + 1, eol[-1] == '\r' ? eol - 1 : eol, &value_end);
+            return value_end - *value;
+        }
+        line = eol;
+    }
+    return -1;
+}
+
+/* Looks for a Cache-Control directive, its argument (if any) goes into arg */
+static int has_directive(const char *value, int len, const char *directive, long *arg) {
+    const char *end = value + len;
+    size_t dlen = strlen(directive);
+
+    while(value < end) {
+        const char *comma = memchr(value, ',', end - value);
+        const char *tok_end, *tok = trim(value, comma != NULL ? comma : end, &tok_end);
+        if((size_t)(tok_end - tok) >= dlen && strncasecmp(tok, directive, dlen) == 0 &&
+                (tok + dlen == tok_end || tok[dlen] == '=')) {
+            if(arg != NULL) {
+                const char *a = tok + dlen + 1;
+                if(a < tok_end && *a == '"') {
+                    ++a;
+                }
+                if(tok + dlen == tok_end || a >= tok_end || !isdigit((unsigned char)*a)) {
+                    return 0;
+                }
+                *arg = strtol(a, NULL, 10);
+            }
+            return 1;
+        }
+        if(comma == NULL) {
+            break;
+        }
+        value = comma + 1;
+    }
+    return 0;
+}
+
+/* Parses an IMF-fixdate, returns -1 if it is not one */
+static time_t parse_date(const char *value, int len) {
+    char buf[64];
+    struct tm tm;
+    if(len <= 0 || len >= (int)sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if(end == NULL || *end != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+/* Finds the target of "GET /target HTTP/1.1", fails for other methods */
+static int request_line(const char *req, size_t len, const char **target, size_t *target_len) {
+    const char *eol = memchr(req, '\r', len);
+    if(eol == NULL || (size_t)(eol - req) < 4 || strncmp(req, "GET ", 4) != 0) {
+        return -1;
+    }
+    const char *sp = memchr(req + 4, ' ', eol - (req + 4));
+    if(sp == NULL) {
+        return -1;
+    }
+    *target = req + 4;
+    *target_len = sp - *target;
+    return 0;
+}
+
+static int make_key(char *key, const char *origin, const char *req, size_t req_len) {
+    const char *target;
+    size_t target_len;
+    if(request_line(req, req_len, &target, &target_len) == -1) {
+        return -1;
+    }
+    int len = snprintf(key, HTTP_CACHE_KEY_MAX, "%s%.*s", origin, (int)target_len, target);
+    return (len < 0 || len >= HTTP_CACHE_KEY_MAX) ? -1 : 0;
+}
+
+/*
+ * Writes the values the request has for each header named in vary,
+ * one per line, into out. Returns -1 if they do not fit.
+ */
+static int vary_values(const char *vary, const char *req, size_t req_len, char *out) {
+    const char *end = vary + strlen(vary);
+    size_t len = 0;
+    out[0] = '\0';
+
+    while(vary < end) {
+        const char *comma = memchr(vary, ',', end - vary);
+        const char *name_end, *name = trim(vary, comma != NULL ? comma : end, &name_end);
+        char hname[64];
+        if(name_end - name > 0) {
+            if(name_end - name >= (int)sizeof(hname)) {
+                return -1;
+            }
+            memcpy(hname, name, name_end - name);
+            hname[name_end - name] = '\0';
+            const char *value = "";
+            int vlen = raw_header(req, req_len, hname, &value);
+            if(vlen < 0) {
+                vlen = 0;
+            }
+            int n = snprintf(out + len, HTTP_CACHE_VARY_MAX - len, "%.*s\n", vlen, value);
+            if(n < 0 || (size_t)n >= HTTP_CACHE_VARY_MAX - len) {
+                return -1;
+            }
+            len += n;
+        }
+        if(comma == NULL) {
+            break;
+        }
+        vary = comma + 1;
+    }
+    return 0;
+}
+
+/*
+ * Open addressing with linear probing. Entries are taken out with
+ * a backward shift rather than tombstones, so probes stay short no
+ * matter how many objects come and go.
+ */
+
+static size_t find_slot(const struct cache_shard *shard, const CacheObject *obj) {
+    size_t i = obj->hash & shard->mask;
+    while(shard->slots[i].obj != obj) {
+        i = (i + 1) & shard->mask;
+    }
+    return i;
+}
+
+static void remove_slot(struct cache_shard *shard, size_t i) {
+    size_t j = i;
+    for(;;) {
+        j = (j + 1) & shard->mask;
+        if(shard->slots[j].obj == NULL) {
+            break;
+        }
+        size_t k = shard->slots[j].hash & shard->mask;
+        /* Leave the entry where it is if its home is in (i, j] */
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        shard->slots[i] = shard->slots[j];
+        i = j;
+    }
+    shard->slots[i].obj = NULL;
+}
+
+static void put_slot(struct cache_slot *slots, size_t mask, uint64_t hash, CacheObject *obj) {
+    size_t i = hash & mask;
+    while(slots[i].obj != NULL) {
+        i = (i + 1) & mask;
+    }
+    slots[i].hash = hash;
+    slots[i].obj = obj;
+}
+
+/* Keeps the load of the index under 3/4 */
+static int reserve_slot(struct cache_shard *shard) {
+    size_t nslots = shard->mask + 1;
+    if((shard->nobjects + 1) * 4 <= nslots * 3) {
+        return 0;
+    }
+    struct cache_slot *slots = calloc(nslots * 2, sizeof(struct cache_slot));
+    if(slots == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for(size_t i = 0; i < nslots; ++i) {
+        if(shard->slots[i].obj != NULL) {
+            put_slot(slots, nslots * 2 - 1, shard->slots[i].hash, shard->slots[i].obj);
+        }
+    }
+    free(shard->slots);
+    shard->slots = slots;
+    shard->mask = nslots * 2 - 1;
+    return 0;
+}
+
+/* Segmented LRU */
+
+static void lru_unlink(struct cache_shard *shard, CacheObject *obj) {
+    struct cache_lru *seg = &shard->segs[obj->segment];
+    if(obj->prev != NULL) {
+        obj->prev->next = obj->next;
+    } else {
+        seg->head = obj->next;
+    }
+    if(obj->next != NULL) {
+        obj->next->prev = obj->prev;
+    } else {
+        seg->tail = obj->prev;
+    }
+    seg->bytes -= object_size(obj);
+}
+
+static void lru_push(struct cache_shard *shard, CacheObject *obj, int segment) {
+    struct cache_lru *seg = &shard->segs[segment];
+    obj->segment = segment;
+    obj->prev = NULL;
+    obj->next = seg->head;
+    if(seg->head != NULL) {
+        seg->head->prev = obj;
+    } else {
+        seg->tail = obj;
+    }
+    seg->head = obj;
+    seg->bytes += object_size(obj);
+}
+
+/* A hit moves the object to the head of the protected segment */
+static void lru_touch(struct cache_shard *shard, CacheObject *obj) {
+    lru_unlink(shard, obj);
+    lru_push(shard, obj, SEG_PROTECTED);
+
+    struct cache_lru *prot = &shard->segs[SEG_PROTECTED];
+    while(prot->bytes > shard->max_bytes / 100 * CACHE_PROTECTED_PCT && prot->tail != obj) {
+        CacheObject *demoted = prot->tail;
+        lru_unlink(shard, demoted);
+        lru_push(shard, demoted, SEG_PROBATION);
+    }
+}
+
+/* Takes obj out of the shard and gives back the reference of the cache */
+static void drop_object(struct cache_shard *shard, CacheObject *obj) {
+    remove_slot(shard, find_slot(shard, obj));
+    lru_unlink(shard, obj);
+    obj->segment = SEG_NONE;
+    shard->nobjects--;
+    shard->stats.bytes -= object_size(obj);
+    shard->stats.objects--;
+    http_cache_release(obj);
+}
+
+static CacheObject *find_object(struct cache_shard *shard, uint64_t hash, const char *key,
+        const char *req, size_t req_len) {
+    char values[HTTP_CACHE_VARY_MAX];
+    size_t i = hash & shard->mask;
+    for(; shard->slots[i].obj != NULL; i = (i + 1) & shard->mask) {
+        CacheObject *obj = shard->slots[i].obj;
+        if(shard->slots[i].hash != hash || strcmp(obj->key, key) != 0) {
+            continue;
+        }
+        if(obj->vary[0] == '\0' || (vary_values(obj->vary, req, req_len, values) == 0 &&
+                    strcmp(values, obj->vary_values) == 0)) {
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+/* The request asks for a response from the origin */
+static int wants_fresh(const char *req, size_t req_len) {
+    const char *value;
+    int len = raw_header(req, req_len, "Cache-Control", &value);
+    if(len >= 0 && (has_directive(value, len, "no-cache", NULL) ||
+                has_directive(value, len, "no-store", NULL))) {
+        return 1;
+    }
+    len = raw_header(req, req_len, "Pragma", &value);
+    return len >= 0 && has_directive(value, len, "no-cache", NULL);
+}
+
+int http_cache_lookup(HttpCache *cache, const char *origin, const char *req,
+        size_t req_len, CacheObject **obj) {
+    char key[HTTP_CACHE_KEY_MAX];
+    if(cache == NULL || origin == NULL || req == NULL || obj == NULL ||
+            make_key(key, origin, req, req_len) == -1) {
+        return 0;
+    }
+    uint64_t hash = util_fnv1a_str(key);
+    struct cache_shard *shard = get_shard(cache, hash);
+
+    int bypass = wants_fresh(req, req_len);
+
+    pthread_mutex_lock(&shard->lock);
+    shard->stats.lookups++;
+    CacheObject *found = bypass ? NULL : find_object(shard, hash, key, req, req_len);
+    if(found != NULL && util_now_ms() >= found->expires_ms) {
+        shard->stats.expired++;
+        drop_object(shard, found);
+        found = NULL;
+    }
+    if(found == NULL) {
+        shard->stats.misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+    lru_touch(shard, found);
+    __atomic_add_fetch(&found->refs, 1, __ATOMIC_RELAXED);
+    shard->stats.hits++;
+    shard->stats.bytes_saved += found->len;
+    pthread_mutex_unlock(&shard->lock);
+
+    *obj = found;
+    return 1;
+}
+
+uint64_t http_cache_key_hash(const char *origin, const char *req, size_t req_len) {
+    char key[HTTP_CACHE_KEY_MAX];
+    if(origin == NULL || req == NULL || make_key(key, origin, req, req_len) == -1 ||
+            wants_fresh(req, req_len)) {
+        return 0;
+    }
+    return util_fnv1a_str(key);
+}
+
+int http_cache_object_matches(const CacheObject *obj, const char *req, size_t req_len) {
+    char values[HTTP_CACHE_VARY_MAX];
+    if(obj == NULL || req == NULL) {
+        return 0;
+    }
+    return obj->vary[0] == '\0' || (vary_values(obj->vary, req, req_len, values) == 0 &&
+            strcmp(values, obj->vary_values) == 0);
+}
+
+int http_cache_lookup_disk(HttpCache *cache, const char *origin, const char *req,
+        size_t req_len, DiskHit *hit, char *head, size_t head_sz) {
+    char key[HTTP_CACHE_KEY_MAX];
+    if(cache == NULL || cache->disk == NULL || origin == NULL || req == NULL ||
+            make_key(key, origin, req, req_len) == -1 || wants_fresh(req, req_len)) {
+        return 0;
+    }
+    return disk_cache_lookup(cache->disk, key, hit, head, head_sz);
+}
+
+/* The Age header goes in place of the CRLF that ends the head */
+static int set_head_iov(struct iovec *iov, char *head, size_t head_len, char *age,
+        unsigned long long secs) {
+    int len = snprintf(age, HTTP_CACHE_AGE_SZ, "Age: %llu\r\n\r\n", secs);
+    iov[0].iov_base = head;
+    iov[0].iov_len = head_len - 2;
+    iov[1].iov_base = age;
+    iov[1].iov_len = len;
+    return 2;
+}
+
+int http_cache_object_iov(const CacheObject *obj, struct iovec *iov, char *age) {
+    set_head_iov(iov, obj->data, obj->head_len, age, (util_now_ms() - obj->stored_ms) / 1000);
+    iov[2].iov_base = obj->data + obj->head_len;
+    iov[2].iov_len = obj->len - obj->head_len;
+    return HTTP_CACHE_IOV;
+}
+
+int http_cache_disk_iov(const DiskHit *hit, char *head, struct iovec *iov, char *age) {
+    time_t now = time(NULL);
+    return set_head_iov(iov, head, hit->head_len, age, now > hit->stored ? now - hit->stored : 0);
+}
+
+static int cacheable_status(int status) {
+    switch(status) {
+        case 200: case 203: case 204: case 300: case 301:
+        case 308: case 404: case 405: case 410: case 414:
+            return 1;
+    }
+    return 0;
+}
+
+/* The freshness lifetime of the response in seconds, or -1 if it may not be stored */
+static long freshness(const char *req, size_t req_len, const char *resp, const HttpParser *hp) {
+    if(!cacheable_status(hp->status) || hp->body == HTTP_BODY_UNTIL_CLOSE ||
+            http_find_header(hp, resp, "Set-Cookie") != NULL) {
+        return -1;
+    }
+    const char *value;
+    int len = raw_header(req, req_len, "Cache-Control", &value);
+    if(len >= 0 && has_directive(value, len, "no-store", NULL)) {
+        return -1;
+    }
+    int authorized = raw_header(req, req_len, "Authorization", &value) >= 0;
+
+    const HttpHeader *cc = http_find_header(hp, resp, "Cache-Control");
+    long ttl = -1;
+    if(cc != NULL) {
+        value = resp + cc->value.off;
+        len = cc->value.len;
+        if(has_directive(value, len, "no-store", NULL) ||
+                has_directive(value, len, "no-cache", NULL) ||
+                has_directive(value, len, "private", NULL)) {
+            return -1;
+        }
+        /* Shared caches only store authorized responses when told so */
+        if(authorized && !has_directive(value, len, "public", NULL) &&
+                !has_directive(value, len, "s-maxage", NULL)) {
+            return -1;
+        }
+        if(!has_directive(value, len, "s-maxage", &ttl)) {
+            has_directive(value, len, "max-age", &ttl);
+        }
+    } else if(authorized) {
+        return -1;
+    }
+
+    const HttpHeader *expires = http_find_header(hp, resp, "Expires");
+    if(ttl == -1 && expires != NULL) {
+        time_t exp = parse_date(resp + expires->value.off, expires->value.len);
+        const HttpHeader *date = http_find_header(hp, resp, "Date");
+        time_t now = date != NULL ? parse_date(resp + date->value.off, date->value.len) : -1;
+        if(now == -1) {
+            now = time(NULL);
+        }
+        /* An invalid date means the response is already stale */
+        ttl = exp == -1 ? 0 : exp - now;
+    }
+    return ttl > 0 ? ttl : -1;
+}
+
+CacheObject *http_cache_fill_start(HttpCache *cache, const char *origin,
+        const char *req, size_t req_len, const char *resp, const HttpParser *resp_parser) {
+    char key[HTTP_CACHE_KEY_MAX];
+    char vary[HTTP_CACHE_VARY_MAX];
+    char values[HTTP_CACHE_VARY_MAX];
+    if(cache == NULL || origin == NULL || req == NULL || resp_parser == NULL ||
+            make_key(key, origin, req, req_len) == -1) {
+        return NULL;
+    }
+    long ttl = freshness(req, req_len, resp, resp_parser);
+    if(ttl <= 0) {
+        return NULL;
+    }
+    if(resp_parser->body == HTTP_BODY_LENGTH &&
+            (uint64_t)resp_parser->content_length + resp_parser->head_len > cache->max_object) {
+        return NULL;
+    }
+
+    vary[0] = '\0';
+    const HttpHeader *h = http_find_header(resp_parser, resp, "Vary");
+    if(h != NULL) {
+        if(h->value.len >= sizeof(vary) || memchr(resp + h->value.off, '*', h->value.len)) {
+            return NULL;
+        }
+        memcpy(vary, resp + h->value.off, h->value.len);
+        vary[h->value.len] = '\0';
+    }
+    if(vary_values(vary, req, req_len, values) == -1) {
+        return NULL;
+    }
+
+    CacheObject *obj = calloc(1, sizeof(CacheObject));
+    size_t key_len = strlen(key), vary_len = strlen(vary);
+    char *strings = malloc(key_len + vary_len + strlen(values) + 3);
+    if(obj == NULL || strings == NULL) {
+        perror("malloc");
+        free(obj);
+        free(strings);
+        return NULL;
+    }
+    obj->key = strcpy(strings, key);
+    obj->vary = strcpy(strings + key_len + 1, vary);
+    obj->vary_values = strcpy(strings + key_len + vary_len + 2, values);
+    obj->hash = util_fnv1a_str(key);
+    obj->head_len = resp_parser->head_len;
+    obj->max_len = cache->max_object;
+    obj->stored_ms = util_now_ms();
+    obj->expires_ms = obj->stored_ms + (uint64_t)ttl * 1000;
+    obj->refs = 1;
+    obj->segment = SEG_NONE;
+    return obj;
+}
+
+/* Makes room for n more bytes, up to the limit of the object */
+static int reserve_data(CacheObject *obj, size_t n) {
+    if(obj == NULL || obj->len + n > obj->max_len) {
+        return -1;
+    }
+    if(obj->len + n > obj->cap) {
+        size_t cap = obj->cap > 0 ? obj->cap : 4096;
+        while(cap < obj->len + n) {
+            cap *= 2;
+        }
+        if(cap > obj->max_len) {
+            cap = obj->max_len;
+        }
+        char *data = realloc(obj->data, cap);
+        if(data == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        obj->data = data;
+        obj->cap = cap;
+    }
+    return 0;
+}
+
+int http_cache_fill_append(CacheObject *obj, const void *buf, size_t n) {
+    if(reserve_data(obj, n) == -1) {
+        return -1;
+    }
+    memcpy(obj->data + obj->len, buf, n);
+    obj->len += n;
+    return 0;
+}
+
+int http_cache_fill_read(CacheObject *obj, int fd, size_t n) {
+    if(reserve_data(obj, n) == -1) {
+        return -1;
+    }
+    while(n > 0) {
+        ssize_t got = read(fd, obj->data + obj->len, n);
+        if(got == -1 && errno == EINTR) {
+            continue;
+        }
+        if(got <= 0) {
+            return -1;
+        }
+        obj->len += got;
+        n -= got;
+    }
+    return 0;
+}
+
+int http_cache_fill_finish(HttpCache *cache, CacheObject *obj) {
+    if(cache == NULL || obj == NULL || obj->len < obj->head_len) {
+        http_cache_release(obj);
+        return -1;
+    }
+    /* Responses that vary go to memory only, the disk keys on the request alone */
+    if(cache->disk != NULL && obj->vary[0] == '\0') {
+        time_t stored = time(NULL) - (util_now_ms() - obj->stored_ms) / 1000;
+        disk_cache_store(cache->disk, obj->key, obj->data, obj->head_len, obj->len,
+                stored, stored + (obj->expires_ms - obj->stored_ms) / 1000);
+    }
+    struct cache_shard *shard = get_shard(cache, obj->hash);
+    size_t size = object_size(obj);
+    if(size > shard->max_bytes) {
+        http_cache_release(obj);
+        return -1;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    CacheObject *old;
+    size_t i = obj->hash & shard->mask;
+    /* A fresher response to the same request replaces the old one */
+    while((old = shard->slots[i].obj) != NULL) {
+        if(shard->slots[i].hash == obj->hash && strcmp(old->key, obj->key) == 0 &&
+                strcmp(old->vary, obj->vary) == 0 &&
+                strcmp(old->vary_values, obj->vary_values) == 0) {
+            drop_object(shard, old);
+            continue; /* The next entry was shifted into slot i */
+        }
+        i = (i + 1) & shard->mask;
+    }
+
+    while(shard->stats.bytes + size > shard->max_bytes) {
+        CacheObject *victim = shard->segs[SEG_PROBATION].tail;
+        if(victim == NULL) {
+            victim = shard->segs[SEG_PROTECTED].tail;
+        }
+        shard->stats.evictions++;
+        drop_object(shard, victim);
+    }
+    if(reserve_slot(shard) == -1) {
+        pthread_mutex_unlock(&shard->lock);
+        http_cache_release(obj);
+        return -1;
+    }
+    put_slot(shard->slots, shard->mask, obj->hash, obj);
+    lru_push(shard, obj, SEG_PROBATION);
+    shard->nobjects++;
+    shard->stats.stores++;
+    shard->stats.bytes += size;
+    shard->stats.objects++;
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+size_t http_cache_object_data(const CacheObject *obj, const char **data) {
+    *data = obj->data;
+    return obj->len;
+}
+
+CacheObject *http_cache_retain(CacheObject *obj) {
+    __atomic_add_fetch(&obj->refs, 1, __ATOMIC_RELAXED);
+    return obj;
+}
+
+void http_cache_release(CacheObject *obj) {
+    if(obj != NULL && __atomic_sub_fetch(&obj->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_object(obj);
+    }
+}
+
+void http_cache_attach_disk(HttpCache *cache, DiskCache *disk) {
+    if(cache != NULL) {
+        cache->disk = disk;
+    }
+}
+
+int http_cache_get_stats(HttpCache *cache, HttpCacheStats *stats) {
+    if(cache == NULL || stats == NULL) {
+        return -1;
+    }
+    memset(stats, 0, sizeof(HttpCacheStats));
+    for(int i = 0; i < HTTP_CACHE_SHARDS; ++i) {
+        struct cache_shard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->lookups += shard->stats.lookups;
+        stats->hits += shard->stats.hits;
+        stats->misses += shard->stats.misses;
+        stats->stores += shard->stats.stores;
+        stats->evictions += shard->stats.evictions;
+        stats->expired += shard->stats.expired;
+        stats->bytes_saved += shard->stats.bytes_saved;
+        stats->bytes += shard->stats.bytes;
+        stats->objects += shard->stats.objects;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return 0;
+}
+
+void http_cache_destroy(HttpCache *cache) {
+    if(cache == NULL) {
+        return;
+    }
+    for(int i = 0; i < HTTP_CACHE_SHARDS; ++i) {
+        struct cache_shard *shard = &cache->shards[i];
+        if(shard->slots == NULL) {
+            continue;
+        }
+        for(int seg = SEG_PROBATION; seg <= SEG_PROTECTED; ++seg) {
+            while(shard->segs[seg].head != NULL) {
+                drop_object(shard, shard->segs[seg].head);
+            }
+        }
+        free(shard->slots);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
@@ -1,65 +1,187 @@
-#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
 
-#include "conn.h" 
+#include "conn.h"
+#include "conn_backend.h"
 #include "macro.h"
-#include "prio.h"
+#include "trace.h"
 
-static const pthread_mutex_t s_pool_lock = PTHREAD_MUTEX_INITIALIZER; 
+#if defined(CONN_USE_SELECT)
+#define CONN_BACKEND_DEFAULT CONN_BACKEND_SELECT
+#elif defined(CONN_USE_URING)
+#define CONN_BACKEND_DEFAULT CONN_BACKEND_URING
+#else
+#define CONN_BACKEND_DEFAULT CONN_BACKEND_EPOLL
+#endif
+
+#define CONN_INITIAL_SLOTS 64
+
+struct conn_slot {
+    ConnHandler handler;
+    void *data;
+    unsigned int events;
+    unsigned char in_use;
+};
 
 struct connectionPool {
-    unsigned int pool_size; /* Capped at FD_SETSIZE */
-    struct {
-        fd_set rd_set;
-        fd_set wr_set;
-    } rdwr_fd_sets; 
-    PrioQueue *pq;
+    unsigned int pool_size;
+    ConnBackend backend_type;
+    const struct conn_backend_ops *ops;
+    void *backend;
+    struct conn_slot *slots; /* Indexed by fd */
+    unsigned int nslots;
+    struct conn_event events[CONN_MAX_EVENTS];
 };
 
-ConnectionPool *conn_pool_init() {
+static const struct conn_backend_ops *get_backend_ops(ConnBackend backend) {
+    switch(backend) {
+        case CONN_BACKEND_SELECT:
+            return &conn_select_ops;
+        case CONN_BACKEND_EPOLL:
+            return &conn_epoll_ops;
+        case CONN_BACKEND_URING:
+            return &conn_uring_ops;
+    }
+    return NULL;
+}
+
+static struct conn_slot *get_slot(ConnectionPool *conn_pool, int fd) {
+    if(fd < 0 || (unsigned int)fd >= conn_pool->nslots) {
+        return NULL;
+    }
+    if(!conn_pool->slots[fd].in_use) {
+        return NULL;
+    }
+    return &conn_pool->slots[fd];
+}
+
+static int grow_slots(ConnectionPool *conn_pool, int fd) {
+    unsigned int nslots = conn_pool->nslots;
+    while((unsigned int)fd >= nslots) {
+        nslots *= 2;
+    }
+    if(nslots == conn_pool->nslots) {
+        return 0;
+    }
+    struct conn_slot *slots = realloc(conn_pool->slots,
+            nslots * sizeof(*slots));
+    if(slots == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    memset(slots + conn_pool->nslots, 0,
+            (nslots - conn_pool->nslots) * sizeof(*slots));
+    conn_pool->slots = slots;
+    conn_pool->nslots = nslots;
+    return 0;
+}
+
+ConnectionPool *conn_pool_init_backend(ConnBackend backend) {
+    const struct conn_backend_ops *ops = get_backend_ops(backend);
+    if(ops == NULL) {
+        return NULL;
+    }
+
     ConnectionPool *c_pool = malloc(sizeof(ConnectionPool));
     if(c_pool == NULL) {
         perror("malloc");
         return NULL;
     }
-    UNUSED(s_pool_lock);
 
     c_pool->pool_size = 0;
-    FD_ZERO(&c_pool->rdwr_fd_sets.rd_set);
-    FD_ZERO(&c_pool->rdwr_fd_sets.wr_set);
-    c_pool->pq = prio_init();
-    if(c_pool->pq == NULL) {
+    c_pool->backend_type = backend;
+    c_pool->ops = ops;
+    c_pool->nslots = CONN_INITIAL_SLOTS;
+    c_pool->slots = calloc(c_pool->nslots, sizeof(struct conn_slot));
+    if(c_pool->slots == NULL) {
+        perror("calloc");
+        free(c_pool);
+        return NULL;
+    }
+    c_pool->backend = ops->init();
+    if(c_pool->backend == NULL) {
+        free(c_pool->slots);
         free(c_pool);
-        perror("malloc");
         return NULL;
     }
 
     return c_pool;
 }
 
-int conn_insert_fd(ConnectionPool *conn_pool, int fd) {
-    if(conn_pool == NULL) {
+ConnectionPool *conn_pool_init() {
+    return conn_pool_init_backend(CONN_BACKEND_DEFAULT);
+}
+
+int conn_register_fd(ConnectionPool *conn_pool, int fd,
+        unsigned int events, ConnHandler handler, void *data) {
+    if(conn_pool == NULL || fd < 0) {
         return -1;
     }
-
-    if(conn_pool->pool_size >= FD_SETSIZE) {
+    if(conn_pool->ops->max_fd != 0 && (unsigned int)fd >= conn_pool->ops->max_fd) {
+        return -1;
+    }
+    if(conn_pool->ops->max_fd != 0 && conn_pool->pool_size >= conn_pool->ops->max_fd) {
         return -1;
     }
-    if(fd >= FD_SETSIZE || FD_ISSET(fd, &conn_pool->rdwr_fd_sets.rd_set)) {
+    if(get_slot(conn_pool, fd) != NULL) {
+        return -1;
+    }
+    if(grow_slots(conn_pool, fd) == -1) {
         return -1;
     }
 
-    if(prio_insert(conn_pool->pq, fd) == -1) {
+    events &= (CONN_EV_READ | CONN_EV_WRITE);
+    if(conn_pool->ops->add(conn_pool->backend, fd, events) == -1) {
         return -1;
     }
-    FD_SET(fd, &conn_pool->rdwr_fd_sets.rd_set); 
-    FD_SET(fd, &conn_pool->rdwr_fd_sets.wr_set); 
+    struct conn_slot *slot = &conn_pool->slots[fd];
+    slot->handler = handler;
+    slot->data = data;
+    slot->events = events;
+    slot->in_use = 1;
     conn_pool->pool_size++;
+    TRACE3(conn_insert, fd, events, conn_pool->pool_size);
 
     return 0;
 }
 
+int conn_modify_fd(ConnectionPool *conn_pool, int fd, unsigned int events) {
+    if(conn_pool == NULL) {
+        return -1;
+    }
+    struct conn_slot *slot = get_slot(conn_pool, fd);
+    if(slot == NULL) {
+        return -1;
+    }
+    events &= (CONN_EV_READ | CONN_EV_WRITE);
+    if(slot->events == events) {
+        return 0;
+    }
+    if(conn_pool->ops->mod(conn_pool->backend, fd, events) == -1) {
+        return -1;
+    }
+    slot->events = events;
+    return 0;
+}
+
+void *conn_get_data(ConnectionPool *conn_pool, int fd) {
+    if(conn_pool == NULL) {
+        return NULL;
+    }
+    struct conn_slot *slot = get_slot(conn_pool, fd);
+    if(slot == NULL) {
+        return NULL;
+    }
+    return slot->data;
+}
+
+int conn_insert_fd(ConnectionPool *conn_pool, int fd) {
+    return conn_register_fd(conn_pool, fd, CONN_EV_READ | CONN_EV_WRITE, NULL, NULL);
+}
+
 int conn_remove_fd(ConnectionPool *conn_pool, int fd) {
     if(conn_pool == NULL) {
         return -1;
@@ -67,46 +189,171 @@ int conn_remove_fd(ConnectionPool *conn_pool, int fd) {
     if(conn_pool->pool_size == 0) {
         return -1;
     }
-    int val;
-    if(prio_peek_max(conn_pool->pq, &val) == -1) {
-        return -1;
+    struct conn_slot *slot = get_slot(conn_pool, fd);
+    if(slot == NULL) {
+        return 0;
     }
-    if(fd == val) {
-        if(prio_remove_max(conn_pool->pq, &val) == -1) {
-            return -1;
-        }
+    if(conn_pool->ops->del(conn_pool->backend, fd) == -1) {
+        return -1;
     }
-    FD_CLR(fd, &conn_pool->rdwr_fd_sets.rd_set); 
-    FD_CLR(fd, &conn_pool->rdwr_fd_sets.wr_set); 
+    memset(slot, 0, sizeof(*slot));
     conn_pool->pool_size--;
+    TRACE2(conn_remove, fd, conn_pool->pool_size);
 
     return 0;
 }
 
+int conn_dispatch(ConnectionPool *conn_pool, int timeout_ms) {
+    if(conn_pool == NULL) {
+        return -1;
+    }
+    int nready = conn_pool->ops->wait(conn_pool->backend, conn_pool->events,
+            CONN_MAX_EVENTS, timeout_ms);
+    if(nready == -1) {
+        return -1;
+    }
+
+    int ndispatched = 0;
+    for(int i = 0; i < nready; ++i) {
+        struct conn_event *ev = &conn_pool->events[i];
+        if(ev->events & CONN_EV_COMPLETE) {
+            if(ev->complete != NULL) {
+                ev->complete(conn_pool, ev->fd, ev->res, ev->buf, ev->data);
+                ndispatched++;
+            }
+            continue;
+        }
+        int fd = ev->fd;
+        /* An earlier handler of this round may have removed fd */
+        struct conn_slot *slot = get_slot(conn_pool, fd);
+        if(slot == NULL || slot->handler == NULL) {
+            continue;
+        }
+        slot->handler(conn_pool, fd, ev->events, slot->data);
+        ndispatched++;
+    }
+
+    return ndispatched;
+}
+
+static int submit_async(ConnectionPool *conn_pool, struct conn_async_req *req) {
+    if(conn_pool == NULL || req->fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(conn_pool->ops->async == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return conn_pool->ops->async(conn_pool->backend, req);
+}
+
+int conn_async_accept(ConnectionPool *conn_pool, int listenfd,
+        ConnCompletion complete, void *data) {
+    struct conn_async_req req = {
+        .kind = CONN_ASYNC_ACCEPT, .fd = listenfd,
+        .complete = complete, .data = data,
+    };
+    return submit_async(conn_pool, &req);
+}
+
+int conn_async_recv(ConnectionPool *conn_pool, int fd,
+        ConnCompletion complete, void *data) {
+    struct conn_async_req req = {
+        .kind = CONN_ASYNC_RECV, .fd = fd,
+        .complete = complete, .data = data,
+    };
+    return submit_async(conn_pool, &req);
+}
+
+int conn_async_send(ConnectionPool *conn_pool, int fd,
+        const void *buf, size_t len, unsigned int flags,
+        ConnCompletion complete, void *data) {
+    if(buf == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct conn_async_req req = {
+        .kind = CONN_ASYNC_SEND, .fd = fd, .flags = flags,
+        .buf = buf, .len = len,
+        .complete = complete, .data = data,
+    };
+    return submit_async(conn_pool, &req);
+}
+
+int conn_async_connect(ConnectionPool *conn_pool, int fd,
+        const struct sockaddr *addr, socklen_t addrlen, unsigned int flags,
+        ConnCompletion complete, void *data) {
+    if(addr == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct conn_async_req req = {
+        .kind = CONN_ASYNC_CONNECT, .fd = fd, .flags = flags,
+        .addr = addr, .addrlen = addrlen,
+        .complete = complete, .data = data,
+    };
+    return submit_async(conn_pool, &req);
+}
+
+int conn_async_cancel(ConnectionPool *conn_pool, int fd) {
+    struct conn_async_req req = {
+        .kind = CONN_ASYNC_CANCEL, .fd = fd,
+    };
+    return submit_async(conn_pool, &req);
+}
+
 void conn_destroy(ConnectionPool *conn_pool) {
-    UNUSED(conn_pool);
-    abort();
+    if(conn_pool == NULL) {
+        return;
+    }
+    for(unsigned int fd = 0; fd < conn_pool->nslots; ++fd) {
+        if(!conn_pool->slots[fd].in_use) {
+            continue;
+        }
+        conn_pool->ops->del(conn_pool->backend, fd);
+        shutdown(fd, SHUT_RDWR);
+        close(fd);
+    }
+    conn_pool->ops->destroy(conn_pool->backend);
+    free(conn_pool->slots);
+    free(conn_pool);
 }
 
-int conn_copy_fd_sets(ConnectionPool *conn_pool, 
+int conn_copy_fd_sets(ConnectionPool *conn_pool,
         fd_set *rd_set_cpy, fd_set *wr_set_cpy, int *nfds) {
-    if(conn_pool == NULL || rd_set_cpy == NULL || 
+    if(conn_pool == NULL || rd_set_cpy == NULL ||
             wr_set_cpy == NULL || nfds == NULL) {
         return -1;
     }
-    int val;
-    if(prio_peek_max(conn_pool->pq, &val) == -1) {
+    if(conn_pool->backend_type != CONN_BACKEND_SELECT) {
         return -1;
     }
-    *nfds = val + 1;
-    memcpy(rd_set_cpy, &conn_pool->rdwr_fd_sets.rd_set, sizeof(*rd_set_cpy));
-    memcpy(wr_set_cpy, &conn_pool->rdwr_fd_sets.wr_set, sizeof(*wr_set_cpy));
-    return 0;
+    return conn_select_copy_fd_sets(conn_pool->backend, rd_set_cpy, wr_set_cpy, nfds);
 }
 
 int conn_get_pool_size(ConnectionPool *conn_pool) {
     if(conn_pool == NULL) {
         return -1;
     }
-    return conn_pool->pool_size; 
+    return conn_pool->pool_size;
+}
+
+int conn_get_backend(ConnectionPool *conn_pool) {
+    if(conn_pool == NULL) {
+        return -1;
+    }
+    return conn_pool->backend_type;
+}
+
+ConnBackend conn_get_default_backend() {
+    return CONN_BACKEND_DEFAULT;
+}
+
+const char *conn_backend_name(ConnBackend backend) {
+    const struct conn_backend_ops *ops = get_backend_ops(backend);
+    if(ops == NULL) {
+        return NULL;
+    }
+    return ops->name;
 }
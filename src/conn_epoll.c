@@ -0,0 +1,122 @@
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "conn.h"
+#include "conn_backend.h"
+#include "macro.h"
+
+struct conn_epoll {
+    int epfd;
+    struct epoll_event ep_events[CONN_MAX_EVENTS];
+};
+
+static uint32_t to_epoll_events(unsigned int events) {
+    /* Edge-triggered: handlers drain until EAGAIN */
+    uint32_t ep = EPOLLET | EPOLLRDHUP;
+    if(events & CONN_EV_READ) {
+        ep |= EPOLLIN;
+    }
+    if(events & CONN_EV_WRITE) {
+        ep |= EPOLLOUT;
+    }
+    return ep;
+}
+
+static unsigned int from_epoll_events(uint32_t ep) {
+    unsigned int events = 0;
+    if(ep & (EPOLLIN | EPOLLRDHUP | EPOLLPRI)) {
+        events |= CONN_EV_READ;
+    }
+    if(ep & EPOLLOUT) {
+        events |= CONN_EV_WRITE;
+    }
+    if(ep & (EPOLLERR | EPOLLHUP)) {
+        events |= CONN_EV_ERROR;
+    }
+    return events;
+}
+
+static void *epoll_init(void) {
+    struct conn_epoll *ep = malloc(sizeof(struct conn_epoll));
+    if(ep == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    ep->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(ep->epfd == -1) {
+        perror("epoll_create1");
+        free(ep);
+        return NULL;
+    }
+    return ep;
+}
+
+static void epoll_destroy(void *backend) {
+    struct conn_epoll *ep = backend;
+    close(ep->epfd);
+    free(ep);
+}
+
+static int epoll_ctl_fd(struct conn_epoll *ep, int op, int fd, unsigned int events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = to_epoll_events(events);
+    ev.data.fd = fd;
+    return epoll_ctl(ep->epfd, op, fd, &ev);
+}
+
+static int epoll_add(void *backend, int fd, unsigned int events) {
+    return epoll_ctl_fd(backend, EPOLL_CTL_ADD, fd, events);
+}
+
+static int epoll_mod(void *backend, int fd, unsigned int events) {
+    return epoll_ctl_fd(backend, EPOLL_CTL_MOD, fd, events);
+}
+
+static int epoll_del(void *backend, int fd) {
+    struct conn_epoll *ep = backend;
+    if(epoll_ctl(ep->epfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        /* Closing fd already took it out of the interest list */
+        if(errno == EBADF || errno == ENOENT) {
+            return 0;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static int epoll_wait_events(void *backend, struct conn_event *events,
+        int max_events, int timeout_ms) {
+    struct conn_epoll *ep = backend;
+    if(max_events > CONN_MAX_EVENTS) {
+        max_events = CONN_MAX_EVENTS;
+    }
+
+    int nready = epoll_wait(ep->epfd, ep->ep_events, max_events, timeout_ms);
+    if(nready == -1) {
+        if(errno == EINTR) {
+            return 0;
+        }
+        perror("epoll_wait");
+        return -1;
+    }
+    for(int i = 0; i < nready; ++i) {
+        events[i].fd = ep->ep_events[i].data.fd;
+        events[i].events = from_epoll_events(ep->ep_events[i].events);
+    }
+    return nready;
+}
+
+const struct conn_backend_ops conn_epoll_ops = {
+    .name    = "epoll",
+    .max_fd  = 0,
+    .init    = epoll_init,
+    .destroy = epoll_destroy,
+    .add     = epoll_add,
+    .mod     = epoll_mod,
+    .del     = epoll_del,
+    .wait    = epoll_wait_events,
+};
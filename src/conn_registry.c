@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "conn_registry.h"
+
+/* Entries a shard starts with */
+#define CONN_SHARD_ENTRIES 64
+
+struct conn_entry {
+    ConnInfo info;
+    unsigned char in_use;
+};
+
+/* A shard per cache line at least, so that locking one does not touch another */
+struct conn_shard {
+    pthread_mutex_t lock;
+    struct conn_entry *entries;
+    unsigned int nentries;
+    unsigned int count;
+} __attribute__((aligned(64)));
+
+struct conn_registry {
+    unsigned int nshards;
+    struct conn_shard *shards;
+};
+
+ConnRegistry *conn_registry_init(unsigned int nshards) {
+    if(nshards == 0) {
+        nshards = CONN_REGISTRY_SHARDS;
+    }
+    if((nshards & (nshards - 1)) != 0) {
+        return NULL;
+    }
+    ConnRegistry *registry = malloc(sizeof(ConnRegistry));
+    if(registry == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    registry->shards = aligned_alloc(_Alignof(struct conn_shard),
+            nshards * sizeof(struct conn_shard));
+    if(registry->shards == NULL) {
+        perror("aligned_alloc");
+        free(registry);
+        return NULL;
+    }
+    memset(registry->shards, 0, nshards * sizeof(struct conn_shard));
+    registry->nshards = nshards;
+    for(unsigned int i = 0; i < nshards; ++i) {
+        pthread_mutex_init(&registry->shards[i].lock, NULL);
+    }
+    return registry;
+}
+
+/* The low bits of fd pick the shard, the others the entry */
+static struct conn_shard *get_shard(ConnRegistry *registry, int fd) {
+    return &registry->shards[fd & (registry->nshards - 1)];
+}
+
+static unsigned int entry_of(const ConnRegistry *registry, int fd) {
+    return (unsigned int)fd / registry->nshards;
+}
+
+/* Makes room for entry i, with the lock of the shard held */
+static int grow_shard(struct conn_shard *shard, unsigned int i) {
+    unsigned int n = shard->nentries > 0 ? shard->nentries : CONN_SHARD_ENTRIES;
+    while(i >= n) {
+        n *= 2;
+    }
+    if(n == shard->nentries) {
+        return 0;
+    }
+    struct conn_entry *entries = realloc(shard->entries, n * sizeof(*entries));
+    if(entries == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    memset(entries + shard->nentries, 0, (n - shard->nentries) * sizeof(*entries));
+    shard->entries = entries;
+    shard->nentries = n;
+    return 0;
+}
+
+int conn_registry_insert(ConnRegistry *registry, int fd, const ConnInfo *info) {
+    if(registry == NULL || fd < 0 || info == NULL) {
+        return -1;
+    }
+    struct conn_shard *shard = get_shard(registry, fd);
+    unsigned int i = entry_of(registry, fd);
+    int ret = -1;
+    pthread_mutex_lock(&shard->lock);
+    if(grow_shard(shard, i) == 0 && !shard->entries[i].in_use) {
+        shard->entries[i].info = *info;
+        shard->entries[i].in_use = 1;
+        shard->count++;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return ret;
+}
+
+int conn_registry_remove(ConnRegistry *registry, int fd) {
+    if(registry == NULL || fd < 0) {
+        return -1;
+    }
+    struct conn_shard *shard = get_shard(registry, fd);
+    unsigned int i = entry_of(registry, fd);
+    int ret = -1;
+    pthread_mutex_lock(&shard->lock);
+    if(i < shard->nentries && shard->entries[i].in_use) {
+        shard->entries[i].in_use = 0;
+        shard->count--;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return ret;
+}
+
+int conn_registry_lookup(ConnRegistry *registry, int fd, ConnInfo *info) {
+    if(registry == NULL || fd < 0) {
+        return 0;
+    }
+    struct conn_shard *shard = get_shard(registry, fd);
+    unsigned int i = entry_of(registry, fd);
+    int found = 0;
+    pthread_mutex_lock(&shard->lock);
+    if(i < shard->nentries && shard->entries[i].in_use) {
+        if(info != NULL) {
+            *info = shard->entries[i].info;
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+long conn_registry_foreach(ConnRegistry *registry, ConnVisitor visit, void *arg) {
+    if(registry == NULL || visit == NULL) {
+        return -1;
+    }
+    long n = 0;
+    int stop = 0;
+    for(unsigned int s = 0; s < registry->nshards && !stop; ++s) {
+        struct conn_shard *shard = &registry->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        for(unsigned int i = 0; i < shard->nentries && !stop; ++i) {
+            if(shard->entries[i].in_use) {
+                n++;
+                stop = visit((int)(i * registry->nshards + s), &shard->entries[i].info, arg);
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return n;
+}
+
+long conn_registry_count(ConnRegistry *registry) {
+    if(registry == NULL) {
+        return -1;
+    }
+    long n = 0;
+    for(unsigned int s = 0; s < registry->nshards; ++s) {
+        struct conn_shard *shard = &registry->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        n += shard->count;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return n;
+}
+
+void conn_registry_destroy(ConnRegistry *registry) {
+    if(registry == NULL) {
+        return;
+    }
+    for(unsigned int s = 0; s < registry->nshards; ++s) {
+        pthread_mutex_destroy(&registry->shards[s].lock);
+        free(registry->shards[s].entries);
+    }
+    free(registry->shards);
+    free(registry);
+}
@@ -0,0 +1,179 @@
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "conn.h"
+#include "conn_backend.h"
+#include "macro.h"
+
+/* The members are also kept packed in words, for clz and ctz */
+#define FD_WORD_BITS 64
+#define FD_NWORDS ((FD_SETSIZE + FD_WORD_BITS - 1) / FD_WORD_BITS)
+
+_Static_assert(FD_NWORDS <= FD_WORD_BITS, "the summary word must cover every member word");
+
+struct conn_select {
+    struct {
+        fd_set rd_set;
+        fd_set wr_set;
+    } rdwr_fd_sets;
+    fd_set member_set;
+    /* Bit i of summary is set when members[i] is not zero */
+    uint64_t members[FD_NWORDS];
+    uint64_t summary;
+};
+
+static void set_member(struct conn_select *sel, int fd) {
+    int w = fd / FD_WORD_BITS;
+    sel->members[w] |= (uint64_t)1 << (fd % FD_WORD_BITS);
+    sel->summary |= (uint64_t)1 << w;
+}
+
+static void clear_member(struct conn_select *sel, int fd) {
+    int w = fd / FD_WORD_BITS;
+    sel->members[w] &= ~((uint64_t)1 << (fd % FD_WORD_BITS));
+    if(sel->members[w] == 0) {
+        sel->summary &= ~((uint64_t)1 << w);
+    }
+}
+
+/* The highest member, whatever order they were added and removed in, or -1 */
+static int max_member(const struct conn_select *sel) {
+    if(sel->summary == 0) {
+        return -1;
+    }
+    int w = FD_WORD_BITS - 1 - __builtin_clzll(sel->summary);
+    return w * FD_WORD_BITS + FD_WORD_BITS - 1 - __builtin_clzll(sel->members[w]);
+}
+
+static void set_interest(struct conn_select *sel, int fd, unsigned int events) {
+    if(events & CONN_EV_READ) {
+        FD_SET(fd, &sel->rdwr_fd_sets.rd_set);
+    } else {
+        FD_CLR(fd, &sel->rdwr_fd_sets.rd_set);
+    }
+    if(events & CONN_EV_WRITE) {
+        FD_SET(fd, &sel->rdwr_fd_sets.wr_set);
+    } else {
+        FD_CLR(fd, &sel->rdwr_fd_sets.wr_set);
+    }
+}
+
+static void *select_init(void) {
+    struct conn_select *sel = malloc(sizeof(struct conn_select));
+    if(sel == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    FD_ZERO(&sel->rdwr_fd_sets.rd_set);
+    FD_ZERO(&sel->rdwr_fd_sets.wr_set);
+    FD_ZERO(&sel->member_set);
+    memset(sel->members, 0, sizeof(sel->members));
+    sel->summary = 0;
+    return sel;
+}
+
+static void select_destroy(void *backend) {
+    free(backend);
+}
+
+static int select_add(void *backend, int fd, unsigned int events) {
+    struct conn_select *sel = backend;
+    if(fd < 0 || fd >= FD_SETSIZE || FD_ISSET(fd, &sel->member_set)) {
+        return -1;
+    }
+    FD_SET(fd, &sel->member_set);
+    set_member(sel, fd);
+    set_interest(sel, fd, events);
+    return 0;
+}
+
+static int select_mod(void *backend, int fd, unsigned int events) {
+    struct conn_select *sel = backend;
+    if(!FD_ISSET(fd, &sel->member_set)) {
+        return -1;
+    }
+    set_interest(sel, fd, events);
+    return 0;
+}
+
+static int select_del(void *backend, int fd) {
+    struct conn_select *sel = backend;
+    if(fd < 0 || fd >= FD_SETSIZE || !FD_ISSET(fd, &sel->member_set)) {
+        return -1;
+    }
+    FD_CLR(fd, &sel->member_set);
+    clear_member(sel, fd);
+    set_interest(sel, fd, 0);
+    return 0;
+}
+
+static int select_wait(void *backend, struct conn_event *events,
+        int max_events, int timeout_ms) {
+    struct conn_select *sel = backend;
+    fd_set rd_set, wr_set;
+    int nfds;
+
+    conn_select_copy_fd_sets(sel, &rd_set, &wr_set, &nfds);
+
+    struct timeval tv, *tv_p = NULL;
+    if(timeout_ms >= 0) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        tv_p = &tv;
+    }
+
+    int nready = select(nfds, &rd_set, &wr_set, NULL, tv_p);
+    if(nready == -1) {
+        if(errno == EINTR) {
+            return 0;
+        }
+        perror("select");
+        return -1;
+    }
+
+    /* Only the members are looked at, not every fd below nfds */
+    int n = 0;
+    for(int w = 0; w < FD_NWORDS && n < max_events && nready > 0; ++w) {
+        uint64_t bits = sel->members[w];
+        while(bits != 0 && n < max_events && nready > 0) {
+            int fd = w * FD_WORD_BITS + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            unsigned int ev = 0;
+            if(FD_ISSET(fd, &rd_set)) {
+                ev |= CONN_EV_READ;
+            }
+            if(FD_ISSET(fd, &wr_set)) {
+                ev |= CONN_EV_WRITE;
+            }
+            if(ev != 0) {
+                events[n].fd = fd;
+                events[n].events = ev;
+                n++;
+                nready--;
+            }
+        }
+    }
+    return n;
+}
+
+int conn_select_copy_fd_sets(void *backend,
+        fd_set *rd_set_cpy, fd_set *wr_set_cpy, int *nfds) {
+    struct conn_select *sel = backend;
+    *nfds = max_member(sel) + 1;
+    memcpy(rd_set_cpy, &sel->rdwr_fd_sets.rd_set, sizeof(*rd_set_cpy));
+    memcpy(wr_set_cpy, &sel->rdwr_fd_sets.wr_set, sizeof(*wr_set_cpy));
+    return 0;
+}
+
+const struct conn_backend_ops conn_select_ops = {
+    .name    = "select",
+    .max_fd  = FD_SETSIZE,
+    .init    = select_init,
+    .destroy = select_destroy,
+    .add     = select_add,
+    .mod     = select_mod,
+    .del     = select_del,
+    .wait    = select_wait,
+};
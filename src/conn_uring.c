@@ -0,0 +1,696 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "conn.h"
+#include "conn_backend.h"
+#include "macro.h"
+
+#define URING_ENTRIES      1024
+#define URING_BUF_ENTRIES  256   /* Power of two, as io_uring requires */
+#define URING_BUF_SIZE     16384
+#define URING_BUF_GROUP    0
+#define URING_INITIAL_FDS  64
+#define URING_INITIAL_OPS  64
+
+/*
+ * user_data layout: the top two bits tell what a CQE belongs to.
+ * Polls carry the fd and its generation so that CQEs of a poll
+ * that was removed (or replaced) are recognized and dropped.
+ * Completion operations carry an index into the op table.
+ */
+#define UD_KIND_SHIFT   62
+#define UD_KIND_POLL    1ULL
+#define UD_KIND_OP      2ULL
+#define UD_KIND_IGNORE  3ULL
+#define UD_GEN_SHIFT    32
+#define UD_GEN_MASK     0x3FFFFFFFULL
+
+#define UD_POLL(fd, gen) ((UD_KIND_POLL << UD_KIND_SHIFT) | \
+        (((uint64_t)(gen) & UD_GEN_MASK) << UD_GEN_SHIFT) | (uint32_t)(fd))
+#define UD_OP(idx)       ((UD_KIND_OP << UD_KIND_SHIFT) | (uint32_t)(idx))
+#define UD_IGNORE        (UD_KIND_IGNORE << UD_KIND_SHIFT)
+#define UD_KIND(ud)      ((ud) >> UD_KIND_SHIFT)
+#define UD_GEN(ud)       (((ud) >> UD_GEN_SHIFT) & UD_GEN_MASK)
+#define UD_LOW(ud)       ((uint32_t)(ud))
+
+struct uring_fd {
+    unsigned int events;
+    uint32_t gen;
+    unsigned char in_use;
+};
+
+struct uring_op {
+    enum conn_async_kind kind;
+    int fd;
+    ConnCompletion complete;
+    void *data;
+    int next_free;
+    unsigned char in_use;
+    unsigned char multishot;
+};
+
+struct conn_uring {
+    int ring_fd;
+    unsigned int features;
+
+    /* Submission queue */
+    void *sq_ring;
+    size_t sq_ring_sz;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+    unsigned int sq_local_tail;
+    unsigned int to_submit;
+    unsigned char link_pending;
+    unsigned int link_tail;   /* Where the entry that links to the next one sits */
+
+    /* Completion queue */
+    void *cq_ring;
+    size_t cq_ring_sz;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Provided buffer ring for receives */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_sz;
+    char *bufs;
+    unsigned short buf_tail;
+    unsigned short recycle[CONN_MAX_EVENTS];
+    int nrecycle;
+
+    struct uring_fd *fds; /* Indexed by fd */
+    unsigned int nfds;
+
+    struct uring_op *ops;
+    unsigned int nops;
+    int free_op;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+        unsigned int flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int submit(struct conn_uring *ur, unsigned int min_complete,
+        unsigned int flags, void *arg, size_t argsz) {
+    /* Publish the queued entries before the kernel looks at them */
+    __atomic_store_n(ur->sq_tail, ur->sq_local_tail, __ATOMIC_RELEASE);
+    int ret = sys_io_uring_enter(ur->ring_fd, ur->to_submit, min_complete,
+            flags, arg, argsz);
+    if(ret >= 0) {
+        ur->to_submit -= (unsigned int)ret > ur->to_submit ? ur->to_submit : (unsigned int)ret;
+    }
+    return ret;
+}
+
+static struct io_uring_sqe *get_sqe(struct conn_uring *ur) {
+    unsigned int head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+    if(ur->sq_local_tail - head >= ur->sq_entries) {
+        /* Full: hand the batch over and make room */
+        if(submit(ur, 0, 0, NULL, 0) == -1) {
+            return NULL;
+        }
+        head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+        if(ur->sq_local_tail - head >= ur->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+    unsigned int idx = ur->sq_local_tail & ur->sq_mask;
+    struct io_uring_sqe *sqe = &ur->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ur->sq_array[idx] = idx;
+    ur->sq_local_tail++;
+    ur->to_submit++;
+    return sqe;
+}
+
+static int grow_fds(struct conn_uring *ur, int fd) {
+    unsigned int nfds = ur->nfds;
+    while((unsigned int)fd >= nfds) {
+        nfds *= 2;
+    }
+    if(nfds == ur->nfds) {
+        return 0;
+    }
+    struct uring_fd *fds = realloc(ur->fds, nfds * sizeof(*fds));
+    if(fds == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    memset(fds + ur->nfds, 0, (nfds - ur->nfds) * sizeof(*fds));
+    ur->fds = fds;
+    ur->nfds = nfds;
+    return 0;
+}
+
+static int alloc_op(struct conn_uring *ur) {
+    if(ur->free_op == -1) {
+        unsigned int nops = ur->nops * 2;
+        struct uring_op *ops = realloc(ur->ops, nops * sizeof(*ops));
+        if(ops == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        for(unsigned int i = ur->nops; i < nops; ++i) {
+            ops[i].in_use = 0;
+            ops[i].next_free = (i + 1 < nops) ? (int)(i + 1) : -1;
+        }
+        ur->free_op = ur->nops;
+        ur->ops = ops;
+        ur->nops = nops;
+    }
+    int idx = ur->free_op;
+    ur->free_op = ur->ops[idx].next_free;
+    ur->ops[idx].in_use = 1;
+    return idx;
+}
+
+static void free_op(struct conn_uring *ur, int idx) {
+    ur->ops[idx].in_use = 0;
+    ur->ops[idx].next_free = ur->free_op;
+    ur->free_op = idx;
+}
+
+static void provide_buffer(struct conn_uring *ur, unsigned short bid) {
+    struct io_uring_buf *buf = &ur->buf_ring->bufs[ur->buf_tail & (URING_BUF_ENTRIES - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ur->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ur->buf_tail++;
+}
+
+static void publish_buffers(struct conn_uring *ur) {
+    __atomic_store_n(&ur->buf_ring->tail, ur->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int setup_buffers(struct conn_uring *ur) {
+    ur->buf_ring_sz = URING_BUF_ENTRIES * sizeof(struct io_uring_buf);
+    ur->buf_ring = mmap(NULL, ur->buf_ring_sz, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ur->buf_ring == MAP_FAILED) {
+        ur->buf_ring = NULL;
+        perror("mmap");
+        return -1;
+    }
+    ur->bufs = mmap(NULL, (size_t)URING_BUF_ENTRIES * URING_BUF_SIZE,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ur->bufs == MAP_FAILED) {
+        ur->bufs = NULL;
+        perror("mmap");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ur->buf_ring;
+    reg.ring_entries = URING_BUF_ENTRIES;
+    reg.bgid = URING_BUF_GROUP;
+    if(sys_io_uring_register(ur->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("io_uring_register");
+        return -1;
+    }
+
+    ur->buf_tail = 0;
+    for(unsigned short bid = 0; bid < URING_BUF_ENTRIES; ++bid) {
+        provide_buffer(ur, bid);
+    }
+    publish_buffers(ur);
+    return 0;
+}
+
+static int setup_ring(struct conn_uring *ur) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    /* Only the owning thread submits, so skip the cross-thread wakeups */
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    ur->ring_fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if(ur->ring_fd == -1 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        ur->ring_fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    }
+    if(ur->ring_fd == -1) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    ur->features = p.features;
+
+    ur->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ur->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ur->cq_ring_sz > ur->sq_ring_sz) {
+            ur->sq_ring_sz = ur->cq_ring_sz;
+        }
+        ur->cq_ring_sz = ur->sq_ring_sz;
+    }
+
+    ur->sq_ring = mmap(NULL, ur->sq_ring_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQ_RING);
+    if(ur->sq_ring == MAP_FAILED) {
+        ur->sq_ring = NULL;
+        perror("mmap");
+        return -1;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->cq_ring = ur->sq_ring;
+    } else {
+        ur->cq_ring = mmap(NULL, ur->cq_ring_sz, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_CQ_RING);
+        if(ur->cq_ring == MAP_FAILED) {
+            ur->cq_ring = NULL;
+            perror("mmap");
+            return -1;
+        }
+    }
+    ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQES);
+    if(ur->sqes == MAP_FAILED) {
+        ur->sqes = NULL;
+        perror("mmap");
+        return -1;
+    }
+
+    char *sq = ur->sq_ring, *cq = ur->cq_ring;
+    ur->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ur->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ur->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    ur->sq_entries = *(unsigned int *)(sq + p.sq_off.ring_entries);
+    ur->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ur->sq_local_tail = *ur->sq_tail;
+    ur->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ur->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ur->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_destroy(void *backend) {
+    struct conn_uring *ur = backend;
+    if(ur->sqes != NULL) {
+        munmap(ur->sqes, ur->sqes_sz);
+    }
+    if(ur->cq_ring != NULL && ur->cq_ring != ur->sq_ring) {
+        munmap(ur->cq_ring, ur->cq_ring_sz);
+    }
+    if(ur->sq_ring != NULL) {
+        munmap(ur->sq_ring, ur->sq_ring_sz);
+    }
+    if(ur->ring_fd != -1) {
+        close(ur->ring_fd);
+    }
+    if(ur->bufs != NULL) {
+        munmap(ur->bufs, (size_t)URING_BUF_ENTRIES * URING_BUF_SIZE);
+    }
+    if(ur->buf_ring != NULL) {
+        munmap(ur->buf_ring, ur->buf_ring_sz);
+    }
+    free(ur->fds);
+    free(ur->ops);
+    free(ur);
+}
+
+static void *uring_init(void) {
+    struct conn_uring *ur = calloc(1, sizeof(struct conn_uring));
+    if(ur == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    ur->ring_fd = -1;
+    ur->free_op = -1;
+    ur->nfds = URING_INITIAL_FDS;
+    ur->fds = calloc(ur->nfds, sizeof(struct uring_fd));
+    ur->nops = URING_INITIAL_OPS / 2; /* Doubled by the first alloc_op */
+    ur->ops = calloc(ur->nops, sizeof(struct uring_op));
+    if(ur->fds == NULL || ur->ops == NULL) {
+        perror("calloc");
+        uring_destroy(ur);
+        return NULL;
+    }
+    for(unsigned int i = 0; i < ur->nops; ++i) {
+        ur->ops[i].next_free = (i + 1 < ur->nops) ? (int)(i + 1) : -1;
+    }
+    ur->free_op = 0;
+
+    if(setup_ring(ur) == -1 || setup_buffers(ur) == -1) {
+        uring_destroy(ur);
+        return NULL;
+    }
+    return ur;
+}
+
+static uint32_t to_poll_events(unsigned int events) {
+    uint32_t pe = POLLRDHUP;
+    if(events & CONN_EV_READ) {
+        pe |= POLLIN;
+    }
+    if(events & CONN_EV_WRITE) {
+        pe |= POLLOUT;
+    }
+    return pe;
+}
+
+static unsigned int from_poll_events(uint32_t pe) {
+    unsigned int events = 0;
+    if(pe & (POLLIN | POLLRDHUP | POLLPRI)) {
+        events |= CONN_EV_READ;
+    }
+    if(pe & POLLOUT) {
+        events |= CONN_EV_WRITE;
+    }
+    if(pe & (POLLERR | POLLHUP | POLLNVAL)) {
+        events |= CONN_EV_ERROR;
+    }
+    return events;
+}
+
+static int arm_poll(struct conn_uring *ur, int fd) {
+    struct io_uring_sqe *sqe = get_sqe(ur);
+    if(sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = to_poll_events(ur->fds[fd].events);
+    sqe->user_data = UD_POLL(fd, ur->fds[fd].gen);
+    return 0;
+}
+
+static int disarm_poll(struct conn_uring *ur, int fd) {
+    struct io_uring_sqe *sqe = get_sqe(ur);
+    if(sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = UD_POLL(fd, ur->fds[fd].gen);
+    sqe->user_data = UD_IGNORE;
+    /* Whatever the old poll still reports is stale from now on */
+    ur->fds[fd].gen++;
+    return 0;
+}
+
+static int uring_add(void *backend, int fd, unsigned int events) {
+    struct conn_uring *ur = backend;
+    if(grow_fds(ur, fd) == -1) {
+        return -1;
+    }
+    ur->fds[fd].events = events;
+    ur->fds[fd].in_use = 1;
+    ur->fds[fd].gen++;
+    if(arm_poll(ur, fd) == -1) {
+        ur->fds[fd].in_use = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static int uring_mod(void *backend, int fd, unsigned int events) {
+    struct conn_uring *ur = backend;
+    if(disarm_poll(ur, fd) == -1) {
+        return -1;
+    }
+    ur->fds[fd].events = events;
+    return arm_poll(ur, fd);
+}
+
+static int uring_del(void *backend, int fd) {
+    struct conn_uring *ur = backend;
+    if(disarm_poll(ur, fd) == -1) {
+        return -1;
+    }
+    ur->fds[fd].in_use = 0;
+    return 0;
+}
+
+static int prep_op(struct conn_uring *ur, int idx) {
+    struct uring_op *op = &ur->ops[idx];
+    struct io_uring_sqe *sqe = get_sqe(ur);
+    if(sqe == NULL) {
+        return -1;
+    }
+    sqe->fd = op->fd;
+    sqe->user_data = UD_OP(idx);
+    switch(op->kind) {
+        case CONN_ASYNC_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            break;
+        case CONN_ASYNC_RECV:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUF_GROUP;
+            if(op->multishot) {
+                sqe->ioprio = IORING_RECV_MULTISHOT;
+            }
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+/*
+ * The follower of a linked entry could not be queued, so the chain
+ * ends with that entry. Left as it is, it would hold back whatever
+ * comes next, and cancel it along with itself on a failure.
+ */
+static void break_link(struct conn_uring *ur) {
+    if(ur->link_pending && ur->sq_local_tail - ur->link_tail <= ur->to_submit) {
+        ur->sqes[ur->link_tail & ur->sq_mask].flags &= ~IOSQE_IO_LINK;
+    }
+    ur->link_pending = 0;
+}
+
+static int queue_async(struct conn_uring *ur, const struct conn_async_req *req) {
+    struct io_uring_sqe *sqe;
+
+    if(req->kind == CONN_ASYNC_CANCEL) {
+        if((sqe = get_sqe(ur)) == NULL) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = req->fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = UD_IGNORE;
+        return 0;
+    }
+
+    int idx = alloc_op(ur);
+    if(idx == -1) {
+        return -1;
+    }
+    struct uring_op *op = &ur->ops[idx];
+    op->kind = req->kind;
+    op->fd = req->fd;
+    op->complete = req->complete;
+    op->data = req->data;
+    /* Multishot requests can not wait on a link, so those are one-shot */
+    op->multishot = (req->kind == CONN_ASYNC_ACCEPT ||
+            (req->kind == CONN_ASYNC_RECV && !ur->link_pending));
+
+    if(req->kind == CONN_ASYNC_ACCEPT || req->kind == CONN_ASYNC_RECV) {
+        if(prep_op(ur, idx) == -1) {
+            free_op(ur, idx);
+            return -1;
+        }
+        ur->link_pending = 0;
+        return 0;
+    }
+
+    if((sqe = get_sqe(ur)) == NULL) {
+        free_op(ur, idx);
+        return -1;
+    }
+    sqe->fd = req->fd;
+    sqe->user_data = UD_OP(idx);
+    if(req->kind == CONN_ASYNC_SEND) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uint64_t)(uintptr_t)req->buf;
+        sqe->len = req->len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    } else {
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->addr = (uint64_t)(uintptr_t)req->addr;
+        sqe->off = req->addrlen;
+    }
+    if(req->flags & CONN_ASYNC_LINK) {
+        sqe->flags |= IOSQE_IO_LINK;
+        ur->link_tail = ur->sq_local_tail - 1;
+    }
+    ur->link_pending = (req->flags & CONN_ASYNC_LINK) != 0;
+    return 0;
+}
+
+static int uring_async(void *backend, const struct conn_async_req *req) {
+    struct conn_uring *ur = backend;
+    if(queue_async(ur, req) == -1) {
+        break_link(ur);
+        return -1;
+    }
+    return 0;
+}
+
+/* Turns one CQE into at most one event, returns 1 if it did */
+static int reap_cqe(struct conn_uring *ur, const struct io_uring_cqe *cqe,
+        struct conn_event *ev) {
+    uint64_t ud = cqe->user_data;
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+    if(UD_KIND(ud) == UD_KIND_POLL) {
+        int fd = (int)UD_LOW(ud);
+        if((unsigned int)fd >= ur->nfds || !ur->fds[fd].in_use ||
+                ur->fds[fd].gen != (uint32_t)UD_GEN(ud)) {
+            return 0;
+        }
+        if(cqe->res < 0) {
+            /* Cancelled on purpose, or failed for good, so it stays down */
+            if(cqe->res == -ECANCELED) {
+                return 0;
+            }
+            ev->events = CONN_EV_ERROR;
+        } else {
+            if(!more) {
+                /* The kernel dropped the multishot poll, put it back */
+                arm_poll(ur, fd);
+            }
+            ev->events = from_poll_events((uint32_t)cqe->res);
+        }
+        ev->fd = fd;
+        ev->complete = NULL;
+        return 1;
+    }
+
+    if(UD_KIND(ud) != UD_KIND_OP) {
+        return 0;
+    }
+    int idx = (int)UD_LOW(ud);
+    struct uring_op *op = &ur->ops[idx];
+    ev->fd = op->fd;
+    ev->events = CONN_EV_COMPLETE;
+    ev->res = cqe->res;
+    ev->buf = NULL;
+    ev->complete = op->complete;
+    ev->data = op->data;
+
+    if(cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        ev->buf = ur->bufs + (size_t)bid * URING_BUF_SIZE;
+        /* Handed back to the kernel once the completion ran */
+        ur->recycle[ur->nrecycle++] = bid;
+    }
+
+    if(!more) {
+        int rearm = op->multishot &&
+            ((op->kind == CONN_ASYNC_ACCEPT && cqe->res >= 0) ||
+             (op->kind == CONN_ASYNC_RECV && cqe->res > 0) ||
+             cqe->res == -ENOBUFS);
+        if(rearm) {
+            if(prep_op(ur, idx) == -1) {
+                free_op(ur, idx);
+            }
+        } else {
+            free_op(ur, idx);
+        }
+        if(cqe->res == -ENOBUFS) {
+            /* Out of buffers, not an error for the caller */
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int uring_wait(void *backend, struct conn_event *events,
+        int max_events, int timeout_ms) {
+    struct conn_uring *ur = backend;
+
+    /* The buffers of the previous round are no longer in use */
+    if(ur->nrecycle > 0) {
+        for(int i = 0; i < ur->nrecycle; ++i) {
+            provide_buffer(ur, ur->recycle[i]);
+        }
+        ur->nrecycle = 0;
+        publish_buffers(ur);
+    }
+
+    unsigned int head = *ur->cq_head;
+    unsigned int tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned int min_complete = (head == tail && timeout_ms != 0) ? 1 : 0;
+    unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void *argp = NULL;
+    size_t argsz = 0;
+    if(min_complete && timeout_ms > 0) {
+        if(!(ur->features & IORING_FEAT_EXT_ARG)) {
+            fprintf(stderr, "io_uring: kernel does not support wait timeouts\n");
+            return -1;
+        }
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    if(ur->to_submit > 0 || min_complete) {
+        if(submit(ur, min_complete, flags, argp, argsz) == -1) {
+            if(errno != EINTR && errno != ETIME && errno != EBUSY) {
+                perror("io_uring_enter");
+                return -1;
+            }
+        }
+    }
+
+    if(max_events > CONN_MAX_EVENTS) {
+        max_events = CONN_MAX_EVENTS;
+    }
+    int n = 0;
+    head = *ur->cq_head;
+    tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail && n < max_events) {
+        n += reap_cqe(ur, &ur->cqes[head & ur->cq_mask], &events[n]);
+        head++;
+    }
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+const struct conn_backend_ops conn_uring_ops = {
+    .name    = "io_uring",
+    .max_fd  = 0,
+    .init    = uring_init,
+    .destroy = uring_destroy,
+    .add     = uring_add,
+    .mod     = uring_mod,
+    .del     = uring_del,
+    .wait    = uring_wait,
+    .async   = uring_async,
+};
@@ -0,0 +1,475 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "disk_cache.h"
+#include "macro.h"
+#include "util.h"
+
+#define DISK_INDEX_MAGIC  0x3130584449595850ull /* "PXYIDX01" */
+#define DISK_RECORD_MAGIC 0x52595850u           /* "PXYR" */
+#define DISK_VERSION      1
+#define DISK_HEADER_SZ    4096 /* The header takes the first page of the index */
+#define DISK_MIN_SLOTS    1024
+#define DISK_AVG_OBJECT   4096 /* Sizes the index, with 2 slots per object */
+#define DISK_KEY_MAX      2048
+#define DISK_ALIGN        8
+#define DISK_GUARD_DIV    8    /* Share of the log that is about to be written over */
+
+struct disk_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t clean;     /* The index was closed cleanly */
+    uint64_t data_size;
+    uint64_t nslots;
+    uint64_t write_pos; /* Logical offset of the end of the log */
+};
+
+/* Heads every record of the data file */
+struct disk_record {
+    uint32_t magic;
+    uint32_t key_len;
+    uint64_t pos;       /* Logical offset of the record */
+    uint64_t hash;
+    uint32_t head_len;
+    uint32_t data_len;
+};
+
+struct disk_slot {
+    uint64_t hash;      /* 0 if the slot is empty */
+    uint64_t pos;
+    uint64_t len;       /* Length of the record */
+    int64_t stored;
+    int64_t expires;
+    uint64_t check;     /* Hash of the fields above */
+};
+
+struct disk_cache {
+    pthread_mutex_t lock;
+    int datafd;
+    int indexfd;
+    struct disk_header *header;
+    struct disk_slot *slots;
+    size_t index_size;
+    uint64_t mask;
+    uint64_t nentries;
+    DiskCacheStats stats;
+};
+
+static uint64_t slot_check(const struct disk_slot *slot) {
+    return util_fnv1a(slot, offsetof(struct disk_slot, check), UTIL_FNV1A_BASIS);
+}
+
+static uint64_t data_size(const DiskCache *cache) {
+    return cache->header->data_size;
+}
+
+/*
+ * A record is valid as long as the log did not wrap around over it.
+ * The records that are next in line to be written over are already
+ * treated as gone, so that none of them is being sent to a client
+ * at the time its bytes change.
+ */
+static int in_window(const DiskCache *cache, uint64_t pos) {
+    uint64_t size = data_size(cache);
+    uint64_t end = cache->header->write_pos;
+    return end <= size || pos >= end - size + size / DISK_GUARD_DIV;
+}
+
+static int pread_all(int fd, void *buf, size_t len, off_t off) {
+    while(len > 0) {
+        ssize_t n = pread(fd, buf, len, off);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        buf = (char *)buf + n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+    while(len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/* The header of the record the slot points to must say the same */
+static int record_matches(const DiskCache *cache, const struct disk_slot *slot,
+        struct disk_record *rec) {
+    if(pread_all(cache->datafd, rec, sizeof(*rec), slot->pos % data_size(cache)) == -1) {
+        return 0;
+    }
+    return rec->magic == DISK_RECORD_MAGIC && rec->pos == slot->pos && rec->hash == slot->hash &&
+        sizeof(*rec) + rec->key_len + rec->data_len == slot->len;
+}
+
+/* Open addressing with linear probing and backward-shift deletion */
+
+static void put_slot(DiskCache *cache, const struct disk_slot *slot) {
+    uint64_t i = slot->hash & cache->mask;
+    while(cache->slots[i].hash != 0) {
+        i = (i + 1) & cache->mask;
+    }
+    cache->slots[i] = *slot;
+    cache->slots[i].check = slot_check(slot);
+    cache->nentries++;
+}
+
+static void remove_slot(DiskCache *cache, uint64_t i) {
+    uint64_t j = i;
+    for(;;) {
+        j = (j + 1) & cache->mask;
+        if(cache->slots[j].hash == 0) {
+            break;
+        }
+        uint64_t k = cache->slots[j].hash & cache->mask;
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        cache->slots[i] = cache->slots[j];
+        i = j;
+    }
+    memset(&cache->slots[i], 0, sizeof(struct disk_slot));
+    cache->nentries--;
+}
+
+/*
+ * Rebuilds the index out of its valid entries. When verify is set,
+ * the records are read back as well, which is only needed when the
+ * index was not closed cleanly.
+ */
+static int rebuild(DiskCache *cache, int verify, uint64_t *ndropped) {
+    uint64_t nslots = cache->mask + 1, nvalid = 0;
+    struct disk_slot *valid = malloc(nslots * sizeof(struct disk_slot));
+    if(valid == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    time_t now = time(NULL);
+    struct disk_record rec;
+
+    for(uint64_t i = 0; i < nslots; ++i) {
+        const struct disk_slot *slot = &cache->slots[i];
+        if(slot->hash == 0) {
+            continue;
+        }
+        if(slot->check != slot_check(slot) || !in_window(cache, slot->pos) ||
+                (verify && !record_matches(cache, slot, &rec))) {
+            (*ndropped)++;
+        } else if(slot->expires <= now) {
+            cache->stats.expired++;
+        } else {
+            valid[nvalid++] = *slot;
+        }
+    }
+
+    memset(cache->slots, 0, nslots * sizeof(struct disk_slot));
+    cache->nentries = 0;
+    for(uint64_t i = 0; i < nvalid; ++i) {
+        put_slot(cache, &valid[i]);
+    }
+    free(valid);
+    return 0;
+}
+
+static uint64_t slots_for(size_t data_bytes) {
+    uint64_t nslots = DISK_MIN_SLOTS;
+    while(nslots < data_bytes / DISK_AVG_OBJECT * 2) {
+        nslots *= 2;
+    }
+    return nslots;
+}
+
+/* Maps the index, starting over unless it matches the given sizes */
+static int map_index(DiskCache *cache, size_t data_bytes, int *fresh) {
+    uint64_t nslots = slots_for(data_bytes);
+    cache->index_size = DISK_HEADER_SZ + nslots * sizeof(struct disk_slot);
+
+    struct stat data_st, index_st;
+    if(fstat(cache->datafd, &data_st) == -1 || fstat(cache->indexfd, &index_st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+    *fresh = (size_t)data_st.st_size != data_bytes ||
+        (size_t)index_st.st_size != cache->index_size;
+
+    if(*fresh) {
+        int err;
+        if(ftruncate(cache->indexfd, 0) == -1 ||
+                ftruncate(cache->indexfd, cache->index_size) == -1 ||
+                ftruncate(cache->datafd, data_bytes) == -1) {
+            perror("ftruncate");
+            return -1;
+        }
+        if((err = posix_fallocate(cache->datafd, 0, data_bytes)) != 0) {
+            errno = err;
+            perror("posix_fallocate");
+            return -1;
+        }
+    }
+
+    void *map = mmap(NULL, cache->index_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            cache->indexfd, 0);
+    if(map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    cache->header = map;
+    cache->slots = (struct disk_slot *)((char *)map + DISK_HEADER_SZ);
+    cache->mask = nslots - 1;
+
+    struct disk_header *h = cache->header;
+    if(*fresh || h->magic != DISK_INDEX_MAGIC || h->version != DISK_VERSION ||
+            h->data_size != data_bytes || h->nslots != nslots) {
+        memset(map, 0, cache->index_size);
+        h->magic = DISK_INDEX_MAGIC;
+        h->version = DISK_VERSION;
+        h->data_size = data_bytes;
+        h->nslots = nslots;
+        h->write_pos = 0;
+        h->clean = 1;
+        *fresh = 1;
+    }
+    return 0;
+}
+
+static void free_cache(DiskCache *cache) {
+    if(cache->header != NULL) {
+        munmap(cache->header, cache->index_size);
+    }
+    if(cache->datafd != -1) {
+        close(cache->datafd);
+    }
+    if(cache->indexfd != -1) {
+        close(cache->indexfd);
+    }
+    free(cache);
+}
+
+DiskCache *disk_cache_open(const char *path, size_t data_bytes) {
+    char data_path[4096], index_path[4096];
+    if(path == NULL || data_bytes < DISK_GUARD_DIV * DISK_AVG_OBJECT ||
+            snprintf(data_path, sizeof(data_path), "%s.data", path) >= (int)sizeof(data_path) ||
+            snprintf(index_path, sizeof(index_path), "%s.index", path) >= (int)sizeof(index_path)) {
+        return NULL;
+    }
+    DiskCache *cache = calloc(1, sizeof(DiskCache));
+    if(cache == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    cache->datafd = open(data_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    cache->indexfd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(cache->datafd == -1 || cache->indexfd == -1) {
+        perror("open");
+        free_cache(cache);
+        return NULL;
+    }
+
+    int fresh;
+    if(map_index(cache, data_bytes, &fresh) == -1 ||
+            (!fresh && rebuild(cache, !cache->header->clean, &cache->stats.dropped) == -1)) {
+        free_cache(cache);
+        return NULL;
+    }
+    cache->stats.recovered = cache->nentries;
+    /* Until it is closed, a crash leaves the index to be checked */
+    cache->header->clean = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+/* Finds the slot of hash, returns -1 if there is none */
+static int64_t find_slot(const DiskCache *cache, uint64_t hash) {
+    uint64_t i = hash & cache->mask;
+    for(; cache->slots[i].hash != 0; i = (i + 1) & cache->mask) {
+        if(cache->slots[i].hash == hash) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static uint64_t key_hash(const char *key) {
+    /* 0 marks the empty slots */
+    return util_fnv1a_str(key) | 1;
+}
+
+int disk_cache_store(DiskCache *cache, const char *key, const char *data,
+        size_t head_len, size_t len, time_t stored, time_t expires) {
+    if(cache == NULL || key == NULL || data == NULL || head_len > len) {
+        return -1;
+    }
+    size_t key_len = strlen(key);
+    uint64_t size = data_size(cache);
+    uint64_t rec_len = sizeof(struct disk_record) + key_len + len;
+    if(key_len > DISK_KEY_MAX || rec_len > size / DISK_GUARD_DIV || expires <= stored) {
+        return -1;
+    }
+    struct disk_slot slot;
+    memset(&slot, 0, sizeof(slot));
+    slot.hash = key_hash(key);
+    slot.len = rec_len;
+    slot.stored = stored;
+    slot.expires = expires;
+
+    /* Records do not wrap around, the tail of the file is skipped instead */
+    pthread_mutex_lock(&cache->lock);
+    uint64_t pos = cache->header->write_pos;
+    if(pos % size + rec_len > size) {
+        pos += size - pos % size;
+    }
+    cache->header->write_pos = pos + (rec_len + DISK_ALIGN - 1) / DISK_ALIGN * DISK_ALIGN;
+    pthread_mutex_unlock(&cache->lock);
+    slot.pos = pos;
+
+    struct disk_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = DISK_RECORD_MAGIC;
+    rec.key_len = key_len;
+    rec.pos = pos;
+    rec.hash = slot.hash;
+    rec.head_len = head_len;
+    rec.data_len = len;
+    off_t off = pos % size;
+    if(pwrite_all(cache->datafd, &rec, sizeof(rec), off) == -1 ||
+            pwrite_all(cache->datafd, key, key_len, off + sizeof(rec)) == -1 ||
+            pwrite_all(cache->datafd, data, len, off + sizeof(rec) + key_len) == -1) {
+        perror("pwrite");
+        return -1;
+    }
+
+    /* The record is written before the index points to it */
+    pthread_mutex_lock(&cache->lock);
+    int64_t i = find_slot(cache, slot.hash);
+    if(i != -1) {
+        remove_slot(cache, i);
+    }
+    if(!in_window(cache, pos)) {
+        /* Other records were appended over it in the meantime */
+        cache->stats.overwritten++;
+        pthread_mutex_unlock(&cache->lock);
+        return -1;
+    }
+    if((cache->nentries + 1) * 4 > (cache->mask + 1) * 3) {
+        rebuild(cache, 0, &cache->stats.overwritten);
+    }
+    if((cache->nentries + 1) * 4 > (cache->mask + 1) * 3) {
+        pthread_mutex_unlock(&cache->lock);
+        return -1;
+    }
+    put_slot(cache, &slot);
+    cache->stats.stores++;
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+int disk_cache_lookup(DiskCache *cache, const char *key, DiskHit *hit,
+        char *head, size_t head_sz) {
+    if(cache == NULL || key == NULL || hit == NULL || head == NULL) {
+        return 0;
+    }
+    size_t key_len = strlen(key);
+    uint64_t hash = key_hash(key);
+    struct disk_slot slot;
+
+    pthread_mutex_lock(&cache->lock);
+    int64_t i = find_slot(cache, hash);
+    if(i != -1 && !in_window(cache, cache->slots[i].pos)) {
+        cache->stats.overwritten++;
+        remove_slot(cache, i);
+        i = -1;
+    }
+    if(i != -1 && cache->slots[i].expires <= time(NULL)) {
+        cache->stats.expired++;
+        remove_slot(cache, i);
+        i = -1;
+    }
+    if(i == -1) {
+        cache->stats.misses++;
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    slot = cache->slots[i];
+    pthread_mutex_unlock(&cache->lock);
+
+    /* The hash only picks the slot, the key of the record decides */
+    struct disk_record rec;
+    char rec_key[DISK_KEY_MAX];
+    off_t off = slot.pos % data_size(cache);
+    int found = record_matches(cache, &slot, &rec) && rec.key_len == key_len &&
+        rec.head_len <= head_sz && rec.head_len >= 2 &&
+        pread_all(cache->datafd, rec_key, key_len, off + sizeof(rec)) == 0 &&
+        memcmp(rec_key, key, key_len) == 0 &&
+        pread_all(cache->datafd, head, rec.head_len, off + sizeof(rec) + key_len) == 0;
+
+    pthread_mutex_lock(&cache->lock);
+    if(found) {
+        cache->stats.hits++;
+        cache->stats.bytes_saved += rec.data_len;
+    } else {
+        cache->stats.misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if(!found) {
+        return 0;
+    }
+
+    hit->fd = cache->datafd;
+    hit->off = off + sizeof(rec) + key_len + rec.head_len;
+    hit->len = rec.data_len - rec.head_len;
+    hit->head_len = rec.head_len;
+    hit->stored = slot.stored;
+    return 1;
+}
+
+int disk_cache_get_stats(DiskCache *cache, DiskCacheStats *stats) {
+    if(cache == NULL || stats == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    stats->entries = cache->nentries;
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+void disk_cache_close(DiskCache *cache) {
+    if(cache == NULL) {
+        return;
+    }
+    /* The records must be on the disk before the index says so */
+    fdatasync(cache->datafd);
+    msync(cache->header, cache->index_size, MS_SYNC);
+    cache->header->clean = 1;
+    msync(cache->header, DISK_HEADER_SZ, MS_SYNC);
+    munmap(cache->header, cache->index_size);
+    close(cache->datafd);
+    close(cache->indexfd);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
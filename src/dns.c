@@ -0,0 +1,744 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
+
+#include "dns.h"
+#include "macro.h"
+#include "util.h"
+
+#define DNS_PORT          53
+#define DNS_MAX_TRIES     3
+#define DNS_MSG_SZ        1232 /* What fits in one unfragmented UDP datagram */
+#define DNS_NEGATIVE_TTL  30   /* When the answer does not carry its SOA */
+#define DNS_MAX_TTL       3600
+#define DNS_TYPE_A        1
+#define DNS_TYPE_SOA      6
+#define DNS_TYPE_AAAA     28
+#define DNS_CLASS_IN      1
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_ID_BATCH      64   /* Query ids drawn from the kernel at once */
+
+#define DNS_CACHE_SHARDS  16
+#define DNS_SHARD_BUCKETS 64
+#define DNS_SHARD_MAX     256
+
+struct dns_entry {
+    char name[DNS_NAME_MAX + 1];
+    uint64_t hash;
+    int status;
+    unsigned int naddrs;
+    DnsAddr addrs[DNS_MAX_ADDRS];
+    uint64_t expires_ms;
+    struct dns_entry *next;  /* Chain of the bucket */
+    struct dns_entry *older; /* Order of insertion in the shard */
+    struct dns_entry *newer;
+};
+
+struct dns_shard {
+    pthread_mutex_t lock;
+    struct dns_entry *buckets[DNS_SHARD_BUCKETS];
+    struct dns_entry *oldest;
+    struct dns_entry *newest;
+    unsigned int nentries;
+};
+
+struct dns_cache {
+    struct dns_shard shards[DNS_CACHE_SHARDS];
+};
+
+struct dns_waiter {
+    DnsCallback cb;
+    void *data;
+    struct dns_waiter *next;
+};
+
+struct dns_query {
+    DnsResolver *resolver;
+    char name[DNS_NAME_MAX + 1];
+    int fd;
+    uint16_t id;
+    uint16_t qtype;
+    unsigned int tries;
+    uint64_t deadline_ms;
+    struct dns_waiter *waiters;
+    struct dns_query *next;
+};
+
+struct dns_resolver {
+    ConnectionPool *conn_pool;
+    DnsCache *cache;
+    struct sockaddr_storage ns;
+    socklen_t nslen;
+    unsigned int timeout_ms;
+    struct dns_query *queries;
+    uint16_t ids[DNS_ID_BATCH];
+    unsigned int nids;
+};
+
+DnsCache *dns_cache_init(void) {
+    DnsCache *cache = calloc(1, sizeof(DnsCache));
+    if(cache == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    for(int i = 0; i < DNS_CACHE_SHARDS; ++i) {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+    }
+    return cache;
+}
+
+/* The low bits pick the bucket, the high ones the shard */
+static struct dns_shard *get_shard(DnsCache *cache, uint64_t hash) {
+    return &cache->shards[(hash >> 24) % DNS_CACHE_SHARDS];
+}
+
+static struct dns_entry *find_entry(struct dns_shard *shard, const char *name,
+        uint64_t hash) {
+    struct dns_entry *e = shard->buckets[hash % DNS_SHARD_BUCKETS];
+    while(e != NULL && (e->hash != hash || strcmp(e->name, name) != 0)) {
+        e = e->next;
+    }
+    return e;
+}
+
+static void remove_entry(struct dns_shard *shard, struct dns_entry *e) {
+    struct dns_entry **link = &shard->buckets[e->hash % DNS_SHARD_BUCKETS];
+    while(*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+
+    if(e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        shard->oldest = e->newer;
+    }
+    if(e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        shard->newest = e->older;
+    }
+    shard->nentries--;
+    free(e);
+}
+
+int dns_cache_lookup(DnsCache *cache, const char *name, DnsAddr *addrs,
+        unsigned int *naddrs) {
+    if(cache == NULL || name == NULL || addrs == NULL || naddrs == NULL) {
+        return 1;
+    }
+    uint64_t hash = util_fnv1a_str(name);
+    struct dns_shard *shard = get_shard(cache, hash);
+    int status = 1;
+
+    pthread_mutex_lock(&shard->lock);
+    struct dns_entry *e = find_entry(shard, name, hash);
+    if(e != NULL && e->expires_ms <= util_now_ms()) {
+        remove_entry(shard, e);
+        e = NULL;
+    }
+    if(e != NULL) {
+        status = e->status;
+        *naddrs = e->naddrs;
+        memcpy(addrs, e->addrs, e->naddrs * sizeof(DnsAddr));
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return status;
+}
+
+int dns_cache_insert(DnsCache *cache, const char *name, int status,
+        const DnsAddr *addrs, unsigned int naddrs, unsigned int ttl) {
+    if(cache == NULL || name == NULL || strlen(name) > DNS_NAME_MAX ||
+            naddrs > DNS_MAX_ADDRS || (naddrs > 0 && addrs == NULL)) {
+        return -1;
+    }
+    struct dns_entry *e = malloc(sizeof(struct dns_entry));
+    if(e == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    strcpy(e->name, name);
+    e->hash = util_fnv1a_str(name);
+    e->status = status;
+    e->naddrs = naddrs;
+    if(naddrs > 0) {
+        memcpy(e->addrs, addrs, naddrs * sizeof(DnsAddr));
+    }
+    e->expires_ms = util_now_ms() + (uint64_t)ttl * 1000;
+
+    struct dns_shard *shard = get_shard(cache, e->hash);
+    pthread_mutex_lock(&shard->lock);
+    struct dns_entry *old = find_entry(shard, name, e->hash);
+    if(old != NULL) {
+        remove_entry(shard, old);
+    }
+    if(shard->nentries == DNS_SHARD_MAX) {
+        remove_entry(shard, shard->oldest);
+    }
+    e->next = shard->buckets[e->hash % DNS_SHARD_BUCKETS];
+    shard->buckets[e->hash % DNS_SHARD_BUCKETS] = e;
+    e->newer = NULL;
+    e->older = shard->newest;
+    if(shard->newest != NULL) {
+        shard->newest->newer = e;
+    } else {
+        shard->oldest = e;
+    }
+    shard->newest = e;
+    shard->nentries++;
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+void dns_cache_destroy(DnsCache *cache) {
+    if(cache == NULL) {
+        return;
+    }
+    for(int i = 0; i < DNS_CACHE_SHARDS; ++i) {
+        struct dns_shard *shard = &cache->shards[i];
+        while(shard->oldest != NULL) {
+            remove_entry(shard, shard->oldest);
+        }
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+/*
+ * Together with the port of its socket, the id is all that tells a
+ * spoofed answer from the real one, so it comes from getrandom(2)
+ */
+static uint16_t next_id(DnsResolver *resolver) {
+    if(resolver->nids == 0) {
+        if(getrandom(resolver->ids, sizeof(resolver->ids), 0) != sizeof(resolver->ids)) {
+            /* Only before Linux 3.17, the ids are then as weak as the clock */
+            uint64_t x = util_now_us();
+            for(unsigned int i = 0; i < DNS_ID_BATCH; ++i) {
+                x += 0x9e3779b97f4a7c15ull;
+                resolver->ids[i] = (uint16_t)((x ^ (x >> 31)) * 0xbf58476d1ce4e5b9ull >> 48);
+            }
+        }
+        resolver->nids = DNS_ID_BATCH;
+    }
+    return resolver->ids[--resolver->nids];
+}
+
+/* Lower case, without the final dot, made of valid labels */
+static int normalize_name(const char *name, char *out) {
+    size_t len = strlen(name);
+    if(len > 0 && name[len - 1] == '.') {
+        len--;
+    }
+    if(len == 0 || len > DNS_NAME_MAX) {
+        return -1;
+    }
+    size_t label = 0;
+    for(size_t i = 0; i < len; ++i) {
+        unsigned char c = name[i];
+        if(c == '.') {
+            if(label == 0) {
+                return -1;
+            }
+            label = 0;
+        } else if(isalnum(c) || c == '-' || c == '_') {
+            if(++label > 63) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+        out[i] = tolower(c);
+    }
+    out[len] = '\0';
+    return label == 0 ? -1 : 0;
+}
+
+static int parse_literal(const char *name, DnsAddr *addr) {
+    if(inet_pton(AF_INET, name, &addr->addr.v4) == 1) {
+        addr->family = AF_INET;
+        return 0;
+    }
+    if(inet_pton(AF_INET6, name, &addr->addr.v6) == 1) {
+        addr->family = AF_INET6;
+        return 0;
+    }
+    return -1;
+}
+
+static int read_nameserver(struct sockaddr_storage *ns, socklen_t *nslen) {
+    FILE *f = fopen("/etc/resolv.conf", "r");
+    char line[256], addr[64];
+    int found = 0;
+    while(f != NULL && !found && fgets(line, sizeof(line), f) != NULL) {
+        found = sscanf(line, " nameserver %63s", addr) == 1;
+    }
+    if(f != NULL) {
+        fclose(f);
+    }
+    if(!found) {
+        strcpy(addr, "127.0.0.1");
+    }
+
+    DnsAddr a;
+    if(parse_literal(addr, &a) == -1) {
+        return -1;
+    }
+    memset(ns, 0, sizeof(*ns));
+    if(a.family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)ns;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(DNS_PORT);
+        sin->sin_addr = a.addr.v4;
+        *nslen = sizeof(*sin);
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ns;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(DNS_PORT);
+        sin6->sin6_addr = a.addr.v6;
+        *nslen = sizeof(*sin6);
+    }
+    return 0;
+}
+
+static void dns_handler(ConnectionPool *conn_pool, int fd, unsigned int events, void *data);
+
+DnsResolver *dns_resolver_init(ConnectionPool *conn_pool, DnsCache *cache,
+        const struct sockaddr *ns, socklen_t nslen, unsigned int timeout_ms) {
+    if(conn_pool == NULL || cache == NULL) {
+        return NULL;
+    }
+    struct sockaddr_storage ns_storage;
+    if(ns == NULL) {
+        if(read_nameserver(&ns_storage, &nslen) == -1) {
+            fprintf(stderr, "Could not parse the nameserver of /etc/resolv.conf\n");
+            return NULL;
+        }
+        ns = (struct sockaddr *)&ns_storage;
+    }
+
+    if(nslen > sizeof(struct sockaddr_storage)) {
+        return NULL;
+    }
+
+    DnsResolver *resolver = malloc(sizeof(DnsResolver));
+    if(resolver == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    resolver->conn_pool = conn_pool;
+    resolver->cache = cache;
+    memcpy(&resolver->ns, ns, nslen);
+    resolver->nslen = nslen;
+    resolver->timeout_ms = timeout_ms;
+    resolver->queries = NULL;
+    resolver->nids = 0;
+    return resolver;
+}
+
+static void free_waiters(struct dns_waiter *w) {
+    while(w != NULL) {
+        struct dns_waiter *next = w->next;
+        free(w);
+        w = next;
+    }
+}
+
+/*
+ * Every query has a socket of its own, so a source port the kernel
+ * picked at random, which a spoofer has to guess along with the id.
+ * Connected, so that the kernel drops datagrams from anyone else.
+ */
+static int open_query(DnsResolver *resolver, struct dns_query *q) {
+    q->fd = socket(resolver->ns.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(q->fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if(connect(q->fd, (struct sockaddr *)&resolver->ns, resolver->nslen) == -1) {
+        perror("connect");
+        close(q->fd);
+        return -1;
+    }
+    if(conn_register_fd(resolver->conn_pool, q->fd, CONN_EV_READ, dns_handler, q) == -1) {
+        close(q->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void close_query(DnsResolver *resolver, struct dns_query *q) {
+    conn_remove_fd(resolver->conn_pool, q->fd);
+    close(q->fd);
+    free_waiters(q->waiters);
+    free(q);
+}
+
+static size_t build_query(const struct dns_query *q, unsigned char *buf) {
+    memset(buf, 0, 12);
+    buf[0] = q->id >> 8;
+    buf[1] = q->id & 0xFF;
+    buf[2] = 0x01; /* Recursion desired */
+    buf[5] = 1;    /* One question */
+
+    size_t pos = 12;
+    const char *label = q->name;
+    for(;;) {
+        const char *dot = strchr(label, '.');
+        size_t len = dot != NULL ? (size_t)(dot - label) : strlen(label);
+        buf[pos++] = len;
+        memcpy(buf + pos, label, len);
+        pos += len;
+        if(dot == NULL) {
+            break;
+        }
+        label = dot + 1;
+    }
+    buf[pos++] = 0;
+    buf[pos++] = 0;
+    buf[pos++] = q->qtype;
+    buf[pos++] = 0;
+    buf[pos++] = DNS_CLASS_IN;
+    return pos;
+}
+
+static void send_query(DnsResolver *resolver, struct dns_query *q) {
+    unsigned char buf[DNS_MSG_SZ];
+    q->id = next_id(resolver);
+    q->tries++;
+    q->deadline_ms = util_now_ms() + resolver->timeout_ms;
+    size_t len = build_query(q, buf);
+    /* A lost query is sent again once its deadline passes */
+    send(q->fd, buf, len, MSG_NOSIGNAL);
+}
+
+/* Takes q off the list, caches the answer and calls back every waiter */
+static void finish_query(DnsResolver *resolver, struct dns_query *q, int status,
+        const DnsAddr *addrs, unsigned int naddrs, unsigned int ttl) {
+    struct dns_query **link = &resolver->queries;
+    while(*link != q) {
+        link = &(*link)->next;
+    }
+    *link = q->next;
+
+    if(status == DNS_OK || status == DNS_ERR_NOTFOUND) {
+        dns_cache_insert(resolver->cache, q->name, status, addrs, naddrs,
+                ttl < DNS_MAX_TTL ? ttl : DNS_MAX_TTL);
+    }
+    for(struct dns_waiter *w = q->waiters; w != NULL; w = w->next) {
+        w->cb(status, addrs, naddrs, w->data);
+    }
+    close_query(resolver, q);
+}
+
+static uint16_t get16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/*
+ * Reads the (possibly compressed) name at *pos into out, which may
+ * be NULL to skip it. *pos moves past the name as it is in the
+ * record. Returns -1 if the name is malformed.
+ */
+static int read_name(const unsigned char *msg, size_t len, size_t *pos, char *out) {
+    size_t p = *pos, out_len = 0;
+    int jumped = 0, hops = 0;
+
+    for(;;) {
+        if(p >= len) {
+            return -1;
+        }
+        unsigned char c = msg[p];
+        if((c & 0xC0) == 0xC0) {
+            if(p + 1 >= len || ++hops > 16) {
+                return -1;
+            }
+            if(!jumped) {
+                *pos = p + 2;
+                jumped = 1;
+            }
+            p = ((c & 0x3F) << 8) | msg[p + 1];
+            continue;
+        }
+        if(c == 0) {
+            if(!jumped) {
+                *pos = p + 1;
+            }
+            break;
+        }
+        if(c > 63 || p + 1 + c > len || out_len + c + 1 > DNS_NAME_MAX + 1) {
+            return -1;
+        }
+        if(out != NULL) {
+            if(out_len > 0) {
+                out[out_len - 1] = '.';
+            }
+            for(unsigned int i = 0; i < c; ++i) {
+                out[out_len + i] = tolower(msg[p + 1 + i]);
+            }
+            out[out_len + c] = '\0';
+        }
+        out_len += c + 1;
+        p += c + 1;
+    }
+    if(out != NULL && out_len == 0) {
+        out[0] = '\0';
+    }
+    return 0;
+}
+
+/* Reads the fixed part of a record, returns -1 if it does not fit */
+static int read_record(const unsigned char *msg, size_t len, size_t *pos,
+        uint16_t *type, uint32_t *ttl, uint16_t *rdlen) {
+    if(read_name(msg, len, pos, NULL) == -1 || *pos + 10 > len) {
+        return -1;
+    }
+    *type = get16(msg + *pos);
+    *ttl = get32(msg + *pos + 4);
+    *rdlen = get16(msg + *pos + 8);
+    *pos += 10;
+    return *pos + *rdlen > len ? -1 : 0;
+}
+
+/* Returns 1 once q is over and freed, 0 while it still waits */
+static int handle_response(DnsResolver *resolver, struct dns_query *q,
+        const unsigned char *msg, size_t len) {
+    if(len < 12 || !(msg[2] & 0x80) || get16(msg) != q->id || get16(msg + 4) != 1) {
+        return 0;
+    }
+
+    /* The question must be the one that was asked */
+    char name[DNS_NAME_MAX + 1];
+    size_t pos = 12;
+    if(read_name(msg, len, &pos, name) == -1 || pos + 4 > len ||
+            strcmp(name, q->name) != 0 || get16(msg + pos) != q->qtype) {
+        return 0;
+    }
+    pos += 4;
+
+    int rcode = msg[3] & 0x0F;
+    if(rcode != 0 && rcode != DNS_RCODE_NXDOMAIN) {
+        finish_query(resolver, q, DNS_ERR_SERVFAIL, NULL, 0, 0);
+        return 1;
+    }
+
+    DnsAddr addrs[DNS_MAX_ADDRS];
+    unsigned int naddrs = 0;
+    uint32_t ttl = UINT32_MAX;
+    uint16_t type, rdlen;
+    uint32_t rr_ttl;
+    unsigned int nanswers = get16(msg + 6);
+    for(unsigned int i = 0; i < nanswers; ++i) {
+        if(read_record(msg, len, &pos, &type, &rr_ttl, &rdlen) == -1) {
+            return 0;
+        }
+        /* The TTL of a CNAME on the way bounds that of the addresses */
+        if(rr_ttl < ttl) {
+            ttl = rr_ttl;
+        }
+        if(type == q->qtype && naddrs < DNS_MAX_ADDRS) {
+            if(type == DNS_TYPE_A && rdlen == 4) {
+                addrs[naddrs].family = AF_INET;
+                memcpy(&addrs[naddrs++].addr.v4, msg + pos, 4);
+            } else if(type == DNS_TYPE_AAAA && rdlen == 16) {
+                addrs[naddrs].family = AF_INET6;
+                memcpy(&addrs[naddrs++].addr.v6, msg + pos, 16);
+            }
+        }
+        pos += rdlen;
+    }
+    if(naddrs > 0) {
+        finish_query(resolver, q, DNS_OK, addrs, naddrs, ttl);
+        return 1;
+    }
+
+    if(rcode == 0 && q->qtype == DNS_TYPE_A) {
+        /* The name exists but has no IPv4 address */
+        q->qtype = DNS_TYPE_AAAA;
+        q->tries = 0;
+        send_query(resolver, q);
+        return 0;
+    }
+
+    /* RFC 2308: negative answers live for the SOA minimum of the zone */
+    uint32_t neg_ttl = DNS_NEGATIVE_TTL;
+    unsigned int nauthority = get16(msg + 8);
+    for(unsigned int i = 0; i < nauthority; ++i) {
+        if(read_record(msg, len, &pos, &type, &rr_ttl, &rdlen) == -1) {
+            break;
+        }
+        size_t rdata = pos;
+        pos += rdlen;
+        if(type != DNS_TYPE_SOA) {
+            continue;
+        }
+        if(read_name(msg, len, &rdata, NULL) == -1 || read_name(msg, len, &rdata, NULL) == -1 ||
+                rdata + 20 > pos) {
+            break;
+        }
+        uint32_t minimum = get32(msg + rdata + 16);
+        neg_ttl = minimum < rr_ttl ? minimum : rr_ttl;
+        break;
+    }
+    finish_query(resolver, q, DNS_ERR_NOTFOUND, NULL, 0, neg_ttl);
+    return 1;
+}
+
+static void dns_handler(ConnectionPool *conn_pool, int fd, unsigned int events, void *data) {
+    UNUSED(conn_pool);
+    UNUSED(events);
+
+    struct dns_query *q = data;
+    unsigned char buf[DNS_MSG_SZ];
+    for(;;) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if(n == -1) {
+            /* An ICMP error of an earlier query is reported once, read on */
+            if(errno == EINTR || errno == ECONNREFUSED) {
+                continue;
+            }
+            break;
+        }
+        if(handle_response(q->resolver, q, buf, n)) {
+            return;
+        }
+    }
+}
+
+int dns_resolve(DnsResolver *resolver, const char *name, DnsCallback cb, void *data) {
+    if(resolver == NULL || name == NULL || cb == NULL) {
+        return -1;
+    }
+
+    DnsAddr addrs[DNS_MAX_ADDRS];
+    unsigned int naddrs = 0;
+    if(parse_literal(name, &addrs[0]) == 0) {
+        cb(DNS_OK, addrs, 1, data);
+        return 0;
+    }
+
+    char norm[DNS_NAME_MAX + 1];
+    if(normalize_name(name, norm) == -1) {
+        cb(DNS_ERR_FORMAT, NULL, 0, data);
+        return 0;
+    }
+    if(strcmp(norm, "localhost") == 0) {
+        parse_literal("127.0.0.1", &addrs[0]);
+        cb(DNS_OK, addrs, 1, data);
+        return 0;
+    }
+    int status = dns_cache_lookup(resolver->cache, norm, addrs, &naddrs);
+    if(status != 1) {
+        cb(status, status == DNS_OK ? addrs : NULL, naddrs, data);
+        return 0;
+    }
+
+    struct dns_waiter *w = malloc(sizeof(struct dns_waiter));
+    if(w == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    w->cb = cb;
+    w->data = data;
+
+    /* Waits along with the lookup of the same name, if any */
+    struct dns_query *q = resolver->queries;
+    while(q != NULL && strcmp(q->name, norm) != 0) {
+        q = q->next;
+    }
+    if(q == NULL) {
+        q = malloc(sizeof(struct dns_query));
+        if(q == NULL) {
+            perror("malloc");
+            free(w);
+            return -1;
+        }
+        if(open_query(resolver, q) == -1) {
+            free(q);
+            free(w);
+            return -1;
+        }
+        q->resolver = resolver;
+        strcpy(q->name, norm);
+        q->qtype = DNS_TYPE_A;
+        q->tries = 0;
+        q->waiters = NULL;
+        q->next = resolver->queries;
+        resolver->queries = q;
+        send_query(resolver, q);
+    }
+    w->next = q->waiters;
+    q->waiters = w;
+    return 1;
+}
+
+void dns_cancel(DnsResolver *resolver, void *data) {
+    if(resolver == NULL) {
+        return;
+    }
+    for(struct dns_query *q = resolver->queries; q != NULL; q = q->next) {
+        struct dns_waiter **link = &q->waiters;
+        while(*link != NULL) {
+            if((*link)->data == data) {
+                struct dns_waiter *w = *link;
+                *link = w->next;
+                free(w);
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+}
+
+void dns_resolver_tick(DnsResolver *resolver) {
+    if(resolver == NULL) {
+        return;
+    }
+    uint64_t now = util_now_ms();
+    struct dns_query *q = resolver->queries, *next;
+    for(; q != NULL; q = next) {
+        next = q->next;
+        if(now < q->deadline_ms) {
+            continue;
+        }
+        if(q->tries >= DNS_MAX_TRIES) {
+            finish_query(resolver, q, DNS_ERR_TIMEOUT, NULL, 0, 0);
+        } else {
+            send_query(resolver, q);
+        }
+    }
+}
+
+int dns_get_pending(DnsResolver *resolver) {
+    if(resolver == NULL) {
+        return -1;
+    }
+    int n = 0;
+    for(struct dns_query *q = resolver->queries; q != NULL; q = q->next) {
+        n++;
+    }
+    return n;
+}
+
+void dns_resolver_destroy(DnsResolver *resolver) {
+    if(resolver == NULL) {
+        return;
+    }
+    while(resolver->queries != NULL) {
+        struct dns_query *q = resolver->queries;
+        resolver->queries = q->next;
+        close_query(resolver, q);
+    }
+    free(resolver);
+}
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "health.h"
+#include "macro.h"
+#include "util.h"
+
+/* "HTTP/1.1 200", all a probe reads of the response */
+#define STATUS_LINE_LEN 12
+
+/* The request of a probe, the path and the host of the backend are bounded */
+#define REQUEST_SZ (HEALTH_PATH_SZ + BALANCER_HOST_SZ + BALANCER_PORT_SZ + 64)
+
+enum probe_state {
+    PROBE_IDLE,       /* Waiting for the next probe to be due */
+    PROBE_RESOLVING,  /* Waiting for the addresses of the backend */
+    PROBE_CONNECTING, /* Waiting for the connect(2) to the backend */
+    PROBE_SENDING,    /* Sending the request */
+    PROBE_READING     /* Waiting for the status line */
+};
+
+struct probe {
+    HealthChecker *checker;
+    unsigned int backend;
+    enum probe_state state;
+    int fd;
+    uint64_t due_ms;
+    size_t off;
+    char status[16];
+};
+
+struct health_checker {
+    ConnectionPool *conn_pool;
+    DnsCache *dns_cache;
+    int owns_cache;
+    DnsResolver *resolver;
+    Balancer *balancer;
+    char path[HEALTH_PATH_SZ];
+    unsigned int interval_ms;
+    unsigned int timeout_ms;
+    struct probe *probes;
+    unsigned int nprobes;
+    HealthStats stats;
+};
+
+static void probe_handler(ConnectionPool *conn_pool, int fd, unsigned int events, void *data);
+
+HealthChecker *health_init(ConnectionPool *conn_pool, DnsCache *dns_cache,
+        Balancer *balancer, const char *path, unsigned int interval_ms,
+        unsigned int timeout_ms) {
+    if(conn_pool == NULL || balancer_count(balancer) == 0) {
+        return NULL;
+    }
+    if(path != NULL && (path[0] != '/' || strlen(path) >= HEALTH_PATH_SZ)) {
+        fprintf(stderr, "Health check path %s must start with / and be shorter than %d bytes\n",
+                path, HEALTH_PATH_SZ);
+        return NULL;
+    }
+    HealthChecker *checker = calloc(1, sizeof(HealthChecker));
+    if(checker == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    checker->conn_pool = conn_pool;
+    checker->balancer = balancer;
+    if(path != NULL) {
+        strcpy(checker->path, path);
+    }
+    checker->interval_ms = interval_ms > 0 ? interval_ms : HEALTH_INTERVAL_MS;
+    checker->timeout_ms = timeout_ms > 0 ? timeout_ms : HEALTH_TIMEOUT_MS;
+    checker->nprobes = balancer_count(balancer);
+    checker->owns_cache = dns_cache == NULL;
+    checker->dns_cache = checker->owns_cache ? dns_cache_init() : dns_cache;
+    if(checker->dns_cache != NULL) {
+        /* A lookup slower than a probe fails it anyway */
+        checker->resolver = dns_resolver_init(conn_pool, checker->dns_cache, NULL, 0,
+                checker->timeout_ms);
+    }
+    checker->probes = calloc(checker->nprobes, sizeof(struct probe));
+    if(checker->resolver == NULL || checker->probes == NULL) {
+        if(checker->probes == NULL) {
+            perror("calloc");
+        }
+        health_destroy(checker);
+        return NULL;
+    }
+
+    /* The first probes spread over the first interval */
+    uint64_t now = util_now_ms();
+    for(unsigned int i = 0; i < checker->nprobes; ++i) {
+        struct probe *p = &checker->probes[i];
+        p->checker = checker;
+        p->backend = i;
+        p->state = PROBE_IDLE;
+        p->fd = -1;
+        p->due_ms = now + (uint64_t)checker->interval_ms * i / checker->nprobes;
+    }
+    return checker;
+}
+
+/* Leaves the probe with nothing in flight */
+static void stop_probe(struct probe *p) {
+    HealthChecker *checker = p->checker;
+    if(p->state == PROBE_RESOLVING) {
+        dns_cancel(checker->resolver, p);
+    }
+    if(p->fd != -1) {
+        conn_remove_fd(checker->conn_pool, p->fd);
+        close(p->fd);
+        p->fd = -1;
+    }
+    p->state = PROBE_IDLE;
+}
+
+static void finish_probe(struct probe *p, int ok) {
+    HealthChecker *checker = p->checker;
+    stop_probe(p);
+    checker->stats.probes++;
+    if(!ok) {
+        checker->stats.failures++;
+    }
+    balancer_probe(checker->balancer, p->backend, ok);
+    p->due_ms = util_now_ms() + checker->interval_ms;
+}
+
+/* Non-blocking connect(2) to the first address that takes it */
+static int connect_backend(const struct probe *p, const DnsAddr *addrs, unsigned int naddrs) {
+    char *end;
+    unsigned long port = strtoul(balancer_port(p->checker->balancer, p->backend), &end, 10);
+    if(*end != '\0' || port == 0 || port > 65535) {
+        return -1;
+    }
+
+    int fd = -1;
+    for(unsigned int i = 0; i < naddrs; ++i) {
+        struct sockaddr_storage ss;
+        socklen_t sslen;
+        memset(&ss, 0, sizeof(ss));
+        if(addrs[i].family == AF_INET) {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(port);
+            sin->sin_addr = addrs[i].addr.v4;
+            sslen = sizeof(*sin);
+        } else {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(port);
+            sin6->sin6_addr = addrs[i].addr.v6;
+            sslen = sizeof(*sin6);
+        }
+        fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(fd == -1) {
+            continue;
+        }
+        if(connect(fd, (struct sockaddr *)&ss, sslen) == 0 || errno == EINPROGRESS) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static void on_resolved(int status, const DnsAddr *addrs, unsigned int naddrs, void *data) {
+    struct probe *p = data;
+    if(p->state != PROBE_RESOLVING) {
+        return;
+    }
+    /* Not in flight anymore, stop_probe must not cancel it */
+    p->state = PROBE_CONNECTING;
+    if(status != DNS_OK || (p->fd = connect_backend(p, addrs, naddrs)) == -1) {
+        finish_probe(p, 0);
+        return;
+    }
+    if(conn_register_fd(p->checker->conn_pool, p->fd, CONN_EV_WRITE, probe_handler, p) == -1) {
+        close(p->fd);
+        p->fd = -1;
+        finish_probe(p, 0);
+    }
+}
+
+static void start_probe(struct probe *p) {
+    HealthChecker *checker = p->checker;
+    p->state = PROBE_RESOLVING;
+    p->due_ms = util_now_ms() + checker->timeout_ms;
+    p->off = 0;
+    /* An answer known already comes back before dns_resolve returns */
+    if(dns_resolve(checker->resolver, balancer_host(checker->balancer, p->backend),
+                on_resolved, p) == -1) {
+        p->state = PROBE_CONNECTING;
+        finish_probe(p, 0);
+    }
+}
+
+/* The request of a probe, the Host is the backend itself */
+static int probe_request(const struct probe *p, char *buf) {
+    const char *host = balancer_host(p->checker->balancer, p->backend);
+    const char *port = balancer_port(p->checker->balancer, p->backend);
+    int v6 = strchr(host, ':') != NULL;
+    return snprintf(buf, REQUEST_SZ, "GET %s HTTP/1.1\r\nHost: %s%s%s:%s\r\n"
+            "Connection: close\r\n\r\n", p->checker->path, v6 ? "[" : "", host,
+            v6 ? "]" : "", port);
+}
+
+/* Returns 1 once the request is out, 0 while it is not, -1 on failure */
+static int send_request(struct probe *p) {
+    char req[REQUEST_SZ];
+    size_t len = probe_request(p, req);
+    while(p->off < len) {
+        ssize_t n = send(p->fd, req + p->off, len - p->off, MSG_NOSIGNAL);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        p->off += n;
+    }
+    return 1;
+}
+
+/* Returns 1 once the status line is read, 0 while it is not, -1 on failure */
+static int read_status(struct probe *p) {
+    while(p->off < STATUS_LINE_LEN) {
+        ssize_t n = recv(p->fd, p->status + p->off, STATUS_LINE_LEN - p->off, 0);
+        if(n == 0) {
+            return -1;
+        }
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        p->off += n;
+    }
+    return 1;
+}
+
+static void probe_handler(ConnectionPool *conn_pool, int fd, unsigned int events, void *data) {
+    UNUSED(fd);
+    UNUSED(events);
+
+    struct probe *p = data;
+    int status;
+    switch(p->state) {
+        case PROBE_CONNECTING: {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if(getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+                err = errno;
+            }
+            if(err == EINPROGRESS || err == EALREADY) {
+                return;
+            }
+            if(err != 0 || p->checker->path[0] == '\0') {
+                finish_probe(p, err == 0);
+                return;
+            }
+            p->state = PROBE_SENDING;
+            p->off = 0;
+        }
+            /* fall through */
+        case PROBE_SENDING:
+            if((status = send_request(p)) <= 0) {
+                if(status == -1) {
+                    finish_probe(p, 0);
+                }
+                return;
+            }
+            if(conn_modify_fd(conn_pool, p->fd, CONN_EV_READ) == -1) {
+                finish_probe(p, 0);
+                return;
+            }
+            p->state = PROBE_READING;
+            p->off = 0;
+            return;
+        case PROBE_READING:
+            if((status = read_status(p)) == 0) {
+                return;
+            }
+            /* "HTTP/1.x 2xx" or "HTTP/1.x 3xx" */
+            finish_probe(p, status == 1 && memcmp(p->status, "HTTP/1.", 7) == 0 &&
+                    p->status[8] == ' ' && (p->status[9] == '2' || p->status[9] == '3'));
+            return;
+        default:
+            return;
+    }
+}
+
+int health_timeout(HealthChecker *checker, int max_ms) {
+    if(checker == NULL) {
+        return max_ms;
+    }
+    uint64_t now = util_now_ms();
+    int timeout = max_ms;
+    for(unsigned int i = 0; i < checker->nprobes; ++i) {
+        uint64_t due = checker->probes[i].due_ms;
+        int ms = due > now ? (int)(due - now) : 0;
+        if(timeout < 0 || ms < timeout) {
+            timeout = ms;
+        }
+    }
+    return timeout;
+}
+
+void health_tick(HealthChecker *checker) {
+    if(checker == NULL) {
+        return;
+    }
+    dns_resolver_tick(checker->resolver);
+    uint64_t now = util_now_ms();
+    balancer_tick(checker->balancer, now);
+    for(unsigned int i = 0; i < checker->nprobes; ++i) {
+        struct probe *p = &checker->probes[i];
+        if(now < p->due_ms) {
+            continue;
+        }
+        if(p->state == PROBE_IDLE) {
+            start_probe(p);
+        } else {
+            checker->stats.timeouts++;
+            finish_probe(p, 0);
+        }
+    }
+}
+
+int health_get_stats(const HealthChecker *checker, HealthStats *stats) {
+    if(checker == NULL || stats == NULL) {
+        return -1;
+    }
+    *stats = checker->stats;
+    return 0;
+}
+
+void health_destroy(HealthChecker *checker) {
+    if(checker == NULL) {
+        return;
+    }
+    for(unsigned int i = 0; checker->probes != NULL && i < checker->nprobes; ++i) {
+        stop_probe(&checker->probes[i]);
+    }
+    free(checker->probes);
+    dns_resolver_destroy(checker->resolver);
+    if(checker->owns_cache) {
+        dns_cache_destroy(checker->dns_cache);
+    }
+    free(checker);
+}
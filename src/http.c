@@ -0,0 +1,579 @@
+#include <string.h>
+#include <strings.h>
+
+#include "http.h"
+
+enum head_state {
+    H_START,
+    H_METHOD,
+    H_TARGET,
+    H_REQ_VERSION,
+    H_RESP_VERSION,
+    H_STATUS,
+    H_STATUS_SP,
+    H_REASON,
+    H_LINE_LF,
+    H_HDR_START,
+    H_HDR_NAME,
+    H_HDR_OWS,
+    H_HDR_VALUE,
+    H_HDR_LF,
+    H_END_LF,
+    H_DONE
+};
+
+enum chunk_state {
+    C_SIZE_FIRST,
+    C_SIZE,
+    C_EXT,
+    C_SIZE_LF,
+    C_DATA,
+    C_DATA_CR,
+    C_DATA_LF,
+    C_TRAILER_START,
+    C_TRAILER,
+    C_END_LF
+};
+
+enum te_kind {
+    TE_NONE,
+    TE_CHUNKED,
+    TE_OTHER
+};
+
+/* RFC 9110 tchar, the characters of methods and header names */
+static const unsigned char s_tchar[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1,
+    ['*'] = 1, ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1,
+    ['`'] = 1, ['|'] = 1, ['~'] = 1,
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1,
+    ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1,
+    ['G'] = 1, ['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1,
+    ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1,
+    ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1,
+    ['Y'] = 1, ['Z'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1,
+    ['g'] = 1, ['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1,
+    ['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1,
+    ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1,
+    ['y'] = 1, ['z'] = 1,
+};
+
+static int hex_val(unsigned char c) {
+    if(c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if(c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+static HttpSlice make_slice(size_t off, size_t end) {
+    HttpSlice s = { (uint32_t)off, (uint32_t)(end - off) };
+    return s;
+}
+
+int http_slice_eq(const char *buf, HttpSlice slice, const char *s) {
+    return strlen(s) == slice.len && strncasecmp(buf + slice.off, s, slice.len) == 0;
+}
+
+void http_parser_init(HttpParser *parser, HttpKind kind, unsigned int flags) {
+    if(parser == NULL) {
+        return;
+    }
+    memset(parser, 0, sizeof(*parser));
+    parser->kind = kind;
+    parser->content_length = -1;
+    parser->status = -1;
+    parser->_flags = flags;
+    parser->_state = kind == HTTP_REQUEST ? H_START : H_RESP_VERSION;
+}
+
+static int fail(HttpParser *parser, HttpError error) {
+    parser->error = error;
+    return HTTP_PARSE_ERROR;
+}
+
+/* "HTTP/x.y" */
+static int parse_version(HttpParser *parser, const char *v, size_t len) {
+    if(len != 8 || memcmp(v, "HTTP/", 5) != 0 || v[6] != '.' ||
+            v[5] < '0' || v[5] > '9' || v[7] < '0' || v[7] > '9') {
+        return fail(parser, HTTP_ERR_SYNTAX);
+    }
+    parser->version_major = v[5] - '0';
+    parser->version_minor = v[7] - '0';
+    if(parser->version_major != 1) {
+        return fail(parser, HTTP_ERR_VERSION);
+    }
+    return 0;
+}
+
+/* Whether token is one of the comma separated tokens of a header value */
+static int has_token(const char *v, size_t len, const char *token) {
+    size_t token_len = strlen(token);
+    size_t i = 0;
+    while(i < len) {
+        while(i < len && (v[i] == ' ' || v[i] == '\t' || v[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while(i < len && v[i] != ',') {
+            i++;
+        }
+        size_t end = i;
+        while(end > start && (v[end - 1] == ' ' || v[end - 1] == '\t')) {
+            end--;
+        }
+        if(end - start == token_len && strncasecmp(v + start, token, token_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* The framing and persistence of the message depend on a few headers */
+static int on_header(HttpParser *parser, const char *buf, const HttpHeader *h) {
+    const char *v = buf + h->value.off;
+    size_t len = h->value.len;
+
+    if(http_slice_eq(buf, h->name, "Content-Length")) {
+        if(len == 0 || len > 18) {
+            return fail(parser, HTTP_ERR_CONTENT_LENGTH);
+        }
+        int64_t cl = 0;
+        for(size_t i = 0; i < len; ++i) {
+            if(v[i] < '0' || v[i] > '9') {
+                return fail(parser, HTTP_ERR_CONTENT_LENGTH);
+            }
+            cl = cl * 10 + (v[i] - '0');
+        }
+        if(parser->content_length != -1 && parser->content_length != cl) {
+            return fail(parser, HTTP_ERR_CONTENT_LENGTH);
+        }
+        parser->content_length = cl;
+    } else if(http_slice_eq(buf, h->name, "Transfer-Encoding")) {
+        /* Only the last coding tells whether the body is chunked */
+        size_t end = len, start;
+        while(end > 0 && (v[end - 1] == ' ' || v[end - 1] == '\t')) {
+            end--;
+        }
+        start = end;
+        while(start > 0 && v[start - 1] != ',') {
+            start--;
+        }
+        while(start < end && (v[start] == ' ' || v[start] == '\t')) {
+            start++;
+        }
+        if(end - start == 7 && strncasecmp(v + start, "chunked", 7) == 0) {
+            parser->_te_chunked = TE_CHUNKED;
+        } else {
+            parser->_te_chunked = TE_OTHER;
+        }
+    } else if(http_slice_eq(buf, h->name, "Connection")) {
+        if(has_token(v, len, "close")) {
+            parser->_conn_close = 1;
+        }
+        if(has_token(v, len, "keep-alive")) {
+            parser->_conn_keep_alive = 1;
+        }
+        if(has_token(v, len, "upgrade")) {
+            parser->upgrade = 1;
+        }
+    }
+    return 0;
+}
+
+static int on_head_done(HttpParser *parser) {
+    int te = parser->_te_chunked;
+
+    if(parser->kind == HTTP_REQUEST) {
+        if(te == TE_OTHER || (te == TE_CHUNKED && parser->content_length != -1)) {
+            /* Ambiguous framing is how requests get smuggled */
+            return fail(parser, HTTP_ERR_FRAMING);
+        }
+        if(te == TE_CHUNKED) {
+            parser->body = HTTP_BODY_CHUNKED;
+        } else if(parser->content_length > 0) {
+            parser->body = HTTP_BODY_LENGTH;
+        } else {
+            parser->body = HTTP_BODY_NONE;
+        }
+    } else {
+        int status = parser->status;
+        if((parser->_flags & HTTP_PARSER_NO_BODY) || (status >= 100 && status < 200) ||
+                status == 204 || status == 304) {
+            parser->body = HTTP_BODY_NONE;
+        } else if(te == TE_CHUNKED) {
+            parser->body = HTTP_BODY_CHUNKED;
+        } else if(te == TE_OTHER) {
+            parser->body = HTTP_BODY_UNTIL_CLOSE;
+        } else if(parser->content_length >= 0) {
+            parser->body = parser->content_length > 0 ? HTTP_BODY_LENGTH : HTTP_BODY_NONE;
+        } else {
+            parser->body = HTTP_BODY_UNTIL_CLOSE;
+        }
+    }
+
+    if(parser->version_minor >= 1) {
+        parser->keep_alive = !parser->_conn_close;
+    } else {
+        parser->keep_alive = parser->_conn_keep_alive && !parser->_conn_close;
+    }
+    if(parser->body == HTTP_BODY_UNTIL_CLOSE ||
+            (te == TE_CHUNKED && parser->content_length != -1)) {
+        parser->keep_alive = 0;
+    }
+
+    if(parser->body == HTTP_BODY_LENGTH) {
+        parser->_remaining = (uint64_t)parser->content_length;
+    }
+    parser->_chunk_state = C_SIZE_FIRST;
+    return 0;
+}
+
+int http_parse_head(HttpParser *parser, const char *buf, size_t len) {
+    if(parser == NULL || buf == NULL) {
+        return HTTP_PARSE_ERROR;
+    }
+    if(parser->_state == H_DONE) {
+        return HTTP_PARSE_DONE;
+    }
+    if(len > UINT32_MAX) {
+        return fail(parser, HTTP_ERR_SYNTAX);
+    }
+
+    int state = parser->_state;
+    size_t mark = parser->_mark;
+    size_t i;
+
+    for(i = parser->_pos; i < len; ++i) {
+        unsigned char c = buf[i];
+        switch(state) {
+            case H_START:
+                /* Empty lines before the request line are ignored */
+                if(c == '\r' || c == '\n') {
+                    break;
+                }
+                mark = i;
+                state = H_METHOD;
+                /* fall through */
+            case H_METHOD:
+                if(c == ' ') {
+                    if(i == mark) {
+                        return fail(parser, HTTP_ERR_SYNTAX);
+                    }
+                    parser->method = make_slice(mark, i);
+                    mark = i + 1;
+                    state = H_TARGET;
+                } else if(!s_tchar[c]) {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                break;
+            case H_TARGET:
+                if(c == ' ') {
+                    if(i == mark) {
+                        return fail(parser, HTTP_ERR_SYNTAX);
+                    }
+                    parser->target = make_slice(mark, i);
+                    mark = i + 1;
+                    state = H_REQ_VERSION;
+                } else if(c <= ' ' || c == 0x7F) {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                break;
+            case H_REQ_VERSION:
+                if(c == '\r') {
+                    if(parse_version(parser, buf + mark, i - mark) == HTTP_PARSE_ERROR) {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    state = H_LINE_LF;
+                } else if(i - mark >= 8) {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                break;
+            case H_RESP_VERSION:
+                if(c == ' ') {
+                    if(parse_version(parser, buf + mark, i - mark) == HTTP_PARSE_ERROR) {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    parser->status = 0;
+                    mark = i + 1;
+                    state = H_STATUS;
+                } else if(i - mark >= 8) {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                break;
+            case H_STATUS:
+                if(c < '0' || c > '9') {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                parser->status = parser->status * 10 + (c - '0');
+                if(i - mark == 2) {
+                    state = H_STATUS_SP;
+                }
+                break;
+            case H_STATUS_SP:
+                if(c == ' ') {
+                    mark = i + 1;
+                    state = H_REASON;
+                } else if(c == '\r') {
+                    parser->reason = make_slice(i, i);
+                    state = H_LINE_LF;
+                } else {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                break;
+            case H_REASON:
+                if(c == '\r') {
+                    parser->reason = make_slice(mark, i);
+                    state = H_LINE_LF;
+                } else if((c < ' ' && c != '\t') || c == 0x7F) {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                break;
+            case H_LINE_LF:
+            case H_HDR_LF:
+                if(c != '\n') {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                state = H_HDR_START;
+                break;
+            case H_HDR_START:
+                if(c == '\r') {
+                    state = H_END_LF;
+                    break;
+                }
+                if(!s_tchar[c]) {
+                    /* Includes obsolete line folding */
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                if(parser->nheaders == HTTP_MAX_HEADERS) {
+                    return fail(parser, HTTP_ERR_TOO_MANY_HEADERS);
+                }
+                mark = i;
+                state = H_HDR_NAME;
+                break;
+            case H_HDR_NAME:
+                if(c == ':') {
+                    parser->headers[parser->nheaders].name = make_slice(mark, i);
+                    state = H_HDR_OWS;
+                } else if(!s_tchar[c]) {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                break;
+            case H_HDR_OWS:
+                if(c == ' ' || c == '\t') {
+                    break;
+                }
+                mark = i;
+                state = H_HDR_VALUE;
+                /* fall through */
+            case H_HDR_VALUE:
+                if(c == '\r') {
+                    size_t end = i;
+                    while(end > mark && (buf[end - 1] == ' ' || buf[end - 1] == '\t')) {
+                        end--;
+                    }
+                    HttpHeader *h = &parser->headers[parser->nheaders++];
+                    h->value = make_slice(mark, end);
+                    if(on_header(parser, buf, h) == HTTP_PARSE_ERROR) {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    state = H_HDR_LF;
+                } else if((c < ' ' && c != '\t') || c == 0x7F) {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                break;
+            case H_END_LF:
+                if(c != '\n') {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                parser->head_len = i + 1;
+                parser->_state = H_DONE;
+                parser->_pos = i + 1;
+                if(on_head_done(parser) == HTTP_PARSE_ERROR) {
+                    return HTTP_PARSE_ERROR;
+                }
+                return HTTP_PARSE_DONE;
+        }
+    }
+
+    parser->_state = state;
+    parser->_mark = mark;
+    parser->_pos = i;
+    return HTTP_PARSE_AGAIN;
+}
+
+static int parse_chunked(HttpParser *parser, const char *buf, size_t len,
+        size_t *consumed) {
+    int state = parser->_chunk_state;
+    size_t i = 0;
+
+    while(i < len) {
+        if(state == C_DATA) {
+            /* Skipped as a whole, the data is never looked at */
+            size_t n = len - i;
+            if(n > parser->_remaining) {
+                n = parser->_remaining;
+            }
+            parser->_remaining -= n;
+            i += n;
+            if(parser->_remaining == 0) {
+                state = C_DATA_CR;
+            }
+            continue;
+        }
+
+        unsigned char c = buf[i++];
+        int h;
+        switch(state) {
+            case C_SIZE_FIRST:
+            case C_SIZE:
+                h = hex_val(c);
+                if(h >= 0) {
+                    if(parser->_remaining > (UINT64_MAX >> 4)) {
+                        return fail(parser, HTTP_ERR_SYNTAX);
+                    }
+                    parser->_remaining = (parser->_remaining << 4) | h;
+                    state = C_SIZE;
+                    break;
+                }
+                if(state == C_SIZE_FIRST) {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                if(c == '\r') {
+                    state = C_SIZE_LF;
+                } else if(c == ';' || c == ' ' || c == '\t') {
+                    state = C_EXT;
+                } else {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                break;
+            case C_EXT:
+                if(c == '\r') {
+                    state = C_SIZE_LF;
+                }
+                break;
+            case C_SIZE_LF:
+                if(c != '\n') {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                state = parser->_remaining == 0 ? C_TRAILER_START : C_DATA;
+                break;
+            case C_DATA_CR:
+                if(c != '\r') {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                state = C_DATA_LF;
+                break;
+            case C_DATA_LF:
+                if(c != '\n') {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                state = C_SIZE_FIRST;
+                break;
+            case C_TRAILER_START:
+                state = c == '\r' ? C_END_LF : C_TRAILER;
+                break;
+            case C_TRAILER:
+                if(c == '\n') {
+                    state = C_TRAILER_START;
+                }
+                break;
+            case C_END_LF:
+                if(c != '\n') {
+                    return fail(parser, HTTP_ERR_SYNTAX);
+                }
+                parser->_chunk_state = state;
+                *consumed = i;
+                return HTTP_PARSE_DONE;
+        }
+    }
+
+    parser->_chunk_state = state;
+    *consumed = i;
+    return HTTP_PARSE_AGAIN;
+}
+
+int http_parse_body(HttpParser *parser, const char *buf, size_t len,
+        size_t *consumed) {
+    if(parser == NULL || consumed == NULL || (buf == NULL && len > 0)) {
+        return HTTP_PARSE_ERROR;
+    }
+    if(parser->_state != H_DONE) {
+        return fail(parser, HTTP_ERR_SYNTAX);
+    }
+
+    size_t n;
+    switch(parser->body) {
+        case HTTP_BODY_NONE:
+            *consumed = 0;
+            return HTTP_PARSE_DONE;
+        case HTTP_BODY_LENGTH:
+            n = len < parser->_remaining ? len : parser->_remaining;
+            parser->_remaining -= n;
+            *consumed = n;
+            return parser->_remaining == 0 ? HTTP_PARSE_DONE : HTTP_PARSE_AGAIN;
+        case HTTP_BODY_CHUNKED:
+            return parse_chunked(parser, buf, len, consumed);
+        case HTTP_BODY_UNTIL_CLOSE:
+            *consumed = len;
+            return HTTP_PARSE_AGAIN;
+    }
+    return fail(parser, HTTP_ERR_SYNTAX);
+}
+
+uint64_t http_body_remaining(const HttpParser *parser) {
+    if(parser == NULL) {
+        return 0;
+    }
+    switch(parser->body) {
+        case HTTP_BODY_LENGTH:
+            return parser->_remaining;
+        case HTTP_BODY_CHUNKED:
+            return parser->_chunk_state == C_DATA ? parser->_remaining : 0;
+        case HTTP_BODY_UNTIL_CLOSE:
+            return UINT64_MAX;
+        case HTTP_BODY_NONE:
+            break;
+    }
+    return 0;
+}
+
+int http_body_skip(HttpParser *parser, uint64_t n) {
+    if(parser == NULL || n > http_body_remaining(parser)) {
+        return HTTP_PARSE_ERROR;
+    }
+    switch(parser->body) {
+        case HTTP_BODY_LENGTH:
+            parser->_remaining -= n;
+            return parser->_remaining == 0 ? HTTP_PARSE_DONE : HTTP_PARSE_AGAIN;
+        case HTTP_BODY_CHUNKED:
+            parser->_remaining -= n;
+            if(parser->_remaining == 0) {
+                parser->_chunk_state = C_DATA_CR;
+            }
+            return HTTP_PARSE_AGAIN;
+        case HTTP_BODY_UNTIL_CLOSE:
+            return HTTP_PARSE_AGAIN;
+        case HTTP_BODY_NONE:
+            break;
+    }
+    return HTTP_PARSE_DONE;
+}
+
+const HttpHeader *http_find_header(const HttpParser *parser,
+        const char *buf, const char *name) {
+    if(parser == NULL || buf == NULL || name == NULL) {
+        return NULL;
+    }
+    for(unsigned int i = 0; i < parser->nheaders; ++i) {
+        if(http_slice_eq(buf, parser->headers[i].name, name)) {
+            return &parser->headers[i];
+        }
+    }
+    return NULL;
+}
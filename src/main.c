@@ -1,18 +1,91 @@
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "admission.h"
+#include "balancer.h"
 #include "macro.h"
 #include "server.h"
 
+static int parse_uint(const char *s, unsigned int *val) {
+    char *end;
+    unsigned long ret = strtoul(s, &end, 10);
+    if(*s == '\0' || *end != '\0' || ret > 0xFFFF) {
+        return -1;
+    }
+    *val = (unsigned int)ret;
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if(argc != 3) {
-        P_USAGE_EXIT(argv[0]);
+    ProxyConfig config;
+    memset(&config, 0, sizeof(config));
+    char *backends[BALANCER_MAX_BACKENDS];
+    config.backends = backends;
+
+    int opt;
+    while((opt = getopt(argc, argv, "p:t:c:d:D:m:r:R:l:u:b:H:")) != -1) {
+        switch(opt) {
+            case 'p':
+                config.port = optarg;
+                break;
+            case 't':
+                if(parse_uint(optarg, &config.nworkers) == -1) {
+                    P_USAGE_EXIT(argv[0]);
+                }
+                break;
+            case 'c':
+                if(parse_uint(optarg, &config.cache_mb) == -1) {
+                    P_USAGE_EXIT(argv[0]);
+                }
+                break;
+            case 'd':
+                config.disk_cache = optarg;
+                break;
+            case 'D':
+                if(parse_uint(optarg, &config.disk_cache_mb) == -1) {
+                    P_USAGE_EXIT(argv[0]);
+                }
+                break;
+            case 'm':
+                config.metrics_port = optarg;
+                break;
+            case 'r':
+                if(parse_uint(optarg, &config.conn_rate) == -1) {
+                    P_USAGE_EXIT(argv[0]);
+                }
+                break;
+            case 'R':
+                if(parse_uint(optarg, &config.client_rate) == -1) {
+                    P_USAGE_EXIT(argv[0]);
+                }
+                break;
+            case 'l':
+                if(parse_uint(optarg, &config.max_inflight) == -1) {
+                    P_USAGE_EXIT(argv[0]);
+                }
+                break;
+            case 'u':
+                if(config.nbackends == BALANCER_MAX_BACKENDS) {
+                    P_USAGE_EXIT(argv[0]);
+                }
+                backends[config.nbackends++] = optarg;
+                break;
+            case 'b':
+                config.balance = optarg;
+                break;
+            case 'H':
+                config.health_path = optarg;
+                break;
+            default:
+                P_USAGE_EXIT(argv[0]);
+        }
     }
-    if(strcmp(argv[1], "-p") != 0) {
+    if(config.port == NULL || optind != argc) {
         P_USAGE_EXIT(argv[0]);
     }
 
-    if(run_proxy_server(argv[2]) == -1) {
+    if(run_proxy_server(&config) == -1) {
         exit(EXIT_FAILURE);
     }
 
@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+struct metric_hist {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t sum;
+};
+
+struct metrics {
+    uint64_t counters[METRIC_COUNTERS];
+    uint64_t backends[BALANCER_MAX_BACKENDS][METRIC_BACKEND_COUNTERS];
+    struct metric_hist hists[METRIC_HISTS];
+} __attribute__((aligned(64)));
+
+/* Upper bounds of the buckets of the Prometheus histograms, in microseconds */
+static const uint64_t s_bounds_us[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+static const char *s_hist_names[METRIC_HISTS] = {
+    [METRIC_ACCEPT_TO_FIRST_BYTE] = "proxy_accept_to_first_byte_seconds",
+    [METRIC_UPSTREAM_CONNECT] = "proxy_upstream_connect_seconds",
+    [METRIC_TIME_TO_FIRST_BYTE] = "proxy_time_to_first_byte_seconds",
+    [METRIC_REQUEST_TIME] = "proxy_request_duration_seconds"
+};
+
+static const char *s_hist_help[METRIC_HISTS] = {
+    [METRIC_ACCEPT_TO_FIRST_BYTE] = "Time from the accept to the first byte of the request.",
+    [METRIC_UPSTREAM_CONNECT] = "Time to connect to the origin.",
+    [METRIC_TIME_TO_FIRST_BYTE] = "Time from the request head to the first byte of the response.",
+    [METRIC_REQUEST_TIME] = "Time from the first byte of the request to the end of the response."
+};
+
+/* Labels of the errors, indexed from METRIC_ERR_BAD_REQUEST */
+static const char *s_error_kinds[] = {
+    "bad_request", "head_too_large", "bad_gateway", "gateway_timeout",
+    "client_timeout", "idle_timeout", "aborted", "overloaded", "no_backend"
+};
+
+struct counter_desc {
+    MetricCounter counter;
+    const char *name;
+    const char *label; /* Tells apart the counters of a family, NULL for none */
+    const char *type;
+    const char *help;
+};
+
+/* The counters past the errors, those of a family follow each other */
+static const struct counter_desc s_counters[] = {
+    { METRIC_ACCEPT_BATCHES, "proxy_accept_batches_total", NULL, "counter",
+        "Drains of the listening sockets that took a connection." },
+    { METRIC_ACCEPT_SHED, "proxy_accept_dropped_total", "reason=\"no_descriptor\"", "counter",
+        "Connections closed right after their accept." },
+    { METRIC_ACCEPT_ERRORS, "proxy_accept_dropped_total", "reason=\"error\"", "counter", NULL },
+    { METRIC_ADMISSION_RESET, "proxy_admission_reset_total", "reason=\"rate\"", "counter",
+        "Connections reset over a rate." },
+    { METRIC_ADMISSION_RESET_CLIENT, "proxy_admission_reset_total", "reason=\"client_rate\"",
+        "counter", NULL },
+    { METRIC_ADMISSION_LIMIT, "proxy_admission_limit", NULL, "gauge",
+        "Requests let in at once at most, 0 for no limit." },
+    { METRIC_ADMISSION_INFLIGHT, "proxy_admission_inflight", NULL, "gauge",
+        "Requests let in and not over yet." },
+    { METRIC_POOL_HITS, "proxy_upstream_pool_hits_total", NULL, "counter",
+        "Idle upstream connections reused." },
+    { METRIC_POOL_MISSES, "proxy_upstream_pool_misses_total", NULL, "counter",
+        "Requests that found no idle upstream connection." },
+    { METRIC_POOL_STALE, "proxy_upstream_pool_dropped_total", "reason=\"stale\"", "counter",
+        "Idle upstream connections closed without being reused." },
+    { METRIC_POOL_EXPIRED, "proxy_upstream_pool_dropped_total", "reason=\"expired\"", "counter",
+        NULL },
+    { METRIC_POOL_EVICTED, "proxy_upstream_pool_dropped_total", "reason=\"evicted\"", "counter",
+        NULL },
+    { METRIC_POOL_IDLE, "proxy_upstream_pool_idle", NULL, "gauge",
+        "Idle upstream connections kept." },
+    { METRIC_TUNNELS_OPENED, "proxy_tunnels_total", NULL, "counter",
+        "Tunnels and upgrades the origin was connected for." },
+    { METRIC_TUNNELS_ACTIVE, "proxy_tunnels_active", NULL, "gauge",
+        "Tunnels and upgrades open." },
+    { METRIC_COLLAPSE_LEADERS, "proxy_collapse_leaders_total", NULL, "counter",
+        "Cache misses that fetched a response others could follow." },
+    { METRIC_COLLAPSE_FOLLOWERS, "proxy_collapse_followers_total", NULL, "counter",
+        "Cache misses that followed the fetch of another one." },
+    { METRIC_COLLAPSE_FALLBACKS, "proxy_collapse_fallbacks_total", NULL, "counter",
+        "Followers that fetched the response on their own." },
+    { METRIC_COLLAPSE_TIMEOUTS, "proxy_collapse_fallback_timeouts_total", NULL, "counter",
+        "Of those, the ones whose leader had no head in time." },
+    { METRIC_HEALTH_PROBES, "proxy_health_probes_total", NULL, "counter",
+        "Health probes of the backends over." },
+    { METRIC_HEALTH_FAILURES, "proxy_health_probe_failures_total", NULL, "counter",
+        "Health probes that failed." },
+    { METRIC_HEALTH_TIMEOUTS, "proxy_health_probe_timeouts_total", NULL, "counter",
+        "Of those, the ones that took too long." },
+    { METRIC_CACHE_LOOKUPS, "proxy_cache_lookups_total", NULL, "counter",
+        "GET requests looked up in the response cache." },
+    { METRIC_CACHE_HITS, "proxy_cache_hits_total", NULL, "counter",
+        "Responses served from the response cache." },
+    { METRIC_CACHE_STORES, "proxy_cache_stores_total", NULL, "counter",
+        "Responses stored in the response cache." },
+    { METRIC_CACHE_EVICTIONS, "proxy_cache_dropped_total", "reason=\"evicted\"", "counter",
+        "Objects dropped from the response cache." },
+    { METRIC_CACHE_EXPIRED, "proxy_cache_dropped_total", "reason=\"expired\"", "counter", NULL },
+    { METRIC_CACHE_BYTES_SAVED, "proxy_cache_served_bytes_total", NULL, "counter",
+        "Bytes served from the response cache." },
+    { METRIC_CACHE_BYTES, "proxy_cache_bytes", NULL, "gauge",
+        "Bytes held by the response cache." },
+    { METRIC_CACHE_OBJECTS, "proxy_cache_objects", NULL, "gauge",
+        "Objects held by the response cache." },
+    { METRIC_DISK_HITS, "proxy_disk_cache_hits_total", NULL, "counter",
+        "Responses served from the disk cache." },
+    { METRIC_DISK_STORES, "proxy_disk_cache_stores_total", NULL, "counter",
+        "Responses written to the disk cache." },
+    { METRIC_DISK_OVERWRITTEN, "proxy_disk_cache_overwritten_total", NULL, "counter",
+        "Entries of the disk cache lost to its log wrapping around." },
+    { METRIC_DISK_ENTRIES, "proxy_disk_cache_entries", NULL, "gauge",
+        "Entries of the index of the disk cache." }
+};
+
+static const char *s_backend_names[METRIC_BACKEND_COUNTERS] = {
+    [METRIC_BACKEND_REQUESTS] = "proxy_backend_requests_total",
+    [METRIC_BACKEND_FAILURES] = "proxy_backend_failures_total",
+    [METRIC_BACKEND_TRIPS] = "proxy_backend_breaker_trips_total",
+    [METRIC_BACKEND_OPEN] = "proxy_backend_breakers_open",
+    [METRIC_BACKEND_DOWN] = "proxy_backend_workers_down"
+};
+
+static const char *s_backend_help[METRIC_BACKEND_COUNTERS] = {
+    [METRIC_BACKEND_REQUESTS] = "Requests sent to the backend.",
+    [METRIC_BACKEND_FAILURES] = "Requests of the backend that failed.",
+    [METRIC_BACKEND_TRIPS] = "Times a breaker of the backend opened.",
+    [METRIC_BACKEND_OPEN] = "Workers whose breaker of the backend is not closed.",
+    [METRIC_BACKEND_DOWN] = "Workers whose health probes of the backend fail."
+};
+
+/*
+ * The owner is the only writer, so an update is a load and a store
+ * that cannot tear, which compile to plain moves, with no lock prefix
+ */
+static inline uint64_t load(const uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static inline void bump(uint64_t *p, uint64_t n) {
+    __atomic_store_n(p, load(p) + n, __ATOMIC_RELAXED);
+}
+
+Metrics *metrics_init(void) {
+    Metrics *metrics = aligned_alloc(64, sizeof(Metrics));
+    if(metrics == NULL) {
+        perror("aligned_alloc");
+        return NULL;
+    }
+    memset(metrics, 0, sizeof(Metrics));
+    return metrics;
+}
+
+unsigned int metrics_bucket(uint64_t us) {
+    if(us >> METRICS_MAX_BITS) {
+        us = ((uint64_t)1 << METRICS_MAX_BITS) - 1;
+    }
+    if(us < (1 << METRICS_SUB_BITS)) {
+        return us;
+    }
+    /* The highest bit picks the power of two, the bits below it the bucket */
+    unsigned int shift = 63 - __builtin_clzll(us) - METRICS_SUB_BITS;
+    return ((shift + 1) << METRICS_SUB_BITS) +
+        ((us >> shift) & ((1 << METRICS_SUB_BITS) - 1));
+}
+
+uint64_t metrics_bucket_max(unsigned int bucket) {
+    if(bucket < (1 << METRICS_SUB_BITS)) {
+        return bucket;
+    }
+    unsigned int shift = (bucket >> METRICS_SUB_BITS) - 1;
+    uint64_t mantissa = (bucket & ((1 << METRICS_SUB_BITS) - 1)) | (1 << METRICS_SUB_BITS);
+    return (mantissa << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+void metrics_add(Metrics *metrics, MetricCounter counter, uint64_t n) {
+    if(metrics == NULL) {
+        return;
+    }
+    bump(&metrics->counters[counter], n);
+}
+
+void metrics_set(Metrics *metrics, MetricCounter counter, uint64_t value) {
+    if(metrics == NULL) {
+        return;
+    }
+    __atomic_store_n(&metrics->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+void metrics_set_backend(Metrics *metrics, unsigned int backend,
+        MetricBackendCounter counter, uint64_t value) {
+    if(metrics == NULL || backend >= BALANCER_MAX_BACKENDS) {
+        return;
+    }
+    __atomic_store_n(&metrics->backends[backend][counter], value, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(Metrics *metrics, MetricHist hist, uint64_t us) {
+    if(metrics == NULL) {
+        return;
+    }
+    struct metric_hist *h = &metrics->hists[hist];
+    bump(&h->buckets[metrics_bucket(us)], 1);
+    bump(&h->sum, us);
+}
+
+uint64_t metrics_get(const Metrics *metrics, MetricCounter counter) {
+    if(metrics == NULL) {
+        return 0;
+    }
+    return load(&metrics->counters[counter]);
+}
+
+uint64_t metrics_get_backend(const Metrics *metrics, unsigned int backend,
+        MetricBackendCounter counter) {
+    if(metrics == NULL || backend >= BALANCER_MAX_BACKENDS) {
+        return 0;
+    }
+    return load(&metrics->backends[backend][counter]);
+}
+
+uint64_t metrics_percentile(const Metrics *metrics, MetricHist hist, double q) {
+    if(metrics == NULL) {
+        return 0;
+    }
+    const struct metric_hist *h = &metrics->hists[hist];
+    uint64_t counts[METRICS_BUCKETS];
+    uint64_t total = 0;
+    for(unsigned int i = 0; i < METRICS_BUCKETS; ++i) {
+        counts[i] = load(&h->buckets[i]);
+        total += counts[i];
+    }
+    if(total == 0) {
+        return 0;
+    }
+    /* The rank of the value, rounded up */
+    double at = q * total;
+    uint64_t rank = at;
+    if(rank < at || rank == 0) {
+        rank++;
+    }
+    uint64_t seen = 0;
+    for(unsigned int i = 0; i < METRICS_BUCKETS; ++i) {
+        seen += counts[i];
+        if(seen >= rank) {
+            return metrics_bucket_max(i);
+        }
+    }
+    return metrics_bucket_max(METRICS_BUCKETS - 1);
+}
+
+int metrics_merge(Metrics *dst, const Metrics *src) {
+    if(dst == NULL || src == NULL) {
+        return -1;
+    }
+    for(int i = 0; i < METRIC_COUNTERS; ++i) {
+        bump(&dst->counters[i], load(&src->counters[i]));
+    }
+    for(int i = 0; i < BALANCER_MAX_BACKENDS; ++i) {
+        for(int j = 0; j < METRIC_BACKEND_COUNTERS; ++j) {
+            bump(&dst->backends[i][j], load(&src->backends[i][j]));
+        }
+    }
+    for(int i = 0; i < METRIC_HISTS; ++i) {
+        for(unsigned int j = 0; j < METRICS_BUCKETS; ++j) {
+            uint64_t n = load(&src->hists[i].buckets[j]);
+            if(n > 0) {
+                bump(&dst->hists[i].buckets[j], n);
+            }
+        }
+        bump(&dst->hists[i].sum, load(&src->hists[i].sum));
+    }
+    return 0;
+}
+
+static void format_counter(FILE *out, const char *name, const char *help,
+        const char *type, uint64_t value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type,
+            name, value);
+}
+
+/*
+ * The count of a bound is that of the buckets entirely below it, and
+ * the count of the histogram that of its buckets, so that it always
+ * matches the +Inf bucket even while the owner records more values
+ */
+static void format_hist(FILE *out, MetricHist hist, const struct metric_hist *h) {
+    const char *name = s_hist_names[hist];
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, s_hist_help[hist], name);
+    uint64_t seen = 0;
+    unsigned int bucket = 0;
+    for(size_t i = 0; i < sizeof(s_bounds_us) / sizeof(s_bounds_us[0]); ++i) {
+        while(bucket < METRICS_BUCKETS && metrics_bucket_max(bucket) <= s_bounds_us[i]) {
+            seen += load(&h->buckets[bucket++]);
+        }
+        fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, s_bounds_us[i] / 1e6, seen);
+    }
+    while(bucket < METRICS_BUCKETS) {
+        seen += load(&h->buckets[bucket++]);
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, seen);
+    fprintf(out, "%s_sum %.6f\n%s_count %lu\n", name, load(&h->sum) / 1e6, name, seen);
+}
+
+int metrics_format(const Metrics *metrics, FILE *out) {
+    if(metrics == NULL || out == NULL) {
+        return -1;
+    }
+    const uint64_t *c = metrics->counters;
+    uint64_t opened = load(&c[METRIC_CONNS_OPENED]);
+    uint64_t closed = load(&c[METRIC_CONNS_CLOSED]);
+    format_counter(out, "proxy_connections_active", "Client connections open.", "gauge",
+            opened > closed ? opened - closed : 0);
+    format_counter(out, "proxy_connections_total", "Client connections taken on.", "counter",
+            opened);
+    format_counter(out, "proxy_requests_total", "Request heads read.", "counter",
+            load(&c[METRIC_REQUESTS]));
+    format_counter(out, "proxy_client_received_bytes_total", "Bytes of the clients relayed.",
+            "counter", load(&c[METRIC_BYTES_IN]));
+    format_counter(out, "proxy_client_sent_bytes_total", "Bytes sent to the clients.",
+            "counter", load(&c[METRIC_BYTES_OUT]));
+
+    fprintf(out, "# HELP proxy_errors_total Errors by kind.\n# TYPE proxy_errors_total counter\n");
+    for(int i = METRIC_ERR_BAD_REQUEST; i <= METRIC_ERR_NO_BACKEND; ++i) {
+        fprintf(out, "proxy_errors_total{kind=\"%s\"} %lu\n",
+                s_error_kinds[i - METRIC_ERR_BAD_REQUEST], load(&c[i]));
+    }
+    for(size_t i = 0; i < sizeof(s_counters) / sizeof(s_counters[0]); ++i) {
+        const struct counter_desc *d = &s_counters[i];
+        if(d->help != NULL) {
+            fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", d->name, d->help, d->name, d->type);
+        }
+        if(d->label != NULL) {
+            fprintf(out, "%s{%s} %lu\n", d->name, d->label, load(&c[d->counter]));
+        } else {
+            fprintf(out, "%s %lu\n", d->name, load(&c[d->counter]));
+        }
+    }
+    for(int i = 0; i < METRIC_HISTS; ++i) {
+        format_hist(out, i, &metrics->hists[i]);
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+int metrics_format_backends(const Metrics *metrics, char *const *names,
+        unsigned int nbackends, FILE *out) {
+    if(metrics == NULL || (names == NULL && nbackends > 0) || out == NULL ||
+            nbackends > BALANCER_MAX_BACKENDS) {
+        return -1;
+    }
+    if(nbackends == 0) {
+        return 0;
+    }
+    for(int i = 0; i < METRIC_BACKEND_COUNTERS; ++i) {
+        const char *name = s_backend_names[i];
+        const char *type = strstr(name, "_total") != NULL ? "counter" : "gauge";
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, s_backend_help[i], name, type);
+        for(unsigned int b = 0; b < nbackends; ++b) {
+            fprintf(out, "%s{backend=\"%s\"} %lu\n", name, names[b],
+                    load(&metrics->backends[b][i]));
+        }
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+void metrics_destroy(Metrics *metrics) {
+    free(metrics);
+}
@@ -111,3 +111,152 @@ void prio_destroy(PrioQueue *pq) {
     }
     free(pq);
 }
+
+struct prio_index {
+    unsigned int capacity;
+    unsigned int len;
+    unsigned int *heap;
+    unsigned int *pos;
+    int64_t *prio;
+};
+
+PrioIndex *prio_index_init(unsigned int capacity) {
+    if(capacity == 0) {
+        return NULL;
+    }
+    PrioIndex *pi = malloc(sizeof(PrioIndex));
+    if(pi == NULL) {
+        return NULL;
+    }
+    pi->heap = malloc(capacity * sizeof(unsigned int));
+    pi->pos = malloc(capacity * sizeof(unsigned int));
+    pi->prio = malloc(capacity * sizeof(int64_t));
+    if(pi->heap == NULL || pi->pos == NULL || pi->prio == NULL) {
+        prio_index_destroy(pi);
+        return NULL;
+    }
+    for(unsigned int i = 0; i < capacity; ++i) {
+        pi->pos[i] = capacity;
+    }
+    pi->capacity = capacity;
+    pi->len = 0;
+
+    return pi;
+}
+
+/* Puts key at i of the heap, and tells key where it is */
+static void place(PrioIndex *pi, unsigned int i, unsigned int key) {
+    pi->heap[i] = key;
+    pi->pos[key] = i;
+}
+
+static void index_bubble_up(PrioIndex *pi, unsigned int i) {
+    unsigned int key = pi->heap[i];
+    while(i > 0) {
+        unsigned int p = GET_PARENT_IDX(i);
+        if(pi->prio[pi->heap[p]] <= pi->prio[key]) {
+            break;
+        }
+        place(pi, i, pi->heap[p]);
+        i = p;
+    }
+    place(pi, i, key);
+}
+
+static void index_bubble_down(PrioIndex *pi, unsigned int i) {
+    unsigned int key = pi->heap[i];
+    for(;;) {
+        unsigned int sub = GET_LEFT_CHILD(i);
+        if(sub >= pi->len) {
+            break;
+        }
+        unsigned int right_child = GET_RIGHT_CHILD(i);
+        if(right_child < pi->len && pi->prio[pi->heap[right_child]] < pi->prio[pi->heap[sub]]) {
+            sub = right_child;
+        }
+        if(pi->prio[pi->heap[sub]] >= pi->prio[key]) {
+            break;
+        }
+        place(pi, i, pi->heap[sub]);
+        i = sub;
+    }
+    place(pi, i, key);
+}
+
+int prio_index_set(PrioIndex *pi, unsigned int key, int64_t prio) {
+    if(pi == NULL || key >= pi->capacity) {
+        return -1;
+    }
+    unsigned int i = pi->pos[key];
+    if(i == pi->capacity) {
+        pi->prio[key] = prio;
+        place(pi, pi->len, key);
+        index_bubble_up(pi, pi->len);
+        pi->len++;
+        return 0;
+    }
+    int64_t old = pi->prio[key];
+    pi->prio[key] = prio;
+    if(prio < old) {
+        index_bubble_up(pi, i);
+    } else {
+        index_bubble_down(pi, i);
+    }
+    return 0;
+}
+
+int prio_index_get(const PrioIndex *pi, unsigned int key, int64_t *prio) {
+    if(pi == NULL || prio == NULL || key >= pi->capacity || pi->pos[key] == pi->capacity) {
+        return -1;
+    }
+    *prio = pi->prio[key];
+    return 0;
+}
+
+int prio_index_remove(PrioIndex *pi, unsigned int key) {
+    if(pi == NULL || key >= pi->capacity || pi->pos[key] == pi->capacity) {
+        return -1;
+    }
+    unsigned int i = pi->pos[key];
+    pi->pos[key] = pi->capacity;
+    pi->len--;
+    if(i == pi->len) {
+        return 0;
+    }
+    /* The last key fills the hole, and goes whichever way it has to */
+    unsigned int last = pi->heap[pi->len];
+    place(pi, i, last);
+    index_bubble_up(pi, i);
+    if(pi->pos[last] == i) {
+        index_bubble_down(pi, i);
+    }
+    return 0;
+}
+
+int prio_index_peek_min(const PrioIndex *pi, unsigned int *key, int64_t *prio) {
+    if(pi == NULL || key == NULL || pi->len == 0) {
+        return -1;
+    }
+    *key = pi->heap[0];
+    if(prio != NULL) {
+        *prio = pi->prio[*key];
+    }
+    return 0;
+}
+
+unsigned int prio_index_len(const PrioIndex *pi) {
+    if(pi == NULL) {
+        return 0;
+    }
+    return pi->len;
+}
+
+void prio_index_destroy(PrioIndex *pi) {
+    if(pi == NULL) {
+        return;
+    }
+    free(pi->heap);
+    free(pi->pos);
+    free(pi->prio);
+    free(pi);
+}
@@ -0,0 +1,2327 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "relay.h"
+#include "cache.h"
+#include "conn.h"
+#include "conn_registry.h"
+#include "dns.h"
+#include "http.h"
+#include "upstream.h"
+#include "slab.h"
+#include "timer.h"
+#include "metrics.h"
+#include "trace.h"
+#include "util.h"
+#include "macro.h"
+
+#define RELAY_BUF_SZ     (16 * 1024)
+#define RELAY_HEAD_SZ    8192
+#define RELAY_OUT_SZ     (RELAY_BUF_SZ - RELAY_HEAD_SZ)
+#define RELAY_SPLICE_SZ  (64 * 1024)
+#define RELAY_FRAME_SZ   4096
+#define RELAY_PIPE_HIGH  (64 * 1024) /* A pipe this full stops its source from being read */
+#define RELAY_PIPE_LOW   (16 * 1024) /* until it drains down to this */
+#define RELAY_HOST_SZ    256
+#define RELAY_PORT_SZ    8
+#define RELAY_ORIGIN_SZ  (RELAY_HOST_SZ + RELAY_PORT_SZ)
+#define RELAY_RING_SZ    RELAY_BUF_SZ
+#define RELAY_LEADER_BUCKETS 256
+
+/* dns_status while the lookup of the origin is pending */
+#define RELAY_DNS_PENDING 1
+
+static const char s_resp_200_tunnel[] =
+    "HTTP/1.1 200 Connection Established\r\n\r\n";
+static const char s_resp_400[] =
+    "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char s_resp_431[] =
+    "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char s_resp_502[] =
+    "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char s_resp_503[] =
+    "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+static const char s_resp_503_no_backend[] =
+    "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char s_resp_504[] =
+    "HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+enum relay_state {
+    RELAY_READ_HEAD,  /* Reading the request head of the client */
+    RELAY_RESOLVING,  /* Waiting for the addresses of the origin */
+    RELAY_CONNECTING, /* Waiting for the connect(2) to the origin */
+    RELAY_SEND_HEAD,  /* Sending the rewritten head to the origin */
+    RELAY_PUMP,       /* Splicing bodies in both directions */
+    RELAY_SEND_ERROR, /* Sending an error response to the client */
+    RELAY_SEND_CACHED, /* Sending a response from the cache to the client */
+    RELAY_COLLAPSED   /* Sending the response another relay is fetching */
+};
+
+/*
+ * What the timer of a relay waits for. The head of the client and the
+ * answer of the origin have deadlines that waiting does not push back,
+ * so that a client sending a byte now and then cannot hold a relay.
+ * Once bytes flow, the timer only fires after a while with none.
+ */
+enum relay_deadline {
+    RELAY_DEADLINE_HEAD,     /* The whole request head is read */
+    RELAY_DEADLINE_UPSTREAM, /* The origin answers with a head */
+    RELAY_DEADLINE_IDLE,     /* Some byte moves either way */
+    RELAY_DEADLINE_COLLAPSE  /* The leader of a follower gets a response head */
+};
+
+/*
+ * One direction of the relay, the pipe sits between both sockets.
+ * When the direction carries a message whose end is known (msg is
+ * set), the body is spliced for as long as the parser says the next
+ * bytes are body bytes, and the few bytes that frame it (chunk
+ * sizes and trailers) go through frame so that the parser sees them.
+ * A response that goes into the cache is copied out of the pipe with
+ * tee(2), so that it still reaches the client without a copy.
+ *
+ * While the sink is full, the source is still read into the pipe, up
+ * to a high watermark past which it is left alone until the pipe has
+ * drained down to a low one, so that neither side waits on the other
+ * and a pipe never holds more than the watermark. Chunks smaller than
+ * frame are read into it along with their framing, so that a stream
+ * of small chunks is moved by the frameful rather than chunk by chunk.
+ *
+ * A raw stream (a tunnel) that cannot have pipes goes through a ring
+ * buffer of its own instead, which is read into while the sink is
+ * still draining it.
+ */
+struct relay_pipe {
+    int fds[2];
+    size_t len;                  /* Bytes sitting in the pipe (or the ring) */
+    char *ring;                  /* Used instead of the pipe when set */
+    size_t ring_off;             /* Where the bytes of the ring start */
+    uint64_t bytes;              /* Bytes forwarded to the sink */
+    HttpParser *msg;             /* NULL to forward until EOF */
+    char frame[RELAY_FRAME_SZ];
+    size_t frame_len;
+    size_t frame_off;
+    unsigned char msg_done;      /* Every byte of the message was read */
+    unsigned char extra;         /* Bytes followed the end of the message */
+    unsigned char eof;           /* The source has no more bytes */
+    unsigned char done;          /* Everything was forwarded */
+    unsigned char paused;        /* Past the high watermark, not below the low one yet */
+    CacheObject *fill;           /* The response being stored, if any */
+    int capfds[2];               /* The pipe stored bytes are teed into */
+};
+
+/*
+ * On io_uring, a new connection to the origin is a connect(2) linked
+ * to the send(2) of the head, both handed to the kernel with the rest
+ * of the batch of the worker. The attempt owns the socket and a copy
+ * of the head until both have completed, so a relay that gives up on
+ * it meanwhile leaves the kernel nothing of its own to use.
+ */
+struct relay_connect {
+    struct relay *relay;      /* NULL once the relay gave up on it */
+    RelayCtx *ctx;
+    int fd;
+    unsigned int addr;        /* Index of the address of the origin tried */
+    unsigned int pending;     /* Completions still to come */
+    int res;                  /* Of the connect(2) */
+    int sent;                 /* Bytes of the head sent, or -errno */
+    struct relay_connect *prev; /* List of those given up on */
+    struct relay_connect *next;
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    size_t len;
+    char head[];
+};
+
+struct relay {
+    RelayCtx *ctx;
+    enum relay_state state;
+    int clientfd;
+    int upstreamfd;
+    struct relay_connect *connecting; /* The connection to the origin in the kernel's hands */
+    unsigned char reused;     /* The upstream came from the idle pool */
+    unsigned char retryable;  /* The whole request fits in out */
+    unsigned char tunnel;     /* A CONNECT, bytes are relayed as they are */
+    unsigned char closing;    /* The client is closed after this response */
+    unsigned char admitted;   /* The request counts against the concurrency limit */
+    unsigned int requests;    /* Request heads read on the connection */
+    int backend;              /* Of the balancer, -1 for none */
+    char host[RELAY_HOST_SZ];
+    char port[RELAY_PORT_SZ];
+    int dns_status;
+    unsigned int naddrs;
+    DnsAddr addrs[DNS_MAX_ADDRS];
+    char *buf;                /* The I/O buffer, it holds head then out */
+    char *head;               /* The request head, then the response head */
+    size_t head_len;
+    HttpParser req;
+    HttpParser resp;
+    unsigned int resp_flags;
+    size_t resp_start;        /* Start of the response head being parsed */
+    size_t resp_end;          /* End of what is parsed and may be sent */
+    size_t resp_sent;
+    unsigned char resp_final; /* The final (not 1xx) head was parsed */
+    char *out;                /* The head as it is sent to the origin */
+    size_t out_len;
+    size_t out_off;
+    size_t pending_len;       /* Bytes of the next request, kept after out */
+    const char *err;          /* The error response, if any */
+    size_t err_len;
+    size_t err_off;
+    CacheObject *cached;      /* The response served from the cache */
+    struct iovec iov[HTTP_CACHE_IOV];
+    int iovcnt;
+    int iov_off;
+    char age[HTTP_CACHE_AGE_SZ];
+    DiskHit disk;             /* The body to send from the disk tier, if any */
+    uint64_t cached_sent;     /* Bytes of the cached response sent */
+    uint64_t accepted_us;     /* When the client was accepted */
+    uint64_t request_us;      /* When the first byte of the request came */
+    uint64_t head_us;         /* When the request head was complete */
+    uint64_t connect_us;      /* When connect(2) to the origin was called */
+    uint64_t bytes_in;        /* Bytes of the requests before this one */
+    uint64_t bytes_out;       /* Bytes of the responses before this one */
+    struct relay_pipe up;     /* client -> origin */
+    struct relay_pipe down;   /* origin -> client */
+    uint64_t leader_hash;     /* Cache key of the response it fetches for others, 0 if none */
+    struct relay *leader_next; /* Chain of the bucket of the leaders */
+    struct relay *leader;     /* The relay it follows, if any */
+    struct relay *followers;  /* The relays that follow it */
+    struct relay *fprev;      /* List of the followers of the leader */
+    struct relay *fnext;
+    Timer timer;
+    enum relay_deadline deadline;
+    struct relay *prev;
+    struct relay *next;
+};
+
+struct relay_ctx {
+    ConnectionPool *conn_pool;
+    UpstreamPool *upstreams;
+    DnsCache *dns_cache;
+    DnsResolver *resolver;
+    int owns_cache;
+    HttpCache *cache;
+    Slab *relay_slab;
+    Slab *buf_slab;           /* Page-aligned buffers of RELAY_BUF_SZ bytes */
+    RelayTunnelStats tunnels;
+    RelayCollapseStats collapse;
+    struct relay *leaders[RELAY_LEADER_BUCKETS];
+    TimerWheel *timers;
+    unsigned int timeout_ms[4]; /* Indexed by enum relay_deadline */
+    RelayTimeoutStats timeouts;
+    ConnRegistry *registry;   /* Where the clients are recorded, if anywhere */
+    unsigned int worker;
+    Metrics *metrics;         /* What the relays record, if anything */
+    Admission *admission;     /* What lets the requests in, if anything */
+    Balancer *balancer;       /* Where the requests go, if not to their origin */
+    struct relay *relays;
+    unsigned int nrelays;
+    struct relay_connect *orphans; /* Given up on, waiting for their completions */
+};
+
+static void relay_handler(ConnectionPool *conn_pool, int fd,
+        unsigned int events, void *data);
+static void collapse_release(struct relay *r);
+static void drop_connect(struct relay *r);
+
+RelayCtx *relay_ctx_init(ConnectionPool *conn_pool, DnsCache *dns_cache,
+        HttpCache *cache) {
+    if(conn_pool == NULL) {
+        return NULL;
+    }
+    RelayCtx *ctx = malloc(sizeof(RelayCtx));
+    if(ctx == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    ctx->owns_cache = dns_cache == NULL;
+    ctx->dns_cache = ctx->owns_cache ? dns_cache_init() : dns_cache;
+    if(ctx->dns_cache == NULL) {
+        free(ctx);
+        return NULL;
+    }
+    ctx->resolver = dns_resolver_init(conn_pool, ctx->dns_cache, NULL, 0,
+            RELAY_DNS_TIMEOUT_MS);
+    ctx->upstreams = upstream_pool_init(RELAY_UPSTREAM_MAX_IDLE, RELAY_UPSTREAM_IDLE_MS);
+    ctx->relay_slab = slab_init(sizeof(struct relay), 0);
+    ctx->buf_slab = slab_init(RELAY_BUF_SZ, (size_t)sysconf(_SC_PAGESIZE));
+    ctx->timers = timer_wheel_init(util_now_ms());
+    if(ctx->resolver == NULL || ctx->upstreams == NULL || ctx->relay_slab == NULL ||
+            ctx->buf_slab == NULL || ctx->timers == NULL) {
+        timer_wheel_destroy(ctx->timers);
+        dns_resolver_destroy(ctx->resolver);
+        upstream_pool_destroy(ctx->upstreams);
+        slab_destroy(ctx->relay_slab);
+        slab_destroy(ctx->buf_slab);
+        if(ctx->owns_cache) {
+            dns_cache_destroy(ctx->dns_cache);
+        }
+        free(ctx);
+        return NULL;
+    }
+    ctx->conn_pool = conn_pool;
+    ctx->cache = cache;
+    memset(&ctx->tunnels, 0, sizeof(ctx->tunnels));
+    ctx->timeout_ms[RELAY_DEADLINE_HEAD] = RELAY_HEAD_TIMEOUT_MS;
+    ctx->timeout_ms[RELAY_DEADLINE_UPSTREAM] = RELAY_UPSTREAM_TIMEOUT_MS;
+    ctx->timeout_ms[RELAY_DEADLINE_IDLE] = RELAY_IDLE_TIMEOUT_MS;
+    ctx->timeout_ms[RELAY_DEADLINE_COLLAPSE] = RELAY_COLLAPSE_TIMEOUT_MS;
+    memset(&ctx->timeouts, 0, sizeof(ctx->timeouts));
+    memset(&ctx->collapse, 0, sizeof(ctx->collapse));
+    memset(ctx->leaders, 0, sizeof(ctx->leaders));
+    ctx->registry = NULL;
+    ctx->worker = 0;
+    ctx->metrics = NULL;
+    ctx->admission = NULL;
+    ctx->balancer = NULL;
+    ctx->relays = NULL;
+    ctx->nrelays = 0;
+    ctx->orphans = NULL;
+    return ctx;
+}
+
+/* Readies a drained pipe for the next message, its pipe stays open */
+static void reset_pipe(struct relay_pipe *p, HttpParser *msg) {
+    p->len = 0;
+    p->ring_off = 0;
+    p->bytes = 0;
+    p->msg = msg;
+    p->frame_len = p->frame_off = 0;
+    p->msg_done = p->extra = p->eof = p->done = 0;
+    p->paused = 0;
+}
+
+static void init_pipe(struct relay_pipe *p, HttpParser *msg) {
+    p->fds[0] = p->fds[1] = -1;
+    p->ring = NULL;
+    p->fill = NULL;
+    p->capfds[0] = p->capfds[1] = -1;
+    reset_pipe(p, msg);
+}
+
+/* Gives up storing the response, it still goes to the client */
+static void drop_fill(struct relay_pipe *p) {
+    http_cache_release(p->fill);
+    p->fill = NULL;
+    for(int i = 0; i < 2; ++i) {
+        if(p->capfds[i] != -1) {
+            close(p->capfds[i]);
+            p->capfds[i] = -1;
+        }
+    }
+}
+
+static void close_pipe(struct relay_pipe *p, Slab *buf_slab) {
+    for(int i = 0; i < 2; ++i) {
+        if(p->fds[i] != -1) {
+            close(p->fds[i]);
+            p->fds[i] = -1;
+        }
+    }
+    slab_free(buf_slab, p->ring);
+    p->ring = NULL;
+    drop_fill(p);
+}
+
+/* Gives the I/O buffer back once neither head is needed anymore */
+static void release_buffer(struct relay *r) {
+    slab_free(r->ctx->buf_slab, r->buf);
+    r->buf = r->head = r->out = NULL;
+}
+
+/* Adds the bytes of the exchange that ends to those of the connection */
+static void count_bytes(struct relay *r) {
+    /* What the client sent past its head, and everything it was sent */
+    uint64_t bytes_in = r->out_off + r->up.bytes;
+    uint64_t bytes_out = r->resp_sent + r->down.bytes + r->cached_sent + r->err_off;
+    metrics_add(r->ctx->metrics, METRIC_BYTES_IN, bytes_in);
+    metrics_add(r->ctx->metrics, METRIC_BYTES_OUT, bytes_out);
+    r->bytes_in += bytes_in;
+    r->bytes_out += bytes_out;
+}
+
+/* The request no longer counts against the concurrency limit */
+static void end_admission(struct relay *r) {
+    if(r->admitted) {
+        admission_end(r->ctx->admission);
+        r->admitted = 0;
+    }
+}
+
+/* Feeds the breaker of the backend, before a response head came back only */
+static void report_backend(struct relay *r, int ok) {
+    if(r->backend != -1 && !r->resp_final) {
+        balancer_report(r->ctx->balancer, r->backend, ok, util_now_ms());
+    }
+}
+
+/* The backend no longer counts the request as in flight */
+static void release_backend(struct relay *r) {
+    if(r->backend != -1) {
+        balancer_release(r->ctx->balancer, r->backend);
+        r->backend = -1;
+    }
+}
+
+static void relay_close(struct relay *r) {
+    RelayCtx *ctx = r->ctx;
+
+    if(r->state == RELAY_RESOLVING) {
+        dns_cancel(ctx->resolver, r);
+    }
+    drop_connect(r);
+    collapse_release(r);
+    end_admission(r);
+    release_backend(r);
+    timer_cancel(ctx->timers, &r->timer);
+    conn_remove_fd(ctx->conn_pool, r->clientfd);
+    /* Before the fd is closed, another worker may be given it right after */
+    conn_registry_remove(ctx->registry, r->clientfd);
+    close(r->clientfd);
+    if(r->upstreamfd != -1) {
+        conn_remove_fd(ctx->conn_pool, r->upstreamfd);
+        close(r->upstreamfd);
+    }
+    count_bytes(r);
+    metrics_add(ctx->metrics, METRIC_CONNS_CLOSED, 1);
+    TRACE4(close, r->clientfd, r->accepted_us, r->bytes_in, r->bytes_out);
+    if(r->tunnel && r->state == RELAY_PUMP) {
+        ctx->tunnels.active--;
+        ctx->tunnels.bytes_up += r->out_off + r->up.bytes;
+        ctx->tunnels.bytes_down += r->down.bytes;
+    }
+    close_pipe(&r->up, ctx->buf_slab);
+    close_pipe(&r->down, ctx->buf_slab);
+    release_buffer(r);
+    http_cache_release(r->cached);
+
+    if(r->prev != NULL) {
+        r->prev->next = r->next;
+    } else {
+        ctx->relays = r->next;
+    }
+    if(r->next != NULL) {
+        r->next->prev = r->prev;
+    }
+    ctx->nrelays--;
+    slab_free(ctx->relay_slab, r);
+}
+
+/* The exchange broke once the client had part of the response */
+static void abort_relay(struct relay *r) {
+    metrics_add(r->ctx->metrics, METRIC_ERR_ABORTED, 1);
+    relay_close(r);
+}
+
+static void on_timeout(Timer *timer, void *data);
+
+/* Arms the timer of a relay for its deadline, from now on */
+static void arm_deadline(struct relay *r, enum relay_deadline deadline) {
+    r->deadline = deadline;
+    timer_arm(r->ctx->timers, &r->timer, util_now_ms() + r->ctx->timeout_ms[deadline]);
+}
+
+/* Forgets everything about the request of a relay, not about its client */
+static void reset_request(struct relay *r) {
+    r->state = RELAY_READ_HEAD;
+    r->upstreamfd = -1;
+    r->connecting = NULL;
+    r->reused = r->retryable = r->tunnel = 0;
+    r->dns_status = RELAY_DNS_PENDING;
+    r->naddrs = 0;
+    r->head_len = 0;
+    http_parser_init(&r->req, HTTP_REQUEST, 0);
+    r->resp_flags = 0;
+    r->resp_start = r->resp_end = r->resp_sent = 0;
+    r->resp_final = 0;
+    r->out_len = r->out_off = 0;
+    r->pending_len = 0;
+    r->err = NULL;
+    r->err_len = r->err_off = 0;
+    r->cached = NULL;
+    r->iovcnt = r->iov_off = 0;
+    r->disk.len = 0;
+    r->cached_sent = 0;
+    r->request_us = r->head_us = r->connect_us = 0;
+    r->admitted = 0;
+    r->backend = -1;
+    r->leader_hash = 0;
+    r->leader_next = r->leader = r->followers = NULL;
+    r->fprev = r->fnext = NULL;
+}
+
+int relay_start(RelayCtx *ctx, int connfd) {
+    if(ctx == NULL || connfd < 0) {
+        if(connfd >= 0) {
+            close(connfd);
+        }
+        return -1;
+    }
+    struct relay *r = slab_alloc(ctx->relay_slab);
+    char *buf = slab_alloc(ctx->buf_slab);
+    if(r == NULL || buf == NULL) {
+        slab_free(ctx->relay_slab, r);
+        slab_free(ctx->buf_slab, buf);
+        close(connfd);
+        return -1;
+    }
+    r->ctx = ctx;
+    r->buf = r->head = buf;
+    r->out = buf + RELAY_HEAD_SZ;
+    r->clientfd = connfd;
+    r->closing = 0;
+    r->requests = 0;
+    reset_request(r);
+    r->accepted_us = util_now_us();
+    r->bytes_in = r->bytes_out = 0;
+    init_pipe(&r->up, &r->req);
+    init_pipe(&r->down, &r->resp);
+    timer_init(&r->timer, on_timeout, r);
+
+    if(conn_register_fd(ctx->conn_pool, connfd, CONN_EV_READ, relay_handler, r) == -1) {
+        close(connfd);
+        slab_free(ctx->buf_slab, buf);
+        slab_free(ctx->relay_slab, r);
+        return -1;
+    }
+
+    r->prev = NULL;
+    r->next = ctx->relays;
+    if(ctx->relays != NULL) {
+        ctx->relays->prev = r;
+    }
+    ctx->relays = r;
+    ctx->nrelays++;
+    arm_deadline(r, RELAY_DEADLINE_HEAD);
+    if(ctx->registry != NULL) {
+        ConnInfo info = { .worker = ctx->worker, .since_ms = util_now_ms() };
+        conn_registry_insert(ctx->registry, connfd, &info);
+    }
+    metrics_add(ctx->metrics, METRIC_CONNS_OPENED, 1);
+    return 0;
+}
+
+int relay_get_count(RelayCtx *ctx) {
+    if(ctx == NULL) {
+        return -1;
+    }
+    return ctx->nrelays;
+}
+
+int relay_get_tunnel_stats(RelayCtx *ctx, RelayTunnelStats *stats) {
+    if(ctx == NULL || stats == NULL) {
+        return -1;
+    }
+    *stats = ctx->tunnels;
+    return 0;
+}
+
+int relay_get_alloc_stats(RelayCtx *ctx, SlabStats *relays, SlabStats *buffers) {
+    if(ctx == NULL || slab_get_stats(ctx->relay_slab, relays) == -1 ||
+            slab_get_stats(ctx->buf_slab, buffers) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+int relay_get_collapse_stats(RelayCtx *ctx, RelayCollapseStats *stats) {
+    if(ctx == NULL || stats == NULL) {
+        return -1;
+    }
+    *stats = ctx->collapse;
+    return 0;
+}
+
+int relay_get_timeout_stats(RelayCtx *ctx, RelayTimeoutStats *stats) {
+    if(ctx == NULL || stats == NULL) {
+        return -1;
+    }
+    *stats = ctx->timeouts;
+    return 0;
+}
+
+int relay_ctx_set_timeouts(RelayCtx *ctx, unsigned int head_ms,
+        unsigned int upstream_ms, unsigned int idle_ms) {
+    if(ctx == NULL || head_ms == 0 || upstream_ms == 0 || idle_ms == 0) {
+        return -1;
+    }
+    ctx->timeout_ms[RELAY_DEADLINE_HEAD] = head_ms;
+    ctx->timeout_ms[RELAY_DEADLINE_UPSTREAM] = upstream_ms;
+    ctx->timeout_ms[RELAY_DEADLINE_IDLE] = idle_ms;
+    return 0;
+}
+
+int relay_ctx_set_collapse_timeout(RelayCtx *ctx, unsigned int collapse_ms) {
+    if(ctx == NULL) {
+        return -1;
+    }
+    ctx->timeout_ms[RELAY_DEADLINE_COLLAPSE] = collapse_ms;
+    return 0;
+}
+
+int relay_ctx_set_registry(RelayCtx *ctx, ConnRegistry *registry, unsigned int worker) {
+    if(ctx == NULL || ctx->relays != NULL) {
+        return -1;
+    }
+    ctx->registry = registry;
+    ctx->worker = worker;
+    return 0;
+}
+
+int relay_ctx_set_metrics(RelayCtx *ctx, Metrics *metrics) {
+    if(ctx == NULL || ctx->relays != NULL) {
+        return -1;
+    }
+    ctx->metrics = metrics;
+    return 0;
+}
+
+int relay_ctx_set_admission(RelayCtx *ctx, Admission *admission) {
+    if(ctx == NULL || ctx->relays != NULL) {
+        return -1;
+    }
+    ctx->admission = admission;
+    return 0;
+}
+
+int relay_ctx_set_balancer(RelayCtx *ctx, Balancer *balancer) {
+    if(ctx == NULL || ctx->relays != NULL) {
+        return -1;
+    }
+    ctx->balancer = balancer;
+    return 0;
+}
+
+int relay_get_upstream_stats(RelayCtx *ctx, UpstreamStats *stats) {
+    if(ctx == NULL) {
+        return -1;
+    }
+    return upstream_pool_get_stats(ctx->upstreams, stats);
+}
+
+void relay_ctx_tick(RelayCtx *ctx) {
+    if(ctx == NULL) {
+        return;
+    }
+    upstream_pool_expire(ctx->upstreams);
+    dns_resolver_tick(ctx->resolver);
+    timer_wheel_advance(ctx->timers, util_now_ms());
+}
+
+int relay_ctx_timeout(RelayCtx *ctx, int max_ms) {
+    if(ctx == NULL) {
+        return max_ms;
+    }
+    return timer_wheel_timeout(ctx->timers, util_now_ms(), max_ms);
+}
+
+void relay_ctx_destroy(RelayCtx *ctx) {
+    if(ctx == NULL) {
+        return;
+    }
+    while(ctx->relays != NULL) {
+        relay_close(ctx->relays);
+    }
+    /* The worker dispatches no more, their completions never come */
+    while(ctx->orphans != NULL) {
+        struct relay_connect *c = ctx->orphans;
+        ctx->orphans = c->next;
+        close(c->fd);
+        free(c);
+    }
+    upstream_pool_destroy(ctx->upstreams);
+    dns_resolver_destroy(ctx->resolver);
+    if(ctx->owns_cache) {
+        dns_cache_destroy(ctx->dns_cache);
+    }
+    slab_destroy(ctx->relay_slab);
+    slab_destroy(ctx->buf_slab);
+    timer_wheel_destroy(ctx->timers);
+    free(ctx);
+}
+
+/* Appends n bytes of s to the outgoing head, fails once it is full */
+static int out_append(struct relay *r, const char *s, size_t n) {
+    if(r->out_len + n > RELAY_OUT_SZ) {
+        return -1;
+    }
+    memcpy(r->out + r->out_len, s, n);
+    r->out_len += n;
+    return 0;
+}
+
+/* Splits "host[:port]" (or "[v6]:port") into host and port, the port is required without a default */
+static int split_authority(const char *auth, size_t len,
+        char *host, char *port, const char *default_port) {
+    const char *host_start = auth, *host_end, *colon = NULL;
+    if(len > 0 && auth[0] == '[') {
+        const char *close_br = memchr(auth, ']', len);
+        if(close_br == NULL) {
+            return -1;
+        }
+        host_start = auth + 1;
+        host_end = close_br;
+        if(close_br + 1 < auth + len) {
+            if(close_br[1] != ':') {
+                return -1;
+            }
+            colon = close_br + 1;
+        }
+    } else {
+        colon = memchr(auth, ':', len);
+        host_end = colon != NULL ? colon : auth + len;
+    }
+
+    size_t host_len = host_end - host_start;
+    if(host_len == 0 || host_len >= RELAY_HOST_SZ) {
+        return -1;
+    }
+    memcpy(host, host_start, host_len);
+    host[host_len] = '\0';
+
+    if(colon == NULL) {
+        if(default_port == NULL) {
+            return -1;
+        }
+        strcpy(port, default_port);
+        return 0;
+    }
+    size_t port_len = auth + len - (colon + 1);
+    if(port_len == 0 || port_len >= RELAY_PORT_SZ) {
+        return -1;
+    }
+    memcpy(port, colon + 1, port_len);
+    port[port_len] = '\0';
+    return 0;
+}
+
+/*
+ * A CONNECT names the origin in its target ("host:port"). Nothing
+ * is sent on its behalf, only the bytes the client sent after the
+ * head go to the origin first, which out holds.
+ */
+static const char *rewrite_connect(struct relay *r) {
+    const HttpParser *hp = &r->req;
+    if(split_authority(r->head + hp->target.off, hp->target.len, r->host, r->port, NULL) == -1) {
+        return s_resp_400;
+    }
+    if(out_append(r, r->head + hp->head_len, r->head_len - hp->head_len) == -1) {
+        return s_resp_431;
+    }
+    r->tunnel = 1;
+    return NULL;
+}
+
+/*
+ * What follows the request in the head buffer is the start of the
+ * next one, pipelined behind it. It waits after out, as the buffer
+ * is about to hold the response head, and if it does not fit there
+ * the client is closed after the response instead.
+ */
+static void keep_pending(struct relay *r, const char *next) {
+    size_t len = r->head + r->head_len - next;
+    if(len == 0) {
+        return;
+    }
+    if(r->out_len + len > RELAY_OUT_SZ) {
+        r->closing = 1;
+        return;
+    }
+    memcpy(r->out + r->out_len, next, len);
+    r->pending_len = len;
+}
+
+/*
+ * Turns the request head of the client into the one sent to the
+ * origin: the target becomes origin-form, the hop-by-hop headers
+ * are dropped and the origin is asked to keep the connection open
+ * so that it can go back to the idle pool after the response.
+ * Returns the response to send back on failure, NULL on success.
+ */
+static const char *rewrite_head(struct relay *r) {
+    const HttpParser *hp = &r->req;
+    const char *head = r->head;
+
+    if(http_slice_eq(head, hp->method, "CONNECT")) {
+        /* A reverse proxy does not open tunnels to wherever it is told */
+        return r->ctx->balancer == NULL ? rewrite_connect(r) : s_resp_400;
+    }
+
+    const char *target = head + hp->target.off;
+    const char *target_end = target + hp->target.len;
+    const char *path = target;
+    size_t path_len = hp->target.len;
+    const char *authority = NULL;
+    size_t authority_len = 0;
+    if(path_len > 7 && strncasecmp(target, "http://", 7) == 0) {
+        authority = target + 7;
+        path = authority;
+        while(path < target_end && *path != '/' && *path != '?' && *path != '#') {
+            ++path;
+        }
+        authority_len = path - authority;
+        /* The fragment is the client's alone */
+        const char *fragment = memchr(path, '#', target_end - path);
+        path_len = (fragment != NULL ? fragment : target_end) - path;
+    } else if(target[0] != '/') {
+        return s_resp_400;
+    }
+
+    char version[16];
+    int version_len = snprintf(version, sizeof(version), " HTTP/%d.%d\r\n",
+            hp->version_major, hp->version_minor);
+
+    if(out_append(r, head + hp->method.off, hp->method.len) == -1 ||
+            out_append(r, " ", 1) == -1) {
+        return s_resp_431;
+    }
+    /* "http://host" and "http://host?q" have an empty path */
+    if(path_len == 0 || path[0] != '/') {
+        if(out_append(r, "/", 1) == -1) {
+            return s_resp_431;
+        }
+    }
+    if(out_append(r, path, path_len) == -1) {
+        return s_resp_431;
+    }
+    if(out_append(r, version, version_len) == -1) {
+        return s_resp_431;
+    }
+
+    for(unsigned int i = 0; i < hp->nheaders; ++i) {
+        const HttpHeader *h = &hp->headers[i];
+        if(http_slice_eq(head, h->name, "Connection") ||
+                http_slice_eq(head, h->name, "Proxy-Connection") ||
+                http_slice_eq(head, h->name, "Keep-Alive")) {
+            continue;
+        }
+        if(http_slice_eq(head, h->name, "Host")) {
+            /* The authority of the target wins and is emitted below */
+            if(authority == NULL) {
+                authority = head + h->value.off;
+                authority_len = h->value.len;
+            }
+            continue;
+        }
+        if(out_append(r, head + h->name.off, h->name.len) == -1 ||
+                out_append(r, ": ", 2) == -1 ||
+                out_append(r, head + h->value.off, h->value.len) == -1 ||
+                out_append(r, "\r\n", 2) == -1) {
+            return s_resp_431;
+        }
+    }
+
+    if(authority == NULL || split_authority(authority, authority_len, r->host, r->port, "80") == -1) {
+        return s_resp_400;
+    }
+    if(out_append(r, "Host: ", 6) == -1 || out_append(r, authority, authority_len) == -1 ||
+            out_append(r, "\r\nConnection: keep-alive\r\n\r\n", 28) == -1) {
+        return s_resp_431;
+    }
+
+    /* Body bytes that came along with the head */
+    size_t consumed;
+    int status = http_parse_body(&r->req, head + hp->head_len, r->head_len - hp->head_len,
+            &consumed);
+    if(status == HTTP_PARSE_ERROR) {
+        return s_resp_400;
+    }
+    if(out_append(r, head + hp->head_len, consumed) == -1) {
+        return s_resp_431;
+    }
+    if(status == HTTP_PARSE_DONE) {
+        r->up.msg_done = 1;
+        r->retryable = 1;
+        keep_pending(r, head + hp->head_len + consumed);
+    }
+    return NULL;
+}
+
+/* Where the request goes: its backend if it has one, else its origin */
+static const char *upstream_host(const struct relay *r) {
+    return r->backend != -1 ? balancer_host(r->ctx->balancer, r->backend) : r->host;
+}
+
+static const char *upstream_port(const struct relay *r) {
+    return r->backend != -1 ? balancer_port(r->ctx->balancer, r->backend) : r->port;
+}
+
+/* The port of the origin, 0 if it cannot be parsed */
+static unsigned long upstream_port_num(const struct relay *r) {
+    char *end;
+    unsigned long port = strtoul(upstream_port(r), &end, 10);
+    return (*end != '\0' || port > 65535) ? 0 : port;
+}
+
+static socklen_t upstream_addr(const struct relay *r, unsigned int i, unsigned long port,
+        struct sockaddr_storage *ss) {
+    memset(ss, 0, sizeof(*ss));
+    if(r->addrs[i].family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        sin->sin_addr = r->addrs[i].addr.v4;
+        return sizeof(*sin);
+    }
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    sin6->sin6_addr = r->addrs[i].addr.v6;
+    return sizeof(*sin6);
+}
+
+/* Non-blocking connect(2) to the first resolved address that takes it */
+static int connect_upstream(const struct relay *r) {
+    unsigned long port = upstream_port_num(r);
+    if(port == 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for(unsigned int i = 0; i < r->naddrs; ++i) {
+        struct sockaddr_storage ss;
+        socklen_t sslen = upstream_addr(r, i, port, &ss);
+        fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(fd == -1) {
+            continue;
+        }
+        if(connect(fd, (struct sockaddr *)&ss, sslen) == 0 || errno == EINPROGRESS) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static void fail(struct relay *r, const char *resp) {
+    MetricCounter kind = METRIC_ERR_BAD_GATEWAY;
+    if(resp == s_resp_400) {
+        kind = METRIC_ERR_BAD_REQUEST;
+    } else if(resp == s_resp_431) {
+        kind = METRIC_ERR_HEAD_TOO_LARGE;
+    } else if(resp == s_resp_503) {
+        kind = METRIC_ERR_OVERLOADED;
+    } else if(resp == s_resp_503_no_backend) {
+        kind = METRIC_ERR_NO_BACKEND;
+    } else if(resp == s_resp_504) {
+        kind = METRIC_ERR_GATEWAY_TIMEOUT;
+    }
+    metrics_add(r->ctx->metrics, kind, 1);
+    drop_connect(r);
+    collapse_release(r);
+    /* The backend could not be reached or did not answer in time */
+    if(kind == METRIC_ERR_BAD_GATEWAY || kind == METRIC_ERR_GATEWAY_TIMEOUT) {
+        report_backend(r, 0);
+    }
+    release_backend(r);
+    r->state = RELAY_SEND_ERROR;
+    r->err = resp;
+    r->err_len = strlen(resp);
+    r->err_off = 0;
+    if(r->upstreamfd != -1) {
+        conn_remove_fd(r->ctx->conn_pool, r->upstreamfd);
+        close(r->upstreamfd);
+        r->upstreamfd = -1;
+    }
+}
+
+/* Returns 1 once the head is complete, 0 if more is needed, -1 to close */
+static int read_head(struct relay *r) {
+    for(;;) {
+        /* Only the new bytes are looked at, a pipelined head may be whole already */
+        if(r->head_len > 0) {
+            switch(http_parse_head(&r->req, r->head, r->head_len)) {
+                case HTTP_PARSE_DONE:
+                    r->head_us = util_now_us();
+                    r->requests++;
+                    metrics_add(r->ctx->metrics, METRIC_REQUESTS, 1);
+                    TRACE2(request, r->clientfd, r->head_us - r->request_us);
+                    return 1;
+                case HTTP_PARSE_ERROR:
+                    fail(r, r->req.error == HTTP_ERR_TOO_MANY_HEADERS ?
+                            s_resp_431 : s_resp_400);
+                    return 0;
+            }
+        }
+        if(r->head_len == RELAY_HEAD_SZ) {
+            fail(r, s_resp_431);
+            return 0;
+        }
+        ssize_t n = recv(r->clientfd, r->head + r->head_len,
+                RELAY_HEAD_SZ - r->head_len, 0);
+        if(n == 0) {
+            return -1;
+        }
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if(r->head_len == 0) {
+            r->request_us = util_now_us();
+            if(r->requests == 0) {
+                /* Deferred accepts take clients with their request in, so it waited on the worker */
+                metrics_observe(r->ctx->metrics, METRIC_ACCEPT_TO_FIRST_BYTE,
+                        r->request_us - r->accepted_us);
+                admission_observe(r->ctx->admission, r->request_us - r->accepted_us,
+                        r->request_us);
+            }
+        }
+        r->head_len += n;
+    }
+}
+
+/* Registers a new upstream socket, connected or not */
+static int register_upstream(struct relay *r) {
+    if(r->upstreamfd == -1) {
+        return -1;
+    }
+    if(conn_register_fd(r->ctx->conn_pool, r->upstreamfd, CONN_EV_WRITE,
+                relay_handler, r) == -1) {
+        close(r->upstreamfd);
+        r->upstreamfd = -1;
+        return -1;
+    }
+    r->out_off = 0;
+    return 0;
+}
+
+static void connect_async(struct relay *r, unsigned int first);
+
+/* Connects to the origin once its addresses are known */
+static void connect_resolved(struct relay *r) {
+    if(r->dns_status != DNS_OK) {
+        fail(r, s_resp_502);
+        return;
+    }
+    r->connect_us = util_now_us();
+    if(conn_get_backend(r->ctx->conn_pool) == CONN_BACKEND_URING) {
+        connect_async(r, 0);
+        return;
+    }
+    r->upstreamfd = connect_upstream(r);
+    if(register_upstream(r) == -1) {
+        fail(r, s_resp_502);
+        return;
+    }
+    r->state = RELAY_CONNECTING;
+}
+
+static void on_resolved(int status, const DnsAddr *addrs, unsigned int naddrs, void *data) {
+    struct relay *r = data;
+    r->dns_status = status;
+    r->naddrs = naddrs;
+    if(naddrs > 0) {
+        memcpy(r->addrs, addrs, naddrs * sizeof(DnsAddr));
+    }
+    /* Called from the event loop, the relay was waiting for it */
+    if(r->state == RELAY_RESOLVING) {
+        relay_handler(r->ctx->conn_pool, r->clientfd, 0, r);
+    }
+}
+
+/* Looks the origin up, connecting right away if the answer is known */
+static void resolve_upstream(struct relay *r) {
+    r->reused = 0;
+    r->dns_status = RELAY_DNS_PENDING;
+    switch(dns_resolve(r->ctx->resolver, upstream_host(r), on_resolved, r)) {
+        case 0:
+            connect_resolved(r);
+            break;
+        case 1:
+            r->state = RELAY_RESOLVING;
+            break;
+        default:
+            fail(r, s_resp_502);
+            break;
+    }
+}
+
+/* The origin as the cache knows it */
+static void origin_of(const struct relay *r, char *origin) {
+    snprintf(origin, RELAY_ORIGIN_SZ, "%s:%s", r->host, r->port);
+}
+
+/* Answers from the cache when it holds a fresh response, returns 1 if so */
+static int serve_cached(struct relay *r) {
+    char origin[RELAY_ORIGIN_SZ];
+    origin_of(r, origin);
+    if(http_cache_lookup(r->ctx->cache, origin, r->out, r->out_len, &r->cached)) {
+        r->iovcnt = http_cache_object_iov(r->cached, r->iov, r->age);
+    } else if(http_cache_lookup_disk(r->ctx->cache, origin, r->out, r->out_len,
+                &r->disk, r->head, RELAY_HEAD_SZ)) {
+        /* The head is sent from the buffer, the body with sendfile */
+        r->iovcnt = http_cache_disk_iov(&r->disk, r->head, r->iov, r->age);
+    } else {
+        return 0;
+    }
+    r->iov_off = 0;
+    r->state = RELAY_SEND_CACHED;
+    return 1;
+}
+
+/*
+ * Collapsed forwarding. The first miss for a response that may be
+ * stored leads its fetch, and the misses of the worker for the same
+ * key that come while it runs follow it rather than ask the origin
+ * again. Followers are sent the response from the object it is
+ * stored into, as it grows, and are done once it is stored.
+ *
+ * A follower whose leader has no response head in time, or gets a
+ * response that will not be stored or that varies on headers the
+ * follower does not share, fetches the response on its own. Having
+ * sent part of a response the leader could not finish, it is aborted.
+ */
+
+/* Both requests are for the same target of the same origin */
+static int same_target(const struct relay *a, const struct relay *b) {
+    const char *ta = a->out + 4, *tb = b->out + 4;
+    const char *ea = memchr(ta, ' ', a->out_len - 4), *eb = memchr(tb, ' ', b->out_len - 4);
+    return ea != NULL && eb != NULL && ea - ta == eb - tb && memcmp(ta, tb, ea - ta) == 0 &&
+        strcmp(a->host, b->host) == 0 && strcmp(a->port, b->port) == 0;
+}
+
+/* Follows the relay that fetches the same response, or leads its fetch. Returns 1 to follow */
+static int collapse_join(struct relay *r) {
+    RelayCtx *ctx = r->ctx;
+    if(ctx->cache == NULL || ctx->timeout_ms[RELAY_DEADLINE_COLLAPSE] == 0) {
+        return 0;
+    }
+    char origin[RELAY_ORIGIN_SZ];
+    origin_of(r, origin);
+    uint64_t hash = http_cache_key_hash(origin, r->out, r->out_len);
+    if(hash == 0) {
+        return 0;
+    }
+    struct relay **bucket = &ctx->leaders[hash % RELAY_LEADER_BUCKETS];
+    struct relay *leader = *bucket;
+    while(leader != NULL && (leader->leader_hash != hash || !same_target(leader, r))) {
+        leader = leader->leader_next;
+    }
+    if(leader == NULL) {
+        r->leader_hash = hash;
+        r->leader_next = *bucket;
+        *bucket = r;
+        ctx->collapse.leaders++;
+        return 0;
+    }
+    if(leader->resp_final) {
+        /* The response is on its way, what there is of it goes out right away */
+        if(!http_cache_object_matches(leader->down.fill, r->out, r->out_len)) {
+            return 0;
+        }
+        r->cached = http_cache_retain(leader->down.fill);
+    }
+    r->leader = leader;
+    r->fnext = leader->followers;
+    if(leader->followers != NULL) {
+        leader->followers->fprev = r;
+    }
+    leader->followers = r;
+    r->state = RELAY_COLLAPSED;
+    ctx->collapse.followers++;
+    return 1;
+}
+
+/* No relay may follow r from now on */
+static void unlink_leader(struct relay *r) {
+    struct relay **link = &r->ctx->leaders[r->leader_hash % RELAY_LEADER_BUCKETS];
+    while(*link != r) {
+        link = &(*link)->leader_next;
+    }
+    *link = r->leader_next;
+    r->leader_hash = 0;
+    r->leader_next = NULL;
+}
+
+/* Detaches the followers of r from it, they are returned as a list */
+static struct relay *take_followers(struct relay *r) {
+    struct relay *f = r->followers;
+    r->followers = NULL;
+    for(struct relay *p = f; p != NULL; p = p->fnext) {
+        p->leader = NULL;
+    }
+    return f;
+}
+
+/* A follower is left to fetch the response itself */
+static void fall_back(struct relay *f) {
+    http_cache_release(f->cached);
+    f->cached = NULL;
+    f->ctx->collapse.fallbacks++;
+    relay_handler(f->ctx->conn_pool, f->clientfd, 0, f);
+}
+
+/*
+ * Ends the part r plays in collapsed forwarding without a response
+ * for its followers: a follower leaves its leader, and the followers
+ * of a leader fall back on fetching the response themselves.
+ */
+static void collapse_release(struct relay *r) {
+    if(r->leader != NULL) {
+        if(r->fprev != NULL) {
+            r->fprev->fnext = r->fnext;
+        } else {
+            r->leader->followers = r->fnext;
+        }
+        if(r->fnext != NULL) {
+            r->fnext->fprev = r->fprev;
+        }
+        r->leader = r->fprev = r->fnext = NULL;
+        return;
+    }
+    if(r->leader_hash == 0) {
+        return;
+    }
+    unlink_leader(r);
+    struct relay *f = take_followers(r), *next;
+    for(; f != NULL; f = next) {
+        next = f->fnext;
+        f->fprev = f->fnext = NULL;
+        if(f->cached_sent > 0) {
+            abort_relay(f);
+        } else {
+            fall_back(f);
+        }
+    }
+}
+
+/* Hands what the leader r has of its response on to its followers */
+static void collapse_progress(struct relay *r) {
+    if(r->leader_hash == 0 || !r->resp_final) {
+        return;
+    }
+    CacheObject *fill = r->down.fill;
+    if(fill == NULL) {
+        collapse_release(r);
+        return;
+    }
+    const char *data;
+    size_t len = http_cache_object_data(fill, &data);
+    struct relay *f = r->followers, *next;
+    for(; f != NULL; f = next) {
+        next = f->fnext;
+        if(f->cached == NULL) {
+            if(!http_cache_object_matches(fill, f->out, f->out_len)) {
+                collapse_release(f);
+                fall_back(f);
+                continue;
+            }
+            f->cached = http_cache_retain(fill);
+        }
+        if(f->cached_sent < len) {
+            relay_handler(r->ctx->conn_pool, f->clientfd, 0, f);
+        }
+    }
+}
+
+/* The response of the leader r is stored, its followers are sent the rest of it */
+static void collapse_complete(struct relay *r) {
+    if(r->leader_hash == 0) {
+        return;
+    }
+    unlink_leader(r);
+    struct relay *f = take_followers(r), *next;
+    for(; f != NULL; f = next) {
+        next = f->fnext;
+        f->fprev = f->fnext = NULL;
+        relay_handler(r->ctx->conn_pool, f->clientfd, 0, f);
+    }
+}
+
+/*
+ * In reverse proxy mode, picks the backend of the request, keyed by
+ * its target, which out starts with. Returns -1 when there is none.
+ */
+static int pick_backend(struct relay *r) {
+    if(r->ctx->balancer == NULL || r->backend != -1) {
+        return 0;
+    }
+    const char *target = memchr(r->out, ' ', r->out_len);
+    const char *target_end = NULL;
+    if(target != NULL) {
+        target++;
+        target_end = memchr(target, ' ', r->out + r->out_len - target);
+    }
+    size_t len = target_end != NULL ? (size_t)(target_end - target) : 0;
+    r->backend = balancer_pick(r->ctx->balancer, target, len);
+    return r->backend == -1 ? -1 : 0;
+}
+
+/* Sends the request to the origin, over an idle connection if there is one */
+static void fetch_upstream(struct relay *r) {
+    /* With every backend down or open, the client is told right away */
+    if(pick_backend(r) == -1) {
+        fail(r, s_resp_503_no_backend);
+        return;
+    }
+    r->upstreamfd = upstream_pool_get(r->ctx->upstreams, upstream_host(r), upstream_port(r));
+    if(r->upstreamfd == -1) {
+        resolve_upstream(r);
+        return;
+    }
+    r->reused = 1;
+    TRACE4(upstream, r->clientfd, r->upstreamfd, 0, 1);
+    if(register_upstream(r) == -1) {
+        fail(r, s_resp_502);
+        return;
+    }
+    r->state = RELAY_SEND_HEAD;
+}
+
+/*
+ * A tunnel is relayed the way an upgraded connection is, with no
+ * message in either direction. The 200 that opens it takes the
+ * place of the response head, so it goes out once the origin is
+ * connected, and a connection is never taken from the idle pool.
+ */
+static void start_tunnel(struct relay *r) {
+    r->up.msg = r->down.msg = NULL;
+    memcpy(r->head, s_resp_200_tunnel, sizeof(s_resp_200_tunnel) - 1);
+    r->head_len = r->resp_end = sizeof(s_resp_200_tunnel) - 1;
+    r->resp_final = 1;
+    resolve_upstream(r);
+}
+
+static void start_upstream(struct relay *r) {
+    /* Over the concurrency limit, the request costs as little as it can */
+    if(!admission_begin(r->ctx->admission)) {
+        fail(r, s_resp_503);
+        return;
+    }
+    r->admitted = 1;
+    const char *resp = rewrite_head(r);
+    if(resp != NULL) {
+        fail(r, resp);
+        return;
+    }
+    if(r->tunnel) {
+        start_tunnel(r);
+        return;
+    }
+    if(http_slice_eq(r->head, r->req.method, "HEAD")) {
+        r->resp_flags = HTTP_PARSER_NO_BODY;
+    }
+    /* The request head is in out, the buffer now holds the response head */
+    r->head_len = 0;
+    http_parser_init(&r->resp, HTTP_RESPONSE, r->resp_flags);
+    if(r->req.body == HTTP_BODY_NONE && (serve_cached(r) || collapse_join(r))) {
+        return;
+    }
+    fetch_upstream(r);
+}
+
+/*
+ * An idle connection may be closed by the origin just as it is
+ * reused. When that happens before a byte of the response came
+ * back, and the request can be sent again as a whole, a new
+ * connection is tried. Returns 0 if the relay goes on that way.
+ */
+static int retry_upstream(struct relay *r) {
+    if(!r->reused || !r->retryable || r->head_len > 0) {
+        return -1;
+    }
+    conn_remove_fd(r->ctx->conn_pool, r->upstreamfd);
+    close(r->upstreamfd);
+    r->upstreamfd = -1;
+    resolve_upstream(r);
+    return 0;
+}
+
+static void connected(struct relay *r) {
+    uint64_t us = util_now_us() - r->connect_us;
+    metrics_observe(r->ctx->metrics, METRIC_UPSTREAM_CONNECT, us);
+    TRACE4(upstream, r->clientfd, r->upstreamfd, us, 0);
+}
+
+/* Frees an attempt once the kernel is done with it */
+static void free_connect(struct relay_connect *c) {
+    if(c->relay == NULL) {
+        if(c->prev != NULL) {
+            c->prev->next = c->next;
+        } else {
+            c->ctx->orphans = c->next;
+        }
+        if(c->next != NULL) {
+            c->next->prev = c->prev;
+        }
+        close(c->fd);
+    }
+    free(c);
+}
+
+/* The relay goes on without its attempt, which is cancelled */
+static void drop_connect(struct relay *r) {
+    struct relay_connect *c = r->connecting;
+    if(c == NULL) {
+        return;
+    }
+    r->connecting = NULL;
+    c->relay = NULL;
+    c->prev = NULL;
+    c->next = r->ctx->orphans;
+    if(c->next != NULL) {
+        c->next->prev = c;
+    }
+    r->ctx->orphans = c;
+    conn_async_cancel(r->ctx->conn_pool, c->fd);
+}
+
+/* Both completions of an attempt came, the relay takes the socket over */
+static void finish_async(struct relay_connect *c) {
+    struct relay *r = c->relay;
+    if(r == NULL) {
+        free_connect(c);
+        return;
+    }
+    r->connecting = NULL;
+    if(c->res < 0) {
+        /* The next address may take it */
+        unsigned int next = c->addr + 1;
+        close(c->fd);
+        free_connect(c);
+        connect_async(r, next);
+    } else {
+        r->upstreamfd = c->fd;
+        int sent = c->sent;
+        free_connect(c);
+        if(register_upstream(r) == -1) {
+            fail(r, s_resp_502);
+        } else {
+            connected(r);
+            /* Whatever did not go out is sent the usual way */
+            r->out_off = sent > 0 ? (size_t)sent : 0;
+            r->state = RELAY_SEND_HEAD;
+        }
+    }
+    /* Called from the event loop, the relay was waiting for it */
+    relay_handler(r->ctx->conn_pool, r->clientfd, 0, r);
+}
+
+static void on_async_connect(ConnectionPool *conn_pool, int fd, int res,
+        const void *buf, void *data) {
+    UNUSED(conn_pool);
+    UNUSED(fd);
+    UNUSED(buf);
+
+    struct relay_connect *c = data;
+    c->res = res;
+    if(--c->pending == 0) {
+        finish_async(c);
+    }
+}
+
+static void on_async_send(ConnectionPool *conn_pool, int fd, int res,
+        const void *buf, void *data) {
+    UNUSED(conn_pool);
+    UNUSED(fd);
+    UNUSED(buf);
+
+    struct relay_connect *c = data;
+    c->sent = res;
+    if(--c->pending == 0) {
+        finish_async(c);
+    }
+}
+
+/*
+ * Hands the connect(2) to the origin, from its address first on, and
+ * the send(2) of the head linked to it over to the next batch of the
+ * worker. The relay waits in RELAY_CONNECTING with no socket of its
+ * own until both completed.
+ */
+static void connect_async(struct relay *r, unsigned int first) {
+    unsigned long port = upstream_port_num(r);
+    struct relay_connect *c = NULL;
+    int fd = -1;
+    for(unsigned int i = first; port != 0 && i < r->naddrs; ++i) {
+        struct sockaddr_storage ss;
+        socklen_t sslen = upstream_addr(r, i, port, &ss);
+        fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(fd == -1) {
+            continue;
+        }
+        if((c = malloc(sizeof(struct relay_connect) + r->out_len)) == NULL) {
+            perror("malloc");
+            close(fd);
+            break;
+        }
+        c->relay = r;
+        c->ctx = r->ctx;
+        c->fd = fd;
+        c->addr = i;
+        c->pending = 0;
+        c->res = 0;
+        c->sent = 0;
+        c->prev = c->next = NULL;
+        memcpy(&c->ss, &ss, sslen);
+        c->sslen = sslen;
+        c->len = r->out_len;
+        memcpy(c->head, r->out, r->out_len);
+        break;
+    }
+    if(c == NULL) {
+        fail(r, s_resp_502);
+        return;
+    }
+    unsigned int link = c->len > 0 ? CONN_ASYNC_LINK : 0;
+    if(conn_async_connect(r->ctx->conn_pool, c->fd, (struct sockaddr *)&c->ss, c->sslen,
+                link, on_async_connect, c) == -1) {
+        close(c->fd);
+        free(c);
+        fail(r, s_resp_502);
+        return;
+    }
+    c->pending++;
+    /* Without the send, the head goes out once connected */
+    if(link && conn_async_send(r->ctx->conn_pool, c->fd, c->head, c->len, 0,
+                on_async_send, c) == 0) {
+        c->pending++;
+    }
+    r->connecting = c;
+    r->state = RELAY_CONNECTING;
+}
+
+/* Returns 1 when connected, 0 while pending */
+static int finish_connect(struct relay *r) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(r->upstreamfd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+        err = errno;
+    }
+    if(err == EINPROGRESS || err == EALREADY) {
+        return 0;
+    }
+    if(err != 0) {
+        fail(r, s_resp_502);
+        return 0;
+    }
+    connected(r);
+    return 1;
+}
+
+/* The first byte of the response reached the client */
+static void first_byte_sent(struct relay *r) {
+    uint64_t us = util_now_us() - r->head_us;
+    metrics_observe(r->ctx->metrics, METRIC_TIME_TO_FIRST_BYTE, us);
+    TRACE2(first_byte, r->clientfd, us);
+}
+
+/* The whole response reached the client, a tunnel is not a request that ends */
+static void request_done(struct relay *r) {
+    if(!r->tunnel) {
+        metrics_observe(r->ctx->metrics, METRIC_REQUEST_TIME, util_now_us() - r->request_us);
+    }
+}
+
+/* Writes buf[*off..len) to fd, returns 1 once all of it is out */
+static int send_all(int fd, const char *buf, size_t len, size_t *off) {
+    while(*off < len) {
+        ssize_t n = send(fd, buf + *off, len - *off, MSG_NOSIGNAL);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        *off += n;
+    }
+    return 1;
+}
+
+/*
+ * Writes what is left of the iovecs of r to the client, returns 1 once
+ * all of it is out. The body of a disk hit follows right away, so the
+ * head is held back to go out in the same segments as its first bytes.
+ */
+static int send_iov(struct relay *r) {
+    int flags = MSG_NOSIGNAL | (r->disk.len > 0 ? MSG_MORE : 0);
+    while(r->iov_off < r->iovcnt) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = r->iov + r->iov_off;
+        msg.msg_iovlen = r->iovcnt - r->iov_off;
+        ssize_t n = sendmsg(r->clientfd, &msg, flags);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if(r->cached_sent == 0 && n > 0) {
+            first_byte_sent(r);
+        }
+        r->cached_sent += n;
+        while(r->iov_off < r->iovcnt && (size_t)n >= r->iov[r->iov_off].iov_len) {
+            n -= r->iov[r->iov_off].iov_len;
+            r->iov_off++;
+        }
+        if(n > 0) {
+            r->iov[r->iov_off].iov_base = (char *)r->iov[r->iov_off].iov_base + n;
+            r->iov[r->iov_off].iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+/* Sends what is left of the body of a disk hit, returns 1 once all of it is out */
+static int send_disk_body(struct relay *r) {
+    while(r->disk.len > 0) {
+        ssize_t n = sendfile(r->clientfd, r->disk.fd, &r->disk.off, r->disk.len);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if(n == 0) {
+            /* The data file is shorter than the index says */
+            return -1;
+        }
+        r->disk.len -= n;
+        r->cached_sent += n;
+    }
+    return 1;
+}
+
+/* Sends what the leader has of the response so far, returns 1 once all of it is out */
+static int send_collapsed(struct relay *r) {
+    const char *data;
+    size_t len = http_cache_object_data(r->cached, &data);
+    size_t sent = r->cached_sent;
+    int status = send_all(r->clientfd, data, len, &sent);
+    if(r->cached_sent == 0 && sent > 0) {
+        first_byte_sent(r);
+    }
+    r->cached_sent = sent;
+    return status;
+}
+
+/* Relays a raw stream through a ring buffer from now on */
+static int use_ring(struct relay_pipe *p, Slab *buf_slab) {
+    if(p->ring == NULL && (p->ring = slab_alloc(buf_slab)) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+/* A tunnel still works without pipes, when the process is out of descriptors */
+static int open_pipe(struct relay_pipe *p, Slab *buf_slab) {
+    if(p->fds[0] != -1 || p->ring != NULL) {
+        return 0;
+    }
+    if(pipe2(p->fds, O_NONBLOCK | O_CLOEXEC) == 0) {
+        return 0;
+    }
+    if(p->msg == NULL && (errno == EMFILE || errno == ENFILE)) {
+        return use_ring(p, buf_slab);
+    }
+    perror("pipe2");
+    return -1;
+}
+
+static int open_pipes(struct relay *r) {
+    if(open_pipe(&r->up, r->ctx->buf_slab) == -1 || open_pipe(&r->down, r->ctx->buf_slab) == -1) {
+        return -1;
+    }
+    if(r->tunnel) {
+        r->ctx->tunnels.opened++;
+        r->ctx->tunnels.active++;
+    }
+    return 0;
+}
+
+/* Starts storing the final response when the cache takes it */
+static void start_fill(struct relay *r) {
+    char origin[RELAY_ORIGIN_SZ];
+    origin_of(r, origin);
+    r->down.fill = http_cache_fill_start(r->ctx->cache, origin, r->out, r->out_len,
+            r->head + r->resp_start, &r->resp);
+    if(r->down.fill == NULL) {
+        return;
+    }
+    if(pipe2(r->down.capfds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("pipe2");
+        drop_fill(&r->down);
+        return;
+    }
+    if(http_cache_fill_append(r->down.fill, r->head + r->resp_start,
+                r->resp_end - r->resp_start) == -1) {
+        drop_fill(&r->down);
+    }
+}
+
+/*
+ * Reads the response head into the head buffer and sends it to the
+ * client as it is parsed. Interim (1xx) responses are passed on and
+ * the final one is looked for after them. Returns 1 once the final
+ * head is sent, 0 if a socket would block and -1 on error.
+ */
+static int relay_response_head(struct relay *r) {
+    for(;;) {
+        if(r->resp_sent < r->resp_end) {
+            size_t sent = r->resp_sent;
+            int status = send_all(r->clientfd, r->head, r->resp_end, &r->resp_sent);
+            if(sent == 0 && r->resp_sent > 0) {
+                first_byte_sent(r);
+            }
+            if(status != 1) {
+                return status;
+            }
+        }
+        if(r->resp_final) {
+            return 1;
+        }
+
+        int status = http_parse_head(&r->resp, r->head + r->resp_start,
+                r->head_len - r->resp_start);
+        if(status == HTTP_PARSE_ERROR) {
+            return -1;
+        }
+        if(status == HTTP_PARSE_DONE) {
+            size_t end = r->resp_start + r->resp.head_len;
+            if(r->resp.status / 100 == 1 && r->resp.status != 101) {
+                r->resp_start = r->resp_end = end;
+                http_parser_init(&r->resp, HTTP_RESPONSE, r->resp_flags);
+                continue;
+            }
+            report_backend(r, r->resp.status < 500);
+            r->resp_final = 1;
+            if(r->resp.status == 101) {
+                /* Whatever follows is not HTTP anymore */
+                r->up.msg = r->down.msg = NULL;
+                r->up.msg_done = r->up.done = 0;
+                r->resp_end = r->head_len;
+                continue;
+            }
+            size_t consumed;
+            status = http_parse_body(&r->resp, r->head + end, r->head_len - end, &consumed);
+            if(status == HTTP_PARSE_ERROR) {
+                return -1;
+            }
+            r->down.msg_done = status == HTTP_PARSE_DONE;
+            r->down.extra = end + consumed < r->head_len;
+            r->resp_end = end + consumed;
+            start_fill(r);
+            continue;
+        }
+
+        if(r->head_len == RELAY_HEAD_SZ) {
+            return -1;
+        }
+        ssize_t n = recv(r->upstreamfd, r->head + r->head_len,
+                RELAY_HEAD_SZ - r->head_len, 0);
+        if(n == 0) {
+            return -1;
+        }
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        r->head_len += n;
+    }
+}
+
+/* Reads bytes that frame the body into frame, returns 1 to go on */
+static int read_frame(struct relay_pipe *p, int src) {
+    /* Not past the end of a body of known length, whatever follows is the next message */
+    size_t want = sizeof(p->frame);
+    if(p->msg->body == HTTP_BODY_LENGTH && http_body_remaining(p->msg) < want) {
+        want = http_body_remaining(p->msg);
+    }
+    ssize_t n = recv(src, p->frame, want, 0);
+    if(n == 0) {
+        p->eof = 1;
+        return 1;
+    }
+    if(n == -1) {
+        if(errno == EINTR) {
+            return 1;
+        }
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    size_t consumed;
+    int status = http_parse_body(p->msg, p->frame, n, &consumed);
+    if(status == HTTP_PARSE_ERROR) {
+        return -1;
+    }
+    p->msg_done = status == HTTP_PARSE_DONE;
+    p->extra = consumed < (size_t)n;
+    p->frame_len = consumed;
+    p->frame_off = 0;
+    if(p->fill != NULL && http_cache_fill_append(p->fill, p->frame, consumed) == -1) {
+        drop_fill(p);
+    }
+    return 1;
+}
+
+/* Copies the n bytes just spliced into the pipe, which was empty, into the object */
+static void capture(struct relay_pipe *p, size_t n) {
+    if(tee(p->fds[0], p->capfds[1], n, SPLICE_F_NONBLOCK) != (ssize_t)n ||
+            http_cache_fill_read(p->fill, p->capfds[0], n) == -1) {
+        drop_fill(p);
+    }
+}
+
+/* Points iov at the n bytes of the ring that start at off */
+static int ring_iov(char *ring, size_t off, size_t n, struct iovec *iov) {
+    size_t first = n < RELAY_RING_SZ - off ? n : RELAY_RING_SZ - off;
+    iov[0].iov_base = ring + off;
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring;
+    iov[1].iov_len = n - first;
+    return n > first ? 2 : 1;
+}
+
+/* Like pump, for a raw stream that goes through the ring of p */
+static int pump_ring(struct relay_pipe *p, int src, int dst) {
+    struct iovec iov[2];
+    while(!p->done) {
+        if(p->len > 0) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = ring_iov(p->ring, p->ring_off, p->len, iov);
+            ssize_t n = sendmsg(dst, &msg, MSG_NOSIGNAL);
+            if(n > 0) {
+                p->ring_off = (p->ring_off + n) % RELAY_RING_SZ;
+                p->len -= n;
+                p->bytes += n;
+                continue;
+            }
+            if(n == -1 && errno == EINTR) {
+                continue;
+            }
+            if(n != -1 || errno != EAGAIN) {
+                return -1;
+            }
+            /* The sink is full, the source is still read while there is room */
+        }
+        if(p->eof) {
+            if(p->len == 0) {
+                shutdown(dst, SHUT_WR);
+                p->done = 1;
+            }
+            break;
+        }
+        if(p->len == RELAY_RING_SZ) {
+            break;
+        }
+        ssize_t n = readv(src, iov, ring_iov(p->ring, (p->ring_off + p->len) % RELAY_RING_SZ,
+                    RELAY_RING_SZ - p->len, iov));
+        if(n > 0) {
+            p->len += n;
+        } else if(n == 0) {
+            p->eof = 1;
+        } else if(errno == EAGAIN) {
+            break;
+        } else if(errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Bytes were read from the source that the sink did not take yet */
+static int pipe_busy(const struct relay_pipe *p) {
+    return p->len > 0 || p->frame_off < p->frame_len;
+}
+
+/*
+ * No more bytes may be read from the source until some are forwarded.
+ * Framing goes out behind the pipe, so nothing may be spliced in until
+ * it is out, and what the cache stores is teed from an empty pipe.
+ */
+static int pipe_full(const struct relay_pipe *p) {
+    if(p->ring != NULL) {
+        return p->len == RELAY_RING_SZ;
+    }
+    return p->frame_off < p->frame_len || p->paused || (p->fill != NULL && p->len > 0);
+}
+
+/*
+ * Moves bytes from src to dst through the pipe until one of the
+ * sockets would block, or until the message is over. Returns -1
+ * on error, 0 otherwise.
+ */
+static int pump(struct relay_pipe *p, int src, int dst, Slab *buf_slab) {
+    if(p->ring != NULL) {
+        return pump_ring(p, src, dst);
+    }
+    while(!p->done) {
+        int blocked = 0;
+        if(p->len > 0) {
+            ssize_t n = splice(p->fds[0], NULL, dst, NULL, p->len,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(n > 0) {
+                p->len -= n;
+                p->bytes += n;
+                if(p->len <= RELAY_PIPE_LOW) {
+                    p->paused = 0;
+                }
+                continue;
+            }
+            if(n == -1 && errno == EINTR) {
+                continue;
+            }
+            if(n != -1 || errno != EAGAIN) {
+                return -1;
+            }
+            /* The sink is full, the source is still read while the pipe has room */
+            blocked = 1;
+        } else if(p->frame_off < p->frame_len) {
+            size_t off = p->frame_off;
+            int status = send_all(dst, p->frame, p->frame_len, &p->frame_off);
+            p->bytes += p->frame_off - off;
+            if(status != 1) {
+                return status;
+            }
+            continue;
+        }
+        if(blocked) {
+            if(pipe_full(p) || p->msg_done || p->eof) {
+                return 0;
+            }
+        } else if(p->msg_done) {
+            /* The connection stays open for the next message */
+            p->done = 1;
+            break;
+        } else if(p->eof) {
+            if(p->msg != NULL && p->msg->body != HTTP_BODY_UNTIL_CLOSE) {
+                /* The message was cut short */
+                return -1;
+            }
+            /* Pass the end of the stream on */
+            shutdown(dst, SHUT_WR);
+            p->done = 1;
+            break;
+        }
+
+        size_t want = RELAY_PIPE_HIGH - p->len;
+        if(want > RELAY_SPLICE_SZ) {
+            want = RELAY_SPLICE_SZ;
+        }
+        if(p->msg != NULL) {
+            uint64_t remaining = http_body_remaining(p->msg);
+            if(remaining < sizeof(p->frame)) {
+                /* Framing, and the chunks too small to be worth a splice */
+                int status = read_frame(p, src);
+                if(status != 1) {
+                    return status;
+                }
+                continue;
+            }
+            if(remaining < want) {
+                want = remaining;
+            }
+        }
+        ssize_t n = splice(src, NULL, p->fds[1], NULL, want,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n > 0) {
+            p->len += n;
+            if(p->len >= RELAY_PIPE_HIGH) {
+                p->paused = 1;
+            }
+            if(p->fill != NULL) {
+                capture(p, n);
+            }
+            if(p->msg != NULL && http_body_skip(p->msg, n) == HTTP_PARSE_DONE) {
+                p->msg_done = 1;
+            }
+        } else if(n == 0) {
+            p->eof = 1;
+        } else if(errno == EAGAIN) {
+            return 0;
+        } else if(errno == EINVAL && p->msg == NULL && p->len == 0) {
+            /* The source cannot be spliced, a raw stream is copied instead */
+            return use_ring(p, buf_slab) == -1 ? -1 : pump_ring(p, src, dst);
+        } else if(errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The client connection stays open for its next request when it did
+ * not ask to close it, its request ended where its framing said and
+ * the client was told the response ends where it did. The errors the
+ * proxy answers with all close the connection.
+ */
+static int keep_client(const struct relay *r) {
+    if(r->tunnel || r->closing || !r->req.keep_alive || r->up.msg == NULL || r->up.extra) {
+        return 0;
+    }
+    if(r->state == RELAY_SEND_CACHED || r->state == RELAY_COLLAPSED) {
+        return 1;
+    }
+    return r->state == RELAY_PUMP && r->up.done && r->down.msg_done && r->resp.keep_alive;
+}
+
+/*
+ * Starts over with the next request of a client that stays. Its pipes
+ * are empty and stay open, and the bytes of the request pipelined
+ * behind the last one, if any, go back into the head buffer.
+ */
+static void next_request(struct relay *r) {
+    count_bytes(r);
+    if(r->upstreamfd != -1) {
+        conn_remove_fd(r->ctx->conn_pool, r->upstreamfd);
+        close(r->upstreamfd);
+    }
+    http_cache_release(r->cached);
+    drop_fill(&r->down);
+    size_t pending = r->pending_len;
+    memcpy(r->head, r->out + r->out_len, pending);
+    reset_request(r);
+    reset_pipe(&r->up, &r->req);
+    reset_pipe(&r->down, &r->resp);
+    r->head_len = pending;
+    if(pending > 0) {
+        r->request_us = util_now_us();
+    }
+}
+
+/*
+ * The response is over. The upstream connection goes back to the
+ * idle pool when both messages ended exactly where their framing
+ * said they would and the origin did not ask to close it. Returns
+ * 1 if the client stays for its next request, 0 if it was closed.
+ */
+static int relay_finish(struct relay *r) {
+    request_done(r);
+    end_admission(r);
+    collapse_progress(r);
+    if(r->down.fill != NULL && r->down.msg_done) {
+        http_cache_fill_finish(r->ctx->cache, r->down.fill);
+        r->down.fill = NULL;
+        collapse_complete(r);
+    }
+    collapse_release(r);
+    if(r->up.done && r->up.msg != NULL && !r->down.extra &&
+            r->resp.keep_alive && r->resp.body != HTTP_BODY_UNTIL_CLOSE) {
+        conn_remove_fd(r->ctx->conn_pool, r->upstreamfd);
+        upstream_pool_put(r->ctx->upstreams, upstream_host(r), upstream_port(r), r->upstreamfd);
+        r->upstreamfd = -1;
+    }
+    release_backend(r);
+    if(!keep_client(r)) {
+        relay_close(r);
+        return 0;
+    }
+    next_request(r);
+    return 1;
+}
+
+static int pipe_wants_input(const struct relay_pipe *p) {
+    return !p->done && !p->msg_done && !p->eof && !pipe_full(p);
+}
+
+static void update_interest(struct relay *r) {
+    unsigned int client = 0, upstream = 0;
+    switch(r->state) {
+        case RELAY_READ_HEAD:
+            client = CONN_EV_READ;
+            break;
+        case RELAY_RESOLVING:
+            break;
+        case RELAY_CONNECTING:
+        case RELAY_SEND_HEAD:
+            upstream = CONN_EV_WRITE;
+            break;
+        case RELAY_PUMP:
+            /* Only read a side once what it sent before is forwarded */
+            if(pipe_wants_input(&r->up)) {
+                client |= CONN_EV_READ;
+            }
+            if(pipe_busy(&r->up)) {
+                upstream |= CONN_EV_WRITE;
+            }
+            if(!r->resp_final || pipe_wants_input(&r->down)) {
+                upstream |= CONN_EV_READ;
+            }
+            if(r->resp_sent < r->resp_end || pipe_busy(&r->down)) {
+                client |= CONN_EV_WRITE;
+            }
+            break;
+        case RELAY_SEND_ERROR:
+        case RELAY_SEND_CACHED:
+            client = CONN_EV_WRITE;
+            break;
+        case RELAY_COLLAPSED:
+            /* Until the leader has more of the response, there is nothing to do */
+            if(r->cached != NULL) {
+                const char *data;
+                if(r->cached_sent < http_cache_object_data(r->cached, &data)) {
+                    client = CONN_EV_WRITE;
+                }
+            }
+            break;
+    }
+    conn_modify_fd(r->ctx->conn_pool, r->clientfd, client);
+    if(r->upstreamfd != -1) {
+        conn_modify_fd(r->ctx->conn_pool, r->upstreamfd, upstream);
+    }
+}
+
+/*
+ * Moves the timer of a relay along with its state. A deadline is armed
+ * once, when the relay starts waiting for it, while the idle timer is
+ * pushed back each time the relay makes progress.
+ */
+static void update_deadline(struct relay *r) {
+    enum relay_deadline deadline = RELAY_DEADLINE_IDLE;
+    switch(r->state) {
+        case RELAY_READ_HEAD:
+            /* A client kept open may stay silent between two requests */
+            if(r->requests == 0 || r->head_len > 0) {
+                deadline = RELAY_DEADLINE_HEAD;
+            }
+            break;
+        case RELAY_RESOLVING:
+        case RELAY_CONNECTING:
+        case RELAY_SEND_HEAD:
+            deadline = RELAY_DEADLINE_UPSTREAM;
+            break;
+        case RELAY_PUMP:
+            /* A request body may take its time, the answer to it may not */
+            if(!r->resp_final && r->up.done) {
+                deadline = RELAY_DEADLINE_UPSTREAM;
+            }
+            break;
+        case RELAY_SEND_ERROR:
+        case RELAY_SEND_CACHED:
+            break;
+        case RELAY_COLLAPSED:
+            if(r->cached == NULL) {
+                deadline = RELAY_DEADLINE_COLLAPSE;
+            }
+            break;
+    }
+    if(deadline != r->deadline || deadline == RELAY_DEADLINE_IDLE) {
+        arm_deadline(r, deadline);
+    }
+}
+
+/*
+ * A client that is too slow with its head, or that stays silent, is
+ * closed. An origin that is too slow to answer gets the client a 504,
+ * unless part of the response went out already.
+ */
+static void on_timeout(Timer *timer, void *data) {
+    UNUSED(timer);
+
+    struct relay *r = data;
+    switch(r->deadline) {
+        case RELAY_DEADLINE_HEAD:
+            r->ctx->timeouts.head++;
+            metrics_add(r->ctx->metrics, METRIC_ERR_CLIENT_TIMEOUT, 1);
+            relay_close(r);
+            return;
+        case RELAY_DEADLINE_UPSTREAM:
+            r->ctx->timeouts.upstream++;
+            if(r->resp_sent > 0) {
+                abort_relay(r);
+                return;
+            }
+            if(r->state == RELAY_RESOLVING) {
+                dns_cancel(r->ctx->resolver, r);
+            }
+            fail(r, s_resp_504);
+            arm_deadline(r, RELAY_DEADLINE_IDLE);
+            update_interest(r);
+            return;
+        case RELAY_DEADLINE_IDLE:
+            r->ctx->timeouts.idle++;
+            metrics_add(r->ctx->metrics, METRIC_ERR_IDLE_TIMEOUT, 1);
+            relay_close(r);
+            return;
+        case RELAY_DEADLINE_COLLAPSE:
+            r->ctx->collapse.timeouts++;
+            collapse_release(r);
+            fall_back(r);
+            return;
+    }
+}
+
+/*
+ * Takes a relay as far as its sockets let it. Returns 1 when its
+ * client stays for another request, which may already be buffered,
+ * and 0 once the relay waits for an event or is closed.
+ */
+static int relay_step(struct relay *r) {
+    int status;
+
+    /* Every state falls through to the next one as soon as it is done */
+    switch(r->state) {
+        case RELAY_READ_HEAD:
+            status = read_head(r);
+            if(status == -1) {
+                relay_close(r);
+                return 0;
+            }
+            if(status == 0 || r->state != RELAY_READ_HEAD) {
+                break;
+            }
+            start_upstream(r);
+            if(r->state != RELAY_CONNECTING && r->state != RELAY_SEND_HEAD) {
+                break;
+            }
+            /* fall through */
+        case RELAY_COLLAPSED:
+            if(r->state == RELAY_COLLAPSED) {
+                if(r->leader != NULL || r->cached != NULL) {
+                    break;
+                }
+                /* Left by its leader with nothing sent yet */
+                fetch_upstream(r);
+                if(r->state != RELAY_CONNECTING && r->state != RELAY_SEND_HEAD) {
+                    break;
+                }
+            }
+            /* fall through */
+        case RELAY_RESOLVING:
+            if(r->state == RELAY_RESOLVING) {
+                if(r->dns_status == RELAY_DNS_PENDING) {
+                    break;
+                }
+                connect_resolved(r);
+                if(r->state != RELAY_CONNECTING) {
+                    break;
+                }
+            }
+            /* fall through */
+        case RELAY_CONNECTING:
+            if(r->state == RELAY_CONNECTING) {
+                if(r->connecting != NULL || !finish_connect(r)) {
+                    break;
+                }
+                r->state = RELAY_SEND_HEAD;
+            }
+            /* fall through */
+        case RELAY_SEND_HEAD:
+            status = send_all(r->upstreamfd, r->out, r->out_len, &r->out_off);
+            if(status == -1) {
+                if(retry_upstream(r) == -1) {
+                    fail(r, s_resp_502);
+                }
+                break;
+            }
+            if(status == 0) {
+                break;
+            }
+            if(open_pipes(r) == -1) {
+                relay_close(r);
+                return 0;
+            }
+            r->state = RELAY_PUMP;
+            /* fall through */
+        case RELAY_PUMP:
+            if(pump(&r->up, r->clientfd, r->upstreamfd, r->ctx->buf_slab) == -1) {
+                abort_relay(r);
+                return 0;
+            }
+            if(!r->resp_final || r->resp_sent < r->resp_end) {
+                status = relay_response_head(r);
+                if(status == -1) {
+                    if(retry_upstream(r) == 0) {
+                        break;
+                    }
+                    if(r->resp_sent > 0) {
+                        abort_relay(r);
+                        return 0;
+                    }
+                    fail(r, s_resp_502);
+                    break;
+                }
+                if(status == 0) {
+                    break;
+                }
+            }
+            if(r->up.msg == NULL) {
+                /* An open tunnel or upgrade may idle for long, it is no request in flight */
+                end_admission(r);
+            }
+            if(r->tunnel && r->buf != NULL) {
+                /* An open tunnel only needs its pipes */
+                release_buffer(r);
+            }
+            if(pump(&r->down, r->upstreamfd, r->clientfd, r->ctx->buf_slab) == -1) {
+                /* The response is broken, so is the exchange */
+                abort_relay(r);
+                return 0;
+            }
+            /* A raw stream may still flow the other way once one side closed */
+            if(r->down.done && (r->up.msg != NULL || r->up.done)) {
+                return relay_finish(r);
+            }
+            break;
+        case RELAY_SEND_ERROR:
+        case RELAY_SEND_CACHED:
+            break;
+    }
+
+    if(r->state == RELAY_COLLAPSED && r->cached != NULL) {
+        status = send_collapsed(r);
+        if(status == -1) {
+            relay_close(r);
+            return 0;
+        }
+        /* Without a leader, the object is stored and all of it is out */
+        if(status == 1 && r->leader == NULL) {
+            return relay_finish(r);
+        }
+    }
+    if(r->state == RELAY_SEND_ERROR) {
+        status = send_all(r->clientfd, r->err, r->err_len, &r->err_off);
+        if(status != 0) {
+            relay_close(r);
+            return 0;
+        }
+    }
+    if(r->state == RELAY_SEND_CACHED) {
+        status = send_iov(r);
+        if(status == 1) {
+            status = send_disk_body(r);
+        }
+        if(status == 1) {
+            return relay_finish(r);
+        }
+        if(status == -1) {
+            relay_close(r);
+            return 0;
+        }
+    }
+    collapse_progress(r);
+    update_interest(r);
+    update_deadline(r);
+    return 0;
+}
+
+static void relay_handler(ConnectionPool *conn_pool, int fd,
+        unsigned int events, void *data) {
+    UNUSED(conn_pool);
+    UNUSED(fd);
+    UNUSED(events);
+
+    struct relay *r = data;
+    while(relay_step(r)) {
+        /* The next request is read right away, it may have come along with the last one */
+    }
+}
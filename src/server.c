@@ -1,34 +1,115 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <signal.h>
 #include <pthread.h>
 
 #include "server.h"
+#include "conn.h"
+#include "acceptor.h"
+#include "admission.h"
+#include "balancer.h"
+#include "health.h"
+#include "conn_registry.h"
+#include "relay.h"
+#include "cache.h"
+#include "dns.h"
+#include "http.h"
+#include "metrics.h"
+#include "trace.h"
+#include "util.h"
 #include "macro.h"
 
+/* Longest sleep of a worker, so that idle upstream connections expire */
+#define WORKER_TICK_MS 1000
+
+/* Budget of the response cache when none is given */
+#define DEFAULT_CACHE_MB 64
+
+/* Size of the data file of the disk cache when none is given */
+#define DEFAULT_DISK_CACHE_MB 256
+
+/* Longest request head of the metrics endpoint */
+#define ADMIN_HEAD_SZ 4096
+
+/**
+ * Every worker is a reactor of its own: it has a listening
+ * socket of its own (all of them bound to the same port with
+ * SO_REUSEPORT, so the kernel spreads new connections across
+ * them), a connection pool of its own and a self-pipe that
+ * wakes up its event loop. Nothing is shared between workers
+ * except s_server_running, the DNS and response caches and
+ * the registry of the client connections, which have locks
+ * of their own. The metrics of a worker are only written
+ * by it, the admin thread reads them as they are. The
+ * admission control is per worker too, with a share of
+ * the rates of the proxy each, and so are the balancer of
+ * the backends, which only counts the requests of its
+ * worker, and the health checks that probe them.
+ */
+struct worker {
+    unsigned int id;
+    pthread_t thread_id;
+    int listenfd;
+    int wakefds[2];
+    ConnectionPool *pool;
+    Acceptor *acceptor;
+    Admission *admission;     /* NULL when nothing is limited */
+    Balancer *balancer;       /* NULL for a forward proxy */
+    HealthChecker *health;    /* Probes the backends of balancer */
+    RelayCtx *relay;
+    Metrics *metrics;
+    uint64_t published_ms;    /* When the stats of its modules were last copied in */
+    int status;
+};
+
 static pthread_t s_server_thread_id; 
 static volatile sig_atomic_t s_server_running = PROXY_SERVER_RUNNING;
-static int s_listenfd = -1;
-
-static void terminate_listenfd_atomic() {
-    sigset_t set, oldset;
-    sigemptyset(&set);
-
-    sigaddset(&set, SIGHUP);
-
-    sigprocmask(SIG_BLOCK, &set, &oldset);
-    if(s_listenfd != -1) {
-        close(s_listenfd);
-        s_listenfd = -1;
+static struct worker *s_workers;
+static unsigned int s_nworkers;
+static AdmissionLimits s_limits;  /* Those of a worker */
+static char *const *s_backends;
+static unsigned int s_nbackends;
+static BalancePolicy s_policy;
+static char *s_health_path;
+static DnsCache *s_dns_cache;
+static HttpCache *s_http_cache;
+static DiskCache *s_disk_cache;
+static ConnRegistry *s_registry;
+static int s_admin_fd = -1;
+static int s_admin_wakefds[2] = { -1, -1 };
+static pthread_t s_admin_thread_id;
+
+/* Async-signal-safe, so it is used from terminate_handler as well */
+static void wake_workers(void) {
+    int saved_errno = errno;
+    for(unsigned int i = 0; i < s_nworkers; ++i) {
+        if(s_workers[i].wakefds[1] != -1 &&
+                write(s_workers[i].wakefds[1], "", 1) == -1) {
+            /* The pipe is full, so the worker is woken up anyway */
+        }
     }
-    sigprocmask(SIG_SETMASK, &oldset, NULL);
+    if(s_admin_wakefds[1] != -1 && write(s_admin_wakefds[1], "", 1) == -1) {
+        /* Same for the admin thread */
+    }
+    errno = saved_errno;
+}
+
+static void terminate_server(void) {
+    s_server_running = PROXY_SERVER_TERMINATED;
+    wake_workers();
 }
 
 static void terminate_handler(int signum) {
@@ -36,8 +117,7 @@ static void terminate_handler(int signum) {
         pthread_kill(s_server_thread_id, signum);
     } else {
         /* ensures that main_thread is the only one that handles terminate */
-        s_server_running = PROXY_SERVER_TERMINATED;
-        terminate_listenfd_atomic();
+        terminate_server();
     }
 }
 
@@ -47,6 +127,9 @@ static void set_signals() {
     act.sa_handler = terminate_handler;
 
     sigaction(SIGHUP, &act, NULL);
+
+    /* A peer going away shows up as EPIPE on the relay instead */
+    signal(SIGPIPE, SIG_IGN);
 }
 
 static int32_t parse_port(char *port) {
@@ -94,7 +177,7 @@ static int setup_listenfd(char *port) {
 
     listenfd = -1;
 
-    for(struct addrinfo *cur_ai = res; cur_ai; cur_ai++) {
+    for(struct addrinfo *cur_ai = res; cur_ai; cur_ai = cur_ai->ai_next) {
         if((listenfd = socket(cur_ai->ai_family, 
                         cur_ai->ai_socktype, cur_ai->ai_protocol)) == -1) {
             perror("socket");
@@ -109,6 +192,14 @@ static int setup_listenfd(char *port) {
             break;
         }
 
+        /* Every worker binds its own socket to the same port */
+        if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            perror("setsockopt");
+            close(listenfd);
+            listenfd = -1;
+            break;
+        }
+
         if(bind(listenfd, cur_ai->ai_addr, cur_ai->ai_addrlen) == -1) {
             perror("bind");
             close(listenfd);
@@ -123,6 +214,28 @@ static int setup_listenfd(char *port) {
             break;
         }
 
+        /*
+         * A client of the proxy always speaks first, so a connection
+         * is only worth waking up a worker for once its request is in.
+         * Both are optimizations, the listener works without them.
+         */
+        int defer = ACCEPT_DEFER_SECS;
+        if(setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(int)) == -1) {
+            perror("setsockopt TCP_DEFER_ACCEPT");
+        }
+        /* Requests of returning clients come with the SYN */
+        int qlen = TCP_FASTOPEN_QLEN;
+        if(setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(int)) == -1) {
+            perror("setsockopt TCP_FASTOPEN");
+        }
+
+        if(fcntl(listenfd, F_SETFL, O_NONBLOCK) == -1) {
+            perror("fcntl");
+            close(listenfd);
+            listenfd = -1;
+            break;
+        }
+
         if(listenfd != -1) {
             /* Since we only need one binded one */
             break;
@@ -133,80 +246,665 @@ static int setup_listenfd(char *port) {
     return listenfd;
 }
 
-int run_proxy_server(char *port) {
-    int32_t port_val;
-    if((port_val = parse_port(port)) == -1) {
-        fprintf(stderr, "port value %s could not be parsed!\n", port);
+static void wake_handler(ConnectionPool *conn_pool, int fd,
+        unsigned int events, void *data) {
+    UNUSED(conn_pool);
+    UNUSED(events);
+    UNUSED(data);
+
+    char buf[64];
+    while(read(fd, buf, sizeof(buf)) > 0) {
+        /* Only drains the pipe, s_server_running says why we woke up */
+    }
+}
+
+/* A connection turned away is reset, the client is not left waiting for a FIN */
+static void reset_connection(int connfd) {
+    struct linger lin = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(connfd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    close(connfd);
+}
+
+static void handle_connection(int connfd, void *data) {
+    struct worker *w = data;
+    TRACE2(accept, w->id, connfd);
+    if(!admission_accept(w->admission, connfd, util_now_us())) {
+        reset_connection(connfd);
+        return;
+    }
+    /* The relay owns connfd from here on, even if it fails */
+    relay_start(w->relay, connfd);
+}
+
+static void accept_handler(ConnectionPool *conn_pool, int fd,
+        unsigned int events, void *data) {
+    UNUSED(conn_pool);
+    UNUSED(fd);
+    UNUSED(events);
+
+    struct worker *w = data;
+    /* The whole backlog, since the next edge only comes with a new connection */
+    if(acceptor_drain(w->acceptor) == -1) {
+        terminate_server();
+    }
+}
+
+/* io_uring counterpart of accept_handler, invoked once per connection */
+static void accept_complete(ConnectionPool *conn_pool, int fd, int res,
+        const void *buf, void *data) {
+    UNUSED(buf);
+
+    struct worker *w = data;
+    if(res == -ECANCELED) {
+        return;
+    }
+    if(acceptor_complete(w->acceptor, res) == -1) {
+        terminate_server();
+        return;
+    }
+    /* An error ends the multishot accept */
+    if(res < 0 && conn_async_accept(conn_pool, fd, accept_complete, w) == -1) {
+        fprintf(stderr, "Could not accept on the listening socket again\n");
+        terminate_server();
+    }
+}
+
+static int setup_event_loop(struct worker *w) {
+    /* Created on the worker thread, which is the only one using it */
+    w->pool = conn_pool_init();
+    if(w->pool == NULL) {
+        return -1;
+    }
+    if((s_limits.conn_rate > 0 || s_limits.client_rate > 0 || s_limits.max_inflight > 0) &&
+            (w->admission = admission_init(&s_limits)) == NULL) {
+        return -1;
+    }
+    if(s_nbackends > 0 &&
+            ((w->balancer = balancer_init(s_policy, s_backends, s_nbackends)) == NULL ||
+             (w->health = health_init(w->pool, s_dns_cache, w->balancer, s_health_path,
+                                      0, 0)) == NULL)) {
+        return -1;
+    }
+    w->relay = relay_ctx_init(w->pool, s_dns_cache, s_http_cache);
+    if(w->relay == NULL || relay_ctx_set_registry(w->relay, s_registry, w->id) == -1 ||
+            relay_ctx_set_metrics(w->relay, w->metrics) == -1 ||
+            relay_ctx_set_admission(w->relay, w->admission) == -1 ||
+            relay_ctx_set_balancer(w->relay, w->balancer) == -1) {
+        return -1;
+    }
+    if((w->acceptor = acceptor_init(w->listenfd, handle_connection, w)) == NULL) {
+        return -1;
+    }
+    if(conn_register_fd(w->pool, w->wakefds[0], CONN_EV_READ, wake_handler, w) == -1) {
+        fprintf(stderr, "Could not register the wake up pipe with the connection pool\n");
         return -1;
     }
 
-    s_listenfd = setup_listenfd(port);
-    if(s_listenfd == -1) {
+    int status;
+    if(conn_get_backend(w->pool) == CONN_BACKEND_URING) {
+        /* One multishot accept instead of a readiness poll + accept(2) loop */
+        status = conn_async_accept(w->pool, w->listenfd, accept_complete, w);
+    } else {
+        status = conn_register_fd(w->pool, w->listenfd, CONN_EV_READ, accept_handler, w);
+    }
+    if(status == -1) {
+        fprintf(stderr, "Could not register the listening socket with the connection pool\n");
         return -1;
     }
+    return 0;
+}
 
-    s_server_thread_id = pthread_self();
-    set_signals();
+struct open_conns {
+    unsigned int worker;
+    long count;
+};
+
+static int count_open(int fd, const ConnInfo *info, void *arg) {
+    UNUSED(fd);
+
+    struct open_conns *open = arg;
+    if(info->worker == open->worker) {
+        open->count++;
+    }
+    return 0;
+}
+
+/* Copies the stats of the modules of the worker into its metrics, for the reader */
+static void publish_stats(struct worker *w) {
+    Metrics *m = w->metrics;
+    AcceptStats accepts;
+    if(acceptor_get_stats(w->acceptor, &accepts) == 0) {
+        metrics_set(m, METRIC_ACCEPT_BATCHES, accepts.batches);
+        metrics_set(m, METRIC_ACCEPT_SHED, accepts.shed);
+        metrics_set(m, METRIC_ACCEPT_ERRORS, accepts.errors);
+    }
+    AdmissionStats admission;
+    if(admission_get_stats(w->admission, &admission) == 0) {
+        metrics_set(m, METRIC_ADMISSION_RESET, admission.reset);
+        metrics_set(m, METRIC_ADMISSION_RESET_CLIENT, admission.reset_client);
+        metrics_set(m, METRIC_ADMISSION_LIMIT, admission.limit);
+        metrics_set(m, METRIC_ADMISSION_INFLIGHT, admission.inflight);
+    }
+    UpstreamStats upstream;
+    if(relay_get_upstream_stats(w->relay, &upstream) == 0) {
+        metrics_set(m, METRIC_POOL_HITS, upstream.hits);
+        metrics_set(m, METRIC_POOL_MISSES, upstream.misses);
+        metrics_set(m, METRIC_POOL_STALE, upstream.stale);
+        metrics_set(m, METRIC_POOL_EXPIRED, upstream.expired);
+        metrics_set(m, METRIC_POOL_EVICTED, upstream.evicted);
+        metrics_set(m, METRIC_POOL_IDLE, upstream.idle);
+    }
+    RelayTunnelStats tunnels;
+    if(relay_get_tunnel_stats(w->relay, &tunnels) == 0) {
+        metrics_set(m, METRIC_TUNNELS_OPENED, tunnels.opened);
+        metrics_set(m, METRIC_TUNNELS_ACTIVE, tunnels.active);
+    }
+    RelayCollapseStats collapse;
+    if(relay_get_collapse_stats(w->relay, &collapse) == 0) {
+        metrics_set(m, METRIC_COLLAPSE_LEADERS, collapse.leaders);
+        metrics_set(m, METRIC_COLLAPSE_FOLLOWERS, collapse.followers);
+        metrics_set(m, METRIC_COLLAPSE_FALLBACKS, collapse.fallbacks);
+        metrics_set(m, METRIC_COLLAPSE_TIMEOUTS, collapse.timeouts);
+    }
+    HealthStats health;
+    if(health_get_stats(w->health, &health) == 0) {
+        metrics_set(m, METRIC_HEALTH_PROBES, health.probes);
+        metrics_set(m, METRIC_HEALTH_FAILURES, health.failures);
+        metrics_set(m, METRIC_HEALTH_TIMEOUTS, health.timeouts);
+    }
+    for(unsigned int i = 0; i < balancer_count(w->balancer); ++i) {
+        BackendStats backend;
+        balancer_get_stats(w->balancer, i, &backend);
+        metrics_set_backend(m, i, METRIC_BACKEND_REQUESTS, backend.picks);
+        metrics_set_backend(m, i, METRIC_BACKEND_FAILURES, backend.failures);
+        metrics_set_backend(m, i, METRIC_BACKEND_TRIPS, backend.trips);
+        metrics_set_backend(m, i, METRIC_BACKEND_OPEN, backend.breaker != BREAKER_CLOSED);
+        metrics_set_backend(m, i, METRIC_BACKEND_DOWN, !backend.healthy);
+    }
+    w->published_ms = util_now_ms();
+}
+
+static void teardown_event_loop(struct worker *w) {
+    /* The last scrape before the exit sees the final counters */
+    publish_stats(w);
+    struct open_conns open = { w->id, 0 };
+    conn_registry_foreach(s_registry, count_open, &open);
+    uint64_t errors = 0;
+    for(int i = METRIC_ERR_BAD_REQUEST; i <= METRIC_ERR_NO_BACKEND; ++i) {
+        errors += metrics_get(w->metrics, i);
+    }
+    printf("Worker %u: %lu connections (%ld still open), %lu requests, %lu us at the median, "
+            "%lu us at p99, %lu errors\n", w->id, metrics_get(w->metrics, METRIC_CONNS_OPENED),
+            open.count, metrics_get(w->metrics, METRIC_REQUESTS),
+            metrics_percentile(w->metrics, METRIC_REQUEST_TIME, 0.5),
+            metrics_percentile(w->metrics, METRIC_REQUEST_TIME, 0.99), errors);
+    acceptor_destroy(w->acceptor);
+    w->acceptor = NULL;
+    relay_ctx_destroy(w->relay);
+    w->relay = NULL;
+    health_destroy(w->health);
+    w->health = NULL;
+    /* Once no relay holds a request of them */
+    admission_destroy(w->admission);
+    w->admission = NULL;
+    balancer_destroy(w->balancer);
+    w->balancer = NULL;
+    if(w->pool != NULL) {
+        /* The listening socket and the pipe are closed by the server */
+        conn_remove_fd(w->pool, w->listenfd);
+        conn_remove_fd(w->pool, w->wakefds[0]);
+        conn_destroy(w->pool);
+        w->pool = NULL;
+    }
+}
 
-    struct sockaddr_storage accept_addr;
-    socklen_t addrlen;
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
 
-    printf("Proxy server is now listening on port %s\n", port);
+    if(setup_event_loop(w) == -1) {
+        w->status = -1;
+        terminate_server();
+    }
 
     while(s_server_running == PROXY_SERVER_RUNNING) {
-        addrlen = sizeof(accept_addr);
+        /* Sleeps until the next relay times out or probe is due, if that comes first */
+        int timeout = health_timeout(w->health, relay_ctx_timeout(w->relay, WORKER_TICK_MS));
+        if(conn_dispatch(w->pool, timeout) == -1) {
+            w->status = -1;
+            terminate_server();
+            break;
+        }
+        relay_ctx_tick(w->relay);
+        health_tick(w->health);
+        if(util_now_ms() - w->published_ms >= WORKER_TICK_MS) {
+            publish_stats(w);
+        }
+    }
 
-        int connfd = accept(s_listenfd, (struct sockaddr *)&accept_addr, &addrlen);  
-        if(connfd == -1) {
-            s_server_running = PROXY_SERVER_TERMINATED;
-            terminate_listenfd_atomic();
+    teardown_event_loop(w);
+    return NULL;
+}
+
+/*
+ * The metrics endpoint listens on loopback only, what it tells is
+ * not meant for the clients of the proxy. A thread of its own serves
+ * it one request at a time with blocking sockets, so that a scrape
+ * never runs on a worker, and merges what every worker recorded.
+ */
+static int setup_admin(char *port) {
+    int32_t port_val = parse_port(port);
+    if(port_val == -1 || port_val > 0xFFFF) {
+        fprintf(stderr, "metrics port value %s could not be parsed!\n", port);
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port_val);
+
+    if((s_admin_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket");
+        return -1;
+    }
+    int yes = 1;
+    if(setsockopt(s_admin_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+        perror("setsockopt");
+        return -1;
+    }
+    if(bind(s_admin_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        return -1;
+    }
+    if(listen(s_admin_fd, MAX_BACKLOG_SZ) == -1) {
+        perror("listen");
+        return -1;
+    }
+    if(pipe2(s_admin_wakefds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+    return 0;
+}
+
+static void close_admin(void) {
+    if(s_admin_fd != -1) {
+        close(s_admin_fd);
+        s_admin_fd = -1;
+    }
+    for(int i = 0; i < 2; ++i) {
+        if(s_admin_wakefds[i] != -1) {
+            close(s_admin_wakefds[i]);
+            s_admin_wakefds[i] = -1;
         }
-        // possibly accept finished but the signal terminate happened here
-        if(s_server_running == PROXY_SERVER_TERMINATED) {
-            if(connfd != -1)
-                close(connfd);
-            break;
+    }
+}
+
+static int send_blocking(int fd, const char *buf, size_t len) {
+    while(len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
         }
-        //char *stream_buf;
-        //size_t sz;
-
-        //FILE *fstream; 
-
-        //fstream = open_memstream(&stream_buf, &sz);
-
-        //char buf[512];
-        //while(1) {
-        //    ssize_t nread, nwrite;
-
-        //    nread = recv(connfd, buf, 512, 0);
-        //    //if(nread == 0) {
-        //    //    close(connfd);
-        //    //    break;
-        //    //} else if(nread == -1) {
-        //    //    break;
-        //    //} else {
-        //    //    char *buf_ptr;
-
-        //    //    buf_ptr = buf;
-        //    //    while(nread > 0) {
-        //    //        nwrite = fwrite(buf_ptr, sizeof(char), 512, fstream);
-        //    //        if(nwrite == -1) {
-        //    //            if(errno == EINTR) {
-        //    //                nwrite = 0;
-        //    //            }
-        //    //        }
-        //    //        nread -= nwrite;
-        //    //        buf_ptr += nwrite;
-        //    //    }
-        //    //}
-        //}
-        //fclose(fstream);
-        //printf("%s", stream_buf);
-        //fflush(stdout);
-        //free(stream_buf);
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
 
+/* The metrics of every worker merged, in a buffer the caller frees */
+static char *format_metrics(size_t *len) {
+    Metrics *merged = metrics_init();
+    if(merged == NULL) {
+        return NULL;
+    }
+    for(unsigned int i = 0; i < s_nworkers; ++i) {
+        metrics_merge(merged, s_workers[i].metrics);
+    }
+    char *body = NULL;
+    FILE *out = open_memstream(&body, len);
+    if(out == NULL) {
+        perror("open_memstream");
+        metrics_destroy(merged);
+        return NULL;
+    }
+    HttpCacheStats cache;
+    if(http_cache_get_stats(s_http_cache, &cache) == 0) {
+        metrics_set(merged, METRIC_CACHE_LOOKUPS, cache.lookups);
+        metrics_set(merged, METRIC_CACHE_HITS, cache.hits);
+        metrics_set(merged, METRIC_CACHE_STORES, cache.stores);
+        metrics_set(merged, METRIC_CACHE_EVICTIONS, cache.evictions);
+        metrics_set(merged, METRIC_CACHE_EXPIRED, cache.expired);
+        metrics_set(merged, METRIC_CACHE_BYTES_SAVED, cache.bytes_saved);
+        metrics_set(merged, METRIC_CACHE_BYTES, cache.bytes);
+        metrics_set(merged, METRIC_CACHE_OBJECTS, cache.objects);
+    }
+    DiskCacheStats disk;
+    if(disk_cache_get_stats(s_disk_cache, &disk) == 0) {
+        metrics_set(merged, METRIC_DISK_HITS, disk.hits);
+        metrics_set(merged, METRIC_DISK_STORES, disk.stores);
+        metrics_set(merged, METRIC_DISK_OVERWRITTEN, disk.overwritten);
+        metrics_set(merged, METRIC_DISK_ENTRIES, disk.entries);
+    }
+    int status = metrics_format(merged, out);
+    if(status == 0) {
+        status = metrics_format_backends(merged, s_backends, s_nbackends, out);
+    }
+    metrics_destroy(merged);
+    if(fclose(out) != 0 || status == -1) {
+        free(body);
+        return NULL;
+    }
+    return body;
+}
+
+static void serve_admin(int connfd) {
+    char head[ADMIN_HEAD_SZ];
+    size_t head_len = 0;
+    HttpParser req;
+    http_parser_init(&req, HTTP_REQUEST, 0);
+    int status = HTTP_PARSE_AGAIN;
+    while(status == HTTP_PARSE_AGAIN && head_len < sizeof(head)) {
+        ssize_t n = recv(connfd, head + head_len, sizeof(head) - head_len, 0);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            /* Gone, or too slow */
+            return;
+        }
+        head_len += n;
+        status = http_parse_head(&req, head, head_len);
+    }
+
+    const char *resp = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    if(status == HTTP_PARSE_DONE) {
+        if(!http_slice_eq(head, req.method, "GET")) {
+            resp = "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 0\r\n"
+                "Connection: close\r\n\r\n";
+        } else if(!http_slice_eq(head, req.target, "/metrics")) {
+            resp = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        } else {
+            size_t len;
+            char *body = format_metrics(&len);
+            if(body == NULL) {
+                resp = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n"
+                    "Connection: close\r\n\r\n";
+            } else {
+                char hdr[160];
+                int hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+                if(send_blocking(connfd, hdr, hdr_len) == 0) {
+                    send_blocking(connfd, body, len);
+                }
+                free(body);
+                return;
+            }
+        }
+    }
+    send_blocking(connfd, resp, strlen(resp));
+}
+
+static void *admin_main(void *arg) {
+    UNUSED(arg);
+
+    struct pollfd fds[2] = {
+        { s_admin_fd, POLLIN, 0 },
+        { s_admin_wakefds[0], POLLIN, 0 }
+    };
+    struct timeval tv = { ADMIN_IO_TIMEOUT_SECS, 0 };
+    while(s_server_running == PROXY_SERVER_RUNNING) {
+        if(poll(fds, 2, -1) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if(!(fds[0].revents & POLLIN)) {
+            /* Woken up, s_server_running says why */
+            continue;
+        }
+        int connfd = accept4(s_admin_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(connfd == -1) {
+            continue;
+        }
+        /* A client that stalls only holds the endpoint for so long */
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        serve_admin(connfd);
         close(connfd);
     }
+    return NULL;
+}
+
+static void close_workers(void) {
+    for(unsigned int i = 0; i < s_nworkers; ++i) {
+        struct worker *w = &s_workers[i];
+        if(w->listenfd != -1) {
+            close(w->listenfd);
+        }
+        metrics_destroy(w->metrics);
+        for(int j = 0; j < 2; ++j) {
+            if(w->wakefds[j] != -1) {
+                close(w->wakefds[j]);
+            }
+        }
+    }
+    free(s_workers);
+    s_workers = NULL;
+    s_nworkers = 0;
+    dns_cache_destroy(s_dns_cache);
+    s_dns_cache = NULL;
+    conn_registry_destroy(s_registry);
+    s_registry = NULL;
+    http_cache_destroy(s_http_cache);
+    s_http_cache = NULL;
+    /* Last, so that the index is marked clean only once nothing uses it */
+    if(s_disk_cache != NULL) {
+        disk_cache_close(s_disk_cache);
+        s_disk_cache = NULL;
+    }
+}
 
+static int setup_workers(char *port, unsigned int nworkers, size_t cache_bytes,
+        const char *disk_path, size_t disk_bytes) {
+    s_workers = calloc(nworkers, sizeof(struct worker));
+    if(s_workers == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    s_nworkers = nworkers;
+    for(unsigned int i = 0; i < nworkers; ++i) {
+        struct worker *w = &s_workers[i];
+        w->id = i;
+        w->listenfd = -1;
+        w->wakefds[0] = w->wakefds[1] = -1;
+    }
+    for(unsigned int i = 0; i < nworkers; ++i) {
+        if((s_workers[i].metrics = metrics_init()) == NULL) {
+            return -1;
+        }
+    }
+    if((s_dns_cache = dns_cache_init()) == NULL ||
+            (s_http_cache = http_cache_init(cache_bytes)) == NULL ||
+            (s_registry = conn_registry_init(0)) == NULL) {
+        return -1;
+    }
+    if(disk_path != NULL) {
+        if((s_disk_cache = disk_cache_open(disk_path, disk_bytes)) == NULL) {
+            return -1;
+        }
+        http_cache_attach_disk(s_http_cache, s_disk_cache);
+    }
+
+    for(unsigned int i = 0; i < nworkers; ++i) {
+        struct worker *w = &s_workers[i];
+        if((w->listenfd = setup_listenfd(port)) == -1) {
+            return -1;
+        }
+        if(pipe2(w->wakefds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            perror("pipe2");
+            return -1;
+        }
+    }
     return 0;
 }
+
+/*
+ * The share of a limit of the proxy that falls to a worker, rounded up
+ * and no less than min. The proxy as a whole then allows nworkers times
+ * that, which is said when it is more than the limit asked for.
+ */
+static unsigned int share(const char *opt, unsigned int limit, unsigned int nworkers,
+        unsigned int min) {
+    if(limit == 0) {
+        return 0;
+    }
+    unsigned int per_worker = (limit + nworkers - 1) / nworkers;
+    if(per_worker < min) {
+        per_worker = min;
+    }
+    uint64_t effective = (uint64_t)per_worker * nworkers;
+    if(effective > limit) {
+        fprintf(stderr, "%s %u is %lu with %u workers of %u each\n", opt, limit,
+                (unsigned long)effective, nworkers, per_worker);
+    }
+    return per_worker;
+}
+
+int run_proxy_server(const ProxyConfig *config) {
+    if(config == NULL) {
+        return -1;
+    }
+
+    char *port = config->port;
+    int32_t port_val;
+    if((port_val = parse_port(port)) == -1) {
+        fprintf(stderr, "port value %s could not be parsed!\n", port);
+        return -1;
+    }
+
+    unsigned int nworkers = config->nworkers;
+    if(nworkers == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpus > 0 ? (unsigned int)ncpus : 1;
+    }
+
+    /*
+     * SO_REUSEPORT spreads the connections evenly, those of a client
+     * included since it hashes their ports too, so every worker
+     * enforces its share of every limit without talking to the others
+     */
+    s_limits.conn_rate = share("-r", config->conn_rate, nworkers, 1);
+    s_limits.client_rate = share("-R", config->client_rate, nworkers, 1);
+    s_limits.max_inflight = share("-l", config->max_inflight, nworkers, ADMISSION_MIN_LIMIT);
+
+    s_policy = BALANCE_LEAST_OUTSTANDING;
+    if(config->balance != NULL && balancer_parse_policy(config->balance, &s_policy) == -1) {
+        fprintf(stderr, "balance policy %s is not one of least, p2c or hash!\n", config->balance);
+        return -1;
+    }
+    if(config->nbackends > 0) {
+        /* Each worker has a balancer of its own, this one only checks the backends */
+        Balancer *balancer = balancer_init(s_policy, config->backends, config->nbackends);
+        if(balancer == NULL) {
+            return -1;
+        }
+        balancer_destroy(balancer);
+    }
+    s_backends = config->backends;
+    s_nbackends = config->nbackends;
+    if(config->health_path != NULL &&
+            (config->health_path[0] != '/' || strlen(config->health_path) >= HEALTH_PATH_SZ)) {
+        fprintf(stderr, "health check path %s could not be parsed!\n", config->health_path);
+        return -1;
+    }
+    s_health_path = config->health_path;
+
+    size_t cache_mb = config->cache_mb > 0 ? config->cache_mb : DEFAULT_CACHE_MB;
+    size_t disk_mb = config->disk_cache_mb > 0 ? config->disk_cache_mb : DEFAULT_DISK_CACHE_MB;
+    if(setup_workers(port, nworkers, cache_mb * 1024 * 1024, config->disk_cache,
+                disk_mb * 1024 * 1024) == -1 ||
+            (config->metrics_port != NULL && setup_admin(config->metrics_port) == -1)) {
+        close_admin();
+        close_workers();
+        return -1;
+    }
+
+    s_server_thread_id = pthread_self();
+    set_signals();
+
+    /* Workers inherit the mask, so SIGHUP always lands on this thread */
+    sigset_t set, oldset;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+    int ret = 0;
+    unsigned int nstarted;
+    for(nstarted = 0; nstarted < nworkers; ++nstarted) {
+        struct worker *w = &s_workers[nstarted];
+        int err = pthread_create(&w->thread_id, NULL, worker_main, w);
+        if(err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            ret = -1;
+            terminate_server();
+            break;
+        }
+    }
+    int admin_started = 0;
+    if(ret == 0 && s_admin_fd != -1) {
+        int err = pthread_create(&s_admin_thread_id, NULL, admin_main, NULL);
+        if(err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            ret = -1;
+            terminate_server();
+        } else {
+            admin_started = 1;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if(ret == 0) {
+        printf("Proxy server is now listening on port %s (%u workers, %s)\n", port,
+                nworkers, conn_backend_name(conn_get_default_backend()));
+        if(admin_started) {
+            printf("Metrics are served on 127.0.0.1:%s/metrics\n", config->metrics_port);
+        }
+    }
+
+    for(unsigned int i = 0; i < nstarted; ++i) {
+        pthread_join(s_workers[i].thread_id, NULL);
+        if(s_workers[i].status == -1) {
+            ret = -1;
+        }
+    }
+    if(admin_started) {
+        pthread_join(s_admin_thread_id, NULL);
+    }
+
+    HttpCacheStats stats;
+    if(http_cache_get_stats(s_http_cache, &stats) == 0) {
+        printf("Response cache: %lu hits of %lu lookups (%.1f%%), %lu bytes saved, "
+                "%lu stored, %lu evicted, %lu expired\n", stats.hits, stats.lookups,
+                stats.lookups > 0 ? 100.0 * stats.hits / stats.lookups : 0.0,
+                stats.bytes_saved, stats.stores, stats.evictions, stats.expired);
+    }
+    DiskCacheStats disk_stats;
+    if(s_disk_cache != NULL && disk_cache_get_stats(s_disk_cache, &disk_stats) == 0) {
+        printf("Disk cache: %lu hits, %lu bytes saved, %lu stored, %lu overwritten, "
+                "%lu expired, %lu entries (%lu recovered at start, %lu dropped)\n",
+                disk_stats.hits, disk_stats.bytes_saved, disk_stats.stores,
+                disk_stats.overwritten, disk_stats.expired, disk_stats.entries,
+                disk_stats.recovered, disk_stats.dropped);
+    }
+
+    close_admin();
+    close_workers();
+    return ret;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+struct slab {
+    size_t obj_size;
+    size_t slab_size;
+    size_t per_slab;
+    void *free_list;
+    void **slabs;
+    size_t nslabs;
+    size_t cap;
+    SlabStats stats;
+};
+
+static size_t round_up(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+Slab *slab_init(size_t obj_size, size_t align) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if(align == 0) {
+        align = SLAB_MIN_ALIGN;
+    }
+    if(obj_size == 0 || (align & (align - 1)) != 0 || align > page) {
+        return NULL;
+    }
+    Slab *slab = calloc(1, sizeof(Slab));
+    if(slab == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    /* A free object holds the link to the next one */
+    slab->obj_size = round_up(obj_size < sizeof(void *) ? sizeof(void *) : obj_size, align);
+    slab->slab_size = SLAB_SIZE;
+    if(slab->obj_size * SLAB_MIN_OBJECTS > slab->slab_size) {
+        slab->slab_size = round_up(slab->obj_size * SLAB_MIN_OBJECTS, page);
+    }
+    slab->per_slab = slab->slab_size / slab->obj_size;
+    return slab;
+}
+
+/* Obtains a new slab and puts its objects on the free list, in address order */
+static int grow(Slab *slab) {
+    if(slab->nslabs == slab->cap) {
+        size_t cap = slab->cap > 0 ? slab->cap * 2 : 16;
+        void **slabs = realloc(slab->slabs, cap * sizeof(void *));
+        if(slabs == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        slab->slabs = slabs;
+        slab->cap = cap;
+    }
+    char *mem = mmap(NULL, slab->slab_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    slab->slabs[slab->nslabs++] = mem;
+    for(size_t i = slab->per_slab; i > 0; --i) {
+        void *obj = mem + (i - 1) * slab->obj_size;
+        *(void **)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+    slab->stats.slabs++;
+    slab->stats.capacity += slab->per_slab;
+    return 0;
+}
+
+void *slab_alloc(Slab *slab) {
+    if(slab == NULL || (slab->free_list == NULL && grow(slab) == -1)) {
+        return NULL;
+    }
+    void *obj = slab->free_list;
+    slab->free_list = *(void **)obj;
+    slab->stats.allocs++;
+    if(++slab->stats.outstanding > slab->stats.peak) {
+        slab->stats.peak = slab->stats.outstanding;
+    }
+    return obj;
+}
+
+void slab_free(Slab *slab, void *obj) {
+    if(slab == NULL || obj == NULL) {
+        return;
+    }
+#ifdef DEBUG
+    /* Makes a use after free show */
+    memset(obj, 0x5A, slab->obj_size);
+#endif
+    *(void **)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->stats.frees++;
+    slab->stats.outstanding--;
+}
+
+int slab_get_stats(Slab *slab, SlabStats *stats) {
+    if(slab == NULL || stats == NULL) {
+        return -1;
+    }
+    *stats = slab->stats;
+    return 0;
+}
+
+void slab_destroy(Slab *slab) {
+    if(slab == NULL) {
+        return;
+    }
+    for(size_t i = 0; i < slab->nslabs; ++i) {
+        munmap(slab->slabs[i], slab->slab_size);
+    }
+    free(slab->slabs);
+    free(slab);
+}
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+struct timer_wheel {
+    uint64_t now;
+    uint64_t occupied[TIMER_LEVELS];
+    Timer slots[TIMER_LEVELS][TIMER_SLOTS];
+    long count;
+};
+
+TimerWheel *timer_wheel_init(uint64_t now_ms) {
+    TimerWheel *wheel = malloc(sizeof(TimerWheel));
+    if(wheel == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    wheel->now = now_ms;
+    for(int l = 0; l < TIMER_LEVELS; ++l) {
+        wheel->occupied[l] = 0;
+        for(int s = 0; s < TIMER_SLOTS; ++s) {
+            Timer *head = &wheel->slots[l][s];
+            head->prev = head->next = head;
+        }
+    }
+    wheel->count = 0;
+    return wheel;
+}
+
+void timer_init(Timer *timer, TimerHandler handler, void *data) {
+    if(timer == NULL) {
+        return;
+    }
+    timer->prev = timer->next = NULL;
+    timer->slot = 0;
+    timer->expires_ms = 0;
+    timer->handler = handler;
+    timer->data = data;
+}
+
+int timer_is_armed(const Timer *timer) {
+    return timer != NULL && timer->prev != NULL;
+}
+
+static void unlink_timer(TimerWheel *wheel, Timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    Timer *head = &wheel->slots[timer->slot / TIMER_SLOTS][timer->slot % TIMER_SLOTS];
+    if(head->next == head) {
+        wheel->occupied[timer->slot / TIMER_SLOTS] &= ~((uint64_t)1 << (timer->slot % TIMER_SLOTS));
+    }
+    timer->prev = timer->next = NULL;
+}
+
+/*
+ * Puts timer in the lowest level whose span covers its expiry, or
+ * earliest if that is later. A timer further away than the wheel
+ * covers goes into the top level as far as it reaches, and is placed
+ * again once that slot is reached.
+ */
+static void place(TimerWheel *wheel, Timer *timer, uint64_t earliest) {
+    uint64_t at = timer->expires_ms > earliest ? timer->expires_ms : earliest;
+    if(at - wheel->now > TIMER_MAX_DELAY_MS) {
+        at = wheel->now + TIMER_MAX_DELAY_MS;
+    }
+    uint64_t delta = at - wheel->now;
+    int level = 0;
+    while(level < TIMER_LEVELS - 1 && (delta >> ((level + 1) * TIMER_LEVEL_BITS)) != 0) {
+        level++;
+    }
+    int s = (at >> (level * TIMER_LEVEL_BITS)) & SLOT_MASK;
+    Timer *head = &wheel->slots[level][s];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    timer->slot = level * TIMER_SLOTS + s;
+    wheel->occupied[level] |= (uint64_t)1 << s;
+}
+
+int timer_arm(TimerWheel *wheel, Timer *timer, uint64_t expires_ms) {
+    if(wheel == NULL || timer == NULL) {
+        return -1;
+    }
+    if(timer->prev != NULL) {
+        unlink_timer(wheel, timer);
+    } else {
+        wheel->count++;
+    }
+    timer->expires_ms = expires_ms;
+    /* The current tick has run already */
+    place(wheel, timer, wheel->now + 1);
+    return 0;
+}
+
+void timer_cancel(TimerWheel *wheel, Timer *timer) {
+    if(wheel == NULL || timer == NULL || timer->prev == NULL) {
+        return;
+    }
+    unlink_timer(wheel, timer);
+    wheel->count--;
+}
+
+/*
+ * The first tick after now where the wheel has something to do: a
+ * slot of the lowest level expires, or a slot of an upper level is
+ * reached and its timers move down. The bitmap of a level is rotated
+ * so that the slot after the current one comes first.
+ */
+static uint64_t next_tick(const TimerWheel *wheel) {
+    uint64_t next = UINT64_MAX;
+    for(int l = 0; l < TIMER_LEVELS; ++l) {
+        uint64_t occupied = wheel->occupied[l];
+        if(occupied == 0) {
+            continue;
+        }
+        int shift = l * TIMER_LEVEL_BITS;
+        unsigned int from = ((wheel->now >> shift) + 1) & SLOT_MASK;
+        uint64_t rotated = from == 0 ? occupied :
+            (occupied >> from) | (occupied << (TIMER_SLOTS - from));
+        uint64_t tick = ((wheel->now >> shift) + __builtin_ctzll(rotated) + 1) << shift;
+        if(tick < next) {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+/* Takes every timer out of a slot, into the list headed by list */
+static void take_slot(TimerWheel *wheel, int level, int s, Timer *list) {
+    Timer *head = &wheel->slots[level][s];
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->prev = head->next = head;
+    wheel->occupied[level] &= ~((uint64_t)1 << s);
+}
+
+/* Runs the tick wheel->now, returns the number of timers that expired */
+static int run_tick(TimerWheel *wheel) {
+    uint64_t tick = wheel->now;
+    Timer list;
+
+    /* From the top, so that timers moved down can move further down at once */
+    for(int l = TIMER_LEVELS - 1; l > 0; --l) {
+        int shift = l * TIMER_LEVEL_BITS;
+        int s = (tick >> shift) & SLOT_MASK;
+        if((tick & (((uint64_t)1 << shift) - 1)) != 0 ||
+                (wheel->occupied[l] & ((uint64_t)1 << s)) == 0) {
+            continue;
+        }
+        take_slot(wheel, l, s, &list);
+        while(list.next != &list) {
+            Timer *timer = list.next;
+            list.next = timer->next;
+            timer->next->prev = &list;
+            /* The lowest slot of this tick has yet to run */
+            place(wheel, timer, tick);
+        }
+    }
+
+    int s = tick & SLOT_MASK;
+    if((wheel->occupied[0] & ((uint64_t)1 << s)) == 0) {
+        return 0;
+    }
+    /* A handler may cancel a timer of the list, which unlinks it from there */
+    int n = 0;
+    take_slot(wheel, 0, s, &list);
+    while(list.next != &list) {
+        Timer *timer = list.next;
+        list.next = timer->next;
+        timer->next->prev = &list;
+        timer->prev = timer->next = NULL;
+        wheel->count--;
+        n++;
+        if(timer->handler != NULL) {
+            timer->handler(timer, timer->data);
+        }
+    }
+    return n;
+}
+
+int timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms) {
+    if(wheel == NULL) {
+        return -1;
+    }
+    int n = 0;
+    while(wheel->now < now_ms) {
+        /* The ticks where nothing happens are skipped */
+        uint64_t next = wheel->count > 0 ? next_tick(wheel) : UINT64_MAX;
+        if(next > now_ms) {
+            wheel->now = now_ms;
+            break;
+        }
+        wheel->now = next;
+        n += run_tick(wheel);
+    }
+    return n;
+}
+
+int timer_wheel_timeout(TimerWheel *wheel, uint64_t now_ms, int max_ms) {
+    if(wheel == NULL || wheel->count == 0) {
+        return max_ms;
+    }
+    uint64_t next = next_tick(wheel);
+    if(next <= now_ms) {
+        return 0;
+    }
+    return next - now_ms < (uint64_t)max_ms ? (int)(next - now_ms) : max_ms;
+}
+
+long timer_wheel_count(TimerWheel *wheel) {
+    if(wheel == NULL) {
+        return -1;
+    }
+    return wheel->count;
+}
+
+void timer_wheel_destroy(TimerWheel *wheel) {
+    free(wheel);
+}
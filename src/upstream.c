@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "upstream.h"
+#include "util.h"
+
+#define UPSTREAM_BUCKETS 256
+
+struct origin;
+
+struct idle_conn {
+    int fd;
+    uint64_t since_ms;       /* When the connection went idle */
+    struct origin *origin;
+    struct idle_conn *prev;  /* List of the origin, most recent first */
+    struct idle_conn *next;
+    struct idle_conn *older; /* List of the pool, ordered by since_ms */
+    struct idle_conn *newer;
+};
+
+struct origin {
+    char key[UPSTREAM_KEY_SZ];
+    uint64_t hash;
+    unsigned int nidle;
+    struct idle_conn *head;
+    struct idle_conn *tail;
+    struct origin *next;     /* Chain of the bucket, or list of the free ones */
+};
+
+struct upstream_pool {
+    unsigned int max_idle;
+    unsigned int idle_timeout_ms;
+    struct origin *buckets[UPSTREAM_BUCKETS];
+    struct idle_conn *oldest;
+    struct idle_conn *newest;
+    struct idle_conn *free_conns;
+    struct origin *free_origins;
+    UpstreamStats stats;
+};
+
+static int make_key(char *key, const char *host, const char *port) {
+    if(host == NULL || port == NULL) {
+        return -1;
+    }
+    int len = snprintf(key, UPSTREAM_KEY_SZ, "%s:%s", host, port);
+    return (len < 0 || len >= UPSTREAM_KEY_SZ) ? -1 : 0;
+}
+
+static struct origin *find_origin(UpstreamPool *pool, const char *key, uint64_t hash) {
+    struct origin *o = pool->buckets[hash % UPSTREAM_BUCKETS];
+    while(o != NULL && (o->hash != hash || strcmp(o->key, key) != 0)) {
+        o = o->next;
+    }
+    return o;
+}
+
+/* Takes o off the hash table, it is kept for the next origin that goes idle */
+static void release_origin(UpstreamPool *pool, struct origin *o) {
+    struct origin **link = &pool->buckets[o->hash % UPSTREAM_BUCKETS];
+    while(*link != o) {
+        link = &(*link)->next;
+    }
+    *link = o->next;
+    o->next = pool->free_origins;
+    pool->free_origins = o;
+}
+
+/* Takes c off both lists, releasing its origin once it has no idle connection */
+static void unlink_conn(UpstreamPool *pool, struct idle_conn *c) {
+    struct origin *o = c->origin;
+
+    if(c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        o->head = c->next;
+    }
+    if(c->next != NULL) {
+        c->next->prev = c->prev;
+    } else {
+        o->tail = c->prev;
+    }
+
+    if(c->older != NULL) {
+        c->older->newer = c->newer;
+    } else {
+        pool->oldest = c->newer;
+    }
+    if(c->newer != NULL) {
+        c->newer->older = c->older;
+    } else {
+        pool->newest = c->older;
+    }
+
+    c->next = pool->free_conns;
+    pool->free_conns = c;
+    pool->stats.idle--;
+    if(--o->nidle == 0) {
+        release_origin(pool, o);
+    }
+}
+
+static void drop_conn(UpstreamPool *pool, struct idle_conn *c) {
+    close(c->fd);
+    unlink_conn(pool, c);
+}
+
+/* An idle connection must have nothing to read, not even its EOF */
+static int is_alive(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+UpstreamPool *upstream_pool_init(unsigned int max_idle, unsigned int idle_timeout_ms) {
+    UpstreamPool *pool = calloc(1, sizeof(UpstreamPool));
+    if(pool == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    pool->max_idle = max_idle;
+    pool->idle_timeout_ms = idle_timeout_ms;
+    return pool;
+}
+
+int upstream_pool_get(UpstreamPool *pool, const char *host, const char *port) {
+    char key[UPSTREAM_KEY_SZ];
+    if(pool == NULL || make_key(key, host, port) == -1) {
+        return -1;
+    }
+    uint64_t hash = util_fnv1a_str(key);
+    uint64_t now = util_now_ms();
+
+    struct origin *o;
+    while((o = find_origin(pool, key, hash)) != NULL) {
+        struct idle_conn *c = o->head;
+        if(now - c->since_ms >= pool->idle_timeout_ms) {
+            pool->stats.expired++;
+            drop_conn(pool, c);
+            continue;
+        }
+        if(!is_alive(c->fd)) {
+            pool->stats.stale++;
+            drop_conn(pool, c);
+            continue;
+        }
+        int fd = c->fd;
+        unlink_conn(pool, c);
+        pool->stats.hits++;
+        return fd;
+    }
+    pool->stats.misses++;
+    return -1;
+}
+
+int upstream_pool_put(UpstreamPool *pool, const char *host, const char *port, int fd) {
+    char key[UPSTREAM_KEY_SZ];
+    if(pool == NULL || fd < 0 || pool->max_idle == 0 || make_key(key, host, port) == -1) {
+        if(fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    uint64_t hash = util_fnv1a_str(key);
+
+    struct origin *o = find_origin(pool, key, hash);
+    if(o != NULL && o->nidle >= pool->max_idle) {
+        pool->stats.evicted++;
+        drop_conn(pool, o->tail);
+        /* The origin is gone if that was its only connection */
+        o = find_origin(pool, key, hash);
+    }
+    if(o == NULL) {
+        o = pool->free_origins;
+        if(o != NULL) {
+            pool->free_origins = o->next;
+        } else if((o = malloc(sizeof(struct origin))) == NULL) {
+            perror("malloc");
+            close(fd);
+            return -1;
+        }
+        strcpy(o->key, key);
+        o->hash = hash;
+        o->nidle = 0;
+        o->head = o->tail = NULL;
+        o->next = pool->buckets[hash % UPSTREAM_BUCKETS];
+        pool->buckets[hash % UPSTREAM_BUCKETS] = o;
+    }
+
+    struct idle_conn *c = pool->free_conns;
+    if(c != NULL) {
+        pool->free_conns = c->next;
+    } else if((c = malloc(sizeof(struct idle_conn))) == NULL) {
+        perror("malloc");
+        if(o->nidle == 0) {
+            release_origin(pool, o);
+        }
+        close(fd);
+        return -1;
+    }
+
+    c->fd = fd;
+    c->since_ms = util_now_ms();
+    c->origin = o;
+    c->prev = NULL;
+    c->next = o->head;
+    if(o->head != NULL) {
+        o->head->prev = c;
+    } else {
+        o->tail = c;
+    }
+    o->head = c;
+    o->nidle++;
+
+    c->newer = NULL;
+    c->older = pool->newest;
+    if(pool->newest != NULL) {
+        pool->newest->newer = c;
+    } else {
+        pool->oldest = c;
+    }
+    pool->newest = c;
+    pool->stats.idle++;
+    return 0;
+}
+
+unsigned int upstream_pool_expire(UpstreamPool *pool) {
+    if(pool == NULL) {
+        return 0;
+    }
+    uint64_t now = util_now_ms();
+    unsigned int n = 0;
+    while(pool->oldest != NULL && now - pool->oldest->since_ms >= pool->idle_timeout_ms) {
+        drop_conn(pool, pool->oldest);
+        pool->stats.expired++;
+        n++;
+    }
+    return n;
+}
+
+int upstream_pool_get_stats(UpstreamPool *pool, UpstreamStats *stats) {
+    if(pool == NULL || stats == NULL) {
+        return -1;
+    }
+    *stats = pool->stats;
+    return 0;
+}
+
+void upstream_pool_destroy(UpstreamPool *pool) {
+    if(pool == NULL) {
+        return;
+    }
+    while(pool->oldest != NULL) {
+        drop_conn(pool, pool->oldest);
+    }
+    while(pool->free_conns != NULL) {
+        struct idle_conn *c = pool->free_conns;
+        pool->free_conns = c->next;
+        free(c);
+    }
+    while(pool->free_origins != NULL) {
+        struct origin *o = pool->free_origins;
+        pool->free_origins = o->next;
+        free(o);
+    }
+    free(pool);
+}
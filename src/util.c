@@ -0,0 +1,33 @@
+#include <time.h>
+
+#include "util.h"
+
+uint64_t util_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t util_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t util_fnv1a(const void *buf, size_t len, uint64_t h) {
+    const unsigned char *p = buf;
+    for(size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+uint64_t util_fnv1a_str(const char *s) {
+    uint64_t h = UTIL_FNV1A_BASIS;
+    for(; *s != '\0'; ++s) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
@@ -0,0 +1,203 @@
+#include <criterion/criterion.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "acceptor.h"
+#include "test_util.h"
+
+#define ACCEPTOR_NOTNULL(acceptor) \
+    do { \
+        cr_assert_not_null(acceptor, "Expected a non-null value from acceptor. Memory allocation may have potentially failed.");\
+    } while(0); \
+
+#define ACCEPT_CLIENTS 16
+
+struct accepted {
+    int fds[ACCEPT_CLIENTS * 2];
+    int n;
+};
+
+static void on_accept(int connfd, void *data) {
+    struct accepted *acc = data;
+    cr_assert_lt(acc->n, ACCEPT_CLIENTS * 2, "Expected fewer connections");
+    cr_assert(fcntl(connfd, F_GETFL) & O_NONBLOCK, "Expected a non-blocking connection");
+    cr_assert(fcntl(connfd, F_GETFD) & FD_CLOEXEC, "Expected a close-on-exec connection");
+    acc->fds[acc->n++] = connfd;
+}
+
+static void close_accepted(struct accepted *acc) {
+    for(int i = 0; i < acc->n; ++i) {
+        close(acc->fds[i]);
+    }
+    acc->n = 0;
+}
+
+/* A non-blocking listener on an ephemeral port of loopback */
+static int listen_nonblocking(struct sockaddr_in *addr) {
+    int fd = listen_loopback(addr);
+    if(fd != -1) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
+    return fd;
+}
+
+static int connect_loopback(const struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert_neq(fd, -1, "socket failed");
+    cr_assert_eq(connect(fd, (const struct sockaddr *)addr, sizeof(*addr)), 0, "connect failed");
+    return fd;
+}
+
+/* The peer of a shed connection finds it closed */
+static int is_closed(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, 0);
+    return n == 0 || (n == -1 && errno == ECONNRESET);
+}
+
+Test(acceptor_suite, acceptor_init_1) {
+    struct accepted acc = { .n = 0 };
+    cr_assert_null(acceptor_init(-1, on_accept, &acc), "Expected a bad listener to be refused");
+    cr_assert_null(acceptor_init(3, NULL, &acc), "Expected a missing handler to be refused");
+    cr_assert_eq(acceptor_drain(NULL), -1, "Expected a drain of a NULL acceptor to fail");
+    cr_assert_eq(acceptor_complete(NULL, 3), -1, "Expected a completion of a NULL acceptor to fail");
+
+    AcceptStats stats;
+    Acceptor *acceptor = acceptor_init(3, on_accept, &acc);
+    ACCEPTOR_NOTNULL(acceptor);
+    cr_assert_eq(acceptor_get_stats(acceptor, NULL), -1, "Expected stats without a target to fail");
+    cr_assert_eq(acceptor_get_stats(acceptor, &stats), 0, "Expected stats");
+    cr_assert_eq(stats.accepted + stats.batches + stats.shed + stats.errors, 0, "Expected no counts yet");
+    acceptor_destroy(acceptor);
+}
+
+Test(acceptor_suite, acceptor_drain_1) {
+    struct sockaddr_in addr;
+    int listenfd = listen_nonblocking(&addr);
+    cr_assert_neq(listenfd, -1, "Could not listen on loopback");
+    struct accepted acc = { .n = 0 };
+    Acceptor *acceptor = acceptor_init(listenfd, on_accept, &acc);
+    ACCEPTOR_NOTNULL(acceptor);
+
+    cr_assert_eq(acceptor_drain(acceptor), 0, "Expected an empty backlog");
+
+    /* The whole backlog is taken in one drain */
+    int clients[ACCEPT_CLIENTS];
+    for(int i = 0; i < ACCEPT_CLIENTS; ++i) {
+        clients[i] = connect_loopback(&addr);
+    }
+    int n = acceptor_drain(acceptor);
+    cr_assert_eq(n, ACCEPT_CLIENTS, "Expected %d connections but got %d", ACCEPT_CLIENTS, n);
+    cr_assert_eq(acc.n, ACCEPT_CLIENTS, "Expected every connection to be handed over");
+    cr_assert_eq(acceptor_drain(acceptor), 0, "Expected the backlog to be drained");
+
+    AcceptStats stats;
+    acceptor_get_stats(acceptor, &stats);
+    cr_assert_eq(stats.accepted, ACCEPT_CLIENTS, "Expected %d accepted", ACCEPT_CLIENTS);
+    cr_assert_eq(stats.batches, 1, "Expected a single batch but got %lu", stats.batches);
+    cr_assert_eq(stats.shed, 0, "Expected nothing shed");
+
+    for(int i = 0; i < ACCEPT_CLIENTS; ++i) {
+        close(clients[i]);
+    }
+    close_accepted(&acc);
+    acceptor_destroy(acceptor);
+    close(listenfd);
+}
+
+Test(acceptor_suite, acceptor_shed_1) {
+    struct sockaddr_in addr;
+    int listenfd = listen_nonblocking(&addr);
+    cr_assert_neq(listenfd, -1, "Could not listen on loopback");
+    struct accepted acc = { .n = 0 };
+    Acceptor *acceptor = acceptor_init(listenfd, on_accept, &acc);
+    ACCEPTOR_NOTNULL(acceptor);
+
+    int clients[ACCEPT_CLIENTS];
+    for(int i = 0; i < ACCEPT_CLIENTS; ++i) {
+        clients[i] = connect_loopback(&addr);
+    }
+
+    /* No descriptor is left, but the reserve */
+    struct rlimit old, low;
+    getrlimit(RLIMIT_NOFILE, &old);
+    int lowest = dup(0);
+    close(lowest);
+    low = old;
+    low.rlim_cur = lowest;
+    cr_assert_eq(setrlimit(RLIMIT_NOFILE, &low), 0, "setrlimit failed");
+    int n = acceptor_drain(acceptor);
+    int again = acceptor_drain(acceptor);
+    setrlimit(RLIMIT_NOFILE, &old);
+
+    cr_assert_eq(n, 0, "Expected no connection handed over but got %d", n);
+    cr_assert_eq(again, 0, "Expected the backlog to be gone after shedding");
+    AcceptStats stats;
+    acceptor_get_stats(acceptor, &stats);
+    cr_assert_eq(stats.shed, ACCEPT_CLIENTS, "Expected %d shed but got %lu", ACCEPT_CLIENTS, stats.shed);
+    for(int i = 0; i < ACCEPT_CLIENTS; ++i) {
+        cr_assert(is_closed(clients[i]), "Expected client %d to find its connection closed", i);
+        close(clients[i]);
+    }
+
+    /* The reserve is back, and so are the connections */
+    int client = connect_loopback(&addr);
+    cr_assert_eq(acceptor_drain(acceptor), 1, "Expected the connection to be handed over");
+    cr_assert_eq(acc.n, 1, "Expected a connection");
+    close(client);
+    close_accepted(&acc);
+    acceptor_destroy(acceptor);
+    close(listenfd);
+}
+
+Test(acceptor_suite, acceptor_complete_1) {
+    struct sockaddr_in addr;
+    int listenfd = listen_nonblocking(&addr);
+    cr_assert_neq(listenfd, -1, "Could not listen on loopback");
+    struct accepted acc = { .n = 0 };
+    Acceptor *acceptor = acceptor_init(listenfd, on_accept, &acc);
+    ACCEPTOR_NOTNULL(acceptor);
+
+    /* A connection the kernel accepted is handed over */
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv), 0, "socketpair failed");
+    cr_assert_eq(acceptor_complete(acceptor, sv[0]), 0, "Expected the connection to be taken");
+    cr_assert_eq(acc.n, 1, "Expected the connection to be handed over");
+    close(sv[1]);
+
+    cr_assert_eq(acceptor_complete(acceptor, -ECONNABORTED), 0, "Expected an aborted connection to be skipped");
+    cr_assert_eq(acceptor_complete(acceptor, -EBADF), -1, "Expected a bad listener to be fatal");
+
+    /* Out of descriptors, the backlog is shed instead */
+    int clients[4];
+    for(int i = 0; i < 4; ++i) {
+        clients[i] = connect_loopback(&addr);
+    }
+    struct rlimit old, low;
+    getrlimit(RLIMIT_NOFILE, &old);
+    int lowest = dup(0);
+    close(lowest);
+    low = old;
+    low.rlim_cur = lowest;
+    cr_assert_eq(setrlimit(RLIMIT_NOFILE, &low), 0, "setrlimit failed");
+    int status = acceptor_complete(acceptor, -EMFILE);
+    setrlimit(RLIMIT_NOFILE, &old);
+    cr_assert_eq(status, 0, "Expected running out of descriptors not to be fatal");
+
+    AcceptStats stats;
+    acceptor_get_stats(acceptor, &stats);
+    cr_assert_eq(stats.accepted, 1, "Expected 1 accepted but got %lu", stats.accepted);
+    cr_assert_eq(stats.errors, 1, "Expected 1 error but got %lu", stats.errors);
+    cr_assert_eq(stats.shed, 4, "Expected 4 shed but got %lu", stats.shed);
+    for(int i = 0; i < 4; ++i) {
+        close(clients[i]);
+    }
+    close_accepted(&acc);
+    acceptor_destroy(acceptor);
+    close(listenfd);
+}
@@ -0,0 +1,192 @@
+#include <criterion/criterion.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "admission.h"
+#include "test_util.h"
+
+#define ADMISSION_NOTNULL(admission) \
+    do { \
+        cr_assert_not_null(admission, "Expected a non-null value from admission. Memory allocation may have potentially failed.");\
+    } while(0); \
+
+/* Connects from the loopback address from and returns the accepted end */
+static int accept_from(int listenfd, const struct sockaddr_in *addr, const char *from,
+        int *clientfd) {
+    *clientfd = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert_neq(*clientfd, -1, "socket failed");
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    inet_pton(AF_INET, from, &local.sin_addr);
+    cr_assert_eq(bind(*clientfd, (struct sockaddr *)&local, sizeof(local)), 0, "bind failed");
+    cr_assert_eq(connect(*clientfd, (const struct sockaddr *)addr, sizeof(*addr)), 0,
+            "connect failed");
+    int connfd = accept(listenfd, NULL, NULL);
+    cr_assert_neq(connfd, -1, "accept failed");
+    return connfd;
+}
+
+Test(admission_suite, admission_init_1) {
+    cr_assert_null(admission_init(NULL), "Expected missing limits to be refused");
+    cr_assert_eq(admission_accept(NULL, 0, 0), 1, "Expected no admission to let everything in");
+    cr_assert_eq(admission_begin(NULL), 1, "Expected no admission to let every request in");
+
+    AdmissionLimits limits = { .max_inflight = 1 };
+    Admission *admission = admission_init(&limits);
+    ADMISSION_NOTNULL(admission);
+    AdmissionStats stats;
+    cr_assert_eq(admission_get_stats(admission, NULL), -1, "Expected stats without a target to fail");
+    cr_assert_eq(admission_get_stats(admission, &stats), 0, "Expected stats");
+    cr_assert_eq(stats.limit, ADMISSION_MIN_LIMIT, "Expected the limit to be raised to %d but got %u",
+            ADMISSION_MIN_LIMIT, stats.limit);
+    cr_assert_eq(stats.accepted + stats.reset + stats.admitted + stats.shed, 0,
+            "Expected no counts yet");
+    admission_destroy(admission);
+}
+
+Test(admission_suite, admission_conn_rate_1) {
+    AdmissionLimits limits = { .conn_rate = 2 };
+    Admission *admission = admission_init(&limits);
+    ADMISSION_NOTNULL(admission);
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+
+    /* The burst is a second at the rate */
+    uint64_t now = 1000000;
+    cr_assert_eq(admission_accept(admission, sv[0], now), 1, "Expected the first connection in");
+    cr_assert_eq(admission_accept(admission, sv[0], now), 1, "Expected the second connection in");
+    cr_assert_eq(admission_accept(admission, sv[0], now), 0, "Expected the third connection reset");
+
+    /* Half a second brings a token back, and only one */
+    now += 500000;
+    cr_assert_eq(admission_accept(admission, sv[0], now), 1, "Expected a connection in after a while");
+    cr_assert_eq(admission_accept(admission, sv[0], now), 0, "Expected the next one reset");
+    /* A long pause fills the bucket up to the burst, not beyond */
+    now += 3600 * 1000000ull;
+    for(int i = 0; i < 2; ++i) {
+        cr_assert_eq(admission_accept(admission, sv[0], now), 1, "Expected the burst in");
+    }
+    cr_assert_eq(admission_accept(admission, sv[0], now), 0, "Expected no more than the burst");
+
+    AdmissionStats stats;
+    admission_get_stats(admission, &stats);
+    cr_assert_eq(stats.accepted, 5, "Expected 5 connections in but got %lu", stats.accepted);
+    cr_assert_eq(stats.reset, 3, "Expected 3 connections reset but got %lu", stats.reset);
+    cr_assert_eq(stats.reset_client, 0, "Expected no client over its rate");
+    close(sv[0]);
+    close(sv[1]);
+    admission_destroy(admission);
+}
+
+Test(admission_suite, admission_client_rate_1) {
+    AdmissionLimits limits = { .client_rate = 1, .client_burst = 2 };
+    Admission *admission = admission_init(&limits);
+    ADMISSION_NOTNULL(admission);
+    struct sockaddr_in addr;
+    int listenfd = listen_loopback(&addr);
+    cr_assert_neq(listenfd, -1, "Could not listen on loopback");
+
+    /* A client has a bucket of its own, another one is not held back by it */
+    int fds[4][2];
+    const char *from[4] = { "127.0.0.1", "127.0.0.1", "127.0.0.1", "127.0.0.2" };
+    int expected[4] = { 1, 1, 0, 1 };
+    uint64_t now = 1000000;
+    for(int i = 0; i < 4; ++i) {
+        fds[i][0] = accept_from(listenfd, &addr, from[i], &fds[i][1]);
+        cr_assert_eq(admission_accept(admission, fds[i][0], now), expected[i],
+                "Expected connection %d from %s to be %s", i, from[i],
+                expected[i] ? "let in" : "reset");
+    }
+    now += 1000000;
+    cr_assert_eq(admission_accept(admission, fds[0][0], now), 1, "Expected the client to get a token back");
+    cr_assert_eq(admission_accept(admission, fds[0][0], now), 0, "Expected a single token back");
+
+    AdmissionStats stats;
+    admission_get_stats(admission, &stats);
+    cr_assert_eq(stats.reset_client, 2, "Expected 2 connections over their client rate but got %lu",
+            stats.reset_client);
+    cr_assert_eq(stats.reset, 0, "Expected no connection over the rate of the worker");
+    for(int i = 0; i < 4; ++i) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    close(listenfd);
+    admission_destroy(admission);
+}
+
+Test(admission_suite, admission_limit_1) {
+    AdmissionLimits limits = { .max_inflight = 8 };
+    Admission *admission = admission_init(&limits);
+    ADMISSION_NOTNULL(admission);
+
+    for(int i = 0; i < 8; ++i) {
+        cr_assert_eq(admission_begin(admission), 1, "Expected request %d in", i);
+    }
+    cr_assert_eq(admission_begin(admission), 0, "Expected the request over the limit shed");
+    admission_end(admission);
+    cr_assert_eq(admission_begin(admission), 1, "Expected a request in once another ended");
+
+    AdmissionStats stats;
+    admission_get_stats(admission, &stats);
+    cr_assert_eq(stats.admitted, 9, "Expected 9 requests in but got %lu", stats.admitted);
+    cr_assert_eq(stats.shed, 1, "Expected a request shed but got %lu", stats.shed);
+    cr_assert_eq(stats.inflight, 8, "Expected 8 requests in flight but got %u", stats.inflight);
+    for(int i = 0; i < 8; ++i) {
+        admission_end(admission);
+    }
+    admission_end(admission);
+    admission_get_stats(admission, &stats);
+    cr_assert_eq(stats.inflight, 0, "Expected no request in flight but got %u", stats.inflight);
+    admission_destroy(admission);
+}
+
+Test(admission_suite, admission_adapt_1) {
+    AdmissionLimits limits = { .max_inflight = 64 };
+    Admission *admission = admission_init(&limits);
+    ADMISSION_NOTNULL(admission);
+    AdmissionStats stats;
+
+    /* A burst of delays within an interval that also saw a short one is not a queue */
+    uint64_t now = 1000000;
+    for(int i = 0; i < 10; ++i) {
+        admission_observe(admission, i == 5 ? 100 : 10 * ADMISSION_TARGET_DELAY_US, now);
+        now += ADMISSION_INTERVAL_US / 10;
+    }
+    admission_observe(admission, 100, now);
+    admission_get_stats(admission, &stats);
+    cr_assert_eq(stats.limit, 64, "Expected the limit to stay at 64 but got %u", stats.limit);
+
+    /* A standing queue shrinks the limit interval after interval, down to its floor */
+    unsigned int last = stats.limit;
+    for(int i = 0; i < 100; ++i) {
+        now += ADMISSION_INTERVAL_US;
+        admission_observe(admission, 2 * ADMISSION_TARGET_DELAY_US, now);
+        admission_get_stats(admission, &stats);
+        cr_assert_leq(stats.limit, last, "Expected the limit not to grow under a queue");
+        last = stats.limit;
+    }
+    cr_assert_eq(stats.limit, ADMISSION_MIN_LIMIT, "Expected the limit at its floor but got %u",
+            stats.limit);
+
+    /* Without a queue, it only grows while the requests reach it */
+    for(int i = 0; i < 10; ++i) {
+        now += ADMISSION_INTERVAL_US;
+        admission_observe(admission, 100, now);
+    }
+    admission_get_stats(admission, &stats);
+    cr_assert_eq(stats.limit, ADMISSION_MIN_LIMIT, "Expected an unused limit to stay put but got %u",
+            stats.limit);
+    for(int i = 0; i < 100; ++i) {
+        while(admission_begin(admission)) {
+        }
+        now += ADMISSION_INTERVAL_US;
+        admission_observe(admission, 100, now);
+    }
+    admission_get_stats(admission, &stats);
+    cr_assert_eq(stats.limit, 64, "Expected the limit back at its ceiling but got %u", stats.limit);
+    admission_destroy(admission);
+}
@@ -0,0 +1,227 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "balancer.h"
+
+#define BALANCER_NOTNULL(balancer) \
+    do { \
+        cr_assert_not_null(balancer, "Expected a non-null value from balancer. Memory allocation may have potentially failed.");\
+    } while(0); \
+
+static char *s_backends[] = { "127.0.0.1:8081", "localhost:8082", "[::1]:8083", "10.0.0.4:8084" };
+
+Test(balancer_suite, balancer_init_1) {
+    BalancePolicy policy;
+    cr_assert_eq(balancer_parse_policy("p2c", &policy), 0, "Expected p2c to be a policy");
+    cr_assert_eq(policy, BALANCE_TWO_CHOICES, "Expected the policy of two choices");
+    cr_assert_eq(balancer_parse_policy("random", &policy), -1, "Expected random not to be a policy");
+
+    cr_assert_null(balancer_init(BALANCE_HASH, s_backends, 0), "Expected no backend to be refused");
+    char *bad[][1] = { { "127.0.0.1" }, { "::1:80" }, { "[::1]80" }, { "host:http" }, { ":80" } };
+    for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+        cr_assert_null(balancer_init(BALANCE_HASH, bad[i], 1), "Expected %s to be refused", bad[i][0]);
+    }
+
+    Balancer *balancer = balancer_init(BALANCE_LEAST_OUTSTANDING, s_backends, 4);
+    BALANCER_NOTNULL(balancer);
+    cr_assert_eq(balancer_count(balancer), 4, "Expected 4 backends");
+    cr_assert_str_eq(balancer_host(balancer, 1), "localhost", "Expected the host of a backend");
+    cr_assert_str_eq(balancer_host(balancer, 2), "::1", "Expected an IPv6 host without brackets");
+    cr_assert_str_eq(balancer_port(balancer, 2), "8083", "Expected the port of a backend");
+    cr_assert_null(balancer_host(balancer, 4), "Expected no backend past the last");
+    balancer_destroy(balancer);
+}
+
+Test(balancer_suite, balancer_least_1) {
+    Balancer *balancer = balancer_init(BALANCE_LEAST_OUTSTANDING, s_backends, 4);
+    BALANCER_NOTNULL(balancer);
+
+    /* Idle backends are gone through in turn */
+    int picked[8];
+    for(int i = 0; i < 8; ++i) {
+        picked[i] = balancer_pick(balancer, NULL, 0);
+        cr_assert_eq(picked[i], i % 4, "Expected backend %d but got %d", i % 4, picked[i]);
+    }
+    /* A backend that finishes its requests takes the next ones */
+    balancer_release(balancer, 2);
+    balancer_release(balancer, 2);
+    cr_assert_eq(balancer_pick(balancer, NULL, 0), 2, "Expected the idle backend");
+    cr_assert_eq(balancer_pick(balancer, NULL, 0), 2, "Expected the backend with one in flight");
+    cr_assert_eq(balancer_pick(balancer, NULL, 0), 0, "Expected the backend picked the longest ago");
+
+    BackendStats stats;
+    cr_assert_eq(balancer_get_stats(balancer, 2, &stats), 0, "Expected stats");
+    cr_assert_eq(stats.picks, 4, "Expected 4 picks but got %lu", stats.picks);
+    cr_assert_eq(stats.outstanding, 2, "Expected 2 in flight but got %u", stats.outstanding);
+    cr_assert_eq(balancer_get_stats(balancer, 0, &stats), 0, "Expected stats");
+    cr_assert_eq(stats.outstanding, 3, "Expected 3 in flight but got %u", stats.outstanding);
+    balancer_destroy(balancer);
+}
+
+Test(balancer_suite, balancer_two_choices_1) {
+    Balancer *balancer = balancer_init(BALANCE_TWO_CHOICES, s_backends, 4);
+    BALANCER_NOTNULL(balancer);
+
+    /* A backend that never finishes ends up with no more than its share */
+    unsigned int stuck = 0;
+    for(int i = 0; i < 4000; ++i) {
+        int b = balancer_pick(balancer, NULL, 0);
+        cr_assert(b >= 0 && b < 4, "Expected a backend but got %d", b);
+        if(b != 0) {
+            balancer_release(balancer, b);
+        } else {
+            stuck++;
+        }
+    }
+    BackendStats stats;
+    balancer_get_stats(balancer, 0, &stats);
+    cr_assert_eq(stats.outstanding, stuck, "Expected the requests of backend 0 in flight");
+    cr_assert_lt(stuck, 100, "Expected few requests on the stuck backend but got %u", stuck);
+    balancer_destroy(balancer);
+}
+
+Test(balancer_suite, balancer_hash_1) {
+    Balancer *balancer = balancer_init(BALANCE_HASH, s_backends, 4);
+    BALANCER_NOTNULL(balancer);
+    Balancer *fewer = balancer_init(BALANCE_HASH, s_backends, 3);
+    BALANCER_NOTNULL(fewer);
+
+    /* The same key goes to the same backend, the keys spread, and removing a backend only moves its keys */
+    unsigned int count[4] = { 0 };
+    for(int i = 0; i < 4000; ++i) {
+        char key[32];
+        int len = snprintf(key, sizeof(key), "/item/%d", i);
+        int b = balancer_pick(balancer, key, len);
+        cr_assert_eq(balancer_pick(balancer, key, len), b, "Expected %s to stay on backend %d", key, b);
+        count[b]++;
+        if(b != 3) {
+            cr_assert_eq(balancer_pick(fewer, key, len), b, "Expected %s not to move", key);
+        }
+    }
+    for(int b = 0; b < 4; ++b) {
+        cr_assert(count[b] > 600 && count[b] < 1400, "Expected backend %d to get about a quarter but got %u",
+                b, count[b]);
+    }
+    balancer_destroy(fewer);
+    balancer_destroy(balancer);
+}
+
+Test(balancer_suite, balancer_breaker_1) {
+    Balancer *balancer = balancer_init(BALANCE_LEAST_OUTSTANDING, s_backends, 2);
+    BALANCER_NOTNULL(balancer);
+    BackendStats stats;
+
+    /* Failures in a row trip the breaker, which takes the backend out of rotation */
+    uint64_t now = 1000000;
+    for(int i = 0; i < BALANCER_TRIP_FAILURES; ++i) {
+        balancer_report(balancer, 0, 0, now);
+    }
+    balancer_get_stats(balancer, 0, &stats);
+    cr_assert_eq(stats.breaker, BREAKER_OPEN, "Expected the breaker to be open");
+    cr_assert_eq(stats.trips, 1, "Expected a trip but got %lu", stats.trips);
+    for(int i = 0; i < 10; ++i) {
+        cr_assert_eq(balancer_pick(balancer, NULL, 0), 1, "Expected the other backend");
+        balancer_release(balancer, 1);
+    }
+
+    /* Half open after a while, it takes one trial at a time */
+    balancer_tick(balancer, now + BALANCER_OPEN_MS - 1);
+    balancer_get_stats(balancer, 0, &stats);
+    cr_assert_eq(stats.breaker, BREAKER_OPEN, "Expected the breaker to stay open for a while");
+    now += BALANCER_OPEN_MS;
+    balancer_tick(balancer, now);
+    balancer_get_stats(balancer, 0, &stats);
+    cr_assert_eq(stats.breaker, BREAKER_HALF_OPEN, "Expected the breaker to be half open");
+    cr_assert_eq(balancer_pick(balancer, NULL, 0), 0, "Expected a trial on the half open backend");
+    cr_assert_eq(balancer_pick(balancer, NULL, 0), 1, "Expected a single trial at once");
+    balancer_release(balancer, 1);
+    /* A failed trial opens it again */
+    balancer_report(balancer, 0, 0, now);
+    balancer_release(balancer, 0);
+    balancer_get_stats(balancer, 0, &stats);
+    cr_assert_eq(stats.breaker, BREAKER_OPEN, "Expected a failed trial to open the breaker");
+    cr_assert_eq(stats.trips, 2, "Expected a second trip but got %lu", stats.trips);
+
+    /* Trials that go through close it */
+    now += BALANCER_OPEN_MS;
+    balancer_tick(balancer, now);
+    for(int i = 0; i < BALANCER_TRIALS; ++i) {
+        balancer_get_stats(balancer, 0, &stats);
+        cr_assert_eq(stats.breaker, BREAKER_HALF_OPEN, "Expected the breaker to be half open");
+        balancer_report(balancer, 0, 1, now);
+    }
+    balancer_get_stats(balancer, 0, &stats);
+    cr_assert_eq(stats.breaker, BREAKER_CLOSED, "Expected the breaker to be closed");
+    cr_assert_eq(stats.failures, BALANCER_TRIP_FAILURES + 1, "Expected %d failures but got %lu",
+            BALANCER_TRIP_FAILURES + 1, stats.failures);
+    balancer_destroy(balancer);
+}
+
+Test(balancer_suite, balancer_breaker_rate_1) {
+    Balancer *balancer = balancer_init(BALANCE_TWO_CHOICES, s_backends, 2);
+    BALANCER_NOTNULL(balancer);
+    BackendStats stats;
+
+    /* Every other request failing never trips on the failures in a row, the share does */
+    uint64_t now = 1000000;
+    for(int i = 0; i < BALANCER_MIN_REQUESTS - 1; ++i) {
+        balancer_report(balancer, 0, i % 2, now);
+    }
+    balancer_get_stats(balancer, 0, &stats);
+    cr_assert_eq(stats.breaker, BREAKER_CLOSED, "Expected too few requests to trip the breaker");
+    balancer_report(balancer, 0, 0, now);
+    balancer_get_stats(balancer, 0, &stats);
+    cr_assert_eq(stats.breaker, BREAKER_OPEN, "Expected half the requests failing to trip the breaker");
+
+    /* The failures of a past window are forgotten */
+    now += 2 * BALANCER_OPEN_MS;
+    balancer_tick(balancer, now);
+    for(int i = 0; i < BALANCER_TRIALS; ++i) {
+        balancer_report(balancer, 0, 1, now);
+    }
+    now += BALANCER_WINDOW_MS;
+    for(int i = 0; i < 2 * BALANCER_MIN_REQUESTS; ++i) {
+        balancer_report(balancer, 0, i % 4 != 0, now);
+    }
+    balancer_get_stats(balancer, 0, &stats);
+    cr_assert_eq(stats.breaker, BREAKER_CLOSED, "Expected a quarter failing not to trip the breaker");
+
+    /* With every backend out of rotation, a pick fails right away */
+    for(int b = 0; b < 2; ++b) {
+        for(int i = 0; i < BALANCER_TRIP_FAILURES; ++i) {
+            balancer_report(balancer, b, 0, now);
+        }
+    }
+    cr_assert_eq(balancer_pick(balancer, NULL, 0), -1, "Expected no backend to pick");
+    balancer_destroy(balancer);
+}
+
+Test(balancer_suite, balancer_probe_1) {
+    Balancer *balancer = balancer_init(BALANCE_HASH, s_backends, 4);
+    BALANCER_NOTNULL(balancer);
+    BackendStats stats;
+
+    /* A single failed probe is not enough to take a backend down */
+    int b = balancer_pick(balancer, "/item", 5);
+    balancer_probe(balancer, b, 0);
+    balancer_probe(balancer, b, 1);
+    for(int i = 0; i < BALANCER_PROBE_FALLS - 1; ++i) {
+        balancer_probe(balancer, b, 0);
+    }
+    cr_assert_eq(balancer_pick(balancer, "/item", 5), b, "Expected the backend to stay up");
+
+    /* Down, its keys move to the next backend of the ring and come back once it is up */
+    balancer_probe(balancer, b, 0);
+    balancer_get_stats(balancer, b, &stats);
+    cr_assert_eq(stats.healthy, 0, "Expected the backend to be down");
+    int other = balancer_pick(balancer, "/item", 5);
+    cr_assert(other != -1 && other != b, "Expected another backend but got %d", other);
+    for(int i = 0; i < BALANCER_PROBE_RISES; ++i) {
+        balancer_probe(balancer, b, 1);
+    }
+    balancer_get_stats(balancer, b, &stats);
+    cr_assert_eq(stats.healthy, 1, "Expected the backend to be up");
+    cr_assert_eq(balancer_pick(balancer, "/item", 5), b, "Expected the key back on its backend");
+    balancer_destroy(balancer);
+}
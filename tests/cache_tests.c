@@ -0,0 +1,424 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "disk_cache.h"
+#include "http.h"
+
+#define CACHE_NOTNULL(cache) \
+    do { \
+        cr_assert_not_null(cache, "Expected a non-null value from cache. Memory allocation may have potentially failed.");\
+    } while(0); \
+
+#define GET(target, headers) "GET " target " HTTP/1.1\r\n" headers "\r\n"
+
+#define RESP_OK(headers, body) \
+    "HTTP/1.1 200 OK\r\n" headers "Content-Length: " #body "\r\n\r\n"
+
+/* Starts storing resp as the answer to req, NULL if it may not be stored */
+static CacheObject *start(HttpCache *cache, const char *origin, const char *req,
+        const char *resp) {
+    HttpParser hp;
+    http_parser_init(&hp, HTTP_RESPONSE, 0);
+    cr_assert_eq(http_parse_head(&hp, resp, strlen(resp)), HTTP_PARSE_DONE,
+            "Could not parse %s", resp);
+    return http_cache_fill_start(cache, origin, req, strlen(req), resp, &hp);
+}
+
+static int store(HttpCache *cache, const char *origin, const char *req, const char *resp) {
+    CacheObject *obj = start(cache, origin, req, resp);
+    if(obj == NULL) {
+        return -1;
+    }
+    cr_assert_eq(http_cache_fill_append(obj, resp, strlen(resp)), 0, "Could not fill the object");
+    return http_cache_fill_finish(cache, obj);
+}
+
+static int lookup(HttpCache *cache, const char *origin, const char *req, CacheObject **obj) {
+    return http_cache_lookup(cache, origin, req, strlen(req), obj);
+}
+
+/* What a hit sends to the client */
+static void serve(CacheObject *obj, char *out, size_t sz) {
+    struct iovec iov[HTTP_CACHE_IOV];
+    char age[HTTP_CACHE_AGE_SZ];
+    int n = http_cache_object_iov(obj, iov, age);
+    size_t len = 0;
+    for(int i = 0; i < n; ++i) {
+        cr_assert_lt(len + iov[i].iov_len, sz, "The response does not fit");
+        memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    out[len] = '\0';
+}
+
+Test(cache_suite, cache_store_1) {
+    HttpCache *cache = http_cache_init(1024 * 1024);
+    CACHE_NOTNULL(cache);
+
+    const char *req = GET("/a", "Accept: */*\r\n");
+    CacheObject *obj = NULL;
+    cr_assert_eq(lookup(cache, "example.com:80", req, &obj), 0, "Expected a miss");
+    cr_assert_eq(store(cache, "example.com:80", req,
+                RESP_OK("Cache-Control: max-age=60\r\n", 5) "hello"), 0, "Expected the response to be stored");
+    cr_assert_eq(lookup(cache, "example.com:8080", req, &obj), 0, "Expected the port to matter");
+    cr_assert_eq(lookup(cache, "example.com:80", GET("/b", ""), &obj), 0, "Expected the target to matter");
+    cr_assert_eq(lookup(cache, "example.com:80", req, &obj), 1, "Expected a hit");
+
+    char out[512];
+    serve(obj, out, sizeof(out));
+    cr_assert_str_eq(out, "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+            "Content-Length: 5\r\nAge: 0\r\n\r\nhello", "Unexpected response %s", out);
+    http_cache_release(obj);
+
+    HttpCacheStats stats;
+    http_cache_get_stats(cache, &stats);
+    cr_assert_eq(stats.lookups, 4, "Expected 4 lookups but got %lu", stats.lookups);
+    cr_assert_eq(stats.hits, 1, "Expected 1 hit but got %lu", stats.hits);
+    cr_assert_eq(stats.misses, 3, "Expected 3 misses but got %lu", stats.misses);
+    cr_assert_eq(stats.stores, 1, "Expected 1 store but got %lu", stats.stores);
+    cr_assert_eq(stats.objects, 1, "Expected 1 object but got %lu", stats.objects);
+    cr_assert_gt(stats.bytes_saved, 5, "Expected the bytes served to be counted");
+    http_cache_destroy(cache);
+}
+
+Test(cache_suite, cache_uncacheable_1) {
+    HttpCache *cache = http_cache_init(1024 * 1024);
+    CACHE_NOTNULL(cache);
+    const char *req = GET("/", "");
+    const char *o = "example.com:80";
+
+    cr_assert_null(start(cache, o, req, RESP_OK("", 0)), "Expected no freshness to mean no store");
+    cr_assert_null(start(cache, o, req, RESP_OK("Cache-Control: no-store, max-age=60\r\n", 0)),
+            "Expected no-store to be honoured");
+    cr_assert_null(start(cache, o, req, RESP_OK("Cache-Control: private, max-age=60\r\n", 0)),
+            "Expected private to be honoured");
+    cr_assert_null(start(cache, o, req, RESP_OK("Cache-Control: max-age=0\r\n", 0)),
+            "Expected max-age=0 to mean no store");
+    cr_assert_null(start(cache, o, req,
+                RESP_OK("Cache-Control: max-age=60\r\nSet-Cookie: a=b\r\n", 0)),
+            "Expected cookies not to be stored");
+    cr_assert_null(start(cache, o, req, RESP_OK("Cache-Control: max-age=60\r\nVary: *\r\n", 0)),
+            "Expected Vary: * not to be stored");
+    cr_assert_null(start(cache, o, req,
+                "HTTP/1.1 500 Oops\r\nCache-Control: max-age=60\r\nContent-Length: 0\r\n\r\n"),
+            "Expected a 500 not to be stored");
+    cr_assert_null(start(cache, o, req, "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n\r\n"),
+            "Expected a body that ends with the connection not to be stored");
+    cr_assert_null(start(cache, o, "POST / HTTP/1.1\r\n\r\n",
+                RESP_OK("Cache-Control: max-age=60\r\n", 0)), "Expected POST not to be stored");
+    cr_assert_null(start(cache, o, GET("/", "Cache-Control: no-store\r\n"),
+                RESP_OK("Cache-Control: max-age=60\r\n", 0)), "Expected the request's no-store to be honoured");
+    cr_assert_null(start(cache, o, GET("/", "Authorization: x\r\n"),
+                RESP_OK("Cache-Control: max-age=60\r\n", 0)), "Expected authorized responses not to be stored");
+
+    CacheObject *obj = start(cache, o, GET("/", "Authorization: x\r\n"),
+            RESP_OK("Cache-Control: public, max-age=60\r\n", 0));
+    cr_assert_not_null(obj, "Expected public to allow authorized responses");
+    http_cache_release(obj);
+    http_cache_destroy(cache);
+}
+
+Test(cache_suite, cache_expires_1) {
+    HttpCache *cache = http_cache_init(1024 * 1024);
+    CACHE_NOTNULL(cache);
+    const char *req = GET("/", "");
+
+    CacheObject *obj = start(cache, "a:80", req, RESP_OK(
+                "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\nExpires: Sun, 06 Nov 1994 08:51:17 GMT\r\n", 0));
+    cr_assert_not_null(obj, "Expected Expires to give a lifetime");
+    http_cache_release(obj);
+
+    cr_assert_null(start(cache, "a:80", req, RESP_OK(
+                "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\nExpires: Sun, 06 Nov 1994 08:49:37 GMT\r\n", 0)),
+            "Expected a response that expired not to be stored");
+    cr_assert_null(start(cache, "a:80", req, RESP_OK("Expires: 0\r\n", 0)),
+            "Expected an invalid Expires to mean stale");
+
+    obj = start(cache, "a:80", req, RESP_OK(
+                "Cache-Control: max-age=60\r\nExpires: Sun, 06 Nov 1994 08:49:37 GMT\r\n", 0));
+    cr_assert_not_null(obj, "Expected max-age to win over Expires");
+    http_cache_release(obj);
+    http_cache_destroy(cache);
+}
+
+Test(cache_suite, cache_expiry_1) {
+    HttpCache *cache = http_cache_init(1024 * 1024);
+    CACHE_NOTNULL(cache);
+    const char *req = GET("/", "");
+
+    store(cache, "a:80", req, RESP_OK("Cache-Control: max-age=1\r\n", 0));
+    CacheObject *obj;
+    cr_assert_eq(lookup(cache, "a:80", req, &obj), 1, "Expected a hit");
+    http_cache_release(obj);
+    usleep(1100 * 1000);
+    cr_assert_eq(lookup(cache, "a:80", req, &obj), 0, "Expected the object to be stale");
+
+    HttpCacheStats stats;
+    http_cache_get_stats(cache, &stats);
+    cr_assert_eq(stats.expired, 1, "Expected 1 expired object but got %lu", stats.expired);
+    cr_assert_eq(stats.objects, 0, "Expected no object but got %lu", stats.objects);
+    cr_assert_eq(stats.bytes, 0, "Expected no byte but got %lu", stats.bytes);
+    http_cache_destroy(cache);
+}
+
+Test(cache_suite, cache_vary_1) {
+    HttpCache *cache = http_cache_init(1024 * 1024);
+    CACHE_NOTNULL(cache);
+
+    store(cache, "a:80", GET("/", "Accept-Encoding: gzip\r\n"),
+            RESP_OK("Cache-Control: max-age=60\r\nVary: Accept-Encoding\r\n", 1) "g");
+    store(cache, "a:80", GET("/", "accept-encoding:  br \r\n"),
+            RESP_OK("Cache-Control: max-age=60\r\nVary: Accept-Encoding\r\n", 1) "b");
+
+    CacheObject *obj;
+    char out[512];
+    cr_assert_eq(lookup(cache, "a:80", GET("/", ""), &obj), 0, "Expected a miss without the header");
+    cr_assert_eq(lookup(cache, "a:80", GET("/", "Accept-Encoding: br\r\n"), &obj), 1,
+            "Expected a hit for br");
+    serve(obj, out, sizeof(out));
+    cr_assert_eq(out[strlen(out) - 1], 'b', "Expected the br variant");
+    http_cache_release(obj);
+    cr_assert_eq(lookup(cache, "a:80", GET("/", "Accept-Encoding: gzip\r\n"), &obj), 1,
+            "Expected a hit for gzip");
+    serve(obj, out, sizeof(out));
+    cr_assert_eq(out[strlen(out) - 1], 'g', "Expected the gzip variant");
+    http_cache_release(obj);
+    http_cache_destroy(cache);
+}
+
+Test(cache_suite, cache_bypass_1) {
+    HttpCache *cache = http_cache_init(1024 * 1024);
+    CACHE_NOTNULL(cache);
+
+    store(cache, "a:80", GET("/", ""), RESP_OK("Cache-Control: max-age=60\r\n", 0));
+    CacheObject *obj;
+    cr_assert_eq(lookup(cache, "a:80", GET("/", "Cache-Control: no-cache\r\n"), &obj), 0,
+            "Expected no-cache to skip the cache");
+    cr_assert_eq(lookup(cache, "a:80", GET("/", "Pragma: no-cache\r\n"), &obj), 0,
+            "Expected Pragma: no-cache to skip the cache");
+    cr_assert_eq(lookup(cache, "a:80", "HEAD / HTTP/1.1\r\n\r\n", &obj), 0,
+            "Expected HEAD not to be served");
+    http_cache_destroy(cache);
+}
+
+Test(cache_suite, cache_collapse_key_1) {
+    HttpCache *cache = http_cache_init(1024 * 1024);
+    CACHE_NOTNULL(cache);
+
+    uint64_t hash = http_cache_key_hash("a:80", GET("/x", ""), strlen(GET("/x", "")));
+    cr_assert_neq(hash, 0, "Expected a GET to have a key");
+    cr_assert_eq(http_cache_key_hash("a:80", GET("/x", "Accept: */*\r\n"),
+                strlen(GET("/x", "Accept: */*\r\n"))), hash, "Expected the key to ignore headers");
+    cr_assert_neq(http_cache_key_hash("b:80", GET("/x", ""), strlen(GET("/x", ""))), hash,
+            "Expected the origin to be part of the key");
+    cr_assert_eq(http_cache_key_hash("a:80", GET("/x", "Pragma: no-cache\r\n"),
+                strlen(GET("/x", "Pragma: no-cache\r\n"))), 0, "Expected no key for no-cache");
+    cr_assert_eq(http_cache_key_hash("a:80", "HEAD /x HTTP/1.1\r\n\r\n",
+                strlen("HEAD /x HTTP/1.1\r\n\r\n")), 0,
+            "Expected no key for HEAD");
+
+    /* An object being filled is read as it grows, and matches on what it varies on */
+    const char *req = GET("/x", "Accept-Encoding: gzip\r\n");
+    const char *resp = RESP_OK("Cache-Control: max-age=60\r\nVary: Accept-Encoding\r\n", 2);
+    CacheObject *obj = start(cache, "a:80", req, resp);
+    cr_assert_not_null(obj, "Expected the response to be stored");
+    cr_assert(http_cache_object_matches(obj, req, strlen(req)), "Expected the same request to match");
+    cr_assert_not(http_cache_object_matches(obj, GET("/x", ""), strlen(GET("/x", ""))),
+            "Expected another variant not to match");
+    CacheObject *ref = http_cache_retain(obj);
+    const char *data;
+    cr_assert_eq(http_cache_fill_append(obj, resp, strlen(resp)), 0, "Could not fill the object");
+    cr_assert_eq(http_cache_object_data(ref, &data), strlen(resp), "Expected the head so far");
+    cr_assert_eq(http_cache_fill_append(obj, "ok", 2), 0, "Could not fill the object");
+    cr_assert_eq(http_cache_fill_finish(cache, obj), 0, "Expected the object to be stored");
+    cr_assert_eq(http_cache_object_data(ref, &data), strlen(resp) + 2, "Expected the whole response");
+    cr_assert(memcmp(data + strlen(resp), "ok", 2) == 0, "Expected the body");
+    http_cache_release(ref);
+    http_cache_destroy(cache);
+}
+
+Test(cache_suite, cache_replace_1) {
+    HttpCache *cache = http_cache_init(1024 * 1024);
+    CACHE_NOTNULL(cache);
+    const char *req = GET("/", "");
+
+    store(cache, "a:80", req, RESP_OK("Cache-Control: max-age=60\r\n", 1) "1");
+    CacheObject *old;
+    cr_assert_eq(lookup(cache, "a:80", req, &old), 1, "Expected a hit");
+    store(cache, "a:80", req, RESP_OK("Cache-Control: max-age=60\r\n", 1) "2");
+
+    HttpCacheStats stats;
+    http_cache_get_stats(cache, &stats);
+    cr_assert_eq(stats.objects, 1, "Expected 1 object but got %lu", stats.objects);
+
+    /* The reference that was handed out stays valid */
+    char out[512];
+    serve(old, out, sizeof(out));
+    cr_assert_eq(out[strlen(out) - 1], '1', "Expected the old object to be intact");
+    http_cache_release(old);
+
+    CacheObject *obj;
+    cr_assert_eq(lookup(cache, "a:80", req, &obj), 1, "Expected a hit");
+    serve(obj, out, sizeof(out));
+    cr_assert_eq(out[strlen(out) - 1], '2', "Expected the new object");
+    http_cache_release(obj);
+    http_cache_destroy(cache);
+}
+
+Test(cache_suite, cache_disk_tier_1) {
+    char path[64], file[96];
+    snprintf(path, sizeof(path), "/tmp/cache_tests.%d", (int)getpid());
+    DiskCache *disk = disk_cache_open(path, 1024 * 1024);
+    cr_assert_not_null(disk, "Expected a disk cache");
+    HttpCache *cache = http_cache_init(1024 * 1024);
+    CACHE_NOTNULL(cache);
+    http_cache_attach_disk(cache, disk);
+
+    const char *req = GET("/", "");
+    const char *resp = RESP_OK("Cache-Control: max-age=60\r\n", 5) "hello";
+    cr_assert_eq(store(cache, "a:80", req, resp), 0, "Expected the store to succeed");
+    cr_assert_eq(store(cache, "a:80", GET("/vary", ""),
+                RESP_OK("Cache-Control: max-age=60\r\nVary: Accept\r\n", 1) "1"), 0,
+            "Expected the store to succeed");
+    http_cache_destroy(cache);
+
+    /* A cache that starts empty finds the responses on the disk */
+    cache = http_cache_init(1024 * 1024);
+    CACHE_NOTNULL(cache);
+    CacheObject *obj;
+    DiskHit hit;
+    char head[512];
+    cr_assert_eq(lookup(cache, "a:80", req, &obj), 0, "Expected a miss in memory");
+    cr_assert_eq(http_cache_lookup_disk(cache, "a:80", req, strlen(req), &hit, head, sizeof(head)), 0,
+            "Expected no disk hit while the disk is detached");
+    http_cache_attach_disk(cache, disk);
+    cr_assert_eq(http_cache_lookup_disk(cache, "a:80", req, strlen(req), &hit, head, sizeof(head)), 1,
+            "Expected a hit on the disk");
+    cr_assert_eq(hit.len, 5, "Expected a body of 5 bytes but got %zu", hit.len);
+
+    struct iovec iov[HTTP_CACHE_IOV];
+    char age[HTTP_CACHE_AGE_SZ];
+    int n = http_cache_disk_iov(&hit, head, iov, age);
+    cr_assert_eq(n, 2, "Expected the head and the Age header");
+    cr_assert(iov[0].iov_len + iov[1].iov_len == hit.head_len + strlen("Age: 0\r\n") &&
+            memcmp(iov[0].iov_base, resp, iov[0].iov_len) == 0 &&
+            memcmp(iov[1].iov_base, "Age: 0\r\n\r\n", iov[1].iov_len) == 0,
+            "Expected the head with an Age header");
+
+    /* Responses that vary stay in memory */
+    cr_assert_eq(http_cache_lookup_disk(cache, "a:80", GET("/vary", ""), strlen(GET("/vary", "")),
+                &hit, head, sizeof(head)), 0, "Expected a response that varies not to be on the disk");
+    const char *fresh = GET("/", "Cache-Control: no-cache\r\n");
+    cr_assert_eq(http_cache_lookup_disk(cache, "a:80", fresh, strlen(fresh), &hit, head, sizeof(head)), 0,
+            "Expected a request for a fresh response to bypass the disk");
+
+    http_cache_destroy(cache);
+    disk_cache_close(disk);
+    snprintf(file, sizeof(file), "%s.data", path);
+    unlink(file);
+    snprintf(file, sizeof(file), "%s.index", path);
+    unlink(file);
+}
+
+Test(cache_suite, cache_too_large_1) {
+    HttpCache *cache = http_cache_init(16 * 4096);
+    CACHE_NOTNULL(cache);
+
+    cr_assert_null(start(cache, "a:80", GET("/", ""),
+                RESP_OK("Cache-Control: max-age=60\r\n", 5000)), "Expected a large body not to be stored");
+
+    const char *chunked = "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+        "Transfer-Encoding: chunked\r\n\r\n";
+    CacheObject *obj = start(cache, "a:80", GET("/", ""), chunked);
+    cr_assert_not_null(obj, "Expected a chunked body to be stored");
+    char chunk[1024];
+    memset(chunk, 'x', sizeof(chunk));
+    int status = 0;
+    for(int i = 0; i < 8 && status == 0; ++i) {
+        status = http_cache_fill_append(obj, chunk, sizeof(chunk));
+    }
+    cr_assert_eq(status, -1, "Expected the object to outgrow its limit");
+    http_cache_release(obj);
+    http_cache_destroy(cache);
+}
+
+Test(cache_suite, cache_evict_1) {
+    /* 16 shards of 8 KB */
+    HttpCache *cache = http_cache_init(16 * 8192);
+    CACHE_NOTNULL(cache);
+
+    char body[1000];
+    memset(body, 'x', sizeof(body));
+    char resp[1200];
+    snprintf(resp, sizeof(resp), RESP_OK("Cache-Control: max-age=60\r\n", 1000) "%.1000s", body);
+
+    CacheObject *obj;
+    store(cache, "a:80", GET("/hot", ""), resp);
+    cr_assert_eq(lookup(cache, "a:80", GET("/hot", ""), &obj), 1, "Expected a hit");
+    http_cache_release(obj);
+
+    /* A scan of objects requested once each */
+    char req[64];
+    for(int i = 0; i < 1000; ++i) {
+        snprintf(req, sizeof(req), GET("/cold%d", ""), i);
+        cr_assert_eq(store(cache, "a:80", req, resp), 0, "Expected the response to be stored");
+    }
+
+    HttpCacheStats stats;
+    http_cache_get_stats(cache, &stats);
+    cr_assert_gt(stats.evictions, 800, "Expected evictions but got %lu", stats.evictions);
+    cr_assert_leq(stats.bytes, 16 * 8192, "Expected the budget to hold but got %lu", stats.bytes);
+    cr_assert_eq(stats.stores - stats.evictions, stats.objects, "Expected the counts to add up");
+    cr_assert_eq(lookup(cache, "a:80", GET("/hot", ""), &obj), 1, "Expected the hot object to survive the scan");
+    http_cache_release(obj);
+    http_cache_destroy(cache);
+}
+
+#define CACHE_THREADS 4
+#define CACHE_THREAD_OPS 2000
+
+static void *cache_worker(void *arg) {
+    HttpCache *cache = arg;
+    char req[64];
+    for(int i = 0; i < CACHE_THREAD_OPS; ++i) {
+        snprintf(req, sizeof(req), GET("/%d", ""), i % 300);
+        CacheObject *obj;
+        if(lookup(cache, "a:80", req, &obj) == 1) {
+            char out[512];
+            serve(obj, out, sizeof(out));
+            if(strncmp(out, "HTTP/1.1 200 OK", 15) != 0) {
+                return (void *)1;
+            }
+            http_cache_release(obj);
+        } else {
+            store(cache, "a:80", req, RESP_OK("Cache-Control: max-age=60\r\n", 2) "ok");
+        }
+    }
+    return NULL;
+}
+
+Test(cache_suite, cache_threads_1) {
+    /* Small enough that objects get evicted while other threads hold them */
+    HttpCache *cache = http_cache_init(16 * 2048);
+    CACHE_NOTNULL(cache);
+
+    pthread_t threads[CACHE_THREADS];
+    for(int i = 0; i < CACHE_THREADS; ++i) {
+        pthread_create(&threads[i], NULL, cache_worker, cache);
+    }
+    for(int i = 0; i < CACHE_THREADS; ++i) {
+        void *ret;
+        pthread_join(threads[i], &ret);
+        cr_assert_null(ret, "Expected every hit to be intact");
+    }
+
+    HttpCacheStats stats;
+    http_cache_get_stats(cache, &stats);
+    cr_assert_eq(stats.lookups, CACHE_THREADS * CACHE_THREAD_OPS, "Expected every lookup to be counted");
+    cr_assert_eq(stats.hits + stats.misses, stats.lookups, "Expected hits and misses to add up");
+    http_cache_destroy(cache);
+}
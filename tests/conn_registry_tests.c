@@ -0,0 +1,195 @@
+#include <criterion/criterion.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "conn_registry.h"
+
+#define CONN_REGISTRY_NOTNULL(registry) \
+    do { \
+        cr_assert_not_null(registry, "Expected a non-null value from registry. Memory allocation may have potentially failed.");\
+    } while(0); \
+
+Test(conn_registry_suite, conn_registry_init_1) {
+    cr_assert_null(conn_registry_init(3), "Expected a shard count that is not a power of two to be refused");
+    ConnRegistry *registry = conn_registry_init(0);
+    CONN_REGISTRY_NOTNULL(registry);
+    cr_assert_eq(conn_registry_count(registry), 0, "Expected an empty registry");
+    cr_assert_eq(conn_registry_count(NULL), -1, "Expected a count of a NULL registry to fail");
+    conn_registry_destroy(registry);
+}
+
+Test(conn_registry_suite, conn_registry_insert_1) {
+    ConnRegistry *registry = conn_registry_init(4);
+    CONN_REGISTRY_NOTNULL(registry);
+
+    ConnInfo info = { .worker = 3, .since_ms = 1234 }, got;
+    cr_assert_eq(conn_registry_insert(registry, 7, &info), 0, "Expected the insert to succeed");
+    cr_assert_eq(conn_registry_insert(registry, 7, &info), -1, "Expected a second insert of 7 to fail");
+    cr_assert_eq(conn_registry_insert(registry, -1, &info), -1, "Expected a negative fd to be refused");
+    cr_assert_eq(conn_registry_lookup(registry, 7, &got), 1, "Expected 7 to be found");
+    cr_assert_eq(got.worker, 3, "Expected worker 3 but got %u", got.worker);
+    cr_assert_eq(got.since_ms, 1234, "Expected the time it was opened");
+    cr_assert_eq(conn_registry_lookup(registry, 8, NULL), 0, "Expected 8 not to be found");
+
+    /* Far fds grow their shard */
+    cr_assert_eq(conn_registry_insert(registry, 100000, &info), 0, "Expected the insert of a far fd to succeed");
+    cr_assert_eq(conn_registry_lookup(registry, 100000, NULL), 1, "Expected the far fd to be found");
+    cr_assert_eq(conn_registry_count(registry), 2, "Expected 2 connections");
+
+    cr_assert_eq(conn_registry_remove(registry, 7), 0, "Expected the removal to succeed");
+    cr_assert_eq(conn_registry_remove(registry, 7), -1, "Expected a second removal of 7 to fail");
+    cr_assert_eq(conn_registry_remove(registry, 5000000), -1, "Expected the removal of an unknown fd to fail");
+    cr_assert_eq(conn_registry_lookup(registry, 7, NULL), 0, "Expected 7 to be gone");
+    cr_assert_eq(conn_registry_count(registry), 1, "Expected 1 connection");
+    conn_registry_destroy(registry);
+}
+
+struct visit {
+    int seen[256];
+    int calls;
+    int stop_after;
+};
+
+static int visit_fd(int fd, const ConnInfo *info, void *arg) {
+    struct visit *v = arg;
+    cr_assert_eq(info->worker, (unsigned int)fd % 3, "Expected the info of fd %d", fd);
+    v->seen[fd]++;
+    v->calls++;
+    return v->stop_after > 0 && v->calls == v->stop_after;
+}
+
+Test(conn_registry_suite, conn_registry_foreach_1) {
+    ConnRegistry *registry = conn_registry_init(8);
+    CONN_REGISTRY_NOTNULL(registry);
+
+    for(int fd = 0; fd < 256; fd += 5) {
+        ConnInfo info = { .worker = fd % 3, .since_ms = 0 };
+        conn_registry_insert(registry, fd, &info);
+    }
+    static struct visit v;
+    memset(&v, 0, sizeof(v));
+    cr_assert_eq(conn_registry_foreach(registry, visit_fd, &v), 52, "Expected 52 connections visited");
+    for(int fd = 0; fd < 256; ++fd) {
+        cr_assert_eq(v.seen[fd], fd % 5 == 0, "Expected fd %d to be visited %d times", fd, fd % 5 == 0);
+    }
+
+    /* The visitor stops the iteration */
+    memset(&v, 0, sizeof(v));
+    v.stop_after = 10;
+    cr_assert_eq(conn_registry_foreach(registry, visit_fd, &v), 10, "Expected the iteration to stop after 10");
+    conn_registry_destroy(registry);
+}
+
+#define STRESS_THREADS 8
+#define STRESS_FDS     4096
+#define STRESS_SHARED  64
+#define STRESS_OPS     200000
+
+struct stress {
+    ConnRegistry *registry;
+    unsigned int id;
+    long owned;      /* Owned fds left in the registry */
+    long inserted;   /* Successful inserts of shared fds */
+    long removed;    /* Successful removals of shared fds */
+    long errors;     /* Owned fds not found as they should be */
+};
+
+static volatile int s_stress_done;
+
+/*
+ * Every thread owns the fds equal to its id modulo the number of
+ * threads, whose state it can check, and races the others on the
+ * shared ones, above STRESS_FDS. Asserts are left to the main thread.
+ */
+static void *stress_main(void *arg) {
+    struct stress *st = arg;
+    char mine[STRESS_FDS] = { 0 };
+    unsigned int state = st->id + 1;
+    for(int i = 0; i < STRESS_OPS; ++i) {
+        state = state * 1103515245 + 12345;
+        unsigned int r = state >> 8;
+        ConnInfo info = { .worker = st->id, .since_ms = i };
+        if(r % 4 == 0) {
+            int fd = STRESS_FDS + (r >> 3) % STRESS_SHARED;
+            if(r % 8 == 0) {
+                st->inserted += conn_registry_insert(st->registry, fd, &info) == 0;
+            } else {
+                st->removed += conn_registry_remove(st->registry, fd) == 0;
+            }
+            continue;
+        }
+        int fd = (r % (STRESS_FDS / STRESS_THREADS)) * STRESS_THREADS + st->id;
+        ConnInfo got;
+        if(mine[fd]) {
+            st->errors += conn_registry_lookup(st->registry, fd, &got) != 1 ||
+                got.worker != st->id || conn_registry_remove(st->registry, fd) != 0;
+            mine[fd] = 0;
+        } else {
+            st->errors += conn_registry_lookup(st->registry, fd, NULL) != 0 ||
+                conn_registry_insert(st->registry, fd, &info) != 0;
+            mine[fd] = 1;
+        }
+    }
+    for(int fd = 0; fd < STRESS_FDS; ++fd) {
+        st->owned += mine[fd];
+    }
+    return NULL;
+}
+
+static int count_fd(int fd, const ConnInfo *info, void *arg) {
+    (void)fd;
+    (void)info;
+    (*(long *)arg)++;
+    return 0;
+}
+
+/* Goes over the registry while the other threads change it */
+static void *iterate_main(void *arg) {
+    ConnRegistry *registry = arg;
+    long passes = 0;
+    while(!s_stress_done) {
+        long n = 0;
+        long visited = conn_registry_foreach(registry, count_fd, &n);
+        if(visited != n || n > STRESS_FDS + STRESS_SHARED) {
+            return (void *)-1;
+        }
+        passes++;
+    }
+    return (void *)passes;
+}
+
+Test(conn_registry_suite, conn_registry_stress_1) {
+    ConnRegistry *registry = conn_registry_init(0);
+    CONN_REGISTRY_NOTNULL(registry);
+
+    pthread_t threads[STRESS_THREADS], iterator;
+    struct stress st[STRESS_THREADS];
+    s_stress_done = 0;
+    cr_assert_eq(pthread_create(&iterator, NULL, iterate_main, registry), 0, "pthread_create failed");
+    for(unsigned int i = 0; i < STRESS_THREADS; ++i) {
+        st[i] = (struct stress){ registry, i, 0, 0, 0, 0 };
+        cr_assert_eq(pthread_create(&threads[i], NULL, stress_main, &st[i]), 0, "pthread_create failed");
+    }
+    long owned = 0, shared = 0;
+    for(unsigned int i = 0; i < STRESS_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+        cr_assert_eq(st[i].errors, 0, "Expected thread %u to find its fds as it left them", i);
+        owned += st[i].owned;
+        shared += st[i].inserted - st[i].removed;
+    }
+    s_stress_done = 1;
+    void *passes;
+    pthread_join(iterator, &passes);
+    cr_assert_neq((long)passes, -1, "Expected every iteration to be consistent");
+
+    /* A shared fd is left when it was inserted once more than it was removed */
+    long left = 0;
+    for(int fd = STRESS_FDS; fd < STRESS_FDS + STRESS_SHARED; ++fd) {
+        left += conn_registry_lookup(registry, fd, NULL);
+    }
+    cr_assert_eq(left, shared, "Expected %ld shared fds left but got %ld", shared, left);
+    cr_assert_eq(conn_registry_count(registry), owned + shared, "Expected %ld connections but got %ld",
+            owned + shared, conn_registry_count(registry));
+    conn_registry_destroy(registry);
+}
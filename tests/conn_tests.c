@@ -1,6 +1,13 @@
 #include <criterion/criterion.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "conn.h"
+#include "test_util.h"
 
 #define CONNPOOL_NOTNULL(conn_pool) \
     do { \
@@ -13,7 +20,7 @@ Test(conn_suite, conn_init_1) {
 }
 
 Test(conn_suite, conn_insert_connection_1) {
-    ConnectionPool *conn_pool = conn_pool_init();
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_SELECT);
     CONNPOOL_NOTNULL(conn_pool);
 
     int insert_status = conn_insert_fd(conn_pool, 4); /* some fake fd */ 
@@ -21,7 +28,7 @@ Test(conn_suite, conn_insert_connection_1) {
 }
 
 Test(conn_suite, conn_insert_connection_2) {
-    ConnectionPool *conn_pool = conn_pool_init();
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_SELECT);
     CONNPOOL_NOTNULL(conn_pool);
 
     for(int i = 0; i < 1024; ++i) {
@@ -37,7 +44,7 @@ Test(conn_suite, conn_insert_connection_3) {
 }
 
 Test(conn_suite, conn_insert_connection_correct_size_1) {
-    ConnectionPool *conn_pool = conn_pool_init();
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_SELECT);
     CONNPOOL_NOTNULL(conn_pool);
     int insert_status;
 
@@ -55,7 +62,7 @@ Test(conn_suite, conn_get_fd_set_1) {
 }
 
 Test(conn_suite, conn_get_fd_set_2) {
-    ConnectionPool *conn_pool = conn_pool_init();
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_SELECT);
     CONNPOOL_NOTNULL(conn_pool);
 
     conn_insert_fd(conn_pool, 0);
@@ -80,8 +87,84 @@ Test(conn_suite, conn_get_fd_set_2) {
     cr_assert_eq(nfds, 12, "nfds was not the maximum value that was expected; Got %d but expected 12", nfds);
 }
 
+/* The highest fd in live, or -1 */
+static int live_max(const char *live, int n) {
+    for(int fd = n - 1; fd >= 0; --fd) {
+        if(live[fd]) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+Test(conn_suite, conn_get_fd_set_churn_1) {
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_SELECT);
+    CONNPOOL_NOTNULL(conn_pool);
+
+    /* Fake fds come and go at random, far more times than the pool holds */
+    char live[FD_SETSIZE] = { 0 };
+    int size = 0;
+    unsigned int state = 1;
+    fd_set rd_cpy, wr_cpy;
+    int nfds;
+    for(int i = 0; i < 200000; ++i) {
+        state = state * 1103515245 + 12345;
+        int fd = (state >> 8) % FD_SETSIZE;
+        if(live[fd]) {
+            cr_assert_eq(conn_remove_fd(conn_pool, fd), 0, "Expected the removal of %d to succeed", fd);
+            live[fd] = 0;
+            size--;
+        } else {
+            cr_assert_eq(conn_insert_fd(conn_pool, fd), 0, "Expected the insert of %d to succeed at step %d", fd, i);
+            live[fd] = 1;
+            size++;
+        }
+        cr_assert_eq(conn_copy_fd_sets(conn_pool, &rd_cpy, &wr_cpy, &nfds), 0, "Expected copy_fd to succeed");
+        cr_assert_eq(nfds, live_max(live, FD_SETSIZE) + 1, "Expected nfds %d but got %d at step %d",
+                live_max(live, FD_SETSIZE) + 1, nfds, i);
+    }
+    cr_assert_eq(conn_get_pool_size(conn_pool), size, "Expected %d fds in the pool", size);
+    conn_destroy(conn_pool);
+}
+
+Test(conn_suite, conn_get_fd_set_churn_2) {
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_SELECT);
+    CONNPOOL_NOTNULL(conn_pool);
+
+    fd_set rd_cpy, wr_cpy;
+    int nfds;
+    for(int round = 0; round < 3; ++round) {
+        /* The pool fills up, then empties from the bottom, so the max is removed last */
+        for(int fd = 0; fd < FD_SETSIZE; ++fd) {
+            cr_assert_eq(conn_insert_fd(conn_pool, fd), 0, "Expected the insert of %d to succeed", fd);
+        }
+        cr_assert_eq(conn_insert_fd(conn_pool, FD_SETSIZE), -1, "Expected an fd past FD_SETSIZE to be refused");
+        for(int fd = 0; fd < FD_SETSIZE - 1; ++fd) {
+            cr_assert_eq(conn_remove_fd(conn_pool, fd), 0, "Expected the removal of %d to succeed", fd);
+        }
+        conn_copy_fd_sets(conn_pool, &rd_cpy, &wr_cpy, &nfds);
+        cr_assert_eq(nfds, FD_SETSIZE, "Expected nfds %d but got %d", FD_SETSIZE, nfds);
+
+        /* Removing the max drops nfds to the next member down */
+        cr_assert_eq(conn_insert_fd(conn_pool, 70), 0, "Expected the insert of 70 to succeed");
+        cr_assert_eq(conn_insert_fd(conn_pool, 5), 0, "Expected the insert of 5 to succeed");
+        cr_assert_eq(conn_remove_fd(conn_pool, FD_SETSIZE - 1), 0, "Expected the removal of the max to succeed");
+        conn_copy_fd_sets(conn_pool, &rd_cpy, &wr_cpy, &nfds);
+        cr_assert_eq(nfds, 71, "Expected nfds 71 but got %d", nfds);
+        cr_assert_eq(conn_remove_fd(conn_pool, 70), 0, "Expected the removal of 70 to succeed");
+        conn_copy_fd_sets(conn_pool, &rd_cpy, &wr_cpy, &nfds);
+        cr_assert_eq(nfds, 6, "Expected nfds 6 but got %d", nfds);
+        cr_assert_eq(conn_remove_fd(conn_pool, 5), 0, "Expected the removal of 5 to succeed");
+
+        int ccfs_status = conn_copy_fd_sets(conn_pool, &rd_cpy, &wr_cpy, &nfds);
+        cr_assert_eq(ccfs_status, 0, "Expected copy_fd to succeed on an empty pool");
+        cr_assert_eq(nfds, 0, "Expected nfds 0 on an empty pool but got %d", nfds);
+    }
+    conn_destroy(conn_pool);
+}
+
 Test(conn_suite, conn_get_pool_size_1) {
-    ConnectionPool *conn_pool = conn_pool_init();
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_SELECT);
     CONNPOOL_NOTNULL(conn_pool);
 
     int pool_size;
@@ -112,7 +195,7 @@ Test(conn_suite, conn_remove_connection_1) {
 }
 
 Test(conn_suite, conn_remove_connection_2) {
-    ConnectionPool *conn_pool = conn_pool_init();
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_SELECT);
     CONNPOOL_NOTNULL(conn_pool);
 
     conn_insert_fd(conn_pool, 90);
@@ -129,3 +212,307 @@ Test(conn_suite, conn_remove_connection_3) {
 
     cr_assert_eq(remove_status, -1, "Expected call to fail, but got %d", remove_status);
 }
+
+struct handler_record {
+    int calls;
+    int fd;
+    unsigned int events;
+};
+
+static void record_handler(ConnectionPool *conn_pool, int fd, unsigned int events, void *data) {
+    struct handler_record *rec = data;
+    (void)conn_pool;
+    rec->calls++;
+    rec->fd = fd;
+    rec->events = events;
+}
+
+static void check_dispatch_read(ConnBackend backend) {
+    ConnectionPool *conn_pool = conn_pool_init_backend(backend);
+    CONNPOOL_NOTNULL(conn_pool);
+
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+
+    struct handler_record rec = { 0, -1, 0 };
+    int status = conn_register_fd(conn_pool, sv[0], CONN_EV_READ, record_handler, &rec);
+    cr_assert_eq(status, 0, "Expected register to succeed, but got status %d", status);
+    cr_assert_eq(conn_get_data(conn_pool, sv[0]), &rec, "Expected the registered state back");
+
+    int ndispatched = conn_dispatch(conn_pool, 0);
+    cr_assert_eq(ndispatched, 0, "Expected nothing to be ready, but got %d", ndispatched);
+
+    cr_assert_eq(write(sv[1], "x", 1), 1, "write failed");
+    ndispatched = conn_dispatch(conn_pool, 1000);
+    cr_assert_eq(ndispatched, 1, "Expected one ready connection, but got %d", ndispatched);
+    cr_assert_eq(rec.calls, 1, "Expected handler to be called once, but got %d", rec.calls);
+    cr_assert_eq(rec.fd, sv[0], "Expected fd %d, but got %d", sv[0], rec.fd);
+    cr_assert(rec.events & CONN_EV_READ, "Expected a read event");
+
+    status = conn_remove_fd(conn_pool, sv[0]);
+    cr_assert_eq(status, 0, "Expected remove to succeed, but got status %d", status);
+    cr_assert_null(conn_get_data(conn_pool, sv[0]), "Expected no state after removal");
+    ndispatched = conn_dispatch(conn_pool, 0);
+    cr_assert_eq(ndispatched, 0, "Expected nothing to be dispatched, but got %d", ndispatched);
+
+    conn_destroy(conn_pool);
+    close(sv[1]);
+}
+
+Test(conn_suite, conn_dispatch_select_1) {
+    check_dispatch_read(CONN_BACKEND_SELECT);
+}
+
+Test(conn_suite, conn_dispatch_epoll_1) {
+    check_dispatch_read(CONN_BACKEND_EPOLL);
+}
+
+Test(conn_suite, conn_dispatch_epoll_edge_triggered_1) {
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_EPOLL);
+    CONNPOOL_NOTNULL(conn_pool);
+
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+
+    struct handler_record rec = { 0, -1, 0 };
+    conn_register_fd(conn_pool, sv[0], CONN_EV_READ, record_handler, &rec);
+    cr_assert_eq(write(sv[1], "xy", 2), 2, "write failed");
+    conn_dispatch(conn_pool, 1000);
+    /* The data was not drained, but there was no new edge */
+    int ndispatched = conn_dispatch(conn_pool, 0);
+    cr_assert_eq(ndispatched, 0, "Expected no new edge, but got %d", ndispatched);
+    cr_assert_eq(rec.calls, 1, "Expected handler to be called once, but got %d", rec.calls);
+}
+
+Test(conn_suite, conn_modify_connection_1) {
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_EPOLL);
+    CONNPOOL_NOTNULL(conn_pool);
+
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+
+    struct handler_record rec = { 0, -1, 0 };
+    conn_register_fd(conn_pool, sv[0], CONN_EV_READ, record_handler, &rec);
+    cr_assert_eq(conn_dispatch(conn_pool, 0), 0, "Expected nothing to be ready");
+
+    int status = conn_modify_fd(conn_pool, sv[0], CONN_EV_READ | CONN_EV_WRITE);
+    cr_assert_eq(status, 0, "Expected modify to succeed, but got status %d", status);
+    cr_assert_eq(conn_dispatch(conn_pool, 1000), 1, "Expected the socket to be writable");
+    cr_assert(rec.events & CONN_EV_WRITE, "Expected a write event");
+
+    status = conn_modify_fd(conn_pool, sv[1], CONN_EV_READ);
+    cr_assert_eq(status, -1, "Expected modify of an unknown fd to fail, but got status %d", status);
+}
+
+Test(conn_suite, conn_epoll_many_fds_1) {
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_EPOLL);
+    CONNPOOL_NOTNULL(conn_pool);
+
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+
+    /* select(2) could never hold this one */
+    int high_fd = dup2(sv[0], FD_SETSIZE + 10);
+    if(high_fd == -1) {
+        return; /* RLIMIT_NOFILE too low to check */
+    }
+    int status = conn_insert_fd(conn_pool, high_fd);
+    cr_assert_eq(status, 0, "Expected insert to succeed, but got status %d", status);
+
+    ConnectionPool *sel_pool = conn_pool_init_backend(CONN_BACKEND_SELECT);
+    CONNPOOL_NOTNULL(sel_pool);
+    status = conn_insert_fd(sel_pool, high_fd);
+    cr_assert_eq(status, -1, "Expected insert to fail, but got status %d", status);
+}
+
+Test(conn_suite, conn_get_fd_set_epoll_1) {
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_EPOLL);
+    CONNPOOL_NOTNULL(conn_pool);
+
+    fd_set rd_cpy, wr_cpy;
+    int nfds;
+    int ccfs_status = conn_copy_fd_sets(conn_pool, &rd_cpy, &wr_cpy, &nfds);
+    cr_assert_eq(ccfs_status, -1, "Expected copy_fd to fail for epoll, but got %d", ccfs_status);
+}
+
+/* io_uring may be disabled (kernel.io_uring_disabled), nothing to check then */
+#define URING_POOL_OR_SKIP(conn_pool) \
+    do { \
+        conn_pool = conn_pool_init_backend(CONN_BACKEND_URING); \
+        if(conn_pool == NULL) { \
+            return; \
+        } \
+    } while(0); \
+
+struct completion_record {
+    int calls;
+    int res;
+    char buf[64];
+};
+
+static void record_completion(ConnectionPool *conn_pool, int fd, int res, const void *buf, void *data) {
+    struct completion_record *rec = data;
+    (void)conn_pool;
+    (void)fd;
+    rec->calls++;
+    rec->res = res;
+    if(buf != NULL && res > 0 && (size_t)res < sizeof(rec->buf)) {
+        memcpy(rec->buf, buf, res);
+        rec->buf[res] = '\0';
+    }
+}
+
+Test(conn_suite, conn_dispatch_uring_1) {
+    if(conn_pool_init_backend(CONN_BACKEND_URING) == NULL) {
+        return;
+    }
+    check_dispatch_read(CONN_BACKEND_URING);
+}
+
+Test(conn_suite, conn_async_unsupported_1) {
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_EPOLL);
+    CONNPOOL_NOTNULL(conn_pool);
+
+    int status = conn_async_recv(conn_pool, 0, record_completion, NULL);
+    cr_assert_eq(status, -1, "Expected async recv to fail, but got status %d", status);
+    cr_assert_eq(errno, ENOTSUP, "Expected ENOTSUP, but got %d", errno);
+}
+
+Test(conn_suite, conn_async_accept_1) {
+    ConnectionPool *conn_pool;
+    URING_POOL_OR_SKIP(conn_pool);
+
+    struct sockaddr_in addr;
+    int listenfd = listen_loopback(&addr);
+    cr_assert_neq(listenfd, -1, "Could not listen on loopback");
+
+    struct completion_record rec = { 0, 0, "" };
+    int status = conn_async_accept(conn_pool, listenfd, record_completion, &rec);
+    cr_assert_eq(status, 0, "Expected async accept to succeed, but got status %d", status);
+
+    /* One multishot accept serves every connection */
+    for(int i = 1; i <= 3; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        cr_assert_eq(connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0, "connect failed");
+        while(rec.calls < i) {
+            cr_assert_neq(conn_dispatch(conn_pool, 1000), -1, "dispatch failed");
+        }
+        cr_assert_geq(rec.res, 0, "Expected an accepted socket, but got %d", rec.res);
+        close(rec.res);
+        close(fd);
+    }
+}
+
+Test(conn_suite, conn_async_recv_1) {
+    ConnectionPool *conn_pool;
+    URING_POOL_OR_SKIP(conn_pool);
+
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+
+    struct completion_record rec = { 0, 0, "" };
+    int status = conn_async_recv(conn_pool, sv[0], record_completion, &rec);
+    cr_assert_eq(status, 0, "Expected async recv to succeed, but got status %d", status);
+
+    cr_assert_eq(write(sv[1], "first", 5), 5, "write failed");
+    while(rec.calls < 1) {
+        conn_dispatch(conn_pool, 1000);
+    }
+    cr_assert_str_eq(rec.buf, "first", "Expected 'first', but got '%s'", rec.buf);
+
+    cr_assert_eq(write(sv[1], "second", 6), 6, "write failed");
+    while(rec.calls < 2) {
+        conn_dispatch(conn_pool, 1000);
+    }
+    cr_assert_str_eq(rec.buf, "second", "Expected 'second', but got '%s'", rec.buf);
+
+    close(sv[1]);
+    while(rec.calls < 3) {
+        conn_dispatch(conn_pool, 1000);
+    }
+    cr_assert_eq(rec.res, 0, "Expected end of stream, but got %d", rec.res);
+}
+
+Test(conn_suite, conn_async_send_linked_recv_1) {
+    ConnectionPool *conn_pool;
+    URING_POOL_OR_SKIP(conn_pool);
+
+    struct sockaddr_in addr;
+    int listenfd = listen_loopback(&addr);
+    cr_assert_neq(listenfd, -1, "Could not listen on loopback");
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct completion_record conn_rec = { 0, 0, "" };
+    struct completion_record send_rec = { 0, 0, "" };
+    struct completion_record recv_rec = { 0, 0, "" };
+
+    /* connect -> send -> recv as one linked chain */
+    conn_async_connect(conn_pool, fd, (struct sockaddr *)&addr, sizeof(addr),
+            CONN_ASYNC_LINK, record_completion, &conn_rec);
+    conn_async_send(conn_pool, fd, "ping", 4, CONN_ASYNC_LINK, record_completion, &send_rec);
+    conn_async_recv(conn_pool, fd, record_completion, &recv_rec);
+
+    while(send_rec.calls < 1) {
+        cr_assert_neq(conn_dispatch(conn_pool, 1000), -1, "dispatch failed");
+    }
+    cr_assert_eq(conn_rec.res, 0, "Expected connect to succeed, but got %d", conn_rec.res);
+    cr_assert_eq(send_rec.res, 4, "Expected 4 bytes sent, but got %d", send_rec.res);
+
+    int peer = accept(listenfd, NULL, NULL);
+    char buf[8];
+    cr_assert_eq(read(peer, buf, sizeof(buf)), 4, "Expected the request on the other side");
+    cr_assert_eq(write(peer, "pong", 4), 4, "write failed");
+    while(recv_rec.calls < 1) {
+        cr_assert_neq(conn_dispatch(conn_pool, 1000), -1, "dispatch failed");
+    }
+    cr_assert_str_eq(recv_rec.buf, "pong", "Expected 'pong', but got '%s'", recv_rec.buf);
+}
+
+Test(conn_suite, conn_async_cancel_1) {
+    ConnectionPool *conn_pool;
+    URING_POOL_OR_SKIP(conn_pool);
+
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+
+    struct completion_record rec = { 0, 0, "" };
+    conn_async_recv(conn_pool, sv[0], record_completion, &rec);
+    conn_dispatch(conn_pool, 0);
+    cr_assert_eq(conn_async_cancel(conn_pool, sv[0]), 0, "Expected cancel to succeed");
+    while(rec.calls < 1) {
+        conn_dispatch(conn_pool, 1000);
+    }
+    cr_assert_eq(rec.res, -ECANCELED, "Expected -ECANCELED, but got %d", rec.res);
+}
+
+struct event_record {
+    int calls;
+    unsigned int events;
+};
+
+static void record_event(ConnectionPool *conn_pool, int fd, unsigned int events, void *data) {
+    struct event_record *rec = data;
+    (void)conn_pool;
+    (void)fd;
+    rec->calls++;
+    rec->events = events;
+}
+
+Test(conn_suite, conn_uring_poll_error_1) {
+    ConnectionPool *conn_pool;
+    URING_POOL_OR_SKIP(conn_pool);
+
+    /* The poll of a descriptor closed underneath fails, and is not put back */
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert_neq(fd, -1, "socket failed");
+    close(fd);
+    struct event_record rec = { 0, 0 };
+    cr_assert_eq(conn_register_fd(conn_pool, fd, CONN_EV_READ, record_event, &rec), 0,
+            "Expected the descriptor to be registered");
+    for(int i = 0; i < 5; ++i) {
+        cr_assert_neq(conn_dispatch(conn_pool, 20), -1, "dispatch failed");
+    }
+    cr_assert_eq(rec.calls, 1, "Expected a single call, but got %d", rec.calls);
+    cr_assert(rec.events & CONN_EV_ERROR, "Expected an error, but got events %u", rec.events);
+    conn_remove_fd(conn_pool, fd);
+}
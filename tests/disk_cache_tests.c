@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "disk_cache.h"
+
+#define DISK_CACHE_NOTNULL(cache) \
+    do { \
+        cr_assert_not_null(cache, "Expected a non-null value from cache. Memory allocation may have potentially failed.");\
+    } while(0); \
+
+#define HEAD "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n"
+#define RESP HEAD "hello"
+
+/* Every test has files of its own, removed before and after it */
+static void cache_path(char *path, size_t sz, const char *name) {
+    char file[4096];
+    snprintf(path, sz, "/tmp/disk_cache_tests.%d.%s", (int)getpid(), name);
+    snprintf(file, sizeof(file), "%s.data", path);
+    unlink(file);
+    snprintf(file, sizeof(file), "%s.index", path);
+    unlink(file);
+}
+
+static int store(DiskCache *cache, const char *key, const char *resp, size_t head_len) {
+    time_t now = time(NULL);
+    return disk_cache_store(cache, key, resp, head_len, strlen(resp), now, now + 60);
+}
+
+/* Looks key up and checks that the hit is resp */
+static void assert_hit(DiskCache *cache, const char *key, const char *resp, size_t head_len) {
+    DiskHit hit;
+    char head[256];
+    cr_assert_eq(disk_cache_lookup(cache, key, &hit, head, sizeof(head)), 1,
+            "Expected a hit for %s", key);
+    cr_assert_eq(hit.head_len, head_len, "Expected a head of %zu bytes but got %zu",
+            head_len, hit.head_len);
+    cr_assert(memcmp(head, resp, head_len) == 0, "Expected the head of %s", key);
+
+    /* The body goes out the way the proxy sends it */
+    int sv[2];
+    char body[4096];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+    cr_assert_eq(sendfile(sv[0], hit.fd, &hit.off, hit.len), (ssize_t)hit.len, "sendfile failed");
+    cr_assert_eq(read(sv[1], body, sizeof(body)), (ssize_t)hit.len, "Expected the whole body");
+    cr_assert(memcmp(body, resp + head_len, hit.len) == 0, "Expected the body of %s", key);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static int lookup(DiskCache *cache, const char *key) {
+    DiskHit hit;
+    char head[256];
+    return disk_cache_lookup(cache, key, &hit, head, sizeof(head));
+}
+
+Test(disk_cache_suite, disk_cache_store_1) {
+    char path[256];
+    cache_path(path, sizeof(path), "store");
+    DiskCache *cache = disk_cache_open(path, 1024 * 1024);
+    DISK_CACHE_NOTNULL(cache);
+
+    cr_assert_eq(lookup(cache, "origin:80/a"), 0, "Expected a miss on an empty cache");
+    cr_assert_eq(store(cache, "origin:80/a", RESP, sizeof(HEAD) - 1), 0, "Expected the store to succeed");
+    assert_hit(cache, "origin:80/a", RESP, sizeof(HEAD) - 1);
+    cr_assert_eq(lookup(cache, "origin:80/b"), 0, "Expected a miss for another key");
+
+    /* A key stored again points to the new record */
+    const char resp[] = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nbye";
+    cr_assert_eq(store(cache, "origin:80/a", resp, sizeof(resp) - 4), 0, "Expected the store to succeed");
+    assert_hit(cache, "origin:80/a", resp, sizeof(resp) - 4);
+
+    DiskCacheStats stats;
+    disk_cache_get_stats(cache, &stats);
+    cr_assert_eq(stats.hits, 2, "Expected 2 hits but got %lu", stats.hits);
+    cr_assert_eq(stats.misses, 2, "Expected 2 misses but got %lu", stats.misses);
+    cr_assert_eq(stats.stores, 2, "Expected 2 stores but got %lu", stats.stores);
+    cr_assert_eq(stats.entries, 1, "Expected 1 entry but got %lu", stats.entries);
+    cr_assert_eq(stats.bytes_saved, sizeof(RESP) - 1 + sizeof(resp) - 1,
+            "Expected %zu bytes saved but got %lu", sizeof(RESP) - 1 + sizeof(resp) - 1,
+            stats.bytes_saved);
+    disk_cache_close(cache);
+    cache_path(path, sizeof(path), "store");
+}
+
+Test(disk_cache_suite, disk_cache_expiry_1) {
+    char path[256];
+    cache_path(path, sizeof(path), "expiry");
+    DiskCache *cache = disk_cache_open(path, 1024 * 1024);
+    DISK_CACHE_NOTNULL(cache);
+
+    time_t now = time(NULL);
+    cr_assert_eq(disk_cache_store(cache, "origin:80/a", RESP, sizeof(HEAD) - 1,
+                sizeof(RESP) - 1, now - 60, now - 1), 0, "Expected the store to succeed");
+    cr_assert_eq(disk_cache_store(cache, "origin:80/b", RESP, sizeof(HEAD) - 1,
+                sizeof(RESP) - 1, now, now), -1, "Expected a response already stale to be refused");
+    cr_assert_eq(lookup(cache, "origin:80/a"), 0, "Expected a stale entry to miss");
+
+    DiskCacheStats stats;
+    disk_cache_get_stats(cache, &stats);
+    cr_assert_eq(stats.expired, 1, "Expected 1 expired entry but got %lu", stats.expired);
+    cr_assert_eq(stats.entries, 0, "Expected no entry but got %lu", stats.entries);
+    disk_cache_close(cache);
+    cache_path(path, sizeof(path), "expiry");
+}
+
+Test(disk_cache_suite, disk_cache_reopen_1) {
+    char path[256];
+    cache_path(path, sizeof(path), "reopen");
+    DiskCache *cache = disk_cache_open(path, 1024 * 1024);
+    DISK_CACHE_NOTNULL(cache);
+    cr_assert_eq(store(cache, "origin:80/a", RESP, sizeof(HEAD) - 1), 0, "Expected the store to succeed");
+    cr_assert_eq(store(cache, "origin:80/b", RESP, sizeof(HEAD) - 1), 0, "Expected the store to succeed");
+    disk_cache_close(cache);
+
+    /* The entries are there right away after a restart */
+    cache = disk_cache_open(path, 1024 * 1024);
+    DISK_CACHE_NOTNULL(cache);
+    DiskCacheStats stats;
+    disk_cache_get_stats(cache, &stats);
+    cr_assert_eq(stats.recovered, 2, "Expected 2 entries recovered but got %lu", stats.recovered);
+    cr_assert_eq(stats.dropped, 0, "Expected no entry dropped but got %lu", stats.dropped);
+    assert_hit(cache, "origin:80/a", RESP, sizeof(HEAD) - 1);
+    assert_hit(cache, "origin:80/b", RESP, sizeof(HEAD) - 1);
+
+    /* New records go after the old ones */
+    cr_assert_eq(store(cache, "origin:80/c", RESP, sizeof(HEAD) - 1), 0, "Expected the store to succeed");
+    assert_hit(cache, "origin:80/a", RESP, sizeof(HEAD) - 1);
+    disk_cache_close(cache);
+
+    /* A cache of another size starts over */
+    cache = disk_cache_open(path, 2 * 1024 * 1024);
+    DISK_CACHE_NOTNULL(cache);
+    cr_assert_eq(lookup(cache, "origin:80/a"), 0, "Expected a resized cache to start empty");
+    disk_cache_close(cache);
+    cache_path(path, sizeof(path), "reopen");
+}
+
+/* Finds where the record of key starts in the data file */
+static off_t record_offset(const char *path, const char *key) {
+    char file[4096];
+    static char data[1024 * 1024];
+    snprintf(file, sizeof(file), "%s.data", path);
+    int fd = open(file, O_RDONLY);
+    cr_assert_neq(fd, -1, "Could not open %s", file);
+    ssize_t n = read(fd, data, sizeof(data));
+    close(fd);
+    cr_assert_gt(n, 0, "Could not read %s", file);
+    char *found = memmem(data, n, key, strlen(key));
+    cr_assert_not_null(found, "Expected %s in the data file", key);
+    /* The record header is right before the key: magic, key length, position, hash, lengths */
+    return found - data - (4 + 4 + 8 + 8 + 4 + 4);
+}
+
+Test(disk_cache_suite, disk_cache_crash_1) {
+    char path[256];
+    cache_path(path, sizeof(path), "crash");
+
+    /* The process dies without closing the cache */
+    pid_t pid = fork();
+    cr_assert_neq(pid, -1, "fork failed");
+    if(pid == 0) {
+        DiskCache *cache = disk_cache_open(path, 1024 * 1024);
+        int ret = cache == NULL ||
+            store(cache, "origin:80/a", RESP, sizeof(HEAD) - 1) == -1 ||
+            store(cache, "origin:80/torn", RESP, sizeof(HEAD) - 1) == -1 ||
+            store(cache, "origin:80/c", RESP, sizeof(HEAD) - 1) == -1;
+        _exit(ret);
+    }
+    int status;
+    cr_assert_eq(waitpid(pid, &status, 0), pid, "waitpid failed");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Expected the stores to succeed");
+
+    /* One record was not written out in full */
+    char file[4096];
+    snprintf(file, sizeof(file), "%s.data", path);
+    int fd = open(file, O_WRONLY);
+    cr_assert_neq(fd, -1, "Could not open %s", file);
+    const char torn[4] = { 0 };
+    cr_assert_eq(pwrite(fd, torn, sizeof(torn), record_offset(path, "origin:80/torn")),
+            (ssize_t)sizeof(torn), "pwrite failed");
+    close(fd);
+
+    DiskCache *cache = disk_cache_open(path, 1024 * 1024);
+    DISK_CACHE_NOTNULL(cache);
+    DiskCacheStats stats;
+    disk_cache_get_stats(cache, &stats);
+    cr_assert_eq(stats.recovered, 2, "Expected 2 entries recovered but got %lu", stats.recovered);
+    cr_assert_eq(stats.dropped, 1, "Expected 1 entry dropped but got %lu", stats.dropped);
+    assert_hit(cache, "origin:80/a", RESP, sizeof(HEAD) - 1);
+    assert_hit(cache, "origin:80/c", RESP, sizeof(HEAD) - 1);
+    cr_assert_eq(lookup(cache, "origin:80/torn"), 0, "Expected the torn entry to be gone");
+    disk_cache_close(cache);
+    cache_path(path, sizeof(path), "crash");
+}
+
+Test(disk_cache_suite, disk_cache_wrap_1) {
+    char path[256];
+    cache_path(path, sizeof(path), "wrap");
+    DiskCache *cache = disk_cache_open(path, 64 * 1024);
+    DISK_CACHE_NOTNULL(cache);
+
+    static char resp[2048];
+    memset(resp, 'x', sizeof(resp) - 1);
+    memcpy(resp, HEAD, sizeof(HEAD) - 1);
+    char key[64];
+    for(int i = 0; i < 100; ++i) {
+        snprintf(key, sizeof(key), "origin:80/%d", i);
+        cr_assert_eq(store(cache, key, resp, sizeof(HEAD) - 1), 0, "Expected the store of %s to succeed", key);
+    }
+
+    /* The log wrapped around over the oldest records */
+    cr_assert_eq(lookup(cache, "origin:80/0"), 0, "Expected the oldest entry to be gone");
+    assert_hit(cache, "origin:80/99", resp, sizeof(HEAD) - 1);
+    int nhits = 0;
+    for(int i = 0; i < 100; ++i) {
+        snprintf(key, sizeof(key), "origin:80/%d", i);
+        nhits += lookup(cache, key);
+    }
+    cr_assert_lt(nhits, 32, "Expected at most 32 entries to fit but got %d", nhits);
+    DiskCacheStats stats;
+    disk_cache_get_stats(cache, &stats);
+    cr_assert_eq(stats.overwritten, (uint64_t)(100 - nhits),
+            "Expected %d entries overwritten but got %lu", 100 - nhits, stats.overwritten);
+
+    /* Too large for the log */
+    static char large[16 * 1024];
+    memset(large, 'x', sizeof(large) - 1);
+    memcpy(large, HEAD, sizeof(HEAD) - 1);
+    cr_assert_eq(store(cache, "origin:80/large", large, sizeof(HEAD) - 1), -1,
+            "Expected a response too large to be refused");
+    disk_cache_close(cache);
+    cache_path(path, sizeof(path), "wrap");
+}
@@ -0,0 +1,382 @@
+#include <criterion/criterion.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "conn.h"
+#include "dns.h"
+
+/*
+ * A nameserver stub driven by the event loop of the test. It knows
+ * the records of s_zone and answers NXDOMAIN for every other name.
+ */
+struct stub_record {
+    const char *name;
+    int qtype;
+    const char *addr;
+    unsigned int ttl;
+};
+
+static const struct stub_record s_zone[] = {
+    { "origin.test", 1, "10.0.0.1", 300 },
+    { "origin.test", 1, "10.0.0.2", 60 },
+    { "v6.test", 28, "2001:db8::1", 300 },
+    { "zero.test", 1, "10.0.0.3", 0 },
+};
+
+struct stub {
+    int fd;
+    struct sockaddr_in addr;
+    int nqueries;
+    int silent; /* Drops every query */
+    unsigned short ports[8]; /* Source ports of the first queries */
+};
+
+static size_t put_record(unsigned char *p, int qtype, unsigned int ttl,
+        const void *rdata, unsigned int rdlen) {
+    p[0] = 0xC0;
+    p[1] = 12; /* The name of the question */
+    p[2] = 0;
+    p[3] = qtype;
+    p[4] = 0;
+    p[5] = 1;
+    p[6] = ttl >> 24;
+    p[7] = ttl >> 16;
+    p[8] = ttl >> 8;
+    p[9] = ttl;
+    p[10] = rdlen >> 8;
+    p[11] = rdlen;
+    memcpy(p + 12, rdata, rdlen);
+    return 12 + rdlen;
+}
+
+static void stub_handler(ConnectionPool *conn_pool, int fd, unsigned int events, void *data) {
+    (void)conn_pool;
+    (void)events;
+    struct stub *stub = data;
+    unsigned char q[512], resp[1024];
+    struct sockaddr_storage from;
+    socklen_t fromlen = sizeof(from);
+    ssize_t n;
+
+    while((n = recvfrom(fd, q, sizeof(q), 0, (struct sockaddr *)&from, &fromlen)) > 12) {
+        if(stub->nqueries < 8) {
+            stub->ports[stub->nqueries] = ntohs(((struct sockaddr_in *)&from)->sin_port);
+        }
+        stub->nqueries++;
+        if(stub->silent) {
+            continue;
+        }
+
+        /* The question, decoded */
+        char name[256];
+        size_t pos = 12, len = 0;
+        while(q[pos] != 0) {
+            if(len > 0) {
+                name[len++] = '.';
+            }
+            memcpy(name + len, q + pos + 1, q[pos]);
+            len += q[pos];
+            pos += q[pos] + 1;
+        }
+        name[len] = '\0';
+        int qtype = q[pos + 2];
+        size_t qend = pos + 5;
+
+        memcpy(resp, q, qend);
+        resp[2] = 0x81;
+        resp[3] = 0x80;
+        memset(resp + 6, 0, 6);
+        size_t rlen = qend;
+        int known = 0, nanswers = 0;
+        for(size_t i = 0; i < sizeof(s_zone) / sizeof(s_zone[0]); ++i) {
+            if(strcmp(s_zone[i].name, name) != 0) {
+                continue;
+            }
+            known = 1;
+            if(s_zone[i].qtype != qtype) {
+                continue;
+            }
+            unsigned char rdata[16];
+            inet_pton(qtype == 1 ? AF_INET : AF_INET6, s_zone[i].addr, rdata);
+            rlen += put_record(resp + rlen, qtype, s_zone[i].ttl, rdata, qtype == 1 ? 4 : 16);
+            nanswers++;
+        }
+        resp[7] = nanswers;
+        if(nanswers == 0) {
+            /* NXDOMAIN or no data, with the SOA of the zone */
+            unsigned char soa[22] = { 0 };
+            soa[21] = 60;
+            if(!known) {
+                resp[3] |= 3;
+            }
+            rlen += put_record(resp + rlen, 6, 300, soa, sizeof(soa));
+            resp[9] = 1;
+        }
+        sendto(fd, resp, rlen, 0, (struct sockaddr *)&from, fromlen);
+        fromlen = sizeof(from);
+    }
+}
+
+static void stub_start(ConnectionPool *conn_pool, struct stub *stub) {
+    memset(stub, 0, sizeof(*stub));
+    stub->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    stub->addr.sin_family = AF_INET;
+    stub->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(stub->addr);
+    cr_assert(stub->fd != -1 && bind(stub->fd, (struct sockaddr *)&stub->addr, len) == 0 &&
+            getsockname(stub->fd, (struct sockaddr *)&stub->addr, &len) == 0,
+            "Could not start the nameserver stub");
+    cr_assert_eq(conn_register_fd(conn_pool, stub->fd, CONN_EV_READ, stub_handler, stub), 0,
+            "Could not register the nameserver stub");
+}
+
+struct lookup {
+    int ncalls;
+    int status;
+    unsigned int naddrs;
+    DnsAddr addrs[DNS_MAX_ADDRS];
+};
+
+static void on_resolved(int status, const DnsAddr *addrs, unsigned int naddrs, void *data) {
+    struct lookup *l = data;
+    l->ncalls++;
+    l->status = status;
+    l->naddrs = naddrs;
+    if(naddrs > 0) {
+        memcpy(l->addrs, addrs, naddrs * sizeof(DnsAddr));
+    }
+}
+
+static void dispatch_until_called(ConnectionPool *conn_pool, DnsResolver *resolver,
+        struct lookup *l) {
+    for(int i = 0; i < 200 && l->ncalls == 0; ++i) {
+        conn_dispatch(conn_pool, 10);
+        dns_resolver_tick(resolver);
+    }
+}
+
+static DnsResolver *new_resolver(ConnectionPool **conn_pool, DnsCache **cache,
+        struct stub *stub, unsigned int timeout_ms) {
+    *conn_pool = conn_pool_init();
+    cr_assert_not_null(*conn_pool, "Expected a connection pool");
+    *cache = dns_cache_init();
+    cr_assert_not_null(*cache, "Expected a cache");
+    stub_start(*conn_pool, stub);
+    DnsResolver *resolver = dns_resolver_init(*conn_pool, *cache,
+            (struct sockaddr *)&stub->addr, sizeof(stub->addr), timeout_ms);
+    cr_assert_not_null(resolver, "Expected a resolver");
+    return resolver;
+}
+
+static int addr_is(const DnsAddr *a, const char *s) {
+    char buf[INET6_ADDRSTRLEN];
+    inet_ntop(a->family, &a->addr, buf, sizeof(buf));
+    return strcmp(buf, s) == 0;
+}
+
+Test(dns_suite, dns_resolve_literal_1) {
+    ConnectionPool *conn_pool;
+    DnsCache *cache;
+    struct stub stub;
+    DnsResolver *resolver = new_resolver(&conn_pool, &cache, &stub, 1000);
+
+    struct lookup l = { 0 };
+    int status = dns_resolve(resolver, "192.0.2.7", on_resolved, &l);
+    cr_assert_eq(status, 0, "Expected the literal to be answered right away");
+    cr_assert_eq(l.ncalls, 1, "Expected the callback to be called once");
+    cr_assert(l.status == DNS_OK && addr_is(&l.addrs[0], "192.0.2.7"), "Unexpected address");
+
+    memset(&l, 0, sizeof(l));
+    dns_resolve(resolver, "bad..name", on_resolved, &l);
+    cr_assert_eq(l.status, DNS_ERR_FORMAT, "Expected DNS_ERR_FORMAT but got %d", l.status);
+    cr_assert_eq(stub.nqueries, 0, "Expected no query to be sent");
+}
+
+Test(dns_suite, dns_resolve_1) {
+    ConnectionPool *conn_pool;
+    DnsCache *cache;
+    struct stub stub;
+    DnsResolver *resolver = new_resolver(&conn_pool, &cache, &stub, 1000);
+
+    struct lookup l = { 0 };
+    int status = dns_resolve(resolver, "Origin.Test.", on_resolved, &l);
+    cr_assert_eq(status, 1, "Expected the lookup to be pending");
+    dispatch_until_called(conn_pool, resolver, &l);
+    cr_assert_eq(l.status, DNS_OK, "Expected DNS_OK but got %d", l.status);
+    cr_assert_eq(l.naddrs, 2, "Expected 2 addresses but got %u", l.naddrs);
+    cr_assert(addr_is(&l.addrs[0], "10.0.0.1") && addr_is(&l.addrs[1], "10.0.0.2"),
+            "Unexpected addresses");
+    cr_assert_eq(dns_get_pending(resolver), 0, "Expected no query in flight");
+
+    /* Cached, for the smallest TTL of the answer */
+    memset(&l, 0, sizeof(l));
+    status = dns_resolve(resolver, "origin.test", on_resolved, &l);
+    cr_assert_eq(status, 0, "Expected a cache hit");
+    cr_assert_eq(l.naddrs, 2, "Expected 2 addresses but got %u", l.naddrs);
+    cr_assert_eq(stub.nqueries, 1, "Expected a single query but got %d", stub.nqueries);
+}
+
+Test(dns_suite, dns_resolve_dedup_1) {
+    ConnectionPool *conn_pool;
+    DnsCache *cache;
+    struct stub stub;
+    DnsResolver *resolver = new_resolver(&conn_pool, &cache, &stub, 1000);
+
+    struct lookup l1 = { 0 }, l2 = { 0 };
+    dns_resolve(resolver, "origin.test", on_resolved, &l1);
+    dns_resolve(resolver, "origin.test", on_resolved, &l2);
+    cr_assert_eq(dns_get_pending(resolver), 1, "Expected a single query in flight");
+    dispatch_until_called(conn_pool, resolver, &l1);
+    cr_assert(l1.ncalls == 1 && l2.ncalls == 1, "Expected both lookups to be answered");
+    cr_assert_eq(l2.status, DNS_OK, "Expected DNS_OK but got %d", l2.status);
+    cr_assert_eq(stub.nqueries, 1, "Expected a single query but got %d", stub.nqueries);
+}
+
+Test(dns_suite, dns_resolve_ports_1) {
+    ConnectionPool *conn_pool;
+    DnsCache *cache;
+    struct stub stub;
+    DnsResolver *resolver = new_resolver(&conn_pool, &cache, &stub, 1000);
+
+    /* Queries in flight at once go out of sockets, so ports, of their own */
+    struct lookup l1 = { 0 }, l2 = { 0 };
+    dns_resolve(resolver, "origin.test", on_resolved, &l1);
+    dns_resolve(resolver, "v6.test", on_resolved, &l2);
+    cr_assert_eq(dns_get_pending(resolver), 2, "Expected two queries in flight");
+    dispatch_until_called(conn_pool, resolver, &l1);
+    dispatch_until_called(conn_pool, resolver, &l2);
+    cr_assert(l1.status == DNS_OK && l2.status == DNS_OK, "Expected both names to resolve");
+    cr_assert_geq(stub.nqueries, 2, "Expected the queries at the nameserver");
+    cr_assert_neq(stub.ports[0], stub.ports[1], "Expected another source port, got %u twice",
+            stub.ports[0]);
+}
+
+Test(dns_suite, dns_resolve_negative_1) {
+    ConnectionPool *conn_pool;
+    DnsCache *cache;
+    struct stub stub;
+    DnsResolver *resolver = new_resolver(&conn_pool, &cache, &stub, 1000);
+
+    struct lookup l = { 0 };
+    dns_resolve(resolver, "nowhere.test", on_resolved, &l);
+    dispatch_until_called(conn_pool, resolver, &l);
+    cr_assert_eq(l.status, DNS_ERR_NOTFOUND, "Expected DNS_ERR_NOTFOUND but got %d", l.status);
+
+    memset(&l, 0, sizeof(l));
+    cr_assert_eq(dns_resolve(resolver, "nowhere.test", on_resolved, &l), 0,
+            "Expected the negative answer to be cached");
+    cr_assert_eq(l.status, DNS_ERR_NOTFOUND, "Expected DNS_ERR_NOTFOUND but got %d", l.status);
+    cr_assert_eq(stub.nqueries, 1, "Expected a single query but got %d", stub.nqueries);
+}
+
+Test(dns_suite, dns_resolve_aaaa_1) {
+    ConnectionPool *conn_pool;
+    DnsCache *cache;
+    struct stub stub;
+    DnsResolver *resolver = new_resolver(&conn_pool, &cache, &stub, 1000);
+
+    struct lookup l = { 0 };
+    dns_resolve(resolver, "v6.test", on_resolved, &l);
+    dispatch_until_called(conn_pool, resolver, &l);
+    cr_assert_eq(l.status, DNS_OK, "Expected DNS_OK but got %d", l.status);
+    cr_assert(l.naddrs == 1 && addr_is(&l.addrs[0], "2001:db8::1"), "Expected the IPv6 address");
+    cr_assert_eq(stub.nqueries, 2, "Expected an A then an AAAA query, got %d", stub.nqueries);
+}
+
+Test(dns_suite, dns_resolve_ttl_1) {
+    ConnectionPool *conn_pool;
+    DnsCache *cache;
+    struct stub stub;
+    DnsResolver *resolver = new_resolver(&conn_pool, &cache, &stub, 1000);
+
+    struct lookup l = { 0 };
+    dns_resolve(resolver, "zero.test", on_resolved, &l);
+    dispatch_until_called(conn_pool, resolver, &l);
+    cr_assert_eq(l.status, DNS_OK, "Expected DNS_OK but got %d", l.status);
+
+    /* A TTL of 0 means the answer may not be reused */
+    memset(&l, 0, sizeof(l));
+    cr_assert_eq(dns_resolve(resolver, "zero.test", on_resolved, &l), 1,
+            "Expected the expired answer to be looked up again");
+}
+
+Test(dns_suite, dns_resolve_timeout_1) {
+    ConnectionPool *conn_pool;
+    DnsCache *cache;
+    struct stub stub;
+    DnsResolver *resolver = new_resolver(&conn_pool, &cache, &stub, 20);
+    stub.silent = 1;
+
+    struct lookup l = { 0 };
+    dns_resolve(resolver, "origin.test", on_resolved, &l);
+    dispatch_until_called(conn_pool, resolver, &l);
+    cr_assert_eq(l.status, DNS_ERR_TIMEOUT, "Expected DNS_ERR_TIMEOUT but got %d", l.status);
+    cr_assert_eq(stub.nqueries, 3, "Expected 3 tries but got %d", stub.nqueries);
+
+    DnsAddr addrs[DNS_MAX_ADDRS];
+    unsigned int naddrs;
+    cr_assert_eq(dns_cache_lookup(cache, "origin.test", addrs, &naddrs), 1,
+            "Expected timeouts not to be cached");
+}
+
+Test(dns_suite, dns_cancel_1) {
+    ConnectionPool *conn_pool;
+    DnsCache *cache;
+    struct stub stub;
+    DnsResolver *resolver = new_resolver(&conn_pool, &cache, &stub, 1000);
+
+    struct lookup l = { 0 };
+    dns_resolve(resolver, "origin.test", on_resolved, &l);
+    dns_cancel(resolver, &l);
+    for(int i = 0; i < 200 && dns_get_pending(resolver) > 0; ++i) {
+        conn_dispatch(conn_pool, 10);
+    }
+    cr_assert_eq(l.ncalls, 0, "Expected the callback not to be called");
+
+    DnsAddr addrs[DNS_MAX_ADDRS];
+    unsigned int naddrs;
+    cr_assert_eq(dns_cache_lookup(cache, "origin.test", addrs, &naddrs), DNS_OK,
+            "Expected the answer to reach the cache anyway");
+    dns_resolver_destroy(resolver);
+    dns_cache_destroy(cache);
+}
+
+#define DNS_THREADS 4
+#define DNS_THREAD_NAMES 1000
+
+static void *cache_worker(void *arg) {
+    DnsCache *cache = arg;
+    DnsAddr addr, out[DNS_MAX_ADDRS];
+    unsigned int naddrs;
+    char name[32];
+    for(int i = 0; i < DNS_THREAD_NAMES; ++i) {
+        snprintf(name, sizeof(name), "host%d.test", i);
+        addr.family = AF_INET;
+        addr.addr.v4.s_addr = htonl(i);
+        dns_cache_insert(cache, name, DNS_OK, &addr, 1, 60);
+        if(dns_cache_lookup(cache, name, out, &naddrs) != DNS_OK ||
+                naddrs != 1 || out[0].addr.v4.s_addr != htonl(i)) {
+            return (void *)1;
+        }
+    }
+    return NULL;
+}
+
+Test(dns_suite, dns_cache_threads_1) {
+    DnsCache *cache = dns_cache_init();
+    cr_assert_not_null(cache, "Expected a cache");
+
+    pthread_t threads[DNS_THREADS];
+    for(int i = 0; i < DNS_THREADS; ++i) {
+        pthread_create(&threads[i], NULL, cache_worker, cache);
+    }
+    for(int i = 0; i < DNS_THREADS; ++i) {
+        void *ret;
+        pthread_join(threads[i], &ret);
+        cr_assert_null(ret, "Expected every lookup to find what was inserted");
+    }
+    dns_cache_destroy(cache);
+}
@@ -0,0 +1,164 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "conn.h"
+#include "health.h"
+#include "test_util.h"
+#include "util.h"
+
+#define HEALTH_NOTNULL(checker) \
+    do { \
+        cr_assert_not_null(checker, "Expected a non-null value from checker. Memory allocation may have potentially failed.");\
+    } while(0); \
+
+/* Backends on loopback, the fds of those that listen go to fds, -1 for the others */
+static Balancer *loopback_balancer(const int *listening, int n, int *fds, char names[][32]) {
+    char *backends[BALANCER_MAX_BACKENDS];
+    for(int i = 0; i < n; ++i) {
+        struct sockaddr_in addr;
+        fds[i] = listen_loopback(&addr);
+        cr_assert_neq(fds[i], -1, "Could not listen on loopback");
+        if(!listening[i]) {
+            /* Nothing listens on the port anymore, connecting is refused */
+            close(fds[i]);
+            fds[i] = -1;
+        } else {
+            fcntl(fds[i], F_SETFL, O_NONBLOCK);
+        }
+        snprintf(names[i], 32, "127.0.0.1:%d", ntohs(addr.sin_port));
+        backends[i] = names[i];
+    }
+    return balancer_init(BALANCE_LEAST_OUTSTANDING, backends, n);
+}
+
+Test(health_suite, health_init_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    char *backends[] = { "127.0.0.1:1" };
+    Balancer *balancer = balancer_init(BALANCE_LEAST_OUTSTANDING, backends, 1);
+    cr_assert_not_null(balancer, "Expected a balancer");
+
+    cr_assert_null(health_init(NULL, NULL, balancer, NULL, 0, 0), "Expected no event loop to be refused");
+    cr_assert_null(health_init(conn_pool, NULL, NULL, NULL, 0, 0), "Expected no balancer to be refused");
+    cr_assert_null(health_init(conn_pool, NULL, balancer, "health", 0, 0), "Expected a path without a slash to be refused");
+    HealthChecker *checker = health_init(conn_pool, NULL, balancer, "/health", 0, 0);
+    HEALTH_NOTNULL(checker);
+    cr_assert_leq(health_timeout(checker, 1000), 0, "Expected the first probe to be due");
+    HealthStats stats;
+    cr_assert_eq(health_get_stats(checker, &stats), 0, "Expected stats");
+    cr_assert_eq(stats.probes, 0, "Expected no probe yet");
+    health_destroy(checker);
+    balancer_destroy(balancer);
+    conn_destroy(conn_pool);
+}
+
+Test(health_suite, health_connect_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    int listening[2] = { 1, 0 };
+    int fds[2];
+    char names[2][32];
+    Balancer *balancer = loopback_balancer(listening, 2, fds, names);
+    cr_assert_not_null(balancer, "Expected a balancer");
+    HealthChecker *checker = health_init(conn_pool, NULL, balancer, NULL, 20, 500);
+    HEALTH_NOTNULL(checker);
+
+    /* The backend that refuses connections goes down, the other one stays up */
+    HealthStats stats = { 0 };
+    uint64_t deadline = util_now_ms() + 5000;
+    while(stats.probes < 4 * BALANCER_PROBE_FALLS && util_now_ms() < deadline) {
+        conn_dispatch(conn_pool, health_timeout(checker, 10));
+        health_tick(checker);
+        health_get_stats(checker, &stats);
+    }
+    BackendStats up, down;
+    balancer_get_stats(balancer, 0, &up);
+    balancer_get_stats(balancer, 1, &down);
+    cr_assert_eq(up.healthy, 1, "Expected the listening backend to be up");
+    cr_assert_eq(down.healthy, 0, "Expected the refusing backend to be down");
+    cr_assert_geq(stats.failures, BALANCER_PROBE_FALLS, "Expected failed probes but got %lu", stats.failures);
+    cr_assert_eq(balancer_pick(balancer, NULL, 0), 0, "Expected the backend that is up");
+    cr_assert_eq(balancer_pick(balancer, NULL, 0), 0, "Expected only the backend that is up");
+
+    health_destroy(checker);
+    close(fds[0]);
+    balancer_destroy(balancer);
+    conn_destroy(conn_pool);
+}
+
+Test(health_suite, health_http_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    int listening[3] = { 1, 1, 1 };
+    int fds[3];
+    char names[3][32];
+    Balancer *balancer = loopback_balancer(listening, 3, fds, names);
+    cr_assert_not_null(balancer, "Expected a balancer");
+    HealthChecker *checker = health_init(conn_pool, NULL, balancer, "/health", 20, 100);
+    HEALTH_NOTNULL(checker);
+
+    /* The first answers 200, the second 503 and the third never answers */
+    static const char *answers[] = {
+        "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n",
+        "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n",
+        NULL
+    };
+    int silent[64];
+    int nsilent = 0;
+    HealthStats stats = { 0 };
+    uint64_t deadline = util_now_ms() + 5000;
+    while(stats.timeouts < BALANCER_PROBE_FALLS && util_now_ms() < deadline) {
+        conn_dispatch(conn_pool, health_timeout(checker, 10));
+        health_tick(checker);
+        health_get_stats(checker, &stats);
+        for(int i = 0; i < 3; ++i) {
+            int fd = accept(fds[i], NULL, NULL);
+            if(fd == -1) {
+                continue;
+            }
+            if(answers[i] == NULL) {
+                if(nsilent < 64) {
+                    silent[nsilent++] = fd;
+                } else {
+                    close(fd);
+                }
+                continue;
+            }
+            char req[512];
+            dispatch_until_readable(conn_pool, fd);
+            ssize_t n = read(fd, req, sizeof(req) - 1);
+            req[n > 0 ? n : 0] = '\0';
+            if(strncmp(req, "GET /health HTTP/1.1\r\n", 22) == 0 && strstr(req, names[i]) != NULL) {
+                cr_assert_eq(write(fd, answers[i], strlen(answers[i])), (ssize_t)strlen(answers[i]),
+                        "write failed");
+            }
+            close(fd);
+        }
+    }
+    BackendStats backend;
+    balancer_get_stats(balancer, 0, &backend);
+    cr_assert_eq(backend.healthy, 1, "Expected the backend answering 200 to be up");
+    balancer_get_stats(balancer, 1, &backend);
+    cr_assert_eq(backend.healthy, 0, "Expected the backend answering 503 to be down");
+    balancer_get_stats(balancer, 2, &backend);
+    cr_assert_eq(backend.healthy, 0, "Expected the silent backend to be down");
+    cr_assert_geq(stats.timeouts, BALANCER_PROBE_FALLS, "Expected probes to time out but got %lu",
+            stats.timeouts);
+
+    health_destroy(checker);
+    cr_assert_eq(conn_get_pool_size(conn_pool), 0, "Expected the probes to leave the pool");
+    for(int i = 0; i < nsilent; ++i) {
+        close(silent[i]);
+    }
+    for(int i = 0; i < 3; ++i) {
+        close(fds[i]);
+    }
+    balancer_destroy(balancer);
+    conn_destroy(conn_pool);
+}
@@ -0,0 +1,205 @@
+#include <criterion/criterion.h>
+#include <string.h>
+
+#include "http.h"
+
+/* Parses a whole head at once */
+static int parse(HttpParser *p, HttpKind kind, const char *msg) {
+    http_parser_init(p, kind, 0);
+    return http_parse_head(p, msg, strlen(msg));
+}
+
+/* Feeds the head one more byte per call, as the slowest client would */
+static int parse_bytewise(HttpParser *p, HttpKind kind, const char *msg) {
+    http_parser_init(p, kind, 0);
+    size_t len = strlen(msg);
+    int status = HTTP_PARSE_AGAIN;
+    for(size_t i = 1; i <= len && status == HTTP_PARSE_AGAIN; ++i) {
+        status = http_parse_head(p, msg, i);
+    }
+    return status;
+}
+
+#define SLICE_EQ(buf, slice, s) \
+    cr_assert(http_slice_eq(buf, slice, s), "Expected %s, got %.*s", s, \
+            (int)(slice).len, (buf) + (slice).off)
+
+Test(http_suite, http_request_1) {
+    const char req[] = "GET /index.html?q=1 HTTP/1.1\r\nHost: example.com\r\n"
+        "Accept:  */*  \r\n\r\n";
+    HttpParser p;
+
+    int status = parse(&p, HTTP_REQUEST, req);
+    cr_assert_eq(status, HTTP_PARSE_DONE, "Expected HTTP_PARSE_DONE but got %d", status);
+    SLICE_EQ(req, p.method, "GET");
+    SLICE_EQ(req, p.target, "/index.html?q=1");
+    cr_assert_eq(p.version_major, 1, "Expected HTTP/1.x");
+    cr_assert_eq(p.version_minor, 1, "Expected HTTP/1.1");
+    cr_assert_eq(p.nheaders, 2, "Expected 2 headers but got %u", p.nheaders);
+    SLICE_EQ(req, p.headers[0].name, "Host");
+    SLICE_EQ(req, p.headers[0].value, "example.com");
+    SLICE_EQ(req, p.headers[1].value, "*/*");
+    cr_assert_eq(p.head_len, sizeof(req) - 1, "Expected the whole buffer to be the head");
+    cr_assert_eq(p.body, HTTP_BODY_NONE, "Expected no body");
+    cr_assert_eq(p.keep_alive, 1, "Expected HTTP/1.1 to keep the connection alive");
+}
+
+Test(http_suite, http_request_partial_1) {
+    const char req[] = "\r\nPOST http://a/b HTTP/1.0\r\nContent-Length: 11\r\n"
+        "Connection: Keep-Alive\r\n\r\nhello world";
+    HttpParser p;
+
+    int status = parse_bytewise(&p, HTTP_REQUEST, req);
+    cr_assert_eq(status, HTTP_PARSE_DONE, "Expected HTTP_PARSE_DONE but got %d", status);
+    SLICE_EQ(req, p.method, "POST");
+    SLICE_EQ(req, p.target, "http://a/b");
+    cr_assert_eq(p.version_minor, 0, "Expected HTTP/1.0");
+    cr_assert_eq(p.body, HTTP_BODY_LENGTH, "Expected a Content-Length body");
+    cr_assert_eq(p.content_length, 11, "Expected 11 but got %ld", (long)p.content_length);
+    cr_assert_eq(p.keep_alive, 1, "Expected Connection: Keep-Alive to be honoured");
+    cr_assert_str_eq(req + p.head_len, "hello world", "Expected the body after the head");
+
+    size_t consumed;
+    status = http_parse_body(&p, req + p.head_len, 5, &consumed);
+    cr_assert_eq(status, HTTP_PARSE_AGAIN, "Expected HTTP_PARSE_AGAIN but got %d", status);
+    cr_assert_eq(http_body_remaining(&p), 6, "Expected 6 bytes left");
+    status = http_parse_body(&p, "worldGET /", 10, &consumed);
+    cr_assert_eq(status, HTTP_PARSE_DONE, "Expected HTTP_PARSE_DONE but got %d", status);
+    cr_assert_eq(consumed, 6, "Expected the body to end after 6 bytes, got %zu", consumed);
+}
+
+Test(http_suite, http_request_keep_alive_1) {
+    HttpParser p;
+
+    parse(&p, HTTP_REQUEST, "GET / HTTP/1.0\r\n\r\n");
+    cr_assert_eq(p.keep_alive, 0, "Expected HTTP/1.0 to close by default");
+    parse(&p, HTTP_REQUEST, "GET / HTTP/1.1\r\nConnection: Upgrade, close\r\n\r\n");
+    cr_assert_eq(p.keep_alive, 0, "Expected Connection: close to be honoured");
+    cr_assert_eq(p.upgrade, 1, "Expected the upgrade token to be seen");
+}
+
+Test(http_suite, http_request_errors_1) {
+    HttpParser p;
+    const char *bad[] = {
+        "GET  / HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1\n\n",
+        "GET / HTTP/1.1\r\nBad Name: x\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost: a\r\n folded\r\n\r\n",
+        "GET / HTTQ/1.1\r\n\r\n",
+        "G(T / HTTP/1.1\r\n\r\n",
+    };
+    for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+        int status = parse_bytewise(&p, HTTP_REQUEST, bad[i]);
+        cr_assert_eq(status, HTTP_PARSE_ERROR, "Expected an error for request %zu", i);
+        cr_assert_eq(p.error, HTTP_ERR_SYNTAX, "Expected a syntax error for request %zu", i);
+    }
+
+    cr_assert_eq(parse(&p, HTTP_REQUEST, "GET / HTTP/2.0\r\n\r\n"), HTTP_PARSE_ERROR, "Expected an error");
+    cr_assert_eq(p.error, HTTP_ERR_VERSION, "Expected a version error");
+    cr_assert_eq(parse(&p, HTTP_REQUEST, "POST / HTTP/1.1\r\nContent-Length: 1\r\n"
+                "Content-Length: 2\r\n\r\n"), HTTP_PARSE_ERROR, "Expected an error");
+    cr_assert_eq(p.error, HTTP_ERR_CONTENT_LENGTH, "Expected a Content-Length error");
+    cr_assert_eq(parse(&p, HTTP_REQUEST, "POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n"),
+            HTTP_PARSE_ERROR, "Expected an error");
+    cr_assert_eq(parse(&p, HTTP_REQUEST, "POST / HTTP/1.1\r\nContent-Length: 3\r\n"
+                "Transfer-Encoding: chunked\r\n\r\n"), HTTP_PARSE_ERROR, "Expected an error");
+    cr_assert_eq(p.error, HTTP_ERR_FRAMING, "Expected a framing error");
+}
+
+Test(http_suite, http_request_too_many_headers_1) {
+    char req[4096];
+    size_t len = sprintf(req, "GET / HTTP/1.1\r\n");
+    for(int i = 0; i <= HTTP_MAX_HEADERS; ++i) {
+        len += sprintf(req + len, "X-%d: %d\r\n", i, i);
+    }
+    sprintf(req + len, "\r\n");
+
+    HttpParser p;
+    int status = parse(&p, HTTP_REQUEST, req);
+    cr_assert_eq(status, HTTP_PARSE_ERROR, "Expected HTTP_PARSE_ERROR but got %d", status);
+    cr_assert_eq(p.error, HTTP_ERR_TOO_MANY_HEADERS, "Expected too many headers");
+}
+
+Test(http_suite, http_response_1) {
+    const char resp[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    HttpParser p;
+
+    int status = parse_bytewise(&p, HTTP_RESPONSE, resp);
+    cr_assert_eq(status, HTTP_PARSE_DONE, "Expected HTTP_PARSE_DONE but got %d", status);
+    cr_assert_eq(p.status, 404, "Expected 404 but got %d", p.status);
+    SLICE_EQ(resp, p.reason, "Not Found");
+    cr_assert_eq(p.body, HTTP_BODY_NONE, "Expected no body");
+    cr_assert_eq(p.keep_alive, 1, "Expected the connection to stay open");
+
+    parse(&p, HTTP_RESPONSE, "HTTP/1.1 200 OK\r\n\r\n");
+    cr_assert_eq(p.body, HTTP_BODY_UNTIL_CLOSE, "Expected the body to last until close");
+    cr_assert_eq(p.keep_alive, 0, "Expected the connection to close");
+    cr_assert_eq(http_body_remaining(&p), UINT64_MAX, "Expected an unbounded body");
+
+    parse(&p, HTTP_RESPONSE, "HTTP/1.1 304 Not Modified\r\nContent-Length: 10\r\n\r\n");
+    cr_assert_eq(p.body, HTTP_BODY_NONE, "Expected a 304 to have no body");
+
+    http_parser_init(&p, HTTP_RESPONSE, HTTP_PARSER_NO_BODY);
+    const char head_resp[] = "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\n";
+    http_parse_head(&p, head_resp, sizeof(head_resp) - 1);
+    cr_assert_eq(p.body, HTTP_BODY_NONE, "Expected a response to HEAD to have no body");
+}
+
+Test(http_suite, http_chunked_1) {
+    const char resp[] = "HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip, chunked\r\n\r\n";
+    const char body[] = "5\r\nhello\r\n1A;ext=1\r\nabcdefghijklmnopqrstuvwxyz\r\n"
+        "0\r\nTrailer: x\r\n\r\nHTTP/1.1";
+    size_t body_len = sizeof(body) - 1 - strlen("HTTP/1.1");
+    HttpParser p;
+
+    int status = parse(&p, HTTP_RESPONSE, resp);
+    cr_assert_eq(status, HTTP_PARSE_DONE, "Expected HTTP_PARSE_DONE but got %d", status);
+    cr_assert_eq(p.body, HTTP_BODY_CHUNKED, "Expected a chunked body");
+
+    /* One byte at a time, the end has to be found at the same spot */
+    size_t consumed, total = 0;
+    status = HTTP_PARSE_AGAIN;
+    while(status == HTTP_PARSE_AGAIN && total < sizeof(body) - 1) {
+        status = http_parse_body(&p, body + total, 1, &consumed);
+        total += consumed;
+    }
+    cr_assert_eq(status, HTTP_PARSE_DONE, "Expected HTTP_PARSE_DONE but got %d", status);
+    cr_assert_eq(total, body_len, "Expected %zu bytes of body, got %zu", body_len, total);
+
+    parse(&p, HTTP_RESPONSE, resp);
+    status = http_parse_body(&p, body, 8, &consumed);
+    cr_assert_eq(status, HTTP_PARSE_AGAIN, "Expected HTTP_PARSE_AGAIN but got %d", status);
+    cr_assert_eq(http_body_remaining(&p), 0, "Expected the chunk to be over");
+    status = http_parse_body(&p, body + 8, sizeof(body) - 9, &consumed);
+    cr_assert_eq(status, HTTP_PARSE_DONE, "Expected HTTP_PARSE_DONE but got %d", status);
+    cr_assert_eq(consumed + 8, body_len, "Expected the body to end before the next message");
+}
+
+Test(http_suite, http_chunked_errors_1) {
+    HttpParser p;
+    size_t consumed;
+
+    parse(&p, HTTP_REQUEST, "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n");
+    cr_assert_eq(http_parse_body(&p, "5\r\nhelloX", 9, &consumed), HTTP_PARSE_ERROR,
+            "Expected a missing CRLF after the data to fail");
+    parse(&p, HTTP_REQUEST, "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n");
+    cr_assert_eq(http_parse_body(&p, "\r\n", 2, &consumed), HTTP_PARSE_ERROR,
+            "Expected an empty chunk size to fail");
+    parse(&p, HTTP_REQUEST, "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n");
+    cr_assert_eq(http_parse_body(&p, "fffffffffffffffff\r\n", 19, &consumed), HTTP_PARSE_ERROR,
+            "Expected an overflowing chunk size to fail");
+}
+
+Test(http_suite, http_find_header_1) {
+    const char req[] = "GET / HTTP/1.1\r\nhost: a\r\nX-Empty:\r\n\r\n";
+    HttpParser p;
+    parse(&p, HTTP_REQUEST, req);
+
+    const HttpHeader *h = http_find_header(&p, req, "Host");
+    cr_assert_not_null(h, "Expected a Host header");
+    SLICE_EQ(req, h->value, "a");
+    h = http_find_header(&p, req, "X-Empty");
+    cr_assert_not_null(h, "Expected an X-Empty header");
+    cr_assert_eq(h->value.len, 0, "Expected an empty value");
+    cr_assert_null(http_find_header(&p, req, "Accept"), "Expected no Accept header");
+}
@@ -0,0 +1,203 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+#define METRICS_NOTNULL(metrics) \
+    do { \
+        cr_assert_not_null(metrics, "Expected a non-null value from metrics. Memory allocation may have potentially failed.");\
+    } while(0); \
+
+#define METRICS_WRITES 200000
+
+Test(metrics_suite, metrics_bucket_1) {
+    /* Small values have a bucket each */
+    for(uint64_t us = 0; us < 64; ++us) {
+        cr_assert_eq(metrics_bucket(us), us, "Expected %lu in a bucket of its own", us);
+    }
+    /* Every value falls in a bucket that counts it, within 1/32 of it */
+    unsigned int last = 0;
+    for(uint64_t us = 1; us < ((uint64_t)1 << 40); us += us / 7 + 1) {
+        unsigned int bucket = metrics_bucket(us);
+        cr_assert_lt(bucket, METRICS_BUCKETS, "Expected a bucket below %d but got %u",
+                METRICS_BUCKETS, bucket);
+        cr_assert_geq(bucket, last, "Expected the buckets to grow with the values");
+        last = bucket;
+        if(us >> METRICS_MAX_BITS) {
+            cr_assert_eq(bucket, METRICS_BUCKETS - 1, "Expected %lu to be clamped", us);
+            continue;
+        }
+        uint64_t max = metrics_bucket_max(bucket);
+        uint64_t min = bucket > 0 ? metrics_bucket_max(bucket - 1) + 1 : 0;
+        cr_assert(min <= us && us <= max, "Expected %lu within [%lu, %lu]", us, min, max);
+        cr_assert_leq(max - min, us / 32, "Expected the bucket of %lu to be narrow", us);
+    }
+}
+
+Test(metrics_suite, metrics_percentile_1) {
+    Metrics *metrics = metrics_init();
+    METRICS_NOTNULL(metrics);
+    cr_assert_eq(metrics_percentile(metrics, METRIC_REQUEST_TIME, 0.5), 0,
+            "Expected 0 for an empty histogram");
+
+    for(uint64_t us = 1; us <= 10000; ++us) {
+        metrics_observe(metrics, METRIC_REQUEST_TIME, us);
+    }
+    uint64_t p50 = metrics_percentile(metrics, METRIC_REQUEST_TIME, 0.5);
+    uint64_t p99 = metrics_percentile(metrics, METRIC_REQUEST_TIME, 0.99);
+    uint64_t max = metrics_percentile(metrics, METRIC_REQUEST_TIME, 1);
+    cr_assert(p50 >= 5000 && p50 <= 5000 + 5000 / 32, "Expected p50 near 5000 but got %lu", p50);
+    cr_assert(p99 >= 9900 && p99 <= 9900 + 9900 / 32, "Expected p99 near 9900 but got %lu", p99);
+    cr_assert(max >= 10000 && max <= 10000 + 10000 / 32, "Expected the max near 10000 but got %lu", max);
+    cr_assert_eq(metrics_percentile(metrics, METRIC_UPSTREAM_CONNECT, 0.5), 0,
+            "Expected the other histograms to stay empty");
+    metrics_destroy(metrics);
+}
+
+static void *write_metrics(void *arg) {
+    Metrics *metrics = arg;
+    for(int i = 0; i < METRICS_WRITES; ++i) {
+        metrics_add(metrics, METRIC_REQUESTS, 1);
+        metrics_observe(metrics, METRIC_TIME_TO_FIRST_BYTE, 100);
+    }
+    return NULL;
+}
+
+Test(metrics_suite, metrics_merge_1) {
+    Metrics *worker = metrics_init();
+    METRICS_NOTNULL(worker);
+    cr_assert_eq(metrics_merge(NULL, worker), -1, "Expected a NULL destination to be refused");
+
+    /* Snapshots taken while the owner writes never go backwards */
+    pthread_t thread;
+    cr_assert_eq(pthread_create(&thread, NULL, write_metrics, worker), 0, "pthread_create failed");
+    uint64_t last = 0;
+    for(int i = 0; i < 50; ++i) {
+        Metrics *snap = metrics_init();
+        METRICS_NOTNULL(snap);
+        metrics_merge(snap, worker);
+        uint64_t requests = metrics_get(snap, METRIC_REQUESTS);
+        cr_assert_geq(requests, last, "Expected %lu requests at least but got %lu", last, requests);
+        cr_assert_leq(requests, METRICS_WRITES, "Expected at most %d requests", METRICS_WRITES);
+        last = requests;
+        metrics_destroy(snap);
+    }
+    pthread_join(thread, NULL);
+
+    /* Two workers add up */
+    Metrics *other = metrics_init();
+    METRICS_NOTNULL(other);
+    metrics_add(other, METRIC_REQUESTS, 5);
+    metrics_observe(other, METRIC_TIME_TO_FIRST_BYTE, 1000000);
+    Metrics *all = metrics_init();
+    METRICS_NOTNULL(all);
+    cr_assert_eq(metrics_merge(all, worker), 0, "Expected the merge to succeed");
+    cr_assert_eq(metrics_merge(all, other), 0, "Expected the merge to succeed");
+    cr_assert_eq(metrics_get(all, METRIC_REQUESTS), METRICS_WRITES + 5,
+            "Expected %d requests", METRICS_WRITES + 5);
+    cr_assert_eq(metrics_percentile(all, METRIC_TIME_TO_FIRST_BYTE, 0.5),
+            metrics_bucket_max(metrics_bucket(100)), "Expected the median of both workers at 100");
+    uint64_t max = metrics_percentile(all, METRIC_TIME_TO_FIRST_BYTE, 1);
+    cr_assert_geq(max, 1000000, "Expected the max from the other worker but got %lu", max);
+    metrics_destroy(all);
+    metrics_destroy(other);
+    metrics_destroy(worker);
+}
+
+Test(metrics_suite, metrics_format_1) {
+    Metrics *metrics = metrics_init();
+    METRICS_NOTNULL(metrics);
+    metrics_add(metrics, METRIC_CONNS_OPENED, 3);
+    metrics_add(metrics, METRIC_CONNS_CLOSED, 1);
+    metrics_add(metrics, METRIC_ERR_BAD_GATEWAY, 2);
+    metrics_observe(metrics, METRIC_UPSTREAM_CONNECT, 50);
+    metrics_observe(metrics, METRIC_UPSTREAM_CONNECT, 3000);
+    metrics_observe(metrics, METRIC_UPSTREAM_CONNECT, 20000000);
+
+    char *text = NULL;
+    size_t len;
+    FILE *out = open_memstream(&text, &len);
+    cr_assert_not_null(out, "open_memstream failed");
+    cr_assert_eq(metrics_format(metrics, out), 0, "Expected the metrics to be written");
+    fclose(out);
+
+    cr_assert_not_null(strstr(text, "\nproxy_connections_active 2\n"), "Expected 2 active connections");
+    cr_assert_not_null(strstr(text, "\nproxy_errors_total{kind=\"bad_gateway\"} 2\n"),
+            "Expected 2 bad gateways");
+    cr_assert_not_null(strstr(text, "# TYPE proxy_upstream_connect_seconds histogram\n"),
+            "Expected the type of the histogram");
+    /* The buckets are cumulative */
+    cr_assert_not_null(strstr(text, "proxy_upstream_connect_seconds_bucket{le=\"0.0001\"} 1\n"),
+            "Expected 1 connect below 100 us");
+    cr_assert_not_null(strstr(text, "proxy_upstream_connect_seconds_bucket{le=\"0.005\"} 2\n"),
+            "Expected 2 connects below 5 ms");
+    cr_assert_not_null(strstr(text, "proxy_upstream_connect_seconds_bucket{le=\"10\"} 2\n"),
+            "Expected 2 connects below 10 s");
+    cr_assert_not_null(strstr(text, "proxy_upstream_connect_seconds_bucket{le=\"+Inf\"} 3\n"),
+            "Expected 3 connects in all");
+    cr_assert_not_null(strstr(text, "proxy_upstream_connect_seconds_count 3\n"),
+            "Expected a count of 3");
+    cr_assert_not_null(strstr(text, "proxy_upstream_connect_seconds_sum 20.003050\n"),
+            "Expected the sum in seconds");
+    free(text);
+    metrics_destroy(metrics);
+}
+
+Test(metrics_suite, metrics_format_backends_1) {
+    Metrics *worker = metrics_init();
+    METRICS_NOTNULL(worker);
+    Metrics *other = metrics_init();
+    METRICS_NOTNULL(other);
+    Metrics *all = metrics_init();
+    METRICS_NOTNULL(all);
+
+    /* What a worker copies from its modules replaces what it copied before */
+    metrics_set(worker, METRIC_POOL_HITS, 7);
+    metrics_set(worker, METRIC_POOL_HITS, 9);
+    metrics_set(worker, METRIC_ADMISSION_RESET_CLIENT, 4);
+    metrics_set(other, METRIC_POOL_HITS, 1);
+    metrics_set_backend(worker, 1, METRIC_BACKEND_REQUESTS, 10);
+    metrics_set_backend(other, 1, METRIC_BACKEND_REQUESTS, 5);
+    metrics_set_backend(other, 1, METRIC_BACKEND_OPEN, 1);
+    metrics_set_backend(worker, BALANCER_MAX_BACKENDS, METRIC_BACKEND_REQUESTS, 1);
+    cr_assert_eq(metrics_get(worker, METRIC_POOL_HITS), 9, "Expected the last value set");
+    cr_assert_eq(metrics_get_backend(worker, BALANCER_MAX_BACKENDS, METRIC_BACKEND_REQUESTS), 0,
+            "Expected no backend past the last");
+
+    /* Merged, the backends of every worker add up */
+    metrics_merge(all, worker);
+    metrics_merge(all, other);
+    cr_assert_eq(metrics_get(all, METRIC_POOL_HITS), 10, "Expected the hits of both workers");
+    cr_assert_eq(metrics_get_backend(all, 1, METRIC_BACKEND_REQUESTS), 15,
+            "Expected the requests of both workers");
+    cr_assert_eq(metrics_get_backend(all, 1, METRIC_BACKEND_OPEN), 1,
+            "Expected one worker with the breaker open");
+
+    char *names[] = { "127.0.0.1:8081", "[::1]:8082" };
+    char *text = NULL;
+    size_t len;
+    FILE *out = open_memstream(&text, &len);
+    cr_assert_not_null(out, "open_memstream failed");
+    cr_assert_eq(metrics_format(all, out), 0, "Expected the metrics to be written");
+    cr_assert_eq(metrics_format_backends(all, names, 2, out), 0, "Expected the backends to be written");
+    cr_assert_eq(metrics_format_backends(all, names, BALANCER_MAX_BACKENDS + 1, out), -1,
+            "Expected too many backends to be refused");
+    fclose(out);
+
+    cr_assert_not_null(strstr(text, "\nproxy_upstream_pool_hits_total 10\n"), "Expected 10 pool hits");
+    cr_assert_not_null(strstr(text, "\nproxy_admission_reset_total{reason=\"client_rate\"} 4\n"),
+            "Expected 4 connections over their client rate");
+    cr_assert_not_null(strstr(text, "# TYPE proxy_upstream_pool_idle gauge\n"),
+            "Expected the idle connections as a gauge");
+    cr_assert_not_null(strstr(text, "\nproxy_backend_requests_total{backend=\"[::1]:8082\"} 15\n"),
+            "Expected 15 requests of the second backend");
+    cr_assert_not_null(strstr(text, "\nproxy_backend_breakers_open{backend=\"127.0.0.1:8081\"} 0\n"),
+            "Expected no breaker of the first backend open");
+    free(text);
+    metrics_destroy(all);
+    metrics_destroy(other);
+    metrics_destroy(worker);
+}
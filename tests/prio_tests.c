@@ -1,4 +1,6 @@
 #include <criterion/criterion.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "prio.h"
 
@@ -141,3 +143,147 @@ Test(conn_suite, prio_remove_insert_1) {
     cr_assert_eq(status, 0, "Expected 0 but got %d", val);
     cr_assert_eq(val, 123213129, "Expected 123213129 but got %d", val);
 }
+
+/* Sorts the reference into descending order */
+static int cmp_desc(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x < y) - (x > y);
+}
+
+Test(conn_suite, prio_churn_1) {
+    PrioQueue *pq = prio_init();
+    PRIOQUEUE_NOTNULL(pq);
+
+    /* Inserts and removals at random, checked against a sorted copy */
+    static int ref[1024];
+    int n = 0;
+    unsigned int state = 1;
+    int val;
+    for(int i = 0; i < 100000; ++i) {
+        state = state * 1103515245 + 12345;
+        unsigned int r = state >> 8;
+        if(n < 1024 && (n == 0 || r % 3 != 0)) {
+            int v = (int)(r % 5000);
+            cr_assert_eq(prio_insert(pq, v), 0, "Expected the insert of %d to succeed with %d queued", v, n);
+            ref[n++] = v;
+            qsort(ref, n, sizeof(int), cmp_desc);
+        } else {
+            cr_assert_eq(prio_remove_max(pq, &val), 0, "Expected a removal to succeed with %d queued", n);
+            cr_assert_eq(val, ref[0], "Expected %d but got %d at step %d", ref[0], val, i);
+            memmove(ref, ref + 1, --n * sizeof(int));
+        }
+        if(n > 0) {
+            cr_assert_eq(prio_peek_max(pq, &val), 0, "Expected a peek to succeed");
+            cr_assert_eq(val, ref[0], "Expected a max of %d but got %d", ref[0], val);
+        } else {
+            cr_assert_eq(prio_peek_max(pq, &val), -1, "Expected an empty queue");
+        }
+    }
+    prio_destroy(pq);
+}
+
+Test(conn_suite, prio_churn_2) {
+    PrioQueue *pq = prio_init();
+    PRIOQUEUE_NOTNULL(pq);
+
+    /* A drained queue has its whole capacity back */
+    int val;
+    for(int round = 0; round < 5; ++round) {
+        int n = 0;
+        while(prio_insert(pq, (n * 7919) % 1024) == 0) {
+            n++;
+        }
+        cr_assert_eq(n, 1024, "Expected room for 1024 values in round %d but got %d", round, n);
+        int last = 1024;
+        for(int i = 0; i < n; ++i) {
+            cr_assert_eq(prio_remove_max(pq, &val), 0, "Expected a removal to succeed");
+            cr_assert_leq(val, last, "Expected values in descending order");
+            last = val;
+        }
+        cr_assert_eq(prio_remove_max(pq, &val), -1, "Expected the queue to be drained");
+    }
+    prio_destroy(pq);
+}
+
+Test(conn_suite, prio_index_1) {
+    cr_assert_null(prio_index_init(0), "Expected a queue without keys to be refused");
+    PrioIndex *pi = prio_index_init(8);
+    PRIOQUEUE_NOTNULL(pi);
+
+    unsigned int key;
+    int64_t prio;
+    cr_assert_eq(prio_index_peek_min(pi, &key, &prio), -1, "Expected an empty queue");
+    cr_assert_eq(prio_index_set(pi, 8, 0), -1, "Expected a key past the capacity to be refused");
+    cr_assert_eq(prio_index_remove(pi, 3), -1, "Expected a key not queued to be refused");
+
+    for(unsigned int k = 0; k < 8; ++k) {
+        cr_assert_eq(prio_index_set(pi, k, 10 * (8 - k)), 0, "Expected key %u to be set", k);
+    }
+    cr_assert_eq(prio_index_len(pi), 8, "Expected 8 keys");
+    prio_index_peek_min(pi, &key, &prio);
+    cr_assert_eq(key, 7, "Expected key 7 first but got %u", key);
+
+    /* Updates move a key whichever way its priority went */
+    prio_index_set(pi, 7, 100);
+    prio_index_peek_min(pi, &key, &prio);
+    cr_assert_eq(key, 6, "Expected key 6 first once 7 went up but got %u", key);
+    prio_index_set(pi, 0, -1);
+    prio_index_peek_min(pi, &key, &prio);
+    cr_assert_eq(key, 0, "Expected key 0 first once it went down but got %u", key);
+    cr_assert_eq(prio, -1, "Expected its priority of -1 but got %ld", prio);
+    cr_assert_eq(prio_index_get(pi, 7, &prio), 0, "Expected key 7 to be queued");
+    cr_assert_eq(prio, 100, "Expected a priority of 100 but got %ld", prio);
+
+    cr_assert_eq(prio_index_remove(pi, 0), 0, "Expected key 0 to be removed");
+    cr_assert_eq(prio_index_get(pi, 0, &prio), -1, "Expected key 0 to be gone");
+    prio_index_peek_min(pi, &key, &prio);
+    cr_assert_eq(key, 6, "Expected key 6 first again but got %u", key);
+    cr_assert_eq(prio_index_len(pi), 7, "Expected 7 keys");
+    prio_index_destroy(pi);
+}
+
+Test(conn_suite, prio_index_churn_1) {
+    PrioIndex *pi = prio_index_init(64);
+    PRIOQUEUE_NOTNULL(pi);
+
+    /* Sets and removals at random, checked against the priorities kept aside */
+    int64_t ref[64];
+    int queued[64] = { 0 };
+    unsigned int state = 1;
+    for(int i = 0; i < 100000; ++i) {
+        state = state * 1103515245 + 12345;
+        unsigned int r = state >> 8;
+        unsigned int k = r % 64;
+        if(r % 5 == 0) {
+            cr_assert_eq(prio_index_remove(pi, k), queued[k] ? 0 : -1,
+                    "Expected the removal of key %u to %s", k, queued[k] ? "succeed" : "fail");
+            queued[k] = 0;
+        } else {
+            ref[k] = (int64_t)(r >> 6) % 1000 - 500;
+            cr_assert_eq(prio_index_set(pi, k, ref[k]), 0, "Expected key %u to be set", k);
+            queued[k] = 1;
+        }
+        unsigned int n = 0;
+        int64_t min = INT64_MAX;
+        for(unsigned int j = 0; j < 64; ++j) {
+            if(queued[j]) {
+                n++;
+                if(ref[j] < min) {
+                    min = ref[j];
+                }
+            }
+        }
+        cr_assert_eq(prio_index_len(pi), n, "Expected %u keys at step %d", n, i);
+        unsigned int key;
+        int64_t prio;
+        if(n > 0) {
+            cr_assert_eq(prio_index_peek_min(pi, &key, &prio), 0, "Expected a peek to succeed");
+            cr_assert_eq(prio, min, "Expected a least priority of %ld but got %ld at step %d",
+                    min, prio, i);
+            cr_assert_eq(ref[key], min, "Expected the key of the least priority");
+        } else {
+            cr_assert_eq(prio_index_peek_min(pi, &key, &prio), -1, "Expected an empty queue");
+        }
+    }
+    prio_index_destroy(pi);
+}
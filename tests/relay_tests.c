@@ -0,0 +1,1367 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "conn.h"
+#include "relay.h"
+#include "test_util.h"
+
+#define RELAY_NOTNULL(ctx) \
+    do { \
+        cr_assert_not_null(ctx, "Expected a non-null value from ctx. Memory allocation may have potentially failed.");\
+    } while(0); \
+
+/* Reads until EOF while the event loop keeps running */
+static size_t read_all(ConnectionPool *conn_pool, int fd, char *buf, size_t sz) {
+    size_t len = 0;
+    for(;;) {
+        dispatch_until_readable(conn_pool, fd);
+        ssize_t n = read(fd, buf + len, sz - len - 1);
+        if(n <= 0) {
+            break;
+        }
+        len += n;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static void new_client(RelayCtx *ctx, int sv[2]) {
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    cr_assert_eq(relay_start(ctx, sv[0]), 0, "Expected relay_start to succeed");
+}
+
+Test(relay_suite, relay_forward_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+
+    int sv[2];
+    new_client(ctx, sv);
+    cr_assert_eq(relay_get_count(ctx), 1, "Expected one relay");
+
+    char req[256];
+    int req_len = snprintf(req, sizeof(req),
+            "GET http://127.0.0.1:%d/path?q=1 HTTP/1.1\r\nHost: example\r\n"
+            "Proxy-Connection: keep-alive\r\nConnection: close\r\nAccept: */*\r\n\r\n",
+            ntohs(addr.sin_port));
+    cr_assert_eq(write(sv[1], req, req_len), req_len, "write failed");
+
+    dispatch_until_readable(conn_pool, originfd);
+    int upstream = accept(originfd, NULL, NULL);
+    cr_assert_neq(upstream, -1, "Expected the relay to connect to the origin");
+    char head[512];
+    dispatch_until_readable(conn_pool, upstream);
+    ssize_t n = read(upstream, head, sizeof(head) - 1);
+    cr_assert_gt(n, 0, "Expected the request head at the origin");
+    head[n] = '\0';
+
+    cr_assert(strncmp(head, "GET /path?q=1 HTTP/1.1\r\n", 24) == 0, "Unexpected request line: %s", head);
+    cr_assert_not_null(strstr(head, "Accept: */*\r\n"), "Expected end-to-end headers to be kept");
+    cr_assert_null(strstr(head, "Proxy-Connection"), "Expected hop-by-hop headers to be dropped");
+    cr_assert_not_null(strstr(head, "Connection: keep-alive\r\n"), "Expected Connection: keep-alive");
+    cr_assert_null(strstr(head, "close"), "Expected the Connection of the client to be dropped");
+    cr_assert_null(strstr(head, "example"), "Expected the Host of the target to win");
+
+    const char resp[] = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello";
+    cr_assert_eq(write(upstream, resp, sizeof(resp) - 1), (ssize_t)sizeof(resp) - 1, "write failed");
+    close(upstream);
+
+    char buf[256];
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert_str_eq(buf, resp, "Expected the response of the origin, got %s", buf);
+    cr_assert_eq(relay_get_count(ctx), 0, "Expected the relay to be closed");
+
+    relay_ctx_destroy(ctx);
+}
+
+Test(relay_suite, relay_forward_query_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+
+    /* The authority ends before the query even without a path */
+    int sv[2];
+    new_client(ctx, sv);
+    char req[256];
+    int req_len = snprintf(req, sizeof(req), "GET http://127.0.0.1:%d?q=1#frag HTTP/1.1\r\n\r\n",
+            ntohs(addr.sin_port));
+    cr_assert_eq(write(sv[1], req, req_len), req_len, "write failed");
+
+    dispatch_until_readable(conn_pool, originfd);
+    int upstream = accept(originfd, NULL, NULL);
+    cr_assert_neq(upstream, -1, "Expected the relay to connect to the origin");
+    char head[512];
+    dispatch_until_readable(conn_pool, upstream);
+    ssize_t n = read(upstream, head, sizeof(head) - 1);
+    cr_assert_gt(n, 0, "Expected the request head at the origin");
+    head[n] = '\0';
+
+    cr_assert(strncmp(head, "GET /?q=1 HTTP/1.1\r\n", 20) == 0, "Unexpected request line: %s", head);
+    char host[32];
+    snprintf(host, sizeof(host), "\r\nHost: 127.0.0.1:%d\r\n", ntohs(addr.sin_port));
+    cr_assert_not_null(strstr(head, host), "Expected the Host without the query: %s", head);
+
+    close(upstream);
+    close(sv[1]);
+    close(originfd);
+    relay_ctx_destroy(ctx);
+    conn_destroy(conn_pool);
+}
+
+/*
+ * A chunked response of chunks of every size, from a few bytes that
+ * go with their framing to some that are spliced, while the client
+ * only reads now and then, so that the pipe fills and drains.
+ */
+Test(relay_suite, relay_chunked_backpressure_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+    int sv[2];
+    char req[128];
+    int req_len = snprintf(req, sizeof(req), "GET http://127.0.0.1:%d/ HTTP/1.1\r\n\r\n",
+            ntohs(addr.sin_port));
+    new_client(ctx, sv);
+    cr_assert_eq(write(sv[1], req, req_len), req_len, "write failed");
+    dispatch_until_readable(conn_pool, originfd);
+    int upstream = accept(originfd, NULL, NULL);
+    cr_assert_neq(upstream, -1, "Expected the relay to connect to the origin");
+    char head[512];
+    dispatch_until_readable(conn_pool, upstream);
+    cr_assert_gt(read(upstream, head, sizeof(head)), 0, "Expected the request head at the origin");
+
+    size_t sz = 4 * 1024 * 1024;
+    char *resp = malloc(sz);
+    char *got = malloc(sz);
+    cr_assert(resp != NULL && got != NULL, "malloc failed");
+    size_t len = sprintf(resp, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+    for(size_t chunk = 1; len + chunk + 32 < sz - 64; chunk = chunk * 3 % 70001) {
+        len += sprintf(resp + len, "%zx\r\n", chunk);
+        for(size_t i = 0; i < chunk; ++i) {
+            resp[len + i] = 'a' + i % 26;
+        }
+        len += chunk;
+        len += sprintf(resp + len, "\r\n");
+    }
+    len += sprintf(resp + len, "0\r\n\r\n");
+
+    fcntl(upstream, F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    size_t sent = 0, recvd = 0;
+    for(int i = 0; i < 100000; ++i) {
+        if(sent < len) {
+            ssize_t n = write(upstream, resp + sent, len - sent > 3000 ? 3000 : len - sent);
+            sent += n > 0 ? n : 0;
+        }
+        conn_dispatch(conn_pool, 0);
+        /* A slow client, that leaves the pipe to fill up in between */
+        if(i % 8 == 0 || sent == len) {
+            ssize_t n = read(sv[1], got + recvd, sz - recvd);
+            if(n == 0) {
+                break;
+            }
+            recvd += n > 0 ? n : 0;
+        }
+    }
+    cr_assert_eq(recvd, len, "Expected %zu bytes but got %zu", len, recvd);
+    cr_assert(memcmp(got, resp, len) == 0, "Expected the response as the origin sent it");
+    free(resp);
+    free(got);
+    close(upstream);
+    close(sv[1]);
+    relay_ctx_destroy(ctx);
+    conn_destroy(conn_pool);
+}
+
+/* Sends a request for the origin at port through a new client, which is closed after it */
+static void send_request(RelayCtx *ctx, int sv[2], int port) {
+    char req[128];
+    int req_len = snprintf(req, sizeof(req),
+            "GET http://127.0.0.1:%d/ HTTP/1.1\r\nConnection: close\r\n\r\n", port);
+    new_client(ctx, sv);
+    cr_assert_eq(write(sv[1], req, req_len), req_len, "write failed");
+}
+
+Test(relay_suite, relay_upstream_reuse_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+
+    int sv[2];
+    send_request(ctx, sv, ntohs(addr.sin_port));
+    dispatch_until_readable(conn_pool, originfd);
+    int upstream = accept(originfd, NULL, NULL);
+    cr_assert_neq(upstream, -1, "Expected the relay to connect to the origin");
+    char head[512];
+    dispatch_until_readable(conn_pool, upstream);
+    cr_assert_gt(read(upstream, head, sizeof(head)), 0, "Expected the request head at the origin");
+
+    /* The end of a chunked body is found without the origin closing */
+    const char resp1[] = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "5\r\nhello\r\n0\r\n\r\n";
+    cr_assert_eq(write(upstream, resp1, sizeof(resp1) - 1), (ssize_t)sizeof(resp1) - 1, "write failed");
+    char buf[256];
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert_str_eq(buf, resp1, "Expected the response of the origin, got %s", buf);
+    close(sv[1]);
+
+    UpstreamStats stats;
+    cr_assert_eq(relay_get_upstream_stats(ctx, &stats), 0, "Expected the stats");
+    cr_assert_eq(stats.misses, 1, "Expected one miss but got %lu", stats.misses);
+    cr_assert_eq(stats.idle, 1, "Expected the upstream connection to be kept");
+
+    send_request(ctx, sv, ntohs(addr.sin_port));
+    dispatch_until_readable(conn_pool, upstream);
+    ssize_t n = read(upstream, head, sizeof(head) - 1);
+    cr_assert_gt(n, 0, "Expected the second request on the same connection");
+    head[n] = '\0';
+    cr_assert(strncmp(head, "GET / HTTP/1.1\r\n", 16) == 0, "Unexpected request line: %s", head);
+    struct pollfd pfd = { .fd = originfd, .events = POLLIN };
+    cr_assert_eq(poll(&pfd, 1, 0), 0, "Expected no new connection to the origin");
+
+    const char resp2[] = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nabc";
+    cr_assert_eq(write(upstream, resp2, sizeof(resp2) - 1), (ssize_t)sizeof(resp2) - 1, "write failed");
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert_str_eq(buf, resp2, "Expected the response of the origin, got %s", buf);
+
+    relay_get_upstream_stats(ctx, &stats);
+    cr_assert_eq(stats.hits, 1, "Expected one hit but got %lu", stats.hits);
+    relay_ctx_destroy(ctx);
+}
+
+Test(relay_suite, relay_alloc_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+
+    /* One request after the other over the same upstream connection */
+    int upstream = -1;
+    const char resp[] = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nabc";
+    for(int i = 0; i < 20; ++i) {
+        int sv[2];
+        send_request(ctx, sv, ntohs(addr.sin_port));
+        if(upstream == -1) {
+            dispatch_until_readable(conn_pool, originfd);
+            upstream = accept(originfd, NULL, NULL);
+            cr_assert_neq(upstream, -1, "Expected the relay to connect to the origin");
+        }
+        char buf[512];
+        dispatch_until_readable(conn_pool, upstream);
+        cr_assert_gt(read(upstream, buf, sizeof(buf)), 0, "Expected the request head at the origin");
+        cr_assert_eq(write(upstream, resp, sizeof(resp) - 1), (ssize_t)sizeof(resp) - 1, "write failed");
+        read_all(conn_pool, sv[1], buf, sizeof(buf));
+        cr_assert_str_eq(buf, resp, "Expected the response of the origin, got %s", buf);
+        close(sv[1]);
+    }
+
+    /* The relay and its buffer were taken from the slabs and given back each time */
+    SlabStats relays, buffers;
+    cr_assert_eq(relay_get_alloc_stats(ctx, &relays, &buffers), 0, "Expected the stats");
+    cr_assert_eq(relays.allocs, 20, "Expected 20 relays but got %lu", relays.allocs);
+    cr_assert_eq(relays.outstanding, 0, "Expected no relay left but got %lu", relays.outstanding);
+    cr_assert_eq(relays.peak, 1, "Expected one relay at a time but got %lu", relays.peak);
+    cr_assert_eq(relays.slabs, 1, "Expected a single slab of relays but got %lu", relays.slabs);
+    cr_assert_eq(buffers.outstanding, 0, "Expected no buffer left but got %lu", buffers.outstanding);
+    cr_assert_eq(buffers.slabs, 1, "Expected a single slab of buffers but got %lu", buffers.slabs);
+    relay_ctx_destroy(ctx);
+}
+
+Test(relay_suite, relay_cache_hit_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    HttpCache *cache = http_cache_init(1024 * 1024);
+    cr_assert_not_null(cache, "Expected a cache");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, cache);
+    RELAY_NOTNULL(ctx);
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+
+    int sv[2];
+    send_request(ctx, sv, ntohs(addr.sin_port));
+    dispatch_until_readable(conn_pool, originfd);
+    int upstream = accept(originfd, NULL, NULL);
+    cr_assert_neq(upstream, -1, "Expected the relay to connect to the origin");
+    char head[512];
+    dispatch_until_readable(conn_pool, upstream);
+    cr_assert_gt(read(upstream, head, sizeof(head)), 0, "Expected the request head at the origin");
+
+    /* Both the spliced chunk data and the framing go into the cache */
+    const char resp[] = "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+        "Transfer-Encoding: chunked\r\n\r\n";
+    const char body[] = "5\r\nhello\r\n0\r\n\r\n";
+    cr_assert_eq(write(upstream, resp, sizeof(resp) - 1), (ssize_t)sizeof(resp) - 1, "write failed");
+    char buf[256];
+    dispatch_until_readable(conn_pool, sv[1]);
+    cr_assert_eq(write(upstream, body, sizeof(body) - 1), (ssize_t)sizeof(body) - 1, "write failed");
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert(strncmp(buf, resp, sizeof(resp) - 1) == 0 && strcmp(buf + sizeof(resp) - 1, body) == 0,
+            "Expected the response of the origin, got %s", buf);
+    close(sv[1]);
+
+    /* The origin does not hear of the second request */
+    send_request(ctx, sv, ntohs(addr.sin_port));
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert_str_eq(buf, "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+            "Transfer-Encoding: chunked\r\nAge: 0\r\n\r\n5\r\nhello\r\n0\r\n\r\n",
+            "Expected the response from the cache, got %s", buf);
+    struct pollfd pfd = { .fd = upstream, .events = POLLIN };
+    cr_assert_eq(poll(&pfd, 1, 0), 0, "Expected nothing to reach the origin");
+
+    HttpCacheStats stats;
+    http_cache_get_stats(cache, &stats);
+    cr_assert_eq(stats.hits, 1, "Expected one hit but got %lu", stats.hits);
+    cr_assert_eq(stats.stores, 1, "Expected one store but got %lu", stats.stores);
+    relay_ctx_destroy(ctx);
+    http_cache_destroy(cache);
+}
+
+Test(relay_suite, relay_disk_hit_1) {
+    char path[64], file[96];
+    snprintf(path, sizeof(path), "/tmp/relay_tests.%d", (int)getpid());
+    DiskCache *disk = disk_cache_open(path, 1024 * 1024);
+    cr_assert_not_null(disk, "Expected a disk cache");
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    HttpCache *cache = http_cache_init(1024 * 1024);
+    cr_assert_not_null(cache, "Expected a cache");
+    http_cache_attach_disk(cache, disk);
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, cache);
+    RELAY_NOTNULL(ctx);
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+
+    int sv[2];
+    send_request(ctx, sv, ntohs(addr.sin_port));
+    dispatch_until_readable(conn_pool, originfd);
+    int upstream = accept(originfd, NULL, NULL);
+    cr_assert_neq(upstream, -1, "Expected the relay to connect to the origin");
+    char head[512];
+    dispatch_until_readable(conn_pool, upstream);
+    cr_assert_gt(read(upstream, head, sizeof(head)), 0, "Expected the request head at the origin");
+    const char resp[] = "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+        "Content-Length: 5\r\n\r\nhello";
+    cr_assert_eq(write(upstream, resp, sizeof(resp) - 1), (ssize_t)sizeof(resp) - 1, "write failed");
+    char buf[256];
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert_str_eq(buf, resp, "Expected the response of the origin, got %s", buf);
+    close(sv[1]);
+    relay_ctx_destroy(ctx);
+    http_cache_destroy(cache);
+
+    /* After a restart, the memory is empty but the disk is not */
+    cache = http_cache_init(1024 * 1024);
+    cr_assert_not_null(cache, "Expected a cache");
+    http_cache_attach_disk(cache, disk);
+    ctx = relay_ctx_init(conn_pool, NULL, cache);
+    RELAY_NOTNULL(ctx);
+    send_request(ctx, sv, ntohs(addr.sin_port));
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    const size_t head_len = sizeof(resp) - 1 - strlen("\r\nhello");
+    cr_assert(strncmp(buf, resp, head_len) == 0 && strncmp(buf + head_len, "Age: ", 5) == 0 &&
+            strcmp(buf + strlen(buf) - 9, "\r\n\r\nhello") == 0,
+            "Expected the response from the disk, got %s", buf);
+    /* The idle connection was closed with the first relay, nothing else came */
+    fcntl(upstream, F_SETFL, O_NONBLOCK);
+    cr_assert_leq(read(upstream, head, sizeof(head)), 0, "Expected nothing to reach the origin");
+
+    DiskCacheStats stats;
+    disk_cache_get_stats(disk, &stats);
+    cr_assert_eq(stats.hits, 1, "Expected one disk hit but got %lu", stats.hits);
+    relay_ctx_destroy(ctx);
+    http_cache_destroy(cache);
+    disk_cache_close(disk);
+    snprintf(file, sizeof(file), "%s.data", path);
+    unlink(file);
+    snprintf(file, sizeof(file), "%s.index", path);
+    unlink(file);
+}
+
+Test(relay_suite, relay_bad_request_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    int sv[2];
+    new_client(ctx, sv);
+    const char req[] = "GET relative HTTP/1.1\r\n\r\n";
+    cr_assert_eq(write(sv[1], req, sizeof(req) - 1), (ssize_t)sizeof(req) - 1, "write failed");
+
+    char buf[256];
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert(strncmp(buf, "HTTP/1.1 400", 12) == 0, "Expected a 400, got %s", buf);
+}
+
+Test(relay_suite, relay_bad_gateway_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    /* Nothing listens on the port of a socket that was just closed */
+    struct sockaddr_in addr;
+    int fd = listen_loopback(&addr);
+    close(fd);
+
+    int sv[2];
+    new_client(ctx, sv);
+    char req[128];
+    int req_len = snprintf(req, sizeof(req), "GET / HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n",
+            ntohs(addr.sin_port));
+    cr_assert_eq(write(sv[1], req, req_len), req_len, "write failed");
+
+    char buf[256];
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert(strncmp(buf, "HTTP/1.1 502", 12) == 0, "Expected a 502, got %s", buf);
+}
+
+/* On io_uring, the connect(2) to the origin and the send(2) of the head go through the ring */
+Test(relay_suite, relay_uring_connect_1) {
+    ConnectionPool *conn_pool = conn_pool_init_backend(CONN_BACKEND_URING);
+    if(conn_pool == NULL) {
+        return;
+    }
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+    int sv[2];
+    new_client(ctx, sv);
+    char req[128];
+    int req_len = snprintf(req, sizeof(req), "GET /ring HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n"
+            "Connection: close\r\n\r\n", ntohs(addr.sin_port));
+    cr_assert_eq(write(sv[1], req, req_len), req_len, "write failed");
+
+    dispatch_until_readable(conn_pool, originfd);
+    int upstream = accept(originfd, NULL, NULL);
+    cr_assert_neq(upstream, -1, "Expected the relay to connect to the origin");
+    char head[512];
+    size_t len = 0;
+    while(len < 4 || memcmp(head + len - 4, "\r\n\r\n", 4) != 0) {
+        dispatch_until_readable(conn_pool, upstream);
+        ssize_t n = read(upstream, head + len, sizeof(head) - 1 - len);
+        cr_assert_gt(n, 0, "Expected the whole request head at the origin");
+        len += n;
+    }
+    head[len] = '\0';
+    cr_assert(strncmp(head, "GET /ring HTTP/1.1\r\n", 20) == 0, "Unexpected request line: %s", head);
+
+    const char resp[] = "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\nring";
+    cr_assert_eq(write(upstream, resp, sizeof(resp) - 1), (ssize_t)sizeof(resp) - 1, "write failed");
+    close(upstream);
+    char buf[256];
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert_str_eq(buf, resp, "Expected the response of the origin, got %s", buf);
+    close(sv[1]);
+
+    /* A refused connect cancels the send linked to it */
+    close(originfd);
+    new_client(ctx, sv);
+    cr_assert_eq(write(sv[1], req, req_len), req_len, "write failed");
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert(strncmp(buf, "HTTP/1.1 502", 12) == 0, "Expected a 502, got %s", buf);
+    close(sv[1]);
+    cr_assert_eq(relay_get_count(ctx), 0, "Expected the relays to be closed");
+
+    /* A relay torn down with its connect still queued leaves it to the context */
+    new_client(ctx, sv);
+    cr_assert_eq(write(sv[1], req, req_len), req_len, "write failed");
+    conn_dispatch(conn_pool, 100);
+    relay_ctx_destroy(ctx);
+    close(sv[1]);
+    conn_destroy(conn_pool);
+}
+
+static const char s_tunnel_ok[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+
+/* Asks for a tunnel to the origin at port, early bytes may follow the head */
+static void send_connect(RelayCtx *ctx, int sv[2], int port, const char *early) {
+    char req[128];
+    int req_len = snprintf(req, sizeof(req), "CONNECT 127.0.0.1:%d HTTP/1.1\r\n"
+            "Host: 127.0.0.1:%d\r\n\r\n%s", port, port, early);
+    new_client(ctx, sv);
+    cr_assert_eq(write(sv[1], req, req_len), req_len, "write failed");
+}
+
+/* Reads exactly len bytes from fd while the event loop keeps running */
+static void read_exact(ConnectionPool *conn_pool, int fd, char *buf, size_t len) {
+    size_t got = 0;
+    while(got < len) {
+        dispatch_until_readable(conn_pool, fd);
+        ssize_t n = read(fd, buf + got, len - got);
+        cr_assert_gt(n, 0, "Expected %zu more bytes", len - got);
+        got += n;
+    }
+}
+
+/* Sends len bytes from one end of the tunnel and checks they come out of the other */
+static void transfer(ConnectionPool *conn_pool, int from, int to, size_t len) {
+    static char out[256 * 1024], in[sizeof(out)];
+    cr_assert_leq(len, sizeof(out), "Too many bytes");
+    for(size_t i = 0; i < len; ++i) {
+        out[i] = (char)(i * 7 + len);
+    }
+    fcntl(from, F_SETFL, O_NONBLOCK);
+    fcntl(to, F_SETFL, O_NONBLOCK);
+    size_t sent = 0, got = 0;
+    for(int i = 0; i < 100000 && got < len; ++i) {
+        ssize_t n = sent < len ? write(from, out + sent, len - sent) : 0;
+        if(n > 0) {
+            sent += n;
+        }
+        conn_dispatch(conn_pool, 0);
+        n = read(to, in + got, len - got);
+        if(n > 0) {
+            got += n;
+        }
+    }
+    cr_assert_eq(got, len, "Expected %zu bytes through the tunnel but got %zu", len, got);
+    cr_assert(memcmp(in, out, len) == 0, "Expected the bytes to go through unchanged");
+}
+
+/* Opens a tunnel and returns the origin side of it */
+static int open_tunnel(ConnectionPool *conn_pool, int originfd, int sv[2]) {
+    dispatch_until_readable(conn_pool, originfd);
+    int upstream = accept(originfd, NULL, NULL);
+    cr_assert_neq(upstream, -1, "Expected the relay to connect to the origin");
+    char buf[sizeof(s_tunnel_ok)];
+    read_exact(conn_pool, sv[1], buf, sizeof(s_tunnel_ok) - 1);
+    cr_assert(memcmp(buf, s_tunnel_ok, sizeof(s_tunnel_ok) - 1) == 0,
+            "Expected the tunnel to be established");
+    return upstream;
+}
+
+Test(relay_suite, relay_connect_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+
+    /* What the client sends right after the head is not lost */
+    int sv[2];
+    send_connect(ctx, sv, ntohs(addr.sin_port), "early");
+    int upstream = open_tunnel(conn_pool, originfd, sv);
+    char buf[16];
+    read_exact(conn_pool, upstream, buf, 5);
+    cr_assert(memcmp(buf, "early", 5) == 0, "Expected the early bytes at the origin");
+
+    transfer(conn_pool, upstream, sv[1], 200 * 1024);
+    transfer(conn_pool, sv[1], upstream, 100 * 1024);
+    SlabStats relays, buffers;
+    relay_get_alloc_stats(ctx, &relays, &buffers);
+    cr_assert_eq(buffers.outstanding, 0, "Expected the tunnel to give its buffer back");
+
+    /* The origin may still answer once the client is done sending */
+    shutdown(sv[1], SHUT_WR);
+    dispatch_until_readable(conn_pool, upstream);
+    cr_assert_eq(read(upstream, buf, sizeof(buf)), 0, "Expected the end of the stream at the origin");
+    cr_assert_eq(write(upstream, "after", 5), 5, "write failed");
+    read_exact(conn_pool, sv[1], buf, 5);
+    cr_assert(memcmp(buf, "after", 5) == 0, "Expected the bytes sent after the half-close");
+    cr_assert_eq(relay_get_count(ctx), 1, "Expected the tunnel to stay open");
+
+    close(upstream);
+    fcntl(sv[1], F_SETFL, 0);
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert_eq(relay_get_count(ctx), 0, "Expected the tunnel to be closed");
+
+    RelayTunnelStats stats;
+    relay_get_tunnel_stats(ctx, &stats);
+    cr_assert_eq(stats.opened, 1, "Expected one tunnel but got %lu", stats.opened);
+    cr_assert_eq(stats.active, 0, "Expected no tunnel open but got %lu", stats.active);
+    cr_assert_eq(stats.bytes_up, 5 + 100 * 1024, "Expected %d bytes up but got %lu",
+            5 + 100 * 1024, stats.bytes_up);
+    cr_assert_eq(stats.bytes_down, 200 * 1024 + 5, "Expected %d bytes down but got %lu",
+            200 * 1024 + 5, stats.bytes_down);
+    relay_ctx_destroy(ctx);
+}
+
+Test(relay_suite, relay_connect_ring_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+    int sv[2];
+    send_connect(ctx, sv, ntohs(addr.sin_port), "");
+
+    /* There is a descriptor left for the upstream socket, none for the pipes */
+    struct rlimit old, low;
+    getrlimit(RLIMIT_NOFILE, &old);
+    int lowest = dup(0);
+    close(lowest);
+    low = old;
+    low.rlim_cur = lowest + 1;
+    cr_assert_eq(setrlimit(RLIMIT_NOFILE, &low), 0, "setrlimit failed");
+    dispatch_until_readable(conn_pool, sv[1]);
+    setrlimit(RLIMIT_NOFILE, &old);
+
+    int upstream = open_tunnel(conn_pool, originfd, sv);
+    transfer(conn_pool, upstream, sv[1], 200 * 1024);
+    transfer(conn_pool, sv[1], upstream, 100 * 1024);
+    close(upstream);
+    shutdown(sv[1], SHUT_WR);
+    char buf[16];
+    fcntl(sv[1], F_SETFL, 0);
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert_eq(relay_get_count(ctx), 0, "Expected the tunnel to be closed");
+    relay_ctx_destroy(ctx);
+}
+
+Test(relay_suite, relay_connect_bad_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    /* The port is required */
+    int sv[2];
+    new_client(ctx, sv);
+    const char req[] = "CONNECT 127.0.0.1 HTTP/1.1\r\n\r\n";
+    cr_assert_eq(write(sv[1], req, sizeof(req) - 1), (ssize_t)sizeof(req) - 1, "write failed");
+    char buf[256];
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert(strncmp(buf, "HTTP/1.1 400", 12) == 0, "Expected a 400, got %s", buf);
+
+    struct sockaddr_in addr;
+    int fd = listen_loopback(&addr);
+    close(fd);
+    send_connect(ctx, sv, ntohs(addr.sin_port), "");
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert(strncmp(buf, "HTTP/1.1 502", 12) == 0, "Expected a 502, got %s", buf);
+
+    RelayTunnelStats stats;
+    relay_get_tunnel_stats(ctx, &stats);
+    cr_assert_eq(stats.opened, 0, "Expected no tunnel but got %lu", stats.opened);
+    relay_ctx_destroy(ctx);
+}
+
+/* Runs the event loop, timers included, until fd is readable */
+static void run_until_readable(RelayCtx *ctx, ConnectionPool *conn_pool, int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    for(int i = 0; i < 1000 && poll(&pfd, 1, 0) == 0; ++i) {
+        conn_dispatch(conn_pool, relay_ctx_timeout(ctx, 10));
+        relay_ctx_tick(ctx);
+    }
+}
+
+Test(relay_suite, relay_timeout_head_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+    cr_assert_eq(relay_ctx_set_timeouts(ctx, 100, 1000, 1000), 0, "Expected the timeouts to be set");
+    cr_assert_eq(relay_ctx_set_timeouts(ctx, 0, 1000, 1000), -1, "Expected a timeout of 0 to be refused");
+
+    /* A client trickling its head does not push the deadline back */
+    int sv[2];
+    new_client(ctx, sv);
+    const char req[] = "GET http://127.0.0.1/ HTTP/1.1\r\n";
+    for(size_t i = 0; i < sizeof(req) - 1; ++i) {
+        cr_assert_eq(write(sv[1], req + i, 1), 1, "write failed");
+        conn_dispatch(conn_pool, 10);
+        relay_ctx_tick(ctx);
+    }
+    cr_assert_eq(relay_get_count(ctx), 1, "Expected the relay to wait for the head");
+    run_until_readable(ctx, conn_pool, sv[1]);
+    char buf[64];
+    cr_assert_eq(read(sv[1], buf, sizeof(buf)), 0, "Expected the client to be closed");
+    cr_assert_eq(relay_get_count(ctx), 0, "Expected the relay to be gone");
+
+    RelayTimeoutStats stats;
+    relay_get_timeout_stats(ctx, &stats);
+    cr_assert_eq(stats.head, 1, "Expected 1 head timeout but got %lu", stats.head);
+    close(sv[1]);
+    relay_ctx_destroy(ctx);
+    conn_destroy(conn_pool);
+}
+
+Test(relay_suite, relay_timeout_upstream_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+    relay_ctx_set_timeouts(ctx, 1000, 100, 1000);
+
+    /* The origin takes the connection in its backlog and never answers */
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on the loopback");
+
+    int sv[2];
+    send_request(ctx, sv, ntohs(addr.sin_port));
+    run_until_readable(ctx, conn_pool, sv[1]);
+    char buf[256];
+    ssize_t n = read(sv[1], buf, sizeof(buf) - 1);
+    cr_assert_gt(n, 0, "Expected a response");
+    buf[n] = '\0';
+    cr_assert(strncmp(buf, "HTTP/1.1 504", 12) == 0, "Expected a 504, got %s", buf);
+
+    RelayTimeoutStats stats;
+    relay_get_timeout_stats(ctx, &stats);
+    cr_assert_eq(stats.upstream, 1, "Expected 1 upstream timeout but got %lu", stats.upstream);
+    close(sv[1]);
+    close(originfd);
+    relay_ctx_destroy(ctx);
+    conn_destroy(conn_pool);
+}
+
+Test(relay_suite, relay_timeout_idle_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+    relay_ctx_set_timeouts(ctx, 1000, 1000, 150);
+
+    struct sockaddr_in addr;
+    int listenfd = listen_loopback(&addr);
+    cr_assert_neq(listenfd, -1, "Could not listen on the loopback");
+    int sv[2];
+    send_connect(ctx, sv, ntohs(addr.sin_port), "");
+    int originfd = open_tunnel(conn_pool, listenfd, sv);
+
+    /* Bytes now and then keep the tunnel open past the idle timeout */
+    for(int i = 0; i < 4; ++i) {
+        for(int j = 0; j < 10; ++j) {
+            conn_dispatch(conn_pool, 10);
+            relay_ctx_tick(ctx);
+        }
+        transfer(conn_pool, sv[1], originfd, 16);
+    }
+    cr_assert_eq(relay_get_count(ctx), 1, "Expected the tunnel to stay open");
+
+    run_until_readable(ctx, conn_pool, sv[1]);
+    char buf[64];
+    cr_assert_eq(read(sv[1], buf, sizeof(buf)), 0, "Expected the idle tunnel to be closed");
+    RelayTimeoutStats stats;
+    relay_get_timeout_stats(ctx, &stats);
+    cr_assert_eq(stats.idle, 1, "Expected 1 idle timeout but got %lu", stats.idle);
+    close(originfd);
+    close(listenfd);
+    close(sv[1]);
+    relay_ctx_destroy(ctx);
+    conn_destroy(conn_pool);
+}
+
+Test(relay_suite, relay_keep_alive_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+    int sv[2];
+    new_client(ctx, sv);
+
+    /* Both requests come over the same client connection, one after the other */
+    int upstream = -1;
+    const char resp[] = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nabc";
+    for(int i = 0; i < 2; ++i) {
+        char req[128];
+        int req_len = snprintf(req, sizeof(req), "GET http://127.0.0.1:%d/%d HTTP/1.1\r\n\r\n",
+                ntohs(addr.sin_port), i);
+        cr_assert_eq(write(sv[1], req, req_len), req_len, "write failed");
+        if(upstream == -1) {
+            dispatch_until_readable(conn_pool, originfd);
+            upstream = accept(originfd, NULL, NULL);
+            cr_assert_neq(upstream, -1, "Expected the relay to connect to the origin");
+        }
+        char buf[512];
+        dispatch_until_readable(conn_pool, upstream);
+        ssize_t n = read(upstream, buf, sizeof(buf) - 1);
+        cr_assert_gt(n, 0, "Expected the request head at the origin");
+        buf[n] = '\0';
+        snprintf(req, sizeof(req), "GET /%d HTTP/1.1\r\n", i);
+        cr_assert(strncmp(buf, req, strlen(req)) == 0, "Unexpected request line: %s", buf);
+        cr_assert_eq(write(upstream, resp, sizeof(resp) - 1), (ssize_t)sizeof(resp) - 1, "write failed");
+        read_exact(conn_pool, sv[1], buf, sizeof(resp) - 1);
+        cr_assert(memcmp(buf, resp, sizeof(resp) - 1) == 0, "Expected the response of the origin");
+        cr_assert_eq(relay_get_count(ctx), 1, "Expected the client to be kept");
+    }
+
+    /* The client going away ends the relay */
+    close(sv[1]);
+    for(int i = 0; i < 100 && relay_get_count(ctx) > 0; ++i) {
+        conn_dispatch(conn_pool, 10);
+    }
+    cr_assert_eq(relay_get_count(ctx), 0, "Expected the relay to be closed");
+    close(upstream);
+    close(originfd);
+    relay_ctx_destroy(ctx);
+    conn_destroy(conn_pool);
+}
+
+Test(relay_suite, relay_pipeline_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    Metrics *metrics = metrics_init();
+    cr_assert_not_null(metrics, "Expected metrics");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+    relay_ctx_set_metrics(ctx, metrics);
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+    int sv[2];
+    new_client(ctx, sv);
+
+    /* Three requests in a single write, the first with a body, the last closes */
+    int port = ntohs(addr.sin_port);
+    char req[512];
+    int req_len = snprintf(req, sizeof(req),
+            "POST http://127.0.0.1:%d/0 HTTP/1.1\r\nContent-Length: 4\r\n\r\nbody"
+            "GET http://127.0.0.1:%d/1 HTTP/1.1\r\n\r\n"
+            "GET http://127.0.0.1:%d/2 HTTP/1.1\r\nConnection: close\r\n\r\n",
+            port, port, port);
+    cr_assert_eq(write(sv[1], req, req_len), req_len, "write failed");
+
+    dispatch_until_readable(conn_pool, originfd);
+    int upstream = accept(originfd, NULL, NULL);
+    cr_assert_neq(upstream, -1, "Expected the relay to connect to the origin");
+    const char *lines[] = { "POST /0 HTTP/1.1\r\n", "GET /1 HTTP/1.1\r\n", "GET /2 HTTP/1.1\r\n" };
+    char expected[256] = "";
+    for(int i = 0; i < 3; ++i) {
+        /* A request only reaches the origin once the one before it was answered */
+        char head[512];
+        dispatch_until_readable(conn_pool, upstream);
+        ssize_t n = read(upstream, head, sizeof(head) - 1);
+        cr_assert_gt(n, 0, "Expected request %d at the origin", i);
+        head[n] = '\0';
+        cr_assert(strncmp(head, lines[i], strlen(lines[i])) == 0, "Unexpected request line: %s", head);
+        cr_assert_null(strstr(head + strlen(lines[i]), " HTTP/1.1\r\n"),
+                "Expected a single request at a time: %s", head);
+        if(i == 0) {
+            cr_assert_not_null(strstr(head, "\r\n\r\nbody"), "Expected the body of the request");
+        }
+        char resp[128];
+        int resp_len = snprintf(resp, sizeof(resp),
+                "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n%d", i);
+        cr_assert_eq(write(upstream, resp, resp_len), resp_len, "write failed");
+        strcat(expected, resp);
+    }
+
+    /* The responses come back in order, and the last one closes the client */
+    char buf[512];
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert_str_eq(buf, expected, "Expected the responses in order, got %s", buf);
+    cr_assert_eq(relay_get_count(ctx), 0, "Expected the relay to be closed");
+    cr_assert_eq(metrics_get(metrics, METRIC_REQUESTS), 3, "Expected three requests");
+    cr_assert_eq(metrics_get(metrics, METRIC_CONNS_OPENED), 1, "Expected a single connection");
+    cr_assert_eq(metrics_get(metrics, METRIC_BYTES_OUT), strlen(expected),
+            "Expected the bytes of every response");
+
+    UpstreamStats stats;
+    relay_get_upstream_stats(ctx, &stats);
+    cr_assert_eq(stats.hits, 2, "Expected the upstream connection to be reused, got %lu hits",
+            stats.hits);
+    close(sv[1]);
+    close(upstream);
+    close(originfd);
+    relay_ctx_destroy(ctx);
+    metrics_destroy(metrics);
+    conn_destroy(conn_pool);
+}
+
+Test(relay_suite, relay_collapse_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    HttpCache *cache = http_cache_init(1024 * 1024);
+    cr_assert_not_null(cache, "Expected a cache");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, cache);
+    RELAY_NOTNULL(ctx);
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+
+    /* Three misses for the same response at once, a single one reaches the origin */
+    int sv[3][2];
+    for(int i = 0; i < 3; ++i) {
+        send_request(ctx, sv[i], ntohs(addr.sin_port));
+    }
+    dispatch_until_readable(conn_pool, originfd);
+    int upstream = accept(originfd, NULL, NULL);
+    cr_assert_neq(upstream, -1, "Expected the relay to connect to the origin");
+    char head[512];
+    dispatch_until_readable(conn_pool, upstream);
+    cr_assert_gt(read(upstream, head, sizeof(head)), 0, "Expected the request head at the origin");
+    for(int i = 0; i < 10; ++i) {
+        conn_dispatch(conn_pool, 10);
+    }
+    struct pollfd pfd = { .fd = originfd, .events = POLLIN };
+    cr_assert_eq(poll(&pfd, 1, 0), 0, "Expected no other connection to the origin");
+    RelayCollapseStats stats;
+    relay_get_collapse_stats(ctx, &stats);
+    cr_assert_eq(stats.leaders, 1, "Expected one leader but got %lu", stats.leaders);
+    cr_assert_eq(stats.followers, 2, "Expected two followers but got %lu", stats.followers);
+
+    /* Every client gets the response as it comes, before it is whole */
+    const char resp[] = "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+        "Content-Length: 10\r\n\r\nhello";
+    cr_assert_eq(write(upstream, resp, sizeof(resp) - 1), (ssize_t)sizeof(resp) - 1, "write failed");
+    char buf[256];
+    for(int i = 0; i < 3; ++i) {
+        read_exact(conn_pool, sv[i][1], buf, sizeof(resp) - 1);
+        cr_assert(memcmp(buf, resp, sizeof(resp) - 1) == 0, "Expected the start of the response");
+    }
+    cr_assert_eq(write(upstream, "world", 5), 5, "write failed");
+    for(int i = 0; i < 3; ++i) {
+        read_all(conn_pool, sv[i][1], buf, sizeof(buf));
+        cr_assert_str_eq(buf, "world", "Expected the rest of the response, got %s", buf);
+        close(sv[i][1]);
+    }
+    cr_assert_eq(relay_get_count(ctx), 0, "Expected every relay to be closed");
+
+    HttpCacheStats cache_stats;
+    http_cache_get_stats(cache, &cache_stats);
+    cr_assert_eq(cache_stats.stores, 1, "Expected one store but got %lu", cache_stats.stores);
+    relay_get_collapse_stats(ctx, &stats);
+    cr_assert_eq(stats.fallbacks, 0, "Expected no fallback but got %lu", stats.fallbacks);
+    close(upstream);
+    close(originfd);
+    relay_ctx_destroy(ctx);
+    http_cache_destroy(cache);
+    conn_destroy(conn_pool);
+}
+
+/* A follower fetches the response itself, when it was not answered in time or may not be stored */
+Test(relay_suite, relay_collapse_fallback_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    HttpCache *cache = http_cache_init(1024 * 1024);
+    cr_assert_not_null(cache, "Expected a cache");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, cache);
+    RELAY_NOTNULL(ctx);
+    cr_assert_eq(relay_ctx_set_collapse_timeout(ctx, 100), 0, "Expected the timeout to be set");
+
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+    /* Not stored, and the connections to the origin are not kept for the next round */
+    const char resp[] = "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 2\r\n\r\nok";
+
+    for(int round = 0; round < 2; ++round) {
+        int sv[2][2];
+        int upstream[2];
+        send_request(ctx, sv[0], ntohs(addr.sin_port));
+        dispatch_until_readable(conn_pool, originfd);
+        upstream[0] = accept(originfd, NULL, NULL);
+        cr_assert_neq(upstream[0], -1, "Expected the leader to connect to the origin");
+        send_request(ctx, sv[1], ntohs(addr.sin_port));
+        RelayCollapseStats stats;
+        relay_get_collapse_stats(ctx, &stats);
+        for(int i = 0; i < 100 && stats.followers == (uint64_t)round; ++i) {
+            conn_dispatch(conn_pool, 10);
+            relay_get_collapse_stats(ctx, &stats);
+        }
+        cr_assert_eq(stats.followers, (uint64_t)round + 1, "Expected the second miss to follow the first");
+        if(round == 1) {
+            /* The leader gets a response that is not stored */
+            char head[512];
+            dispatch_until_readable(conn_pool, upstream[0]);
+            cr_assert_gt(read(upstream[0], head, sizeof(head)), 0, "Expected the request head");
+            cr_assert_eq(write(upstream[0], resp, sizeof(resp) - 1), (ssize_t)sizeof(resp) - 1,
+                    "write failed");
+        }
+        run_until_readable(ctx, conn_pool, originfd);
+        upstream[1] = accept(originfd, NULL, NULL);
+        cr_assert_neq(upstream[1], -1, "Expected the follower to connect to the origin");
+
+        for(int i = round; i < 2; ++i) {
+            char head[512];
+            dispatch_until_readable(conn_pool, upstream[i]);
+            cr_assert_gt(read(upstream[i], head, sizeof(head)), 0, "Expected the request head");
+            cr_assert_eq(write(upstream[i], resp, sizeof(resp) - 1), (ssize_t)sizeof(resp) - 1,
+                    "write failed");
+        }
+        for(int i = 0; i < 2; ++i) {
+            char buf[256];
+            read_all(conn_pool, sv[i][1], buf, sizeof(buf));
+            cr_assert_str_eq(buf, resp, "Expected the response of the origin, got %s", buf);
+            close(sv[i][1]);
+            close(upstream[i]);
+        }
+    }
+
+    RelayCollapseStats stats;
+    relay_get_collapse_stats(ctx, &stats);
+    cr_assert_eq(stats.followers, 2, "Expected two followers but got %lu", stats.followers);
+    cr_assert_eq(stats.fallbacks, 2, "Expected two fallbacks but got %lu", stats.fallbacks);
+    cr_assert_eq(stats.timeouts, 1, "Expected one timeout but got %lu", stats.timeouts);
+    close(originfd);
+    relay_ctx_destroy(ctx);
+    http_cache_destroy(cache);
+    conn_destroy(conn_pool);
+}
+
+Test(relay_suite, relay_registry_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+    ConnRegistry *registry = conn_registry_init(0);
+    cr_assert_not_null(registry, "Expected a registry");
+    cr_assert_eq(relay_ctx_set_registry(ctx, registry, 5), 0, "Expected the registry to be set");
+
+    /* A client is recorded for as long as it is relayed */
+    int sv[2];
+    new_client(ctx, sv);
+    ConnInfo info;
+    cr_assert_eq(conn_registry_lookup(registry, sv[0], &info), 1, "Expected the client to be recorded");
+    cr_assert_eq(info.worker, 5, "Expected the client of worker 5 but got %u", info.worker);
+    cr_assert_eq(relay_ctx_set_registry(ctx, NULL, 0), -1, "Expected the registry not to change under a relay");
+
+    const char req[] = "GET relative HTTP/1.1\r\n\r\n";
+    cr_assert_eq(write(sv[1], req, sizeof(req) - 1), (ssize_t)sizeof(req) - 1, "write failed");
+    char buf[256];
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert_eq(conn_registry_count(registry), 0, "Expected the client to be forgotten once closed");
+    close(sv[1]);
+    relay_ctx_destroy(ctx);
+    conn_registry_destroy(registry);
+    conn_destroy(conn_pool);
+}
+
+Test(relay_suite, relay_metrics_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+    Metrics *metrics = metrics_init();
+    cr_assert_not_null(metrics, "Expected metrics");
+    cr_assert_eq(relay_ctx_set_metrics(ctx, metrics), 0, "Expected the metrics to be set");
+
+    int sv[2];
+    new_client(ctx, sv);
+    cr_assert_eq(relay_ctx_set_metrics(ctx, NULL), -1, "Expected the metrics not to change under a relay");
+    const char req[] = "GET relative HTTP/1.1\r\n\r\n";
+    cr_assert_eq(write(sv[1], req, sizeof(req) - 1), (ssize_t)sizeof(req) - 1, "write failed");
+    char buf[256];
+    size_t len = read_all(conn_pool, sv[1], buf, sizeof(buf));
+    close(sv[1]);
+
+    cr_assert_eq(metrics_get(metrics, METRIC_CONNS_OPENED), 1, "Expected a connection opened");
+    cr_assert_eq(metrics_get(metrics, METRIC_CONNS_CLOSED), 1, "Expected a connection closed");
+    cr_assert_eq(metrics_get(metrics, METRIC_REQUESTS), 1, "Expected a request");
+    cr_assert_eq(metrics_get(metrics, METRIC_ERR_BAD_REQUEST), 1, "Expected a bad request");
+    cr_assert_eq(metrics_get(metrics, METRIC_BYTES_OUT), len, "Expected the 400 to be counted");
+    relay_ctx_destroy(ctx);
+    metrics_destroy(metrics);
+    conn_destroy(conn_pool);
+}
+
+Test(relay_suite, relay_admission_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+    AdmissionLimits limits = { .max_inflight = ADMISSION_MIN_LIMIT };
+    Admission *admission = admission_init(&limits);
+    cr_assert_not_null(admission, "Expected an admission");
+    Metrics *metrics = metrics_init();
+    cr_assert_not_null(metrics, "Expected metrics");
+    cr_assert_eq(relay_ctx_set_admission(ctx, admission), 0, "Expected the admission to be set");
+    cr_assert_eq(relay_ctx_set_metrics(ctx, metrics), 0, "Expected the metrics to be set");
+
+    /* The origin never answers, so the requests stay in flight */
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+    int sv[ADMISSION_MIN_LIMIT + 1][2];
+    int upstream[ADMISSION_MIN_LIMIT];
+    for(int i = 0; i < ADMISSION_MIN_LIMIT; ++i) {
+        send_request(ctx, sv[i], ntohs(addr.sin_port));
+        dispatch_until_readable(conn_pool, originfd);
+        upstream[i] = accept(originfd, NULL, NULL);
+        cr_assert_neq(upstream[i], -1, "Expected request %d to reach the origin", i);
+    }
+    cr_assert_eq(relay_ctx_set_admission(ctx, NULL), -1, "Expected the admission not to change under a relay");
+
+    /* The next one is over the limit, it never reaches the origin */
+    send_request(ctx, sv[ADMISSION_MIN_LIMIT], ntohs(addr.sin_port));
+    char buf[256];
+    read_all(conn_pool, sv[ADMISSION_MIN_LIMIT][1], buf, sizeof(buf));
+    cr_assert(strncmp(buf, "HTTP/1.1 503 ", 13) == 0, "Expected a 503 but got %s", buf);
+    cr_assert_eq(metrics_get(metrics, METRIC_ERR_OVERLOADED), 1, "Expected the 503 to be counted");
+    AdmissionStats stats;
+    admission_get_stats(admission, &stats);
+    cr_assert_eq(stats.shed, 1, "Expected a request shed but got %lu", stats.shed);
+    cr_assert_eq(stats.inflight, ADMISSION_MIN_LIMIT, "Expected %d requests in flight but got %u",
+            ADMISSION_MIN_LIMIT, stats.inflight);
+
+    /* A request that fails leaves room for another */
+    close(upstream[0]);
+    for(int i = 0; i < 100 && stats.inflight == ADMISSION_MIN_LIMIT; ++i) {
+        conn_dispatch(conn_pool, 10);
+        admission_get_stats(admission, &stats);
+    }
+    cr_assert_eq(stats.inflight, ADMISSION_MIN_LIMIT - 1, "Expected a request to end but got %u in flight",
+            stats.inflight);
+
+    relay_ctx_destroy(ctx);
+    admission_get_stats(admission, &stats);
+    cr_assert_eq(stats.inflight, 0, "Expected no request left in flight but got %u", stats.inflight);
+    for(int i = 0; i <= ADMISSION_MIN_LIMIT; ++i) {
+        if(i > 0 && i < ADMISSION_MIN_LIMIT) {
+            close(upstream[i]);
+        }
+        close(sv[i][1]);
+    }
+    close(originfd);
+    admission_destroy(admission);
+    metrics_destroy(metrics);
+    conn_destroy(conn_pool);
+}
+
+/* Reads what came on fd so far, once something has */
+static size_t read_some(ConnectionPool *conn_pool, int fd, char *buf, size_t sz) {
+    dispatch_until_readable(conn_pool, fd);
+    ssize_t n = read(fd, buf, sz - 1);
+    buf[n > 0 ? n : 0] = '\0';
+    return n > 0 ? n : 0;
+}
+
+Test(relay_suite, relay_admission_tunnel_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+    AdmissionLimits limits = { .max_inflight = ADMISSION_MIN_LIMIT };
+    Admission *admission = admission_init(&limits);
+    cr_assert_not_null(admission, "Expected an admission");
+    cr_assert_eq(relay_ctx_set_admission(ctx, admission), 0, "Expected the admission to be set");
+
+    /* Tunnels left idle once open are not requests in flight */
+    struct sockaddr_in addr;
+    int originfd = listen_loopback(&addr);
+    cr_assert_neq(originfd, -1, "Could not listen on loopback");
+    int sv[ADMISSION_MIN_LIMIT + 1][2];
+    int upstream[ADMISSION_MIN_LIMIT + 1];
+    for(int i = 0; i < ADMISSION_MIN_LIMIT; ++i) {
+        send_connect(ctx, sv[i], ntohs(addr.sin_port), "");
+        upstream[i] = open_tunnel(conn_pool, originfd, sv[i]);
+    }
+    AdmissionStats stats;
+    admission_get_stats(admission, &stats);
+    cr_assert_eq(stats.inflight, 0, "Expected no request in flight but got %u", stats.inflight);
+
+    /* So a request still gets in */
+    send_request(ctx, sv[ADMISSION_MIN_LIMIT], ntohs(addr.sin_port));
+    dispatch_until_readable(conn_pool, originfd);
+    upstream[ADMISSION_MIN_LIMIT] = accept(originfd, NULL, NULL);
+    cr_assert_neq(upstream[ADMISSION_MIN_LIMIT], -1, "Expected the request to reach the origin");
+    admission_get_stats(admission, &stats);
+    cr_assert_eq(stats.shed, 0, "Expected no request shed but got %lu", stats.shed);
+    cr_assert_eq(stats.inflight, 1, "Expected a request in flight but got %u", stats.inflight);
+
+    relay_ctx_destroy(ctx);
+    for(int i = 0; i <= ADMISSION_MIN_LIMIT; ++i) {
+        close(upstream[i]);
+        close(sv[i][1]);
+    }
+    close(originfd);
+    admission_destroy(admission);
+    conn_destroy(conn_pool);
+}
+
+Test(relay_suite, relay_balance_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    struct sockaddr_in addr[3];
+    int backendfd[3];
+    char names[3][32];
+    char *backends[3];
+    for(int i = 0; i < 3; ++i) {
+        backendfd[i] = listen_loopback(&addr[i]);
+        cr_assert_neq(backendfd[i], -1, "Could not listen on loopback");
+        snprintf(names[i], sizeof(names[i]), "127.0.0.1:%d", ntohs(addr[i].sin_port));
+        backends[i] = names[i];
+    }
+    Balancer *balancer = balancer_init(BALANCE_LEAST_OUTSTANDING, backends, 3);
+    cr_assert_not_null(balancer, "Expected a balancer");
+    cr_assert_eq(relay_ctx_set_balancer(ctx, balancer), 0, "Expected the balancer to be set");
+
+    /* Requests in flight spread over the backends, whatever their Host */
+    static const char req[] = "GET /item HTTP/1.1\r\nHost: site.test\r\nConnection: close\r\n\r\n";
+    int sv[5][2];
+    int upstream[4];
+    char buf[512];
+    for(int i = 0; i < 3; ++i) {
+        new_client(ctx, sv[i]);
+        cr_assert_eq(write(sv[i][1], req, sizeof(req) - 1), (ssize_t)sizeof(req) - 1, "write failed");
+        dispatch_until_readable(conn_pool, backendfd[i]);
+        upstream[i] = accept(backendfd[i], NULL, NULL);
+        cr_assert_neq(upstream[i], -1, "Expected request %d to reach backend %d", i, i);
+    }
+    cr_assert_eq(relay_ctx_set_balancer(ctx, NULL), -1, "Expected the balancer not to change under a relay");
+    read_some(conn_pool, upstream[1], buf, sizeof(buf));
+    cr_assert_not_null(strstr(buf, "Host: site.test\r\n"), "Expected the Host to be kept but got %s", buf);
+
+    /* Once a backend is done, it takes the next request */
+    static const char resp[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok";
+    cr_assert_eq(write(upstream[1], resp, sizeof(resp) - 1), (ssize_t)sizeof(resp) - 1, "write failed");
+    read_all(conn_pool, sv[1][1], buf, sizeof(buf));
+    cr_assert(strncmp(buf, "HTTP/1.1 200 ", 13) == 0, "Expected a 200 but got %s", buf);
+    BackendStats stats;
+    balancer_get_stats(balancer, 1, &stats);
+    cr_assert_eq(stats.outstanding, 0, "Expected backend 1 to be done but got %u in flight", stats.outstanding);
+    new_client(ctx, sv[3]);
+    cr_assert_eq(write(sv[3][1], req, sizeof(req) - 1), (ssize_t)sizeof(req) - 1, "write failed");
+    dispatch_until_readable(conn_pool, backendfd[1]);
+    upstream[3] = accept(backendfd[1], NULL, NULL);
+    cr_assert_neq(upstream[3], -1, "Expected the next request to reach backend 1");
+
+    /* Nor does a reverse proxy open tunnels */
+    char connect_req[128];
+    int connect_len = snprintf(connect_req, sizeof(connect_req),
+            "CONNECT 127.0.0.1:%d HTTP/1.1\r\n\r\n", ntohs(addr[0].sin_port));
+    new_client(ctx, sv[4]);
+    cr_assert_eq(write(sv[4][1], connect_req, connect_len), connect_len, "write failed");
+    read_all(conn_pool, sv[4][1], buf, sizeof(buf));
+    cr_assert(strncmp(buf, "HTTP/1.1 400 ", 13) == 0, "Expected a 400 but got %s", buf);
+
+    relay_ctx_destroy(ctx);
+    for(int i = 0; i < 3; ++i) {
+        balancer_get_stats(balancer, i, &stats);
+        cr_assert_eq(stats.outstanding, 0, "Expected backend %d to have nothing in flight but got %u",
+                i, stats.outstanding);
+        cr_assert_eq(stats.picks, i == 1 ? 2 : 1, "Expected backend %d to be picked %d times but got %lu",
+                i, i == 1 ? 2 : 1, stats.picks);
+    }
+    for(int i = 0; i < 5; ++i) {
+        close(sv[i][1]);
+    }
+    for(int i = 0; i < 4; ++i) {
+        close(upstream[i]);
+    }
+    for(int i = 0; i < 3; ++i) {
+        close(backendfd[i]);
+    }
+    balancer_destroy(balancer);
+    conn_destroy(conn_pool);
+}
+
+Test(relay_suite, relay_breaker_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+    Metrics *metrics = metrics_init();
+    cr_assert_not_null(metrics, "Expected metrics");
+    cr_assert_eq(relay_ctx_set_metrics(ctx, metrics), 0, "Expected the metrics to be set");
+
+    /* Nothing listens on the ports of the backends anymore */
+    char names[2][32];
+    char *backends[2];
+    for(int i = 0; i < 2; ++i) {
+        struct sockaddr_in addr;
+        int fd = listen_loopback(&addr);
+        cr_assert_neq(fd, -1, "Could not listen on loopback");
+        close(fd);
+        snprintf(names[i], sizeof(names[i]), "127.0.0.1:%d", ntohs(addr.sin_port));
+        backends[i] = names[i];
+    }
+    Balancer *balancer = balancer_init(BALANCE_LEAST_OUTSTANDING, backends, 2);
+    cr_assert_not_null(balancer, "Expected a balancer");
+    cr_assert_eq(relay_ctx_set_balancer(ctx, balancer), 0, "Expected the balancer to be set");
+
+    /* Every request that cannot reach its backend counts against it, until both trip */
+    static const char req[] = "GET / HTTP/1.1\r\nHost: site.test\r\n\r\n";
+    char buf[256];
+    int sv[2];
+    for(int i = 0; i < 2 * BALANCER_TRIP_FAILURES; ++i) {
+        new_client(ctx, sv);
+        cr_assert_eq(write(sv[1], req, sizeof(req) - 1), (ssize_t)sizeof(req) - 1, "write failed");
+        read_all(conn_pool, sv[1], buf, sizeof(buf));
+        cr_assert(strncmp(buf, "HTTP/1.1 502 ", 13) == 0, "Expected a 502 but got %s", buf);
+        close(sv[1]);
+    }
+    BackendStats stats;
+    for(int i = 0; i < 2; ++i) {
+        balancer_get_stats(balancer, i, &stats);
+        cr_assert_eq(stats.breaker, BREAKER_OPEN, "Expected the breaker of backend %d to be open", i);
+        cr_assert_eq(stats.outstanding, 0, "Expected nothing in flight on backend %d", i);
+    }
+
+    /* Then the requests fail right away, without a connect */
+    new_client(ctx, sv);
+    cr_assert_eq(write(sv[1], req, sizeof(req) - 1), (ssize_t)sizeof(req) - 1, "write failed");
+    read_all(conn_pool, sv[1], buf, sizeof(buf));
+    cr_assert(strncmp(buf, "HTTP/1.1 503 ", 13) == 0, "Expected a 503 but got %s", buf);
+    close(sv[1]);
+    cr_assert_eq(metrics_get(metrics, METRIC_ERR_NO_BACKEND), 1, "Expected the 503 to be counted");
+    cr_assert_eq(metrics_get(metrics, METRIC_ERR_BAD_GATEWAY), 2 * BALANCER_TRIP_FAILURES,
+            "Expected the 502s to be counted");
+
+    relay_ctx_destroy(ctx);
+    balancer_destroy(balancer);
+    metrics_destroy(metrics);
+    conn_destroy(conn_pool);
+}
+
+Test(relay_suite, relay_ctx_destroy_1) {
+    ConnectionPool *conn_pool = conn_pool_init();
+    cr_assert_not_null(conn_pool, "Expected a connection pool");
+    RelayCtx *ctx = relay_ctx_init(conn_pool, NULL, NULL);
+    RELAY_NOTNULL(ctx);
+
+    int sv[2];
+    new_client(ctx, sv);
+    new_client(ctx, sv);
+    cr_assert_eq(relay_get_count(ctx), 2, "Expected two relays");
+    relay_ctx_destroy(ctx);
+    cr_assert_eq(conn_get_pool_size(conn_pool), 0, "Expected the relays to leave the pool");
+}
@@ -0,0 +1,104 @@
+#include <criterion/criterion.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "slab.h"
+
+#define SLAB_NOTNULL(slab) \
+    do { \
+        cr_assert_not_null(slab, "Expected a non-null value from slab. Memory allocation may have potentially failed.");\
+    } while(0); \
+
+Test(slab_suite, slab_init_1) {
+    cr_assert_null(slab_init(0, 0), "Expected objects of no size to be refused");
+    cr_assert_null(slab_init(64, 24), "Expected an alignment that is not a power of two to be refused");
+    cr_assert_null(slab_init(64, 2 * sysconf(_SC_PAGESIZE)), "Expected an alignment over a page to be refused");
+
+    Slab *slab = slab_init(64, 0);
+    SLAB_NOTNULL(slab);
+    SlabStats stats;
+    slab_get_stats(slab, &stats);
+    cr_assert_eq(stats.slabs, 0, "Expected no slab before the first object");
+    slab_destroy(slab);
+}
+
+Test(slab_suite, slab_alloc_1) {
+    Slab *slab = slab_init(100, 0);
+    SLAB_NOTNULL(slab);
+
+    /* Objects do not overlap and keep what is written to them */
+    unsigned char *objs[64];
+    for(int i = 0; i < 64; ++i) {
+        objs[i] = slab_alloc(slab);
+        cr_assert_not_null(objs[i], "Expected an object");
+        cr_assert_eq((uintptr_t)objs[i] % SLAB_MIN_ALIGN, 0, "Expected an aligned object");
+        memset(objs[i], i, 100);
+    }
+    for(int i = 0; i < 64; ++i) {
+        for(int j = 0; j < 100; ++j) {
+            cr_assert_eq(objs[i][j], i, "Expected object %d to be intact", i);
+        }
+    }
+
+    SlabStats stats;
+    slab_get_stats(slab, &stats);
+    cr_assert_eq(stats.outstanding, 64, "Expected 64 objects out but got %lu", stats.outstanding);
+    cr_assert_eq(stats.slabs, 1, "Expected 64 objects of 112 bytes to fit a slab");
+    slab_destroy(slab);
+}
+
+Test(slab_suite, slab_reuse_1) {
+    Slab *slab = slab_init(256, 0);
+    SLAB_NOTNULL(slab);
+
+    /* The object freed last is handed out first */
+    void *a = slab_alloc(slab);
+    void *b = slab_alloc(slab);
+    slab_free(slab, a);
+    slab_free(slab, b);
+    cr_assert_eq(slab_alloc(slab), b, "Expected the object freed last");
+    cr_assert_eq(slab_alloc(slab), a, "Expected the object freed before");
+    slab_free(slab, NULL);
+
+    /* A steady load does not grow the slabs */
+    SlabStats before, after;
+    slab_get_stats(slab, &before);
+    for(int i = 0; i < 10000; ++i) {
+        void *obj = slab_alloc(slab);
+        slab_free(slab, obj);
+    }
+    slab_get_stats(slab, &after);
+    cr_assert_eq(after.slabs, before.slabs, "Expected no new slab");
+    cr_assert_eq(after.allocs, before.allocs + 10000, "Expected every object to be counted");
+    cr_assert_eq(after.outstanding, 2, "Expected 2 objects out but got %lu", after.outstanding);
+    slab_destroy(slab);
+}
+
+Test(slab_suite, slab_grow_1) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    Slab *slab = slab_init(16 * 1024, page);
+    SLAB_NOTNULL(slab);
+
+    /* Buffers are page-aligned and slabs hold several of them */
+    void *bufs[40];
+    for(int i = 0; i < 40; ++i) {
+        bufs[i] = slab_alloc(slab);
+        cr_assert_not_null(bufs[i], "Expected a buffer");
+        cr_assert_eq((uintptr_t)bufs[i] % page, 0, "Expected a page-aligned buffer");
+    }
+    SlabStats stats;
+    slab_get_stats(slab, &stats);
+    cr_assert_eq(stats.slabs, 40 / SLAB_MIN_OBJECTS, "Expected %d slabs but got %lu",
+            40 / SLAB_MIN_OBJECTS, stats.slabs);
+    cr_assert_eq(stats.capacity, 40, "Expected room for 40 buffers but got %lu", stats.capacity);
+
+    for(int i = 0; i < 30; ++i) {
+        slab_free(slab, bufs[i]);
+    }
+    slab_get_stats(slab, &stats);
+    cr_assert_eq(stats.outstanding, 10, "Expected 10 buffers out but got %lu", stats.outstanding);
+    cr_assert_eq(stats.peak, 40, "Expected a peak of 40 buffers but got %lu", stats.peak);
+    cr_assert_eq(stats.frees, 30, "Expected 30 buffers given back but got %lu", stats.frees);
+    slab_destroy(slab);
+}
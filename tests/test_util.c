@@ -0,0 +1,32 @@
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "test_util.h"
+
+int listen_loopback(struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd == -1) {
+        return -1;
+    }
+    socklen_t len = sizeof(*addr);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(fd, (struct sockaddr *)addr, sizeof(*addr)) == -1 ||
+            listen(fd, 64) == -1 ||
+            getsockname(fd, (struct sockaddr *)addr, &len) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void dispatch_until_readable(ConnectionPool *conn_pool, int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    for(int i = 0; i < 1000 && poll(&pfd, 1, 0) == 0; ++i) {
+        conn_dispatch(conn_pool, 10);
+    }
+}
@@ -0,0 +1,36 @@
+/**
+ * @file test_util.h
+ * @brief The fixtures the suites share: loopback sockets
+ * and the event loop run until a socket has something to
+ * read.
+ *
+ */
+
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <netinet/in.h>
+
+#include "conn.h"
+
+/**
+ * @brief Opens a listener on an ephemeral port of
+ * loopback.
+ *
+ * @param addr Receives the address it listens on
+ * @return The listening socket, or -1 on failure.
+ *
+ */
+extern int listen_loopback(struct sockaddr_in *addr);
+
+/**
+ * @brief Runs the event loop until fd is readable, for
+ * 10 seconds at most.
+ *
+ * @param conn_pool The event loop
+ * @param fd The socket to wait for
+ *
+ */
+extern void dispatch_until_readable(ConnectionPool *conn_pool, int fd);
+
+#endif /* TEST_UTIL_H */
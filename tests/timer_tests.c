@@ -0,0 +1,232 @@
+#include <criterion/criterion.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "timer.h"
+
+#define TIMER_WHEEL_NOTNULL(wheel) \
+    do { \
+        cr_assert_not_null(wheel, "Expected a non-null value from wheel. Memory allocation may have potentially failed.");\
+    } while(0); \
+
+struct expiry {
+    TimerWheel *wheel;
+    uint64_t at;     /* The clock of the wheel when it expired */
+    int calls;
+};
+
+static uint64_t s_clock;
+
+static void on_expiry(Timer *timer, void *data) {
+    (void)timer;
+    struct expiry *e = data;
+    e->at = s_clock;
+    e->calls++;
+}
+
+/* Advances the wheel a millisecond at a time, the way a busy loop would */
+static int advance_to(TimerWheel *wheel, uint64_t to) {
+    int n = 0;
+    while(s_clock < to) {
+        s_clock++;
+        n += timer_wheel_advance(wheel, s_clock);
+    }
+    return n;
+}
+
+Test(timer_suite, timer_arm_1) {
+    s_clock = 1000;
+    TimerWheel *wheel = timer_wheel_init(s_clock);
+    TIMER_WHEEL_NOTNULL(wheel);
+
+    Timer timer;
+    struct expiry e = { wheel, 0, 0 };
+    timer_init(&timer, on_expiry, &e);
+    cr_assert_eq(timer_is_armed(&timer), 0, "Expected a new timer not to be armed");
+    cr_assert_eq(timer_arm(wheel, &timer, s_clock + 10), 0, "Expected the timer to be armed");
+    cr_assert_eq(timer_is_armed(&timer), 1, "Expected the timer to be armed");
+    cr_assert_eq(timer_wheel_count(wheel), 1, "Expected 1 timer armed");
+
+    cr_assert_eq(advance_to(wheel, 1009), 0, "Expected no timer to expire early");
+    cr_assert_eq(advance_to(wheel, 1010), 1, "Expected the timer to expire on time");
+    cr_assert_eq(e.at, 1010, "Expected the timer to expire at 1010 but it did at %lu", e.at);
+    cr_assert_eq(timer_is_armed(&timer), 0, "Expected an expired timer not to be armed");
+    cr_assert_eq(timer_wheel_count(wheel), 0, "Expected no timer armed");
+
+    /* A timer in the past expires on the next tick */
+    timer_arm(wheel, &timer, 5);
+    cr_assert_eq(timer_wheel_advance(wheel, s_clock), 0, "Expected nothing to run on the same tick");
+    cr_assert_eq(advance_to(wheel, s_clock + 1), 1, "Expected a past timer to expire");
+    timer_wheel_destroy(wheel);
+}
+
+Test(timer_suite, timer_cancel_1) {
+    s_clock = 0;
+    TimerWheel *wheel = timer_wheel_init(s_clock);
+    TIMER_WHEEL_NOTNULL(wheel);
+
+    Timer a, b;
+    struct expiry ea = { wheel, 0, 0 }, eb = { wheel, 0, 0 };
+    timer_init(&a, on_expiry, &ea);
+    timer_init(&b, on_expiry, &eb);
+    timer_arm(wheel, &a, 100);
+    timer_arm(wheel, &b, 100);
+    timer_cancel(wheel, &a);
+    timer_cancel(wheel, &a);
+    cr_assert_eq(timer_wheel_count(wheel), 1, "Expected 1 timer armed");
+
+    /* Arming an armed timer moves it */
+    timer_arm(wheel, &b, 5000);
+    cr_assert_eq(timer_wheel_count(wheel), 1, "Expected 1 timer armed");
+    cr_assert_eq(advance_to(wheel, 4999), 0, "Expected no timer to expire before 5000");
+    cr_assert_eq(ea.calls, 0, "Expected a cancelled timer not to run");
+    cr_assert_eq(advance_to(wheel, 5000), 1, "Expected the timer to expire");
+    cr_assert_eq(eb.at, 5000, "Expected the moved timer to expire at 5000 but it did at %lu", eb.at);
+    timer_wheel_destroy(wheel);
+}
+
+Test(timer_suite, timer_levels_1) {
+    s_clock = 12345;
+    TimerWheel *wheel = timer_wheel_init(s_clock);
+    TIMER_WHEEL_NOTNULL(wheel);
+
+    /* Delays on every level, and past the span of the wheel */
+    uint64_t delays[] = { 1, 63, 64, 65, 4095, 4096, 4097, 300000, 262144,
+        16777215, 16777216, 40000000 };
+    int n = sizeof(delays) / sizeof(delays[0]);
+    Timer timers[sizeof(delays) / sizeof(delays[0])];
+    struct expiry e[sizeof(delays) / sizeof(delays[0])];
+    uint64_t start = s_clock;
+    for(int i = 0; i < n; ++i) {
+        e[i].wheel = wheel;
+        e[i].calls = 0;
+        timer_init(&timers[i], on_expiry, &e[i]);
+        timer_arm(wheel, &timers[i], start + delays[i]);
+    }
+
+    /* Jumps, as a worker sleeping until the next timeout does */
+    int expired = 0;
+    while(expired < n) {
+        int timeout = timer_wheel_timeout(wheel, s_clock, 1000000);
+        cr_assert_gt(timeout, 0, "Expected the wheel to let the loop sleep");
+        s_clock += timeout;
+        expired += timer_wheel_advance(wheel, s_clock);
+    }
+    for(int i = 0; i < n; ++i) {
+        cr_assert_eq(e[i].calls, 1, "Expected timer %d to expire once", i);
+        cr_assert_eq(e[i].at, start + delays[i], "Expected timer %d to expire at %lu but it did at %lu",
+                i, start + delays[i], e[i].at);
+    }
+    timer_wheel_destroy(wheel);
+}
+
+Test(timer_suite, timer_timeout_1) {
+    s_clock = 0;
+    TimerWheel *wheel = timer_wheel_init(s_clock);
+    TIMER_WHEEL_NOTNULL(wheel);
+
+    cr_assert_eq(timer_wheel_timeout(wheel, s_clock, 1000), 1000, "Expected the longest sleep with no timer");
+    Timer timer;
+    struct expiry e = { wheel, 0, 0 };
+    timer_init(&timer, on_expiry, &e);
+    timer_arm(wheel, &timer, 30);
+    cr_assert_eq(timer_wheel_timeout(wheel, s_clock, 1000), 30, "Expected to sleep until the timer");
+    cr_assert_eq(timer_wheel_timeout(wheel, s_clock, 10), 10, "Expected the sleep to be capped");
+    cr_assert_eq(timer_wheel_timeout(wheel, 40, 1000), 0, "Expected no sleep once the timer is due");
+
+    /* A timer of an upper level wakes the loop up early at worst */
+    timer_arm(wheel, &timer, 100000);
+    int timeout = timer_wheel_timeout(wheel, s_clock, 1000000);
+    cr_assert(timeout > 0 && timeout <= 100000, "Expected a sleep of at most 100000 but got %d", timeout);
+    timer_wheel_destroy(wheel);
+}
+
+struct chain {
+    TimerWheel *wheel;
+    Timer *other;    /* Cancelled by the handler */
+    int calls;
+};
+
+static void on_chain(Timer *timer, void *data) {
+    struct chain *c = data;
+    c->calls++;
+    if(c->other != NULL) {
+        timer_cancel(c->wheel, c->other);
+    }
+    /* Armed again from its own handler */
+    if(c->calls < 3) {
+        timer_arm(c->wheel, timer, s_clock + 10);
+    }
+}
+
+Test(timer_suite, timer_handler_1) {
+    s_clock = 0;
+    TimerWheel *wheel = timer_wheel_init(s_clock);
+    TIMER_WHEEL_NOTNULL(wheel);
+
+    Timer a, b;
+    struct chain ca = { wheel, &b, 0 }, cb = { wheel, NULL, 0 };
+    timer_init(&a, on_chain, &ca);
+    timer_init(&b, on_chain, &cb);
+    /* Both in the same slot, the first one cancels the second */
+    timer_arm(wheel, &a, 20);
+    timer_arm(wheel, &b, 20);
+
+    cr_assert_eq(advance_to(wheel, 20), 1, "Expected one timer to run");
+    cr_assert_eq(cb.calls, 0, "Expected the cancelled timer not to run");
+    advance_to(wheel, 100);
+    cr_assert_eq(ca.calls, 3, "Expected the timer to run 3 times but it did %d", ca.calls);
+    cr_assert_eq(timer_wheel_count(wheel), 0, "Expected no timer armed");
+    timer_wheel_destroy(wheel);
+}
+
+Test(timer_suite, timer_churn_1) {
+    s_clock = 77;
+    TimerWheel *wheel = timer_wheel_init(s_clock);
+    TIMER_WHEEL_NOTNULL(wheel);
+
+    /* Timers armed, moved and cancelled at random expire when they should */
+    enum { NTIMERS = 2000 };
+    static Timer timers[NTIMERS];
+    static struct expiry e[NTIMERS];
+    static uint64_t due[NTIMERS];
+    for(int i = 0; i < NTIMERS; ++i) {
+        e[i].wheel = wheel;
+        e[i].calls = 0;
+        due[i] = 0;
+        timer_init(&timers[i], on_expiry, &e[i]);
+    }
+    unsigned int state = 1;
+    for(int step = 0; step < 20000; ++step) {
+        for(int k = 0; k < 4; ++k) {
+            state = state * 1103515245 + 12345;
+            int i = (state >> 8) % NTIMERS;
+            state = state * 1103515245 + 12345;
+            unsigned int r = state >> 8;
+            if(r % 5 == 0) {
+                timer_cancel(wheel, &timers[i]);
+                due[i] = 0;
+            } else {
+                /* Mostly short, some on the upper levels */
+                uint64_t delay = r % 7 == 0 ? r % 20000 : r % 200;
+                timer_arm(wheel, &timers[i], s_clock + delay);
+                due[i] = s_clock + delay > s_clock ? s_clock + delay : s_clock + 1;
+            }
+            e[i].calls = 0;
+        }
+        advance_to(wheel, s_clock + state % 3);
+        for(int i = 0; i < NTIMERS; ++i) {
+            if(due[i] != 0 && due[i] <= s_clock) {
+                cr_assert_eq(e[i].calls, 1, "Expected timer %d due at %lu to have expired at %lu",
+                        i, due[i], s_clock);
+                cr_assert_eq(e[i].at, due[i], "Expected timer %d to expire at %lu but it did at %lu",
+                        i, due[i], e[i].at);
+                due[i] = 0;
+            } else if(due[i] != 0) {
+                cr_assert_eq(e[i].calls, 0, "Expected timer %d due at %lu not to expire at %lu",
+                        i, due[i], s_clock);
+            }
+        }
+    }
+    timer_wheel_destroy(wheel);
+}
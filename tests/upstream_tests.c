@@ -0,0 +1,155 @@
+#include <criterion/criterion.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "upstream.h"
+
+#define UPSTREAM_NOTNULL(pool) \
+    do { \
+        cr_assert_not_null(pool, "Expected a non-null value from pool. Memory allocation may have potentially failed.");\
+    } while(0); \
+
+/* A connected socket whose peer is kept open in peer */
+static int new_conn(int *peer) {
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+    *peer = sv[1];
+    return sv[0];
+}
+
+/* The pool closed the connection when its peer reads EOF (or a reset) */
+static int is_closed(int peer) {
+    char c;
+    ssize_t n = recv(peer, &c, 1, MSG_DONTWAIT);
+    return n == 0 || (n == -1 && errno == ECONNRESET);
+}
+
+Test(upstream_suite, upstream_get_1) {
+    UpstreamPool *pool = upstream_pool_init(4, 10000);
+    UPSTREAM_NOTNULL(pool);
+
+    int status = upstream_pool_get(pool, "example.com", "80");
+    cr_assert_eq(status, -1, "Expected -1 but got %d", status);
+
+    int peer, fd = new_conn(&peer);
+    status = upstream_pool_put(pool, "example.com", "80", fd);
+    cr_assert_eq(status, 0, "Expected 0 but got %d", status);
+    cr_assert_eq(upstream_pool_get(pool, "example.com", "8080"), -1, "Expected the port to matter");
+    cr_assert_eq(upstream_pool_get(pool, "example.com", "80"), fd, "Expected the idle connection");
+    cr_assert_eq(upstream_pool_get(pool, "example.com", "80"), -1, "Expected the pool to be empty");
+
+    UpstreamStats stats;
+    upstream_pool_get_stats(pool, &stats);
+    cr_assert_eq(stats.hits, 1, "Expected 1 hit but got %lu", stats.hits);
+    cr_assert_eq(stats.misses, 3, "Expected 3 misses but got %lu", stats.misses);
+    cr_assert_eq(stats.idle, 0, "Expected no idle connection but got %u", stats.idle);
+    upstream_pool_destroy(pool);
+}
+
+Test(upstream_suite, upstream_get_mru_1) {
+    UpstreamPool *pool = upstream_pool_init(4, 10000);
+    UPSTREAM_NOTNULL(pool);
+
+    int peer1, peer2;
+    int fd1 = new_conn(&peer1), fd2 = new_conn(&peer2);
+    upstream_pool_put(pool, "a", "80", fd1);
+    upstream_pool_put(pool, "a", "80", fd2);
+    cr_assert_eq(upstream_pool_get(pool, "a", "80"), fd2, "Expected the most recent connection first");
+    cr_assert_eq(upstream_pool_get(pool, "a", "80"), fd1, "Expected the older connection next");
+    upstream_pool_destroy(pool);
+}
+
+Test(upstream_suite, upstream_origin_reuse_1) {
+    UpstreamPool *pool = upstream_pool_init(4, 10000);
+    UPSTREAM_NOTNULL(pool);
+
+    /* An origin left empty is kept for another one, which must not find its connections */
+    int peer1, peer2;
+    int fd1 = new_conn(&peer1), fd2 = new_conn(&peer2);
+    for(int i = 0; i < 3; ++i) {
+        cr_assert_eq(upstream_pool_put(pool, "a", "80", fd1), 0, "Expected the connection to be kept");
+        cr_assert_eq(upstream_pool_get(pool, "a", "80"), fd1, "Expected the idle connection");
+    }
+    cr_assert_eq(upstream_pool_put(pool, "b", "80", fd2), 0, "Expected the connection to be kept");
+    cr_assert_eq(upstream_pool_get(pool, "a", "80"), -1, "Expected no connection to a");
+    cr_assert_eq(upstream_pool_get(pool, "b", "80"), fd2, "Expected the connection to b");
+    close(fd1);
+    close(fd2);
+    close(peer1);
+    close(peer2);
+    upstream_pool_destroy(pool);
+}
+
+Test(upstream_suite, upstream_get_stale_1) {
+    UpstreamPool *pool = upstream_pool_init(4, 10000);
+    UPSTREAM_NOTNULL(pool);
+
+    int peer1, peer2, peer3;
+    int fd1 = new_conn(&peer1), fd2 = new_conn(&peer2), fd3 = new_conn(&peer3);
+    upstream_pool_put(pool, "a", "80", fd1);
+    upstream_pool_put(pool, "a", "80", fd2);
+    upstream_pool_put(pool, "a", "80", fd3);
+    /* Closed by the origin, and a stray byte nobody asked for */
+    close(peer3);
+    cr_assert_eq(write(peer2, "x", 1), 1, "write failed");
+
+    cr_assert_eq(upstream_pool_get(pool, "a", "80"), fd1, "Expected the live connection");
+    cr_assert(is_closed(peer2), "Expected the stale connection to be closed");
+
+    UpstreamStats stats;
+    upstream_pool_get_stats(pool, &stats);
+    cr_assert_eq(stats.stale, 2, "Expected 2 stale connections but got %lu", stats.stale);
+    cr_assert_eq(stats.hits, 1, "Expected 1 hit but got %lu", stats.hits);
+    upstream_pool_destroy(pool);
+}
+
+Test(upstream_suite, upstream_put_max_idle_1) {
+    UpstreamPool *pool = upstream_pool_init(2, 10000);
+    UPSTREAM_NOTNULL(pool);
+
+    int peers[3], fds[3];
+    for(int i = 0; i < 3; ++i) {
+        fds[i] = new_conn(&peers[i]);
+        cr_assert_eq(upstream_pool_put(pool, "a", "80", fds[i]), 0, "Expected put to succeed");
+    }
+    int peer, other = new_conn(&peer);
+    upstream_pool_put(pool, "b", "80", other);
+
+    cr_assert(is_closed(peers[0]), "Expected the least recently used connection to be closed");
+    UpstreamStats stats;
+    upstream_pool_get_stats(pool, &stats);
+    cr_assert_eq(stats.evicted, 1, "Expected 1 eviction but got %lu", stats.evicted);
+    cr_assert_eq(stats.idle, 3, "Expected 3 idle connections but got %u", stats.idle);
+    upstream_pool_destroy(pool);
+    cr_assert(is_closed(peers[1]) && is_closed(peer), "Expected destroy to close the connections");
+}
+
+Test(upstream_suite, upstream_put_disabled_1) {
+    UpstreamPool *pool = upstream_pool_init(0, 10000);
+    UPSTREAM_NOTNULL(pool);
+
+    int peer, fd = new_conn(&peer);
+    cr_assert_eq(upstream_pool_put(pool, "a", "80", fd), -1, "Expected put to fail");
+    cr_assert(is_closed(peer), "Expected the connection to be closed");
+    cr_assert_eq(upstream_pool_put(NULL, "a", "80", -1), -1, "Expected put to fail");
+    upstream_pool_destroy(pool);
+}
+
+Test(upstream_suite, upstream_expire_1) {
+    UpstreamPool *pool = upstream_pool_init(4, 50);
+    UPSTREAM_NOTNULL(pool);
+
+    int peer1, peer2;
+    int fd1 = new_conn(&peer1);
+    upstream_pool_put(pool, "a", "80", fd1);
+    usleep(80 * 1000);
+    int fd2 = new_conn(&peer2);
+    upstream_pool_put(pool, "b", "80", fd2);
+
+    unsigned int n = upstream_pool_expire(pool);
+    cr_assert_eq(n, 1, "Expected 1 expired connection but got %u", n);
+    cr_assert(is_closed(peer1), "Expected the old connection to be closed");
+    cr_assert_eq(upstream_pool_get(pool, "b", "80"), fd2, "Expected the young connection to stay");
+    upstream_pool_destroy(pool);
+}